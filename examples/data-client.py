@@ -1,25 +1,281 @@
 """ An example data client for the data-server.
 This is a simple data client to interact with the data-server created with
-the makefile. Basically all that it does is send an arbitrary request message
+the makefile. By default all that it does is send an arbitrary request message
 to the server, and then prints the response. It does this 10 times and then
 exits. This provides a really simple way of getting the i2c data from our c++
 program. It is worth noting that zeromq allows the client to start before the
 server even, allowing us to start these in any order.
+Replies look like "Temperature: X Altitude: Y Pressure: P Sequence: S Age: A",
+where S counts up with every sample the server takes and A is the age of the
+sample in microseconds.
+
+Run it with "sub" as an argument to subscribe to the data-server's PUB socket
+instead. The server then pushes every sample to us as soon as it takes it, each
+message starting with the sensor name (mpl3115a2 or lsm9ds1) as the topic.
+Each topic gets its own conflated socket so that if we fall behind we only ever
+see the latest sample of each sensor (conflation keeps a single message per
+socket, so sharing one socket between topics would lose whole sensors).
+
+Run it with "binary" as an argument to ask for binary records instead of text
+(start the server with -b to get binary records from the PUB socket too).
+decode_record shows how to unpack them with struct, the layout is described in
+src/wire-format.hpp.
+
+Run it with "shm" as an argument to read the latest samples straight out of
+the server's shared memory ring (/dev/shm/uas-collect-samples) instead, which
+only works on the same machine but needs no syscalls or server round trips.
+SharedRing shows how to read it with mmap and struct, the layout is described
+in src/shared-memory-ring.hpp.
+
+Run it with "history" as an argument to ask for the last few seconds of
+samples in one go, then for the ones taken since, then for a downsampled
+summary (see the top of src/data-server.cpp for the queries). decode_records
+splits a reply of back to back records up.
+
+Run it with "stats" as an argument to print the server's timings once: bus
+traffic and ioctl times per i2c address, the drivers' data ready waits and
+decode times, and how long requests take inside the server.
+
+Run it with "jitter" as an argument to print how late the server's sampling
+woke up for each sensor, as a histogram (compare the server with and without
+-P, its real time mode).
+
+Run it with "snapshot" as an argument to get the latest value of every field
+of every sensor, each with the sequence number, timestamp and age of the
+sample it came from since the sensors are sampled at different rates.
+
+Run it with "orientation" as an argument to print which way the lsm9ds1 is
+pointing ten times a second for ten seconds, or "vertical" for the altitude and vertical
+velocity fused from both sensors, worked out by the server at the lsm9ds1's
+rate (it has to be run with -i). "calibration" prints the gyro and
+magnetometer calibration the server has arrived at so far, the same way.
 """
+import mmap
+import struct
+import sys
+import time
+
 import zmq
 
+TOPICS = [b"mpl3115a2", b"lsm9ds1"]
+
+# Binary record layout, all little-endian
+HEADER = struct.Struct("<BBHIQq")  # version, sensor, length, age, sequence, timestamp
+MPL3115A2_BODY = struct.Struct("<3f")  # pressure, altitude, temperature
+LSM9DS1_BODY = struct.Struct("<9h")  # accel x y z, gyro x y z, mag x y z
+WIRE_FORMAT_VERSION = 1
+SENSOR_MPL3115A2 = 1
+SENSOR_LSM9DS1 = 2
+
+# Shared memory ring layout, see src/shared-memory-ring.hpp
+SHARED_RING_PATH = "/dev/shm/uas-collect-samples"
+SHARED_RING_MAGIC = b"UASSHRNG"
+SHARED_RING_VERSION = 1
+SHARED_RING_HEADER = struct.Struct("<8sIIIIqq")  # magic, version, channels, slots, slot size, realtime, monotonic
+SHARED_RING_BLOCK = 64
+SHARED_RING_COUNT = struct.Struct("<Q")
+SHARED_RING_CHANNELS = {SENSOR_MPL3115A2: 0, SENSOR_LSM9DS1: 1}
+
 context = zmq.Context()
 
-#  Socket to talk to server
-print("Connecting to data-server...")
-socket = context.socket(zmq.REQ)
-socket.connect("tcp://localhost:5555")
 
-#  Do 10 requests, waiting each time for a response
-for request in range(10):
-    print("Sending request {}...".format(request))
-    socket.send(b"Can I please have data?")
+def decode_record(record):
+    """ Turns a binary record into a dict of its fields """
+    version, sensor, length, age, sequence, timestamp = HEADER.unpack_from(record)
+    if version != WIRE_FORMAT_VERSION or length != len(record):
+        raise ValueError("Unexpected record version {} or length {}".format(version, length))
+    fields = {"sensor": sensor, "age": age, "sequence": sequence, "timestamp": timestamp}
+    if sensor == SENSOR_MPL3115A2:
+        pressure, altitude, temperature = MPL3115A2_BODY.unpack_from(record, HEADER.size)
+        fields.update(pressure=pressure, altitude=altitude, temperature=temperature)
+    elif sensor == SENSOR_LSM9DS1:
+        axes = LSM9DS1_BODY.unpack_from(record, HEADER.size)
+        fields.update(accel=axes[0:3], gyro=axes[3:6], mag=axes[6:9])
+    return fields
+
+
+def decode_records(reply):
+    """ Turns a reply of binary records one after the other into a list of
+    dicts, oldest first """
+    records = []
+    offset = 0
+    while offset < len(reply):
+        length = HEADER.unpack_from(reply, offset)[2]
+        records.append(decode_record(reply[offset:offset + length]))
+        offset += length
+    return records
+
+
+class SharedRing:
+    """ Reads data-server's shared memory ring. Nothing here blocks the server,
+    a slot being rewritten while we copy it is spotted by its sequence changing
+    and read again. Python has no memory fences, the sequence checks and the
+    record's own length and version are what catch a torn copy. """
+
+    def __init__(self, path=SHARED_RING_PATH):
+        with open(path, "rb") as f:
+            self.memory = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+        magic, version, channels, slots, slot_size, _, _ = SHARED_RING_HEADER.unpack_from(self.memory)
+        if magic != SHARED_RING_MAGIC or version != SHARED_RING_VERSION or slot_size != SHARED_RING_BLOCK:
+            raise ValueError("{} isn't a sample ring this version understands".format(path))
+        self.channels = channels
+        self.slots = slots
+
+    def published(self, sensor):
+        """ How many records the server has published for sensor """
+        offset = (1 + SHARED_RING_CHANNELS[sensor]) * SHARED_RING_BLOCK
+        return SHARED_RING_COUNT.unpack_from(self.memory, offset)[0]
+
+    def read(self, sensor, index):
+        """ Record index (counting from 0) for sensor as a dict, None if it
+        isn't there (not published yet or already overwritten) """
+        slot = SHARED_RING_CHANNELS[sensor] * self.slots + index % self.slots
+        offset = (1 + self.channels + slot) * SHARED_RING_BLOCK
+        complete = 2 * index + 2
+        if SHARED_RING_COUNT.unpack_from(self.memory, offset)[0] != complete:
+            return None
+        record = self.memory[offset + 8:offset + SHARED_RING_BLOCK]
+        if SHARED_RING_COUNT.unpack_from(self.memory, offset)[0] != complete:
+            return None
+        return decode_record(record[:HEADER.unpack_from(record)[2]])
+
+    def latest(self, sensor):
+        """ The newest record for sensor, None if there isn't one yet """
+        while True:
+            count = self.published(sensor)
+            if count == 0:
+                return None
+            record = self.read(sensor, count - 1)
+            if record is not None:
+                return record
+
+    def recent(self, sensor, count):
+        """ Up to the last count records for sensor, oldest first """
+        newest = self.published(sensor)
+        records = (self.read(sensor, index) for index in range(max(0, newest - count), newest))
+        return [record for record in records if record is not None]
+
+
+def read_shared_memory():
+    ring = SharedRing()
+    for reading in range(10):
+        print("Latest {} [ {} ]".format(reading, ring.latest(SENSOR_MPL3115A2)))
+        time.sleep(0.1)
+    print("Last 5 [ {} ]".format(ring.recent(SENSOR_MPL3115A2, 5)))
+
+
+def request_data(binary):
+    #  Socket to talk to server
+    print("Connecting to data-server...")
+    socket = context.socket(zmq.REQ)
+    socket.connect("tcp://localhost:5555")
+
+    #  Do 10 requests, waiting each time for a response
+    for request in range(10):
+        print("Sending request {}...".format(request))
+        if binary:
+            socket.send(b"binary")
+        else:
+            socket.send(b"Can I please have data?")
+
+        #  Get the reply (this is a blocking call)
+        message = socket.recv()
+        if binary:
+            message = decode_record(message)
+        print("Received reply {} [ {} ]".format(request, message))
+
+
+def subscribe_data():
+    #  One socket per topic, conflate has to be set before connecting
+    print("Subscribing to data-server...")
+    poller = zmq.Poller()
+    for topic in TOPICS:
+        socket = context.socket(zmq.SUB)
+        socket.setsockopt(zmq.CONFLATE, 1)
+        socket.setsockopt(zmq.SUBSCRIBE, topic)
+        socket.connect("tcp://localhost:5556")
+        poller.register(socket, zmq.POLLIN)
+
+    #  Print the next 10 samples as they arrive
+    received = 0
+    while received < 10:
+        for socket, _ in poller.poll():
+            message = socket.recv()
+            topic, _, sample = message.partition(b" ")
+            if sample[:1] == bytes([WIRE_FORMAT_VERSION]):
+                sample = decode_record(sample)
+            print("Received {} [ {} ]".format(topic, sample))
+            received += 1
+
+
+def request_history():
+    socket = context.socket(zmq.REQ)
+    socket.connect("tcp://localhost:5555")
+
+    #  Everything from the last 5 seconds
+    socket.send(b"history mpl3115a2 5")
+    records = decode_records(socket.recv())
+    print("Last 5 seconds: {} samples".format(len(records)))
+    for record in records[-3:]:
+        print("  {}".format(record))
+
+    #  Then only what is new since the last one we got
+    time.sleep(1)
+    last = records[-1]["sequence"] if records else 0
+    socket.send("since mpl3115a2 {}".format(last).encode())
+    print("Since sequence {}: {} samples".format(last, len(decode_records(socket.recv()))))
+
+    #  And a minute summarised as 6 points of min/mean/max
+    socket.send(b"downsample mpl3115a2 60 6")
+    print("Last minute, start count then min mean max of pressure, altitude, temperature:")
+    print(socket.recv().decode())
+
+
+def request_stats():
+    socket = context.socket(zmq.REQ)
+    socket.connect("tcp://localhost:5555")
+    socket.send(b"stats")
+    print(socket.recv().decode())
+
+
+def request_jitter():
+    socket = context.socket(zmq.REQ)
+    socket.connect("tcp://localhost:5555")
+    socket.send(b"jitter")
+    print(socket.recv().decode())
+
+
+def request_snapshot():
+    socket = context.socket(zmq.REQ)
+    socket.connect("tcp://localhost:5555")
+    socket.send(b"snapshot")
+    for line in socket.recv().decode().splitlines():
+        field, value, sequence, timestamp, age = line.split()
+        print("{:24} {:>12} sample {} taken {} us ago".format(field, value, sequence, age))
+
+
+def request_estimate(request):
+    socket = context.socket(zmq.REQ)
+    socket.connect("tcp://localhost:5555")
+    for _ in range(100):
+        socket.send(request)
+        print(socket.recv().decode())
+        time.sleep(0.1)
+
 
-    #  Get the reply (this is a blocking call)
-    message = socket.recv()
-    print("Received reply {} [ {} ]".format(request, message))
+if len(sys.argv) > 1 and sys.argv[1] == "sub":
+    subscribe_data()
+elif len(sys.argv) > 1 and sys.argv[1] == "shm":
+    read_shared_memory()
+elif len(sys.argv) > 1 and sys.argv[1] == "history":
+    request_history()
+elif len(sys.argv) > 1 and sys.argv[1] == "stats":
+    request_stats()
+elif len(sys.argv) > 1 and sys.argv[1] == "jitter":
+    request_jitter()
+elif len(sys.argv) > 1 and sys.argv[1] == "snapshot":
+    request_snapshot()
+elif len(sys.argv) > 1 and sys.argv[1] in ("orientation", "vertical", "calibration"):
+    request_estimate(sys.argv[1].encode())
+else:
+    request_data(len(sys.argv) > 1 and sys.argv[1] == "binary")
@@ -0,0 +1,51 @@
+#include <math.h>
+
+#include "barometric.hpp"
+
+
+constexpr double ALTITUDE_SCALE = 44330.77;
+constexpr double ALTITUDE_EXPONENT = 0.1902632;
+
+// Pressure ratios covered by the table
+constexpr double TABLE_MIN_RATIO = 0.25;
+constexpr double TABLE_MAX_RATIO = 1.25;
+constexpr unsigned int TABLE_SIZE = 512;
+constexpr double TABLE_STEP = (TABLE_MAX_RATIO - TABLE_MIN_RATIO) / (TABLE_SIZE - 1);
+
+
+// (ratio)^ALTITUDE_EXPONENT at evenly spaced ratios, filled in before main
+class PowerTable
+{
+    public:
+        PowerTable(void)
+        {
+            for (unsigned int i = 0; i < TABLE_SIZE; ++i)
+            {
+                values[i] = static_cast<float>(pow(TABLE_MIN_RATIO + i * TABLE_STEP, ALTITUDE_EXPONENT));
+            }
+        }
+        float values[TABLE_SIZE];
+};
+
+static const PowerTable powerTable;
+
+
+double pressureToAltitude(double pressure, double seaLevelPressure)
+{
+    double ratio = pressure / seaLevelPressure;
+    if (!(ratio >= TABLE_MIN_RATIO && ratio < TABLE_MAX_RATIO))
+    {
+        return ALTITUDE_SCALE * (1.0 - pow(ratio, ALTITUDE_EXPONENT));
+    }
+
+    // Interpolate between the two entries either side of ratio
+    double position = (ratio - TABLE_MIN_RATIO) / TABLE_STEP;
+    unsigned int index = static_cast<unsigned int>(position);
+    if (index >= TABLE_SIZE - 1)
+    {
+        index = TABLE_SIZE - 2;
+    }
+    double fraction = position - index;
+    double power = powerTable.values[index] + (powerTable.values[index + 1] - powerTable.values[index]) * fraction;
+    return ALTITUDE_SCALE * (1.0 - power);
+}
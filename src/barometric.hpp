@@ -0,0 +1,17 @@
+#ifndef BAROMETRIC_HPP
+#define BAROMETRIC_HPP
+
+
+// Standard sea level pressure in Pascals, the MPL3115A2's default reference
+constexpr double STANDARD_SEA_LEVEL_PRESSURE = 101326.0;
+
+// Converts pressure (Pa) to altitude (m) with the barometric formula the
+// MPL3115A2 uses internally, h = 44330.77 * (1 - (p / p0)^0.1902632), where p0
+// is the pressure at sea level.
+// The power comes from a lookup table with linear interpolation instead of
+// pow. For p / p0 between 0.25 and 1.25 (roughly -1.7 km to 10 km) that is
+// within 4 cm of the formula (3.98 cm at worst, see sampling-bench), below the
+// sensor's 1/16 m resolution. Outside that range it falls back to pow.
+double pressureToAltitude(double pressure, double seaLevelPressure);
+
+#endif
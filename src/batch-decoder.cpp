@@ -0,0 +1,141 @@
+#include "batch-decoder.hpp"
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ && defined(__SSE2__)
+#define BATCH_DECODER_SSE2
+#include <emmintrin.h>
+#elif __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ && (defined(__ARM_NEON) || defined(__ARM_NEON__))
+#define BATCH_DECODER_NEON
+#include <arm_neon.h>
+#endif
+
+
+// Four frames are twelve values, which lines the axes back up with the four
+// lanes of a vector: x y z x, y z x y, z x y z
+constexpr unsigned int FRAMES_PER_BLOCK = 4;
+constexpr unsigned int BYTES_PER_FRAME = 6;
+
+
+void decodeAxesReference(const uint8_t *frames, unsigned int count, const AxisCalibration &calibration,
+                         float *values)
+{
+    for (unsigned int i = 0; i < count; ++i)
+    {
+        for (unsigned int axis = 0; axis < 3; ++axis)
+        {
+            const uint8_t *bytes = frames + BYTES_PER_FRAME * i + 2 * axis;
+            int16_t raw = static_cast<int16_t>((bytes[1] << 8) | bytes[0]);
+            values[3 * i + axis] = static_cast<float>(raw) * calibration.scale[axis] + calibration.bias[axis];
+        }
+    }
+}
+
+
+void calibrateAxes(const int16_t raw[3], const AxisCalibration &calibration, float values[3])
+{
+    for (unsigned int axis = 0; axis < 3; ++axis)
+    {
+        values[axis] = static_cast<float>(raw[axis]) * calibration.scale[axis] + calibration.bias[axis];
+    }
+}
+
+
+#if defined(BATCH_DECODER_SSE2)
+
+void decodeAxes(const uint8_t *frames, unsigned int count, const AxisCalibration &calibration,
+                float *values)
+{
+    const float *s = calibration.scale;
+    const float *b = calibration.bias;
+    // _mm_setr_ps puts the first argument in the lowest lane
+    __m128 scale0 = _mm_setr_ps(s[0], s[1], s[2], s[0]);
+    __m128 scale1 = _mm_setr_ps(s[1], s[2], s[0], s[1]);
+    __m128 scale2 = _mm_setr_ps(s[2], s[0], s[1], s[2]);
+    __m128 bias0 = _mm_setr_ps(b[0], b[1], b[2], b[0]);
+    __m128 bias1 = _mm_setr_ps(b[1], b[2], b[0], b[1]);
+    __m128 bias2 = _mm_setr_ps(b[2], b[0], b[1], b[2]);
+
+    unsigned int blocks = count / FRAMES_PER_BLOCK;
+    for (unsigned int block = 0; block < blocks; ++block)
+    {
+        const uint8_t *in = frames + block * FRAMES_PER_BLOCK * BYTES_PER_FRAME;
+        float *out = values + block * FRAMES_PER_BLOCK * 3;
+        __m128i first = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in));
+        __m128i last = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(in + 16));
+        // Sign extend to 32 bits by putting each value in the top half and
+        // shifting it back down
+        __m128i raw0 = _mm_srai_epi32(_mm_unpacklo_epi16(first, first), 16);
+        __m128i raw1 = _mm_srai_epi32(_mm_unpackhi_epi16(first, first), 16);
+        __m128i raw2 = _mm_srai_epi32(_mm_unpacklo_epi16(last, last), 16);
+        _mm_storeu_ps(out, _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(raw0), scale0), bias0));
+        _mm_storeu_ps(out + 4, _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(raw1), scale1), bias1));
+        _mm_storeu_ps(out + 8, _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(raw2), scale2), bias2));
+    }
+
+    unsigned int done = blocks * FRAMES_PER_BLOCK;
+    decodeAxesReference(frames + done * BYTES_PER_FRAME, count - done, calibration, values + done * 3);
+}
+
+
+const char *decodeAxesImplementation(void)
+{
+    return "sse2";
+}
+
+#elif defined(BATCH_DECODER_NEON)
+
+void decodeAxes(const uint8_t *frames, unsigned int count, const AxisCalibration &calibration,
+                float *values)
+{
+    const float *s = calibration.scale;
+    const float *b = calibration.bias;
+    const float scales[12] = { s[0], s[1], s[2], s[0], s[1], s[2], s[0], s[1], s[2], s[0], s[1], s[2] };
+    const float biases[12] = { b[0], b[1], b[2], b[0], b[1], b[2], b[0], b[1], b[2], b[0], b[1], b[2] };
+    float32x4_t scale0 = vld1q_f32(scales);
+    float32x4_t scale1 = vld1q_f32(scales + 4);
+    float32x4_t scale2 = vld1q_f32(scales + 8);
+    float32x4_t bias0 = vld1q_f32(biases);
+    float32x4_t bias1 = vld1q_f32(biases + 4);
+    float32x4_t bias2 = vld1q_f32(biases + 8);
+
+    unsigned int blocks = count / FRAMES_PER_BLOCK;
+    for (unsigned int block = 0; block < blocks; ++block)
+    {
+        const uint8_t *in = frames + block * FRAMES_PER_BLOCK * BYTES_PER_FRAME;
+        float *out = values + block * FRAMES_PER_BLOCK * 3;
+        // Loaded as bytes since the frames needn't be aligned for int16_t
+        int16x8_t first = vreinterpretq_s16_u8(vld1q_u8(in));
+        int16x4_t last = vreinterpret_s16_u8(vld1_u8(in + 16));
+        float32x4_t raw0 = vcvtq_f32_s32(vmovl_s16(vget_low_s16(first)));
+        float32x4_t raw1 = vcvtq_f32_s32(vmovl_s16(vget_high_s16(first)));
+        float32x4_t raw2 = vcvtq_f32_s32(vmovl_s16(last));
+        // Multiply then add rather than vmlaq_f32, which may be fused
+        vst1q_f32(out, vaddq_f32(vmulq_f32(raw0, scale0), bias0));
+        vst1q_f32(out + 4, vaddq_f32(vmulq_f32(raw1, scale1), bias1));
+        vst1q_f32(out + 8, vaddq_f32(vmulq_f32(raw2, scale2), bias2));
+    }
+
+    unsigned int done = blocks * FRAMES_PER_BLOCK;
+    decodeAxesReference(frames + done * BYTES_PER_FRAME, count - done, calibration, values + done * 3);
+}
+
+
+const char *decodeAxesImplementation(void)
+{
+    return "neon";
+}
+
+#else
+
+void decodeAxes(const uint8_t *frames, unsigned int count, const AxisCalibration &calibration,
+                float *values)
+{
+    decodeAxesReference(frames, count, calibration, values);
+}
+
+
+const char *decodeAxesImplementation(void)
+{
+    return "scalar";
+}
+
+#endif
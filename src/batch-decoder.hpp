@@ -0,0 +1,41 @@
+#ifndef BATCH_DECODER_HPP
+#define BATCH_DECODER_HPP
+
+#include <stdint.h>
+
+
+// Turns raw counts into physical units, value = raw * scale + bias for each
+// of x, y and z
+struct AxisCalibration
+{
+    public:
+        float scale[3];
+        float bias[3];
+};
+
+
+// Decodes count frames of x, y and z little endian int16_t (6 bytes each,
+// one straight after the other, the way the lsm9ds1 lays out its output
+// registers and FIFO) into count * 3 floats, x y z for each frame.
+// Four frames at a time go through SSE2 or NEON where the build has them,
+// the rest (and everything without them) one value at a time.
+void decodeAxes(const uint8_t *frames, unsigned int count, const AxisCalibration &calibration,
+                float *values);
+
+// decodeAxes one value at a time, what it has to match bit for bit. The
+// multiply and add are rounded separately in both, so that holds as long as
+// the compiler isn't allowed to fuse them. GCC does by default wherever the
+// target has FMA, whatever -std says, so the makefile builds everything with
+// -ffp-contract=off. NEON flushes denormals to zero where plain float
+// arithmetic doesn't, which no sensible scale and bias come near.
+void decodeAxesReference(const uint8_t *frames, unsigned int count, const AxisCalibration &calibration,
+                         float *values);
+
+// One sample's x, y and z already put together from their bytes, the same
+// arithmetic as decodeAxesReference
+void calibrateAxes(const int16_t raw[3], const AxisCalibration &calibration, float values[3]);
+
+// Which of decodeAxes's implementations this build uses, e.g. "sse2"
+const char *decodeAxesImplementation(void);
+
+#endif
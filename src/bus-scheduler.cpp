@@ -0,0 +1,633 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <stdint.h>
+#include <string>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "bus-scheduler.hpp"
+#include "i2c-abstraction.hpp"
+#include "i2c-recovery.hpp"
+#include "metrics.hpp"
+
+
+constexpr int64_t BusScheduler::DEFAULT_DEADLINE_NS;
+constexpr unsigned int BusScheduler::ADDRESS_COUNT;
+
+// Room for this many requests waiting at once before the queue has to grow
+constexpr unsigned int QUEUE_RESERVE = 64;
+
+// Every scheduler there is, by adapter number
+static std::mutex registryMutex;
+
+
+static std::map<unsigned int, std::unique_ptr<BusScheduler>> &schedulers(void)
+{
+    static std::map<unsigned int, std::unique_ptr<BusScheduler>> schedulers;
+    return schedulers;
+}
+
+
+// Whether messages are a single register read, the write of the register
+// then the read of the data
+static bool isRegisterRead(const struct i2c_msg *messages, unsigned int count)
+{
+    return count == 2 && messages[0].flags == 0 && messages[0].len == 1 &&
+           messages[1].flags == I2C_M_RD && messages[0].addr == messages[1].addr;
+}
+
+
+// Bytes a request puts on the bus, counting each message's address byte,
+// which its share of the bus time is worked out from
+static uint64_t busBytes(const struct i2c_msg *messages, unsigned int count)
+{
+    uint64_t bytes = 0;
+    for (unsigned int i = 0; i < count; ++i)
+    {
+        bytes += messages[i].len + 1;
+    }
+    return bytes;
+}
+
+
+I2cAdapterBackend::I2cAdapterBackend(unsigned int adapterNumber) :
+    m_adapterNumber(adapterNumber)
+{
+    std::ostringstream oss;
+    oss << "/dev/i2c-" << adapterNumber;
+    m_i2cFilename = oss.str();
+    m_i2cFile = open(m_i2cFilename.c_str(), O_RDWR | O_CLOEXEC);
+    if (m_i2cFile < 0)
+    {
+        std::ostringstream err;
+        err << "Could not open " << m_i2cFilename << std::endl << strerror(errno);
+        throw std::runtime_error(err.str());
+    }
+    unsigned long funcs = 0;
+    if (ioctl(m_i2cFile, I2C_FUNCS, &funcs) < 0 || !(funcs & I2C_FUNC_I2C))
+    {
+        close(m_i2cFile);
+        std::ostringstream err;
+        err << "The adapter does not support a mixed read write transaction"
+            << std::endl << strerror(errno);
+        throw std::runtime_error(err.str());
+    }
+}
+
+
+I2cAdapterBackend::~I2cAdapterBackend(void)
+{
+    close(m_i2cFile);
+}
+
+
+bool I2cAdapterBackend::transfer(struct i2c_msg *messages, unsigned int count)
+{
+    struct i2c_rdwr_ioctl_data packagedMessages;
+    packagedMessages.msgs = messages;
+    packagedMessages.nmsgs = count;
+    return ioctl(m_i2cFile, I2C_RDWR, &packagedMessages) >= 0;
+}
+
+
+bool I2cAdapterBackend::recover(void)
+{
+    // The bus is cleared first so the reopened adapter starts on an idle bus
+    if (!recoverI2cBus(m_adapterNumber))
+    {
+        return false;
+    }
+    int i2cFile = open(m_i2cFilename.c_str(), O_RDWR | O_CLOEXEC);
+    if (i2cFile < 0)
+    {
+        return false;
+    }
+    close(m_i2cFile);
+    m_i2cFile = i2cFile;
+    return true;
+}
+
+
+BusScheduler &BusScheduler::adapter(unsigned int adapterNumber)
+{
+    std::lock_guard<std::mutex> lock(registryMutex);
+    std::unique_ptr<BusScheduler> &scheduler = schedulers()[adapterNumber];
+    if (!scheduler)
+    {
+        scheduler.reset(new BusScheduler(adapterNumber, std::make_shared<I2cAdapterBackend>(adapterNumber)));
+    }
+    return *scheduler;
+}
+
+
+void BusScheduler::useBackend(unsigned int adapterNumber, std::shared_ptr<BusBackend> backend)
+{
+    std::lock_guard<std::mutex> lock(registryMutex);
+    std::unique_ptr<BusScheduler> &scheduler = schedulers()[adapterNumber];
+    if (scheduler)
+    {
+        std::ostringstream err;
+        err << "Adapter " << adapterNumber << " already has a bus scheduler";
+        throw std::logic_error(err.str());
+    }
+    scheduler.reset(new BusScheduler(adapterNumber, std::move(backend)));
+}
+
+
+BusScheduler::BusScheduler(unsigned int adapterNumber, std::shared_ptr<BusBackend> backend) :
+    m_adapterNumber(adapterNumber),
+    m_backend(std::move(backend)),
+    m_messages(new struct i2c_msg[I2cTransaction::MAX_MESSAGES]),
+    m_order(0),
+    m_stopping(false),
+    m_started(metricsNow())
+{
+    m_queue.reserve(QUEUE_RESERVE);
+    m_retries.reserve(QUEUE_RESERVE);
+    m_batch.reserve(QUEUE_RESERVE);
+    for (unsigned int address = 0; address < ADDRESS_COUNT; ++address)
+    {
+        m_deadlines[address] = DEFAULT_DEADLINE_NS;
+        m_priorities[address] = 0;
+        m_stats[address].requests.store(0, std::memory_order_relaxed);
+        m_stats[address].coalesced.store(0, std::memory_order_relaxed);
+        m_stats[address].busyTime.store(0, std::memory_order_relaxed);
+    }
+    m_worker = std::thread(&BusScheduler::workLoop, this);
+}
+
+
+BusScheduler::~BusScheduler(void)
+{
+    // The worker finishes whatever is queued, retries too, before it stops
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_workAvailable.notify_one();
+    m_worker.join();
+}
+
+
+void BusScheduler::setDeadline(uint8_t deviceAddress, std::chrono::nanoseconds deadline)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_deadlines[deviceAddress % ADDRESS_COUNT] = deadline.count();
+}
+
+
+void BusScheduler::setPriority(uint8_t deviceAddress, int priority)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_priorities[deviceAddress % ADDRESS_COUNT] = priority;
+}
+
+
+bool BusScheduler::perform(uint8_t deviceAddress, struct i2c_msg *messages, unsigned int count, bool repeatable)
+{
+    if (count == 0 || count > I2cTransaction::MAX_MESSAGES)
+    {
+        errno = EINVAL;
+        return false;
+    }
+
+    // The request lives here, the worker only points at it until it is done
+    Request request;
+    request.deviceAddress = deviceAddress;
+    request.messages = messages;
+    request.count = count;
+    request.leader = nullptr;
+    request.repeatable = repeatable;
+    request.alone = !repeatable;
+    request.tried = 0;
+    request.backoff = 0;
+    request.notBefore = 0;
+    request.started = false;
+    request.retry = false;
+    request.done = false;
+    request.error = 0;
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        request.priority = m_priorities[deviceAddress % ADDRESS_COUNT];
+        request.submitted = metricsNow();
+        request.deadline = request.submitted + m_deadlines[deviceAddress % ADDRESS_COUNT];
+        request.order = m_order++;
+        m_queue.push_back(&request);
+        std::push_heap(m_queue.begin(), m_queue.end(), later);
+        m_workAvailable.notify_one();
+        m_workDone.wait(lock, [&request]() { return request.done; });
+    }
+    if (request.error != 0)
+    {
+        errno = request.error;
+        return false;
+    }
+    return true;
+}
+
+
+bool BusScheduler::recover(void)
+{
+    std::lock_guard<std::mutex> lock(m_backendMutex);
+    return m_backend->recover();
+}
+
+
+BusDeviceSnapshot BusScheduler::snapshot(uint8_t deviceAddress) const
+{
+    const DeviceStats &stats = m_stats[deviceAddress % ADDRESS_COUNT];
+    BusDeviceSnapshot snapshot;
+    snapshot.requests = stats.requests.load(std::memory_order_relaxed);
+    snapshot.coalesced = stats.coalesced.load(std::memory_order_relaxed);
+    snapshot.busyTime = stats.busyTime.load(std::memory_order_relaxed);
+    uint64_t elapsed = metricsNow() - m_started;
+    snapshot.utilization = elapsed == 0 ? 0.0 : static_cast<double>(snapshot.busyTime) / elapsed;
+    snapshot.queueTime = stats.queueTime.snapshot();
+    return snapshot;
+}
+
+
+unsigned int BusScheduler::adapterNumber(void) const
+{
+    return m_adapterNumber;
+}
+
+
+std::thread::native_handle_type BusScheduler::workerHandle(void)
+{
+    return m_worker.native_handle();
+}
+
+
+std::string BusScheduler::formatStats(void)
+{
+    std::lock_guard<std::mutex> lock(registryMutex);
+    std::ostringstream os;
+    for (const std::pair<const unsigned int, std::unique_ptr<BusScheduler>> &entry : schedulers())
+    {
+        if (!entry.second)
+        {
+            continue;
+        }
+        for (unsigned int address = 0; address < ADDRESS_COUNT; ++address)
+        {
+            BusDeviceSnapshot snapshot = entry.second->snapshot(address);
+            if (snapshot.requests == 0)
+            {
+                continue;
+            }
+            os << "bus " << entry.first << " 0x" << std::hex << std::setw(2) << std::setfill('0') << address
+               << std::dec << std::setfill(' ') << std::fixed << std::setprecision(2)
+               << " utilization: " << snapshot.utilization * 100 << "%"
+               << " requests: " << snapshot.requests
+               << " coalesced: " << snapshot.coalesced
+               << " queue " << formatLatency(snapshot.queueTime) << std::endl;
+        }
+    }
+    return os.str();
+}
+
+
+bool BusScheduler::later(const Request *a, const Request *b)
+{
+    if (a->deadline != b->deadline)
+    {
+        return a->deadline > b->deadline;
+    }
+    if (a->priority != b->priority)
+    {
+        return a->priority < b->priority;
+    }
+    return a->order > b->order;
+}
+
+
+BusScheduler::Request *BusScheduler::identicalRead(const Request *request) const
+{
+    if (!isRegisterRead(request->messages, request->count))
+    {
+        return nullptr;
+    }
+    for (Request *other : m_batch)
+    {
+        if (other->leader == nullptr && isRegisterRead(other->messages, other->count) &&
+            other->messages[0].addr == request->messages[0].addr &&
+            other->messages[0].buf[0] == request->messages[0].buf[0] &&
+            other->messages[1].len == request->messages[1].len)
+        {
+            return other;
+        }
+    }
+    return nullptr;
+}
+
+
+uint64_t BusScheduler::releaseRetries(void)
+{
+    uint64_t now = metricsNow();
+    uint64_t next = 0;
+    unsigned int waiting = 0;
+    for (Request *request : m_retries)
+    {
+        if (request->notBefore <= now)
+        {
+            m_queue.push_back(request);
+            std::push_heap(m_queue.begin(), m_queue.end(), later);
+        }
+        else
+        {
+            next = next == 0 || request->notBefore < next ? request->notBefore : next;
+            m_retries[waiting++] = request;
+        }
+    }
+    m_retries.resize(waiting);
+    return next;
+}
+
+
+void BusScheduler::performBatch(unsigned int messageCount)
+{
+    // Everything in one transaction, on the leader's account, counted just
+    // like I2cAbstraction counts its own ioctls
+    uint64_t start = metricsNow();
+    unsigned int leaders = 0;
+    uint64_t totalBytes = 0;
+    for (Request *request : m_batch)
+    {
+        if (request->leader == nullptr)
+        {
+            ++leaders;
+            totalBytes += busBytes(request->messages, request->count);
+        }
+    }
+    I2cDeviceMetrics &metrics = i2cDeviceMetrics(m_batch.front()->deviceAddress);
+    int error = m_backend->transfer(m_messages.get(), messageCount) ? 0 : errno;
+    uint64_t busy = metricsNow() - start;
+    metrics.recordTransaction(busy);
+    for (unsigned int i = 0; error == 0 && i < messageCount; ++i)
+    {
+        if (m_messages[i].flags & I2C_M_RD)
+        {
+            i2cDeviceMetrics(m_messages[i].addr).recordBytes(m_messages[i].len, 0);
+        }
+        else
+        {
+            i2cDeviceMetrics(m_messages[i].addr).recordBytes(0, m_messages[i].len);
+        }
+    }
+
+    I2cRetryPolicy policy = i2cRetryPolicy();
+    for (Request *request : m_batch)
+    {
+        DeviceStats &stats = m_stats[request->deviceAddress % ADDRESS_COUNT];
+        if (!request->started)
+        {
+            request->started = true;
+            stats.requests.fetch_add(1, std::memory_order_relaxed);
+            stats.queueTime.record(start > request->submitted ? start - request->submitted : 0);
+            if (m_batch.size() > 1)
+            {
+                stats.coalesced.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+        if (request->leader == nullptr)
+        {
+            stats.busyTime.fetch_add(busy * busBytes(request->messages, request->count) / totalBytes,
+                                     std::memory_order_relaxed);
+        }
+
+        request->error = error;
+        request->retry = false;
+        if (error == 0)
+        {
+            if (request->leader != nullptr)
+            {
+                // Shared the leader's read, so gets its data
+                memcpy(request->messages[1].buf, request->leader->messages[1].buf, request->messages[1].len);
+            }
+        }
+        else if (m_batch.size() > 1)
+        {
+            // One failure fails the lot, so everyone goes again on their own
+            // straight away to find out whose it was. Only repeatable
+            // requests are ever coalesced.
+            request->leader = nullptr;
+            request->alone = true;
+            request->retry = true;
+            request->notBefore = 0;
+        }
+        else if (++request->tried < policy.attempts && request->repeatable && isTransientI2cError(error))
+        {
+            // Backs off the way retryI2c does, but in the queue rather than
+            // on the bus
+            metrics.recordRetry();
+            request->retry = true;
+            request->notBefore = metricsNow() + request->backoff;
+            uint64_t backoff = std::chrono::duration_cast<std::chrono::nanoseconds>(policy.backoff).count();
+            uint64_t maxBackoff = std::chrono::duration_cast<std::chrono::nanoseconds>(policy.maxBackoff).count();
+            request->backoff = request->backoff == 0 ? backoff : std::min(request->backoff * 2, maxBackoff);
+        }
+        else
+        {
+            metrics.recordError();
+        }
+    }
+}
+
+
+void BusScheduler::workLoop(void)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for (;;)
+    {
+        // With nothing to do but retries still backing off, the worker sleeps
+        // until the first of them is due or something else comes in
+        uint64_t nextRetry = releaseRetries();
+        if (m_queue.empty())
+        {
+            if (nextRetry != 0)
+            {
+                uint64_t now = metricsNow();
+                if (nextRetry > now)
+                {
+                    m_workAvailable.wait_for(lock, std::chrono::nanoseconds(nextRetry - now));
+                }
+            }
+            else if (m_stopping)
+            {
+                return;
+            }
+            else
+            {
+                m_workAvailable.wait(lock);
+            }
+            continue;
+        }
+
+        // The most urgent request, then whatever else fits in with it, unless
+        // either has to go on its own
+        m_batch.clear();
+        unsigned int messageCount = 0;
+        while (!m_queue.empty())
+        {
+            Request *request = m_queue.front();
+            if (!m_batch.empty() && (request->alone || m_batch.front()->alone))
+            {
+                break;
+            }
+            Request *leader = request->alone ? nullptr : identicalRead(request);
+            if (leader == nullptr && messageCount + request->count > I2cTransaction::MAX_MESSAGES)
+            {
+                break;
+            }
+            std::pop_heap(m_queue.begin(), m_queue.end(), later);
+            m_queue.pop_back();
+            request->leader = leader;
+            if (leader == nullptr)
+            {
+                memcpy(&m_messages[messageCount], request->messages, request->count * sizeof(struct i2c_msg));
+                messageCount += request->count;
+            }
+            m_batch.push_back(request);
+        }
+
+        // The bus is only ever used from here and recover, which waits for
+        // the batch to be done
+        lock.unlock();
+        {
+            std::lock_guard<std::mutex> backendLock(m_backendMutex);
+            performBatch(messageCount);
+        }
+        lock.lock();
+        for (Request *request : m_batch)
+        {
+            if (request->retry)
+            {
+                m_retries.push_back(request);
+            }
+            else
+            {
+                request->done = true;
+            }
+        }
+        m_workDone.notify_all();
+    }
+}
+
+
+ScheduledI2c::ScheduledI2c(const unsigned int adapterNumber, const uint8_t deviceAddress) :
+    m_scheduler(BusScheduler::adapter(adapterNumber)),
+    m_deviceAddress(deviceAddress)
+{
+}
+
+
+std::vector<uint8_t> ScheduledI2c::readBytes(uint8_t reg, unsigned int size) const
+{
+    std::vector<uint8_t> data(size);
+    readBytes(reg, data.data(), size);
+    return data;
+}
+
+
+void ScheduledI2c::readBytes(uint8_t reg, uint8_t *buffer, unsigned int size) const
+{
+    if (!tryReadBytes(reg, buffer, size))
+    {
+        std::ostringstream err;
+        err << "Could not perform read" << std::endl << strerror(errno);
+        throw std::runtime_error(err.str());
+    }
+}
+
+
+void ScheduledI2c::writeByte(uint8_t reg, uint8_t data) const
+{
+    if (!tryWriteByte(reg, data))
+    {
+        std::ostringstream err;
+        err << "Could not perform write" << std::endl << strerror(errno);
+        throw std::runtime_error(err.str());
+    }
+}
+
+
+void ScheduledI2c::transfer(I2cTransaction &transaction) const
+{
+    if (!tryTransfer(transaction))
+    {
+        std::ostringstream err;
+        err << "Could not perform transaction of " << transaction.messageCount() << " messages"
+            << std::endl << strerror(errno);
+        throw std::runtime_error(err.str());
+    }
+}
+
+
+bool ScheduledI2c::tryReadBytes(uint8_t reg, uint8_t *buffer, unsigned int size) const
+{
+    // Same messages as I2cAbstraction::readBytes
+    struct i2c_msg messages[2];
+    messages[0].addr = m_deviceAddress;
+    messages[0].flags = 0;
+    messages[0].len = sizeof(reg);
+    messages[0].buf = &reg;
+    messages[1].addr = m_deviceAddress;
+    messages[1].flags = I2C_M_RD;
+    messages[1].len = size;
+    messages[1].buf = buffer;
+    return m_scheduler.perform(m_deviceAddress, messages, 2, true);
+}
+
+
+bool ScheduledI2c::tryWriteByte(uint8_t reg, uint8_t data) const
+{
+    uint8_t out[2];
+    out[0] = reg;
+    out[1] = data;
+    struct i2c_msg message;
+    message.addr = m_deviceAddress;
+    message.flags = 0;
+    message.len = sizeof(out);
+    message.buf = out;
+    return m_scheduler.perform(m_deviceAddress, &message, 1, true);
+}
+
+
+bool ScheduledI2c::tryTransfer(I2cTransaction &transaction) const
+{
+    if (transaction.empty())
+    {
+        return true;
+    }
+    struct i2c_msg messages[I2cTransaction::MAX_MESSAGES];
+    unsigned int messageCount = transaction.buildMessages(messages);
+    return m_scheduler.perform(m_deviceAddress, messages, messageCount, transaction.repeatable());
+}
+
+
+bool ScheduledI2c::recover(void)
+{
+    return m_scheduler.recover();
+}
+
+
+uint8_t ScheduledI2c::deviceAddress(void) const
+{
+    return m_deviceAddress;
+}
@@ -0,0 +1,206 @@
+#ifndef BUS_SCHEDULER_HPP
+#define BUS_SCHEDULER_HPP
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "i2c-abstraction.hpp"
+#include "metrics.hpp"
+
+struct i2c_msg;
+
+
+// This class is what a BusScheduler hands its transactions to.
+class BusBackend
+{
+    public:
+        virtual ~BusBackend(void) {}
+
+        // Performs the messages as a single transaction (one I2C_RDWR ioctl
+        // on linux), false with errno set if it failed
+        virtual bool transfer(struct i2c_msg *messages, unsigned int count) = 0;
+
+        // Gets a bus that has stopped working going again, false with errno
+        // set if it couldn't. Nothing to do unless a backend says otherwise.
+        virtual bool recover(void) { return true; }
+};
+
+
+// This class is the backend for a real adapter, /dev/i2c-N opened once and
+// never bound to a slave address since every message carries its own.
+// recover works like I2cAbstraction's, clearing the bus if it has lines to
+// do it with and reopening the adapter.
+class I2cAdapterBackend : public BusBackend
+{
+    public:
+        explicit I2cAdapterBackend(unsigned int adapterNumber);
+        ~I2cAdapterBackend(void);
+        bool transfer(struct i2c_msg *messages, unsigned int count);
+        bool recover(void);
+    private:
+        I2cAdapterBackend(const I2cAdapterBackend &);
+        I2cAdapterBackend &operator=(const I2cAdapterBackend &);
+        unsigned int m_adapterNumber;
+        std::string m_i2cFilename;
+        int m_i2cFile;
+};
+
+
+// What a BusScheduler has counted for one device at one point in time
+struct BusDeviceSnapshot
+{
+    public:
+        uint64_t requests;
+        uint64_t coalesced;  // Requests that shared a transaction with another
+        uint64_t busyTime;  // Nanoseconds the bus spent on this device's messages
+        double utilization;  // busyTime over the time the scheduler has run
+        LatencySnapshot queueTime;  // From being submitted to being started
+};
+
+
+// This class owns an i2c adapter: one backend (one file descriptor) and one
+// worker thread that performs every transaction for every device on it, so
+// drivers and threads sharing the adapter never contend for it themselves.
+// perform queues a request and waits for the worker to do it.
+// The worker takes requests earliest deadline first, a device's deadline
+// being setDeadline after it submits (DEFAULT_DEADLINE unless set), ties
+// going to the higher setPriority and then to whoever asked first. So a
+// device sampled quickly (e.g. the lsm9ds1) given a short deadline jumps the
+// queue ahead of slower traffic, waiting at most for the transaction already
+// on the bus.
+// Whatever else is queued when the worker starts a transaction is coalesced
+// into it, up to I2cTransaction::MAX_MESSAGES messages, and identical register
+// reads share a single read. A request that isn't repeatable (see
+// I2cTransaction::setRepeatable) always has a transaction to itself and is
+// never retried. If a coalesced transaction fails each request is tried again
+// on its own, so one device failing doesn't fail the others.
+// A request on its own is retried under the i2cRetryPolicy, going back in the
+// queue until its backoff is over so the bus carries on with everyone else's
+// in the meantime. Transactions are counted in i2cDeviceMetrics like
+// I2cAbstraction does, plus the bus time, queueing time and utilization of
+// each device here. recover has the backend recover the bus in between
+// transactions.
+// adapter gets or makes the scheduler for /dev/i2c-N, useBackend makes it on
+// another backend instead (e.g. a SimulatedBusBackend) and has to come first.
+class BusScheduler
+{
+    public:
+        static constexpr int64_t DEFAULT_DEADLINE_NS = 10000000;
+        static BusScheduler &adapter(unsigned int adapterNumber);
+        static void useBackend(unsigned int adapterNumber, std::shared_ptr<BusBackend> backend);
+        ~BusScheduler(void);
+        void setDeadline(uint8_t deviceAddress, std::chrono::nanoseconds deadline);
+        void setPriority(uint8_t deviceAddress, int priority);
+
+        // Performs messages (all for deviceAddress's requests, though they may
+        // address any device) and waits for them, false with errno set if
+        // they failed. repeatable is false if doing them twice isn't the same
+        // as doing them once.
+        bool perform(uint8_t deviceAddress, struct i2c_msg *messages, unsigned int count, bool repeatable);
+
+        // False with errno set if the backend couldn't recover the bus
+        bool recover(void);
+
+        BusDeviceSnapshot snapshot(uint8_t deviceAddress) const;
+        unsigned int adapterNumber(void) const;
+
+        // The worker thread, e.g. to make it real time along with the threads
+        // it performs transactions for
+        std::thread::native_handle_type workerHandle(void);
+
+        // One line per device that has used any scheduler, like
+        // "bus 1 0x6a utilization: U% requests: N coalesced: C queue count: ..."
+        static std::string formatStats(void);
+
+    private:
+        BusScheduler(unsigned int adapterNumber, std::shared_ptr<BusBackend> backend);
+        BusScheduler(const BusScheduler &);
+        BusScheduler &operator=(const BusScheduler &);
+        static constexpr unsigned int ADDRESS_COUNT = 128;
+        struct Request
+        {
+            uint8_t deviceAddress;
+            struct i2c_msg *messages;
+            unsigned int count;
+            int priority;
+            uint64_t submitted;
+            uint64_t deadline;
+            uint64_t order;  // Submission order, the last tie break
+            Request *leader;  // The request whose identical read serves this one
+            bool repeatable;
+            bool alone;  // Needs a transaction to itself, not repeatable or split out of a failed one
+            unsigned int tried;  // Transactions it has had to itself
+            uint64_t backoff;  // Nanoseconds the next retry waits
+            uint64_t notBefore;  // When a retry may go back in the queue
+            bool started;  // Been on the bus, so counted
+            bool retry;  // Has to go again, set by performBatch
+            bool done;
+            int error;  // errno if it failed, 0 if not
+        };
+        struct DeviceStats
+        {
+            std::atomic<uint64_t> requests;
+            std::atomic<uint64_t> coalesced;
+            std::atomic<uint64_t> busyTime;
+            LatencyHistogram queueTime;
+        };
+        // Heap order, true if a should be done after b
+        static bool later(const Request *a, const Request *b);
+        // The request in the batch already reading exactly what request reads,
+        // nullptr if there isn't one
+        Request *identicalRead(const Request *request) const;
+        // Queues the retries whose backoff is over, and says when the next of
+        // the others is due (0 if there are none)
+        uint64_t releaseRetries(void);
+        void performBatch(unsigned int messageCount);
+        void workLoop(void);
+        unsigned int m_adapterNumber;
+        std::shared_ptr<BusBackend> m_backend;
+        std::mutex m_backendMutex;  // Held by the worker while it uses the bus
+        mutable std::mutex m_mutex;
+        std::condition_variable m_workAvailable;
+        std::condition_variable m_workDone;
+        std::vector<Request *> m_queue;  // A heap, most urgent at the front
+        std::vector<Request *> m_retries;  // Waiting out their backoff
+        std::vector<Request *> m_batch;  // What the worker is doing, only it touches this
+        std::unique_ptr<struct i2c_msg[]> m_messages;  // The batch's messages, one after the other
+        uint64_t m_order;
+        bool m_stopping;
+        int64_t m_deadlines[ADDRESS_COUNT];
+        int m_priorities[ADDRESS_COUNT];
+        DeviceStats m_stats[ADDRESS_COUNT];
+        uint64_t m_started;
+        std::thread m_worker;
+};
+
+
+// This class has the same interface as I2cAbstraction but hands every
+// transaction to the adapter's BusScheduler, so the drivers can use it as
+// their transport (e.g. ScheduledMPL3115A2) and share the adapter with
+// everything else on it. recover recovers the whole adapter.
+class ScheduledI2c
+{
+    public:
+        ScheduledI2c(const unsigned int adapterNumber, const uint8_t deviceAddress);
+        std::vector<uint8_t> readBytes(uint8_t reg, unsigned int size) const;
+        void readBytes(uint8_t reg, uint8_t *buffer, unsigned int size) const;
+        void writeByte(uint8_t reg, uint8_t data) const;
+        void transfer(I2cTransaction &transaction) const;
+        bool tryReadBytes(uint8_t reg, uint8_t *buffer, unsigned int size) const;
+        bool tryWriteByte(uint8_t reg, uint8_t data) const;
+        bool tryTransfer(I2cTransaction &transaction) const;
+        bool recover(void);
+        uint8_t deviceAddress(void) const;
+    private:
+        BusScheduler &m_scheduler;
+        uint8_t m_deviceAddress;
+};
+
+#endif
@@ -0,0 +1,259 @@
+// Feeds the online calibrators synthetic lsm9ds1 readings, a magnetometer
+// with known hard and soft iron distortion and a gyro with a known bias, and
+// checks what they recover. Checks a calibration survives being saved and
+// loaded, then measures how long an update takes. Exits with 1 if anything
+// is further off than it should be.
+#include <chrono>
+#include <iostream>
+#include <math.h>
+#include <random>
+#include <string.h>
+#include <string>
+#include <unistd.h>
+
+#include "imu-calibration.hpp"
+#include "lsm9ds1.hpp"
+
+
+constexpr double FIELD_STRENGTH = 0.5;  // Gauss
+constexpr double MAG_NOISE = 0.002;  // Gauss
+constexpr double GYRO_NOISE = 0.3;  // Degrees per second
+constexpr double ACCEL_NOISE = 0.005;  // g
+constexpr unsigned int ITERATIONS = 1000000;
+
+// The distortion the magnetometer readings are given, in its own axes
+constexpr double HARD_IRON[3] = { 0.12, -0.2, 0.08 };
+constexpr double SOFT_IRON[3] = { 1.15, 0.9, 1.0 };
+constexpr double GYRO_BIAS[3] = { 1.5, -2.0, 0.7 };
+
+
+static AxisCalibration magBase(void)
+{
+    AxisCalibration base = { { LSM9DS1_MAG_SENSITIVITY, LSM9DS1_MAG_SENSITIVITY, LSM9DS1_MAG_SENSITIVITY },
+                             { 0.0f, 0.0f, 0.0f } };
+    return base;
+}
+
+
+static AxisCalibration gyroBase(void)
+{
+    AxisCalibration base = { { LSM9DS1_GYRO_SENSITIVITY, LSM9DS1_GYRO_SENSITIVITY, LSM9DS1_GYRO_SENSITIVITY },
+                             { 0.0f, 0.0f, 0.0f } };
+    return base;
+}
+
+
+// Counts that base turns back into value, as near as the device would give
+static void toCounts(const double value[3], const AxisCalibration &base, int16_t raw[3])
+{
+    for (unsigned int axis = 0; axis < 3; ++axis)
+    {
+        double counts = round((value[axis] - base.bias[axis]) / base.scale[axis]);
+        raw[axis] = static_cast<int16_t>(counts > 32767 ? 32767 : (counts < -32768 ? -32768 : counts));
+    }
+}
+
+
+// A magnetometer reading of the field pointing along direction (unit), as
+// the distorted magnetometer would give it with noise of deviation gauss
+static void distortedReading(const double direction[3], std::mt19937 &random, double deviation, int16_t raw[3])
+{
+    std::normal_distribution<double> noise(0.0, deviation);
+    double field[3];
+    for (unsigned int axis = 0; axis < 3; ++axis)
+    {
+        field[axis] = FIELD_STRENGTH * direction[axis] * SOFT_IRON[axis] + HARD_IRON[axis] + noise(random);
+    }
+    toCounts(field, magBase(), raw);
+}
+
+
+// A random direction, uniform over the sphere, or around the horizon only
+static void randomDirection(std::mt19937 &random, bool level, double direction[3])
+{
+    std::normal_distribution<double> normal(0.0, 1.0);
+    double norm = 0.0;
+    for (unsigned int axis = 0; axis < 3; ++axis)
+    {
+        direction[axis] = level && axis == 2 ? 0.0 : normal(random);
+        norm += direction[axis] * direction[axis];
+    }
+    for (unsigned int axis = 0; axis < 3; ++axis)
+    {
+        direction[axis] /= sqrt(norm);
+    }
+}
+
+
+// Fits noisy readings from every direction and checks the corrected field
+// (without noise, so the fit's error isn't lost in it) points the right way
+// with the same strength, then that readings from around the horizon alone
+// aren't believed
+static bool checkMagnetometer(void)
+{
+    std::mt19937 random(1);
+    MagnetometerCalibrator calibrator(magBase());
+    double direction[3];
+    int16_t raw[3];
+    for (unsigned int i = 0; i < 3000; ++i)
+    {
+        randomDirection(random, false, direction);
+        distortedReading(direction, random, MAG_NOISE, raw);
+        calibrator.update(raw);
+    }
+    AxisCalibration calibration;
+    if (!calibrator.calibration(calibration))
+    {
+        std::cerr << "Magnetometer calibration wasn't believed" << std::endl;
+        return false;
+    }
+
+    double worstAngle = 0.0;
+    double smallest = HUGE_VAL;
+    double largest = 0.0;
+    for (unsigned int i = 0; i < 1000; ++i)
+    {
+        randomDirection(random, false, direction);
+        distortedReading(direction, random, 0.0, raw);
+        float corrected[3];
+        calibrateAxes(raw, calibration, corrected);
+        double norm = sqrt(corrected[0] * corrected[0] + corrected[1] * corrected[1] + corrected[2] * corrected[2]);
+        double dot = (corrected[0] * direction[0] + corrected[1] * direction[1] + corrected[2] * direction[2]) / norm;
+        double angle = acos(dot > 1.0 ? 1.0 : dot) * 180.0 / M_PI;
+        worstAngle = angle > worstAngle ? angle : worstAngle;
+        smallest = norm < smallest ? norm : smallest;
+        largest = norm > largest ? norm : largest;
+    }
+    double spread = (largest - smallest) / (largest + smallest) * 2.0;
+    bool ok = worstAngle < 0.5 && spread < 0.02;
+    std::cout << "Magnetometer: worst direction error " << worstAngle << " degrees (limit 0.5), strength spread "
+              << spread * 100.0 << "% (limit 2%) " << (ok ? "ok" : "FAILED") << std::endl;
+
+    MagnetometerCalibrator level(magBase());
+    for (unsigned int i = 0; i < 3000; ++i)
+    {
+        randomDirection(random, true, direction);
+        distortedReading(direction, random, MAG_NOISE, raw);
+        level.update(raw);
+    }
+    bool refused = !level.calibration(calibration);
+    std::cout << "Magnetometer, level readings only: " << (refused ? "not believed, ok" : "believed, FAILED")
+              << std::endl;
+    return ok && refused;
+}
+
+
+// seconds of gyro samples at 952 Hz, still or turning at a rate that keeps
+// changing, feeding calibrator
+static void feedGyro(GyroBiasCalibrator &calibrator, std::mt19937 &random, double seconds, bool still)
+{
+    std::normal_distribution<double> gyroNoise(0.0, GYRO_NOISE);
+    std::normal_distribution<double> accelNoise(0.0, ACCEL_NOISE);
+    unsigned int steps = static_cast<unsigned int>(seconds * 952.0);
+    for (unsigned int i = 0; i < steps; ++i)
+    {
+        double t = i / 952.0;
+        double rate[3];
+        float accel[3];
+        for (unsigned int axis = 0; axis < 3; ++axis)
+        {
+            double turning = still ? 0.0 : 40.0 * sin(2.0 * M_PI * (0.3 + 0.2 * axis) * t);
+            rate[axis] = turning + GYRO_BIAS[axis] + gyroNoise(random);
+            accel[axis] = static_cast<float>((axis == 2 ? 1.0 : 0.0) + accelNoise(random));
+        }
+        int16_t raw[3];
+        toCounts(rate, gyroBase(), raw);
+        calibrator.update(raw, accel);
+    }
+}
+
+
+// Turns, sits still, turns and sits still again, and checks the bias comes
+// out right. Turning alone mustn't give an estimate at all.
+static bool checkGyro(void)
+{
+    std::mt19937 random(2);
+    GyroBiasCalibrator moving(gyroBase());
+    feedGyro(moving, random, 30.0, false);
+    AxisCalibration calibration;
+    bool refused = !moving.calibration(calibration);
+    std::cout << "Gyro, turning only: " << (refused ? "no estimate, ok" : "estimated, FAILED") << std::endl;
+
+    GyroBiasCalibrator calibrator(gyroBase());
+    feedGyro(calibrator, random, 20.0, false);
+    feedGyro(calibrator, random, 3.0, true);
+    feedGyro(calibrator, random, 20.0, false);
+    feedGyro(calibrator, random, 3.0, true);
+    if (!calibrator.calibration(calibration))
+    {
+        std::cerr << "Gyro calibration wasn't believed" << std::endl;
+        return false;
+    }
+    double worst = 0.0;
+    for (unsigned int axis = 0; axis < 3; ++axis)
+    {
+        double error = fabs(calibration.bias[axis] + GYRO_BIAS[axis]);
+        worst = error > worst ? error : worst;
+    }
+    bool ok = worst < 0.05;
+    std::cout << "Gyro: worst bias error " << worst << " degrees per second (limit 0.05) from "
+              << calibrator.count() << " still samples " << (ok ? "ok" : "FAILED") << std::endl;
+    return ok && refused;
+}
+
+
+// Saves a calibration and loads it back, which should give exactly the same
+static bool checkSaveAndLoad(void)
+{
+    ImuCalibration saved = {
+        { { 0.00875f, 0.0087312f, -1.0f / 3.0f }, { 1.2345678f, -0.001f, 1e-7f } },
+        { { -0.000151f, 0.000127f, 0.00014f }, { 0.0123f, -0.2f, 3.0f } }
+    };
+    std::string filename = "/tmp/calibration-bench-" + std::to_string(getpid());
+    ImuCalibration loaded;
+    bool ok = saveImuCalibration(filename, saved) && loadImuCalibration(filename, loaded) &&
+              memcmp(&saved, &loaded, sizeof(saved)) == 0;
+    unlink(filename.c_str());
+    std::cout << "Saved and loaded: " << (ok ? "the same, ok" : "different, FAILED") << std::endl;
+    return ok;
+}
+
+
+int main(void)
+{
+    bool passed = checkMagnetometer();
+    passed = checkGyro() && passed;
+    passed = checkSaveAndLoad() && passed;
+
+    // Readings worked out first so only the updates are timed
+    std::mt19937 random(3);
+    int16_t readings[1024][3];
+    float accel[3] = { 0.0f, 0.0f, 1.0f };
+    for (unsigned int i = 0; i < 1024; ++i)
+    {
+        double direction[3];
+        randomDirection(random, false, direction);
+        distortedReading(direction, random, MAG_NOISE, readings[i]);
+    }
+    MagnetometerCalibrator mag(magBase());
+    GyroBiasCalibrator gyro(gyroBase());
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (unsigned int i = 0; i < ITERATIONS; ++i)
+    {
+        mag.update(readings[i % 1024]);
+    }
+    std::chrono::duration<double, std::nano> magTime = std::chrono::steady_clock::now() - start;
+    start = std::chrono::steady_clock::now();
+    for (unsigned int i = 0; i < ITERATIONS; ++i)
+    {
+        gyro.update(readings[i % 1024], accel);
+    }
+    std::chrono::duration<double, std::nano> gyroTime = std::chrono::steady_clock::now() - start;
+
+    // Something has to depend on every update or the compiler drops them
+    AxisCalibration calibration;
+    std::cout << "Magnetometer update: " << magTime.count() / ITERATIONS << " ns" << std::endl
+              << "Gyro update: " << gyroTime.count() / ITERATIONS << " ns" << std::endl
+              << "Checksum: " << mag.calibration(calibration) + gyro.count() << std::endl;
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,186 @@
+#include <sstream>
+#include <stdexcept>
+#include <stdint.h>
+#include <string>
+#include <string.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/gpio.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "data-ready.hpp"
+
+
+// Creates an epoll instance watching file for input, handles errors
+static int watchForInput(int file)
+{
+    int epollFile = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFile < 0)
+    {
+        std::ostringstream err;
+        err << "Could not create epoll instance" << std::endl << strerror(errno);
+        throw std::runtime_error(err.str());
+    }
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = file;
+    if (epoll_ctl(epollFile, EPOLL_CTL_ADD, file, &event) < 0)
+    {
+        close(epollFile);
+        std::ostringstream err;
+        err << "Could not watch for data ready events" << std::endl << strerror(errno);
+        throw std::runtime_error(err.str());
+    }
+    return epollFile;
+}
+
+
+// Waits for input on the single file epollFile watches, false on timeout
+static bool waitForInput(int epollFile, int timeoutMs)
+{
+    struct epoll_event event;
+    int ready;
+    do
+    {
+        ready = epoll_wait(epollFile, &event, 1, timeoutMs);
+    } while (ready < 0 && errno == EINTR);
+    if (ready < 0)
+    {
+        std::ostringstream err;
+        err << "Could not wait for data ready event" << std::endl << strerror(errno);
+        throw std::runtime_error(err.str());
+    }
+    return ready > 0;
+}
+
+
+GpioDataReady::GpioDataReady(const std::string &chip, unsigned int line)
+{
+    int chipFile = open(chip.c_str(), O_RDONLY | O_CLOEXEC);
+    if (chipFile < 0)
+    {
+        std::ostringstream err;
+        err << "Could not open " << chip << std::endl << strerror(errno);
+        throw std::runtime_error(err.str());
+    }
+
+    // Ask for falling edge events on the line, the request hands back a new
+    // file to read the events from
+    struct gpioevent_request request;
+    memset(&request, 0, sizeof(request));
+    request.lineoffset = line;
+    request.handleflags = GPIOHANDLE_REQUEST_INPUT;
+    request.eventflags = GPIOEVENT_REQUEST_FALLING_EDGE;
+    strncpy(request.consumer_label, "data-ready", sizeof(request.consumer_label) - 1);
+    int result = ioctl(chipFile, GPIO_GET_LINEEVENT_IOCTL, &request);
+    int requestErrno = errno;
+    close(chipFile);
+    if (result < 0)
+    {
+        std::ostringstream err;
+        err << "Could not request events for line " << line << " of " << chip
+            << std::endl << strerror(requestErrno);
+        throw std::runtime_error(err.str());
+    }
+    m_lineFile = request.fd;
+
+    try
+    {
+        m_epollFile = watchForInput(m_lineFile);
+    }
+    catch (...)
+    {
+        close(m_lineFile);
+        throw;
+    }
+}
+
+
+GpioDataReady::~GpioDataReady(void)
+{
+    close(m_epollFile);
+    close(m_lineFile);
+}
+
+
+bool GpioDataReady::wait(int timeoutMs)
+{
+    if (!waitForInput(m_epollFile, timeoutMs))
+    {
+        return false;
+    }
+
+    // Consume the event so the next wait blocks until the next edge
+    struct gpioevent_data event;
+    if (read(m_lineFile, &event, sizeof(event)) != sizeof(event))
+    {
+        std::ostringstream err;
+        err << "Could not read GPIO event" << std::endl << strerror(errno);
+        throw std::runtime_error(err.str());
+    }
+    return true;
+}
+
+
+EventFdDataReady::EventFdDataReady(void)
+{
+    // Semaphore mode so each signal is consumed by exactly one wait
+    m_eventFile = eventfd(0, EFD_CLOEXEC | EFD_SEMAPHORE);
+    if (m_eventFile < 0)
+    {
+        std::ostringstream err;
+        err << "Could not create eventfd" << std::endl << strerror(errno);
+        throw std::runtime_error(err.str());
+    }
+
+    try
+    {
+        m_epollFile = watchForInput(m_eventFile);
+    }
+    catch (...)
+    {
+        close(m_eventFile);
+        throw;
+    }
+}
+
+
+EventFdDataReady::~EventFdDataReady(void)
+{
+    close(m_epollFile);
+    close(m_eventFile);
+}
+
+
+void EventFdDataReady::signal(void)
+{
+    uint64_t one = 1;
+    if (write(m_eventFile, &one, sizeof(one)) != sizeof(one))
+    {
+        std::ostringstream err;
+        err << "Could not signal eventfd" << std::endl << strerror(errno);
+        throw std::runtime_error(err.str());
+    }
+}
+
+
+bool EventFdDataReady::wait(int timeoutMs)
+{
+    if (!waitForInput(m_epollFile, timeoutMs))
+    {
+        return false;
+    }
+    uint64_t count;
+    if (read(m_eventFile, &count, sizeof(count)) != sizeof(count))
+    {
+        std::ostringstream err;
+        err << "Could not read eventfd" << std::endl << strerror(errno);
+        throw std::runtime_error(err.str());
+    }
+    return true;
+}
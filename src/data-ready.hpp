@@ -0,0 +1,53 @@
+#ifndef DATA_READY_HPP
+#define DATA_READY_HPP
+
+#include <string>
+
+
+// This class is something a driver can wait on until its device signals that
+// new data is ready, instead of polling the device's status register.
+// wait blocks until the next data ready event, returning false if timeoutMs
+// passes without one.
+class DataReadySource
+{
+    public:
+        virtual ~DataReadySource(void) {}
+        virtual bool wait(int timeoutMs) = 0;
+};
+
+
+// This class waits on a device's interrupt pin wired to a GPIO line, using
+// the linux gpiochip character device (e.g. /dev/gpiochip0) and epoll.
+// The interrupt is expected to be active low so falling edges are data ready.
+class GpioDataReady : public DataReadySource
+{
+    public:
+        GpioDataReady(const std::string &chip, unsigned int line);
+        ~GpioDataReady(void);
+        bool wait(int timeoutMs);
+    private:
+        GpioDataReady(const GpioDataReady &);
+        GpioDataReady &operator=(const GpioDataReady &);
+        int m_lineFile;
+        int m_epollFile;
+};
+
+
+// This class stands in for a real interrupt using an eventfd, so that code
+// waiting on data ready can be driven without hardware. Each call to signal
+// is one data ready event.
+class EventFdDataReady : public DataReadySource
+{
+    public:
+        EventFdDataReady(void);
+        ~EventFdDataReady(void);
+        void signal(void);
+        bool wait(int timeoutMs);
+    private:
+        EventFdDataReady(const EventFdDataReady &);
+        EventFdDataReady &operator=(const EventFdDataReady &);
+        int m_eventFile;
+        int m_epollFile;
+};
+
+#endif
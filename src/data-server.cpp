@@ -1,54 +1,1651 @@
 // Data server awaits an arbitrary request from another zeromq application.
-// It then collects data from the mpl3115a2 device hanging off the i2c adapter
-// number provided. Finally it sends that data to the requester and awaits
-// another request for data.
+// A background thread continuously collects data from the mpl3115a2 device
+// hanging off the i2c adapter number provided, at the sample rate requested,
+// and keeps the latest sample in memory. Each request is answered straight
+// from that sample (along with its sequence number and age) so the requester
+// never waits on the i2c bus. Requests starting with "binary" get the sample
+// back as a fixed layout binary record (see wire-format.hpp), "config" gets
+// the mpl3115a2 settings, "stats" gets the bus, driver and request timings
+// (see statsString), "snapshot" gets the latest value of every field of every
+// sensor (see snapshotString), "jitter" gets a histogram of how late each
+// sensor's sampling woke up (see jitterString), "orientation" gets where the
+// lsm9ds1 is pointing (see orientationString), "vertical" gets the fused
+// altitude and vertical velocity (see verticalString), "calibration" gets the
+// lsm9ds1's gyro and magnetometer calibration (see calibrationString) and
+// anything else gets text. Requests are only logged with -v.
+//
+// The last -D samples of each sensor are kept in memory too so that clients
+// can ask for a window of them in one request instead of polling:
+//   "history <sensor> <seconds>" gets every sample from the last seconds
+//   "since <sensor> <sequence>" gets every sample after that sequence number
+// both back as binary records one after the other, oldest first, and
+//   "downsample <sensor> <seconds> <points>" splits the last seconds into
+// points equal stretches and gets a line of text for each, "<start> <count>"
+// then "<min> <mean> <max>" for each field (pressure, altitude, temperature
+// or accel, gyro and mag x y z). The sensor is mpl3115a2 or lsm9ds1 and
+// timestamps are on the monotonic clock like the records'. Queries that don't
+// make sense get "Bad query" back.
+//
+// Every sample is also pushed out on a PUB socket as soon as it is taken, with
+// the sensor name as the topic, so subscribers get data at the sensor rate
+// without asking for it. The lsm9ds1 can optionally be sampled as well, in
+// which case its samples go everywhere but the text and binary replies.
+// Each sensor has its own acquisition thread woken by its own PeriodicTimer,
+// so the lsm9ds1 can run at hundreds of Hz with the mpl3115a2 at a few. The
+// rates come from the options or from a -C file with a line per sensor:
+//   # sensor rate (Hz) [fifo [fill rate (Hz)]]
+//   mpl3115a2 4
+//   lsm9ds1 200 fifo 952
+// fifo on the mpl3115a2 line is -m, on the lsm9ds1 line -F with its rate, and
+// leaving the lsm9ds1 out turns it off. Options after -C override the file.
+//
+// -P turns on real time mode: the acquisition threads and the bus scheduler's
+// worker run SCHED_FIFO at that priority (pinned to the -A core if given),
+// all memory is locked with prefaulted stacks, and the threads sleep until
+// the absolute end of each period with clock_nanosleep. How late they wake up
+// is counted either way, so the jitter can be compared with it on and off.
+//
+// Local processes can read every sample from a POSIX shared memory ring
+// instead (see shared-memory-ring.hpp), without going through zeromq.
+//
+// Both sensors share the adapter through its bus scheduler (see
+// bus-scheduler.hpp), the lsm9ds1 with the shorter deadline so its samples
+// are never stuck behind an mpl3115a2 conversion being read.
+//
+// A failed transaction is retried (-a attempts, backing off from -B us) and a
+// sample that still fails is skipped rather than stopping the server. Each
+// sensor is allowed -e failed samples every ERROR_BUDGET_WINDOW, beyond that
+// the bus is recovered: cleared through the -L GPIO lines if given, the
+// adapter reopened and the sensor configured again (see i2c-recovery.hpp).
+//
+// Samples can be filtered before anything sees them, -f channel=spec once for
+// each of the mpl3115a2, accel, gyro and mag channels with a spec like
+// "median:3,lowpass:20:4" (see filters.hpp). The acquisition threads do the
+// filtering, and a decimate stage means fewer samples are published.
+//
+// The lsm9ds1's acquisition thread also keeps track of its orientation with a
+// Madgwick filter (see orientation.hpp), stepped with every sample the device
+// gives in physical units before any filter sees it. -G sets the filter's
+// beta. The acceleration rotated up by that orientation then drives a Kalman
+// filter (see vertical-estimator.hpp) that the mpl3115a2's altitude corrects
+// whenever a new sample of it turns up, so altitude and vertical velocity come
+// out at the lsm9ds1's rate. -V is how noisy the altitude is taken to be.
+//
+// The same thread calibrates the lsm9ds1 as it goes (see imu-calibration.hpp),
+// fitting the magnetometer's hard and soft iron from its readings and taking
+// the gyro's bias whenever the sensor is still, and hands the driver what it
+// comes up with every CALIBRATION_INTERVAL samples. With -K the calibration
+// is loaded from that file at start up and saved back to it every
+// CALIBRATION_SAVE_INTERVAL while it changes, so the next run starts from it.
+//
+// With -w every sample is also written to flight record files (see
+// flight-recorder.hpp), flight-recorder-csv turns them into CSV afterwards.
+//
+// Built with SIMULATED_BUS defined (data-server-sim) the sensors are models on
+// a simulated bus instead, so the server can be run and benchmarked anywhere.
 
+#include <array>
+#include <chrono>
+#include <errno.h>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <memory>
 #include <sstream>
+#include <stdexcept>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string>
+#include <string.h>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+#include <vector>
 #include <zmq.hpp>
 
+#include "barometric.hpp"
+#include "bus-scheduler.hpp"
+#include "data-ready.hpp"
+#include "filters.hpp"
+#include "flight-recorder.hpp"
+#include "i2c-recovery.hpp"
+#include "imu-calibration.hpp"
+#include "lsm9ds1.hpp"
+#include "metrics.hpp"
 #include "mpl3115a2.hpp"
+#include "orientation.hpp"
+#include "periodic-timer.hpp"
+#include "realtime.hpp"
+#include "sample-cache.hpp"
+#include "sensor-sample.hpp"
+#include "shared-memory-ring.hpp"
+#include "simulated-i2c.hpp"
+#include "time-series-store.hpp"
+#include "vertical-estimator.hpp"
+#include "wire-format.hpp"
+
+
+// On the simulated bus the scheduler just has a SimulatedBusBackend
+typedef ScheduledMPL3115A2 Barometer;
+typedef ScheduledLSM9DS1 Imu;
+
+// Where the sensors sit on the bus, for the scheduler's deadlines
+constexpr uint8_t MPL3115A2_ADDRESS = 0x60;
+constexpr uint8_t LSM9DS1_ACCEL_GYRO_ADDRESS = 0x6A;
+constexpr uint8_t LSM9DS1_MAG_ADDRESS = 0x1C;
+
+// Endpoints
+constexpr const char *REQUEST_ENDPOINT = "tcp://*:5555";
+constexpr const char *PUBLISH_ENDPOINT = "tcp://*:5556";
+constexpr const char *SAMPLE_ENDPOINT = "inproc://samples";
+
+// Requests starting with this get a binary record back, anything else gets text
+constexpr const char *BINARY_REQUEST = "binary";
+
+// Requests starting with this get the mpl3115a2 configuration back
+constexpr const char *CONFIG_REQUEST = "config";
+
+// Requests starting with this get the bus, driver and request timings back
+constexpr const char *STATS_REQUEST = "stats";
+
+// Requests starting with this get the latest value of every field back
+constexpr const char *SNAPSHOT_REQUEST = "snapshot";
+
+// Requests starting with this get the sampling jitter histograms back
+constexpr const char *JITTER_REQUEST = "jitter";
+
+// Requests starting with this get the lsm9ds1's orientation back
+constexpr const char *ORIENTATION_REQUEST = "orientation";
+
+// Requests starting with this get the fused altitude and vertical velocity back
+constexpr const char *VERTICAL_REQUEST = "vertical";
+
+// Requests starting with this get the lsm9ds1's calibration back
+constexpr const char *CALIBRATION_REQUEST = "calibration";
+
+// Sensor configuration file lines can ask for their FIFO with this
+constexpr const char *CONFIG_FIFO = "fifo";
+
+// Queries over the samples kept in memory
+constexpr const char *HISTORY_QUERY = "history";
+constexpr const char *SINCE_QUERY = "since";
+constexpr const char *DOWNSAMPLE_QUERY = "downsample";
+constexpr const char *BAD_QUERY_REPLY = "Bad query";
+
+// Most points a downsample query can ask for
+constexpr unsigned int MAX_DOWNSAMPLE_POINTS = 10000;
+
+// Each sensor's failed samples are counted against its budget over this long
+constexpr std::chrono::seconds ERROR_BUDGET_WINDOW(10);
+
+// How many lsm9ds1 samples go by between applying what the online
+// calibration has come up with, and how often it is saved to the -K file
+constexpr unsigned int CALIBRATION_INTERVAL = 256;
+constexpr std::chrono::seconds CALIBRATION_SAVE_INTERVAL(10);
+
+// Topics, subscribers filter on these prefixes
+constexpr const char *MPL3115A2_TOPIC = "mpl3115a2";
+constexpr const char *LSM9DS1_TOPIC = "lsm9ds1";
+
+
+static int64_t monotonicNanoseconds(void)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+// Whether the request starts with command
+static bool requestIs(const zmq::message_t &request, const char *command)
+{
+    return request.size() >= strlen(command) && memcmp(request.data(), command, strlen(command)) == 0;
+}
+
+
+// Hands a sample to the main thread for publishing, as a binary record if
+// binary is set or as text otherwise. Never blocks, if the main thread has
+// fallen that far behind the sample is dropped.
+template <typename Sample>
+static void pushSample(zmq::socket_t &push, const char *topic, const Sample &sample, bool binary)
+{
+    size_t topicSize = strlen(topic);
+    zmq::message_t message;
+    if (binary)
+    {
+        uint8_t record[WIRE_MAX_RECORD_SIZE];
+        size_t recordSize = encodeBinary(sample, 0, record);
+        message.rebuild(topicSize + 1 + recordSize);
+        memcpy(static_cast<char *>(message.data()) + topicSize + 1, record, recordSize);
+    }
+    else
+    {
+        std::string text = encodeText(sample);
+        message.rebuild(topicSize + 1 + text.size());
+        memcpy(static_cast<char *>(message.data()) + topicSize + 1, text.c_str(), text.size());
+    }
+    memcpy(message.data(), topic, topicSize);
+    static_cast<char *>(message.data())[topicSize] = ' ';
+    push.send(message, ZMQ_DONTWAIT);
+}
+
+
+// Where samples go besides the main thread, any may be null if not in use
+struct SampleSinks
+{
+    public:
+        SharedMemoryRing *ring;
+        FlightRecorder *recorder;
+        TimeSeriesStore<AltitudeSample> *altitudeHistory;
+        TimeSeriesStore<ImuSample> *imuHistory;
+};
+
+
+// The filters samples go through before they are published (see -f), each
+// run by its sensor's acquisition thread. The mpl3115a2's pressure, altitude
+// and temperature are the lanes of one pipeline.
+struct SampleFilters
+{
+    public:
+        FilterPipeline mpl3115a2;
+        FilterPipeline accel;
+        FilterPipeline gyro;
+        FilterPipeline mag;
+};
+
+
+// Filters data in place, false if the filter dropped it. Samples skip the
+// conversion to lanes and back if there is nothing to filter them.
+static bool filterSample(SampleFilters &filters, MPL3115A2DATA &data)
+{
+    if (filters.mpl3115a2.empty())
+    {
+        return true;
+    }
+    FilterLanes lanes = { static_cast<float>(data.pressure), static_cast<float>(data.altitude),
+                          static_cast<float>(data.temperature), 0.0f };
+    if (!filters.mpl3115a2.process(lanes))
+    {
+        return false;
+    }
+    data.pressure = lanes[0];
+    data.altitude = lanes[1];
+    data.temperature = lanes[2];
+    return true;
+}
+
+
+static bool filterAxes(FilterPipeline &filter, int16_t axes[3])
+{
+    if (filter.empty())
+    {
+        return true;
+    }
+    FilterLanes lanes = axesToLanes(axes);
+    if (!filter.process(lanes))
+    {
+        return false;
+    }
+    lanesToAxes(lanes, axes);
+    return true;
+}
+
+
+// Every channel sees every sample, which is only kept if none of them
+// dropped it
+static bool filterSample(SampleFilters &filters, LSM9DS1DATA &data)
+{
+    bool keep = filterAxes(filters.accel, data.accel);
+    keep = filterAxes(filters.gyro, data.gyro) && keep;
+    keep = filterAxes(filters.mag, data.mag) && keep;
+    return keep;
+}
+
+
+// What the lsm9ds1's acquisition thread works out from its samples, the
+// latest of it in the caches for the main thread. altitudes is the
+// mpl3115a2's cache, for the barometer readings the vertical estimate is
+// corrected with. The calibrators work from base, the driver's own
+// calibration, whatever has been applied since.
+struct ImuEstimates
+{
+    public:
+        ImuEstimates(float beta, const VerticalNoise &noise, const SampleCache<AltitudeSample> &altitudes,
+                     const ImuCalibration &base)
+            : ahrs(beta), verticalEstimator(noise), altitudes(altitudes), altitudesSeen(0),
+              gyroCalibrator(base.gyro), magCalibrator(base.mag), lastMag(), samplesSinceCalibrated(0) {}
+        MadgwickAhrs ahrs;
+        VerticalEstimator verticalEstimator;
+        const SampleCache<AltitudeSample> &altitudes;
+        uint64_t altitudesSeen;  // Sequence number of the last one corrected with
+        GyroBiasCalibrator gyroCalibrator;
+        MagnetometerCalibrator magCalibrator;
+        int16_t lastMag[3];  // The magnetometer is slower, repeats aren't fitted
+        unsigned int samplesSinceCalibrated;
+        SampleCache<OrientationSample> orientation;
+        SampleCache<VerticalSample> vertical;
+        SampleCache<CalibrationSample> calibration;  // What the driver is using
+};
+
+
+// Feeds data to the calibrators (accel being it in g) and every
+// CALIBRATION_INTERVAL samples hands the driver whatever they have come up
+// with, publishing it if it changed anything
+static void updateCalibration(Imu &lsm9ds1, const LSM9DS1DATA &data, const float accel[3], int64_t timestamp,
+                              ImuEstimates &estimates)
+{
+    estimates.gyroCalibrator.update(data.gyro, accel);
+    if (memcmp(data.mag, estimates.lastMag, sizeof(estimates.lastMag)) != 0)
+    {
+        estimates.magCalibrator.update(data.mag);
+        memcpy(estimates.lastMag, data.mag, sizeof(estimates.lastMag));
+    }
+    if (++estimates.samplesSinceCalibrated < CALIBRATION_INTERVAL)
+    {
+        return;
+    }
+    estimates.samplesSinceCalibrated = 0;
+
+    CalibrationSample calibration;
+    calibration.data.gyro = lsm9ds1.gyroCalibration();
+    calibration.data.mag = lsm9ds1.magCalibration();
+    estimates.gyroCalibrator.calibration(calibration.data.gyro);
+    estimates.magCalibrator.calibration(calibration.data.mag);
+    if (memcmp(&calibration.data.gyro, &lsm9ds1.gyroCalibration(), sizeof(AxisCalibration)) == 0 &&
+        memcmp(&calibration.data.mag, &lsm9ds1.magCalibration(), sizeof(AxisCalibration)) == 0)
+    {
+        return;
+    }
+    lsm9ds1.setGyroCalibration(calibration.data.gyro);
+    lsm9ds1.setMagCalibration(calibration.data.mag);
+    calibration.sequence = estimates.calibration.count() + 1;
+    calibration.timestamp = timestamp;
+    estimates.calibration.publish(calibration);
+}
+
+
+// Steps the AHRS on data, dt seconds after the last step, then the vertical
+// estimate with the acceleration it says is up, correcting that with the
+// latest altitude if there is a new one. Publishes the next of each
+// estimate's samples (the vertical one once an altitude has started it).
+// data should be straight from the device so the estimates see every sample
+// at the device rate whatever the filters do. The calibrators see every
+// sample first, so a new calibration applies from the sample it came from.
+// The field is turned into the accelerometer/gyro frame before it is fused.
+static void estimateMotion(Imu &lsm9ds1, const LSM9DS1DATA &data, int64_t timestamp, float dt,
+                           ImuEstimates &estimates)
+{
+    float accel[3];
+    float gyro[3];
+    float field[3];
+    float mag[3];
+    calibrateAxes(data.accel, lsm9ds1.accelCalibration(), accel);
+    updateCalibration(lsm9ds1, data, accel, timestamp, estimates);
+    calibrateAxes(data.gyro, lsm9ds1.gyroCalibration(), gyro);
+    calibrateAxes(data.mag, lsm9ds1.magCalibration(), field);
+    magToAccelGyroFrame(field, mag);
+    estimates.ahrs.update(gyro, accel, mag, dt);
+
+    // Only this thread publishes, so the next sequence number is one past the
+    // count
+    OrientationSample orientation;
+    orientation.sequence = estimates.orientation.count() + 1;
+    orientation.timestamp = timestamp;
+    orientation.data = estimates.ahrs.orientation();
+    estimates.orientation.publish(orientation);
+
+    // At rest the accelerometer reads 1 g up
+    float earth[3];
+    rotateToEarth(orientation.data, accel, earth);
+    estimates.verticalEstimator.predict((earth[2] - 1.0) * STANDARD_GRAVITY, dt);
+    AltitudeSample altitude;
+    if (estimates.altitudes.count() != estimates.altitudesSeen && estimates.altitudes.read(altitude))
+    {
+        estimates.verticalEstimator.correct(altitude.data.altitude);
+        estimates.altitudesSeen = altitude.sequence;
+    }
+    if (estimates.verticalEstimator.started())
+    {
+        VerticalSample vertical;
+        vertical.sequence = estimates.vertical.count() + 1;
+        vertical.timestamp = timestamp;
+        vertical.data = estimates.verticalEstimator.estimate();
+        estimates.vertical.publish(vertical);
+    }
+}
+
+
+static void storeHistory(const SampleSinks &sinks, const AltitudeSample &sample)
+{
+    if (sinks.altitudeHistory != nullptr)
+    {
+        sinks.altitudeHistory->publish(sample);
+    }
+}
+
+
+static void storeHistory(const SampleSinks &sinks, const ImuSample &sample)
+{
+    if (sinks.imuHistory != nullptr)
+    {
+        sinks.imuHistory->publish(sample);
+    }
+}
+
+
+// Hands a sample to the history, the shared memory ring and the flight
+// recorder. Like pushSample this never blocks, the recorder counts anything it
+// has to drop.
+template <typename Sample>
+static void storeSample(const SampleSinks &sinks, const Sample &sample)
+{
+    storeHistory(sinks, sample);
+    if (sinks.ring != nullptr)
+    {
+        sinks.ring->publish(sample);
+    }
+    if (sinks.recorder != nullptr)
+    {
+        sinks.recorder->record(sample);
+    }
+}
+
+
+// Counts a sample that couldn't be taken (errno says why) against budget,
+// recovering the sensor's bus once the budget has run out
+template <typename Driver>
+static void sampleFailed(const char *sensor, Driver &driver, ErrorBudget &budget)
+{
+    int error = errno;
+    if (budget.spend())
+    {
+        return;
+    }
+    std::cerr << sensor << " failed too often (last: " << strerror(error) << "), recovering the bus" << std::endl;
+    if (!driver.recover())
+    {
+        std::cerr << sensor << " could not recover the bus: " << strerror(errno) << std::endl;
+    }
+}
+
+
+// Samples the mpl3115a2 every time the timer ends a period forever,
+// publishing into cache and pushing every sample to the main thread.
+// Samples that fail are skipped and counted against budget, samples the
+// filters drop are skipped.
+static void acquireAltitude(Barometer &mpl3115a2, SampleCache<AltitudeSample> &cache,
+                            zmq::context_t &context, PeriodicTimer &timer, ErrorBudget &budget,
+                            SampleFilters &filters, bool binary, SampleSinks sinks)
+{
+    zmq::socket_t push(context, ZMQ_PUSH);
+    push.connect(SAMPLE_ENDPOINT);
+
+    AltitudeSample sample;
+    sample.sequence = 0;
+    for (;;)
+    {
+        if (!mpl3115a2.tryGetSample(sample.data))
+        {
+            sampleFailed(MPL3115A2_TOPIC, mpl3115a2, budget);
+            timer.wait();
+            continue;
+        }
+        if (!filterSample(filters, sample.data))
+        {
+            timer.wait();
+            continue;
+        }
+        sample.timestamp = monotonicNanoseconds();
+        ++sample.sequence;
+        cache.publish(sample);
+        pushSample(push, MPL3115A2_TOPIC, sample, binary);
+        storeSample(sinks, sample);
+        timer.wait();
+    }
+}
+
+
+// Wakes up every period of the timer forever, draining the mpl3115a2 FIFO and
+// handling every sample in it like acquireAltitude does.
+// Timestamps are worked back from the time of the drain, one device sample
+// period apart, but never to before the last sample's (the drain can be
+// earlier in its period than the last one was).
+static void acquireAltitudeFifo(Barometer &mpl3115a2, SampleCache<AltitudeSample> &cache,
+                                zmq::context_t &context, PeriodicTimer &timer, ErrorBudget &budget,
+                                SampleFilters &filters, bool binary, SampleSinks sinks)
+{
+    zmq::socket_t push(context, ZMQ_PUSH);
+    push.connect(SAMPLE_ENDPOINT);
+    int64_t devicePeriod = static_cast<int64_t>(1e9 / mpl3115a2.sampleRate());
+
+    AltitudeSample sample;
+    sample.sequence = 0;
+    int64_t last = INT64_MIN;
+    MPL3115A2FIFOBATCH batch;
+    for (;;)
+    {
+        if (!mpl3115a2.tryReadFifo(batch))
+        {
+            sampleFailed(MPL3115A2_TOPIC, mpl3115a2, budget);
+            timer.wait();
+            continue;
+        }
+        int64_t drained = monotonicNanoseconds();
+        if (batch.overrun)
+        {
+            std::cerr << "mpl3115a2 FIFO overrun, wake up more often" << std::endl;
+        }
+        for (unsigned int i = 0; i < batch.count; ++i)
+        {
+            sample.data = batch.samples[i];
+            if (!filterSample(filters, sample.data))
+            {
+                continue;
+            }
+            sample.timestamp = drained - (batch.count - 1 - i) * devicePeriod;
+            if (sample.timestamp < last)
+            {
+                sample.timestamp = last;
+            }
+            last = sample.timestamp;
+            ++sample.sequence;
+            cache.publish(sample);
+            pushSample(push, MPL3115A2_TOPIC, sample, binary);
+            storeSample(sinks, sample);
+        }
+        timer.wait();
+    }
+}
+
+
+// Samples the lsm9ds1 every time the timer ends a period forever, publishing
+// into cache and pushing every sample to the main thread, skipping samples
+// that fail or are filtered out like acquireAltitude does. Every sample
+// steps the estimates (see estimateMotion), over the time since the last one
+// that didn't fail.
+static void acquireImu(Imu &lsm9ds1, SampleCache<ImuSample> &cache, zmq::context_t &context,
+                       PeriodicTimer &timer, ErrorBudget &budget, SampleFilters &filters,
+                       ImuEstimates &estimates, bool binary, SampleSinks sinks)
+{
+    zmq::socket_t push(context, ZMQ_PUSH);
+    push.connect(SAMPLE_ENDPOINT);
+    float period = std::chrono::duration<float>(timer.period()).count();
+
+    ImuSample sample;
+    sample.sequence = 0;
+    int64_t last = 0;
+    for (;;)
+    {
+        if (!lsm9ds1.tryGetSample(sample.data))
+        {
+            sampleFailed(LSM9DS1_TOPIC, lsm9ds1, budget);
+            timer.wait();
+            continue;
+        }
+        sample.timestamp = monotonicNanoseconds();
+        float dt = last == 0 ? period : (sample.timestamp - last) / 1e9f;
+        last = sample.timestamp;
+        estimateMotion(lsm9ds1, sample.data, sample.timestamp, dt, estimates);
+        if (!filterSample(filters, sample.data))
+        {
+            timer.wait();
+            continue;
+        }
+        ++sample.sequence;
+        cache.publish(sample);
+        pushSample(push, LSM9DS1_TOPIC, sample, binary);
+        storeSample(sinks, sample);
+        timer.wait();
+    }
+}
+
+
+// Wakes up every period of the timer forever, draining the lsm9ds1 FIFO
+// (which fills at the odr) and handling every sample in it like acquireImu
+// does. The magnetometer isn't in the FIFO so it is read once per wake up,
+// which makes it current as of the newest sample in the batch.
+// Timestamps are worked back from the time of the drain, one odr period apart
+// (which is also what the estimates step over) but never to before the last
+// sample's, like acquireAltitudeFifo does.
+static void acquireImuFifo(Imu &lsm9ds1, SampleCache<ImuSample> &cache, zmq::context_t &context,
+                           PeriodicTimer &timer, ErrorBudget &budget, SampleFilters &filters,
+                           ImuEstimates &estimates, LSM9DS1ODR odr, bool binary, SampleSinks sinks)
+{
+    zmq::socket_t push(context, ZMQ_PUSH);
+    push.connect(SAMPLE_ENDPOINT);
+    lsm9ds1.configureFifo(odr);
+    int64_t odrPeriod = static_cast<int64_t>(1e9 / Imu::odrHz(odr));
+    float dt = static_cast<float>(1.0 / Imu::odrHz(odr));
+
+    ImuSample sample;
+    sample.sequence = 0;
+    int64_t last = INT64_MIN;
+    LSM9DS1FIFOBATCH batch;
+    std::array<int16_t, 3> mag;
+    for (;;)
+    {
+        if (!lsm9ds1.tryReadFifo(batch) || !lsm9ds1.tryGetMag(mag))
+        {
+            sampleFailed(LSM9DS1_TOPIC, lsm9ds1, budget);
+            timer.wait();
+            continue;
+        }
+        int64_t drained = monotonicNanoseconds();
+        if (batch.overrun)
+        {
+            std::cerr << "lsm9ds1 FIFO overrun, wake up more often" << std::endl;
+        }
+        for (unsigned int i = 0; i < batch.count; ++i)
+        {
+            for (unsigned int axis = 0; axis < 3; ++axis)
+            {
+                sample.data.accel[axis] = batch.samples[i].accel[axis];
+                sample.data.gyro[axis] = batch.samples[i].gyro[axis];
+                sample.data.mag[axis] = mag[axis];
+            }
+            sample.timestamp = drained - (batch.count - 1 - i) * odrPeriod;
+            if (sample.timestamp < last)
+            {
+                sample.timestamp = last;
+            }
+            last = sample.timestamp;
+            estimateMotion(lsm9ds1, sample.data, sample.timestamp, dt, estimates);
+            if (!filterSample(filters, sample.data))
+            {
+                continue;
+            }
+            ++sample.sequence;
+            cache.publish(sample);
+            pushSample(push, LSM9DS1_TOPIC, sample, binary);
+            storeSample(sinks, sample);
+        }
+        timer.wait();
+    }
+}
+
+
+// Answers a query (command is the first word of it, args the rest) from
+// history, false if the arguments don't make sense
+template <typename Sample>
+static bool answerQuery(const TimeSeriesStore<Sample> &history, const std::string &command,
+                        std::istream &args, std::string &reply)
+{
+    std::vector<Sample> samples;
+    int64_t now = monotonicNanoseconds();
+    if (command == DOWNSAMPLE_QUERY)
+    {
+        double seconds;
+        unsigned int points;
+        if (!(args >> seconds >> points) || seconds <= 0 || points == 0 || points > MAX_DOWNSAMPLE_POINTS)
+        {
+            return false;
+        }
+        int64_t from = now - static_cast<int64_t>(seconds * 1e9);
+        history.since(from, samples);
+        std::ostringstream os;
+        for (const SeriesSummary &summary : downsample(samples, from, now, points))
+        {
+            os << summary.start << " " << summary.count;
+            for (unsigned int field = 0; field < summary.fields; ++field)
+            {
+                os << " " << summary.min[field] << " " << summary.mean[field] << " " << summary.max[field];
+            }
+            os << std::endl;
+        }
+        reply = os.str();
+        return true;
+    }
+
+    if (command == HISTORY_QUERY)
+    {
+        double seconds;
+        if (!(args >> seconds) || seconds <= 0)
+        {
+            return false;
+        }
+        history.since(now - static_cast<int64_t>(seconds * 1e9), samples);
+    }
+    else
+    {
+        uint64_t sequence;
+        if (!(args >> sequence))
+        {
+            return false;
+        }
+        history.after(sequence, samples);
+    }
+
+    // Records are all the same size for a sensor, ages are in microseconds
+    uint8_t record[WIRE_MAX_RECORD_SIZE];
+    reply.clear();
+    for (const Sample &sample : samples)
+    {
+        int64_t age = (now - sample.timestamp) / 1000;
+        size_t size = encodeBinary(sample, age > UINT32_MAX ? UINT32_MAX : age, record);
+        reply.append(reinterpret_cast<const char *>(record), size);
+    }
+    return true;
+}
+
+
+// Answers a history, since or downsample request, with BAD_QUERY_REPLY if it
+// doesn't make sense or asks for a sensor that isn't kept
+static std::string historyReply(const zmq::message_t &request, const SampleSinks &sinks)
+{
+    std::istringstream args(std::string(static_cast<const char *>(request.data()), request.size()));
+    std::string command, sensor;
+    args >> command >> sensor;
+    std::string reply;
+    bool answered = false;
+    if (sensor == MPL3115A2_TOPIC && sinks.altitudeHistory != nullptr)
+    {
+        answered = answerQuery(*sinks.altitudeHistory, command, args, reply);
+    }
+    else if (sensor == LSM9DS1_TOPIC && sinks.imuHistory != nullptr)
+    {
+        answered = answerQuery(*sinks.imuHistory, command, args, reply);
+    }
+    return answered ? reply : BAD_QUERY_REPLY;
+}
+
+
+// Everything the metrics have counted so far, one line each: the traffic
+// and ioctl times for each i2c address, how long the drivers waited for data
+// and took to decode it, how many sampling periods each sensor missed and how
+// late it woke up, how many samples failed and how often that ran the error
+// budget out, what the mpl3115a2's register cache saved, how busy the bus scheduler kept each device, and how long
+// requests took from being received to the reply being sent (all in
+// microseconds), then what the flight recorder has written if it is on
+static std::string statsString(const Barometer &mpl3115a2, const PeriodicTimer &altitudeTimer,
+                               const ErrorBudget &altitudeBudget, const Imu *lsm9ds1,
+                               const PeriodicTimer *imuTimer, const ErrorBudget &imuBudget,
+                               const LatencyHistogram &requestTime, const FlightRecorder *recorder)
+{
+    std::ostringstream os;
+    os << formatI2cMetrics()
+       << "mpl3115a2 wait " << formatLatency(mpl3115a2.metrics().waitTime.snapshot()) << std::endl
+       << "mpl3115a2 decode " << formatLatency(mpl3115a2.metrics().decodeTime.snapshot()) << std::endl
+       << "mpl3115a2 missed periods: " << altitudeTimer.missed() << std::endl
+       << "mpl3115a2 jitter " << formatLatency(altitudeTimer.lateness().snapshot()) << std::endl
+       << "mpl3115a2 failed samples: " << altitudeBudget.failures()
+       << " budget exhausted: " << altitudeBudget.exhausted() << std::endl;
+    RegisterCacheStats cacheStats = mpl3115a2.registerCacheStats();
+    os << "mpl3115a2 register cache hits: " << cacheStats.hits << " misses: " << cacheStats.misses
+       << " writes: " << cacheStats.writes << " skipped writes: " << cacheStats.skippedWrites << std::endl;
+    if (lsm9ds1 != nullptr && imuTimer != nullptr)
+    {
+        os << "lsm9ds1 decode " << formatLatency(lsm9ds1->metrics().decodeTime.snapshot()) << std::endl
+           << "lsm9ds1 missed periods: " << imuTimer->missed() << std::endl
+           << "lsm9ds1 jitter " << formatLatency(imuTimer->lateness().snapshot()) << std::endl
+           << "lsm9ds1 failed samples: " << imuBudget.failures()
+           << " budget exhausted: " << imuBudget.exhausted() << std::endl;
+    }
+    os << BusScheduler::formatStats()
+       << "requests " << formatLatency(requestTime.snapshot());
+    if (recorder != nullptr)
+    {
+        os << std::endl << "recorder written: " << recorder->written() << " dropped: " << recorder->dropped()
+           << " files: " << recorder->filesStarted();
+    }
+    return os.str();
+}
+
+
+// How late each sensor's acquisition thread woke up, from the intended start
+// of a sample to the thread running: a line per sensor with the period, then
+// a line per histogram bucket anything fell in (see formatHistogram)
+static std::string jitterString(const PeriodicTimer &altitudeTimer, const PeriodicTimer *imuTimer)
+{
+    std::ostringstream os;
+    os << "mpl3115a2 period: " << altitudeTimer.period().count() / 1000 << " us" << std::endl
+       << formatHistogram(altitudeTimer.lateness().snapshot());
+    if (imuTimer != nullptr)
+    {
+        os << "lsm9ds1 period: " << imuTimer->period().count() / 1000 << " us" << std::endl
+           << formatHistogram(imuTimer->lateness().snapshot());
+    }
+    return os.str();
+}
+
+
+// Runs an acquisition loop on the calling thread, after making the thread real
+// time if realtime asks for it
+static void runAcquisition(RealtimeSettings realtime, std::function<void(void)> acquire)
+{
+    makeRealtime(realtime);
+    acquire();
+}
+
+
+// One line of snapshotString
+template <typename Value, typename Sample>
+static void snapshotField(std::ostream &os, const std::string &name, Value value, const Sample &sample,
+                          int64_t now)
+{
+    os << name << " " << value << " " << sample.sequence << " " << sample.timestamp << " "
+       << (now - sample.timestamp) / 1000 << std::endl;
+}
+
+
+// The latest value of every field of every sensor, a line each:
+// "<sensor>.<field> <value> <sequence> <timestamp> <age>" with the sequence
+// number and timestamp of the sample the field came from and its age in
+// microseconds, since each sensor is sampled at its own rate. The lsm9ds1
+// fields, and the orientation and vertical estimate worked out from them, are
+// left out if it is off or hasn't been sampled yet.
+static std::string snapshotString(const SampleCache<AltitudeSample> &altitudeCache,
+                                  const SampleCache<ImuSample> *imuCache, const ImuEstimates *estimates)
+{
+    int64_t now = monotonicNanoseconds();
+    std::ostringstream os;
+    AltitudeSample altitude;
+    if (altitudeCache.read(altitude))
+    {
+        snapshotField(os, "mpl3115a2.pressure", altitude.data.pressure, altitude, now);
+        snapshotField(os, "mpl3115a2.altitude", altitude.data.altitude, altitude, now);
+        snapshotField(os, "mpl3115a2.temperature", altitude.data.temperature, altitude, now);
+    }
+    ImuSample imu;
+    if (imuCache != nullptr && imuCache->read(imu))
+    {
+        const char axes[] = { 'x', 'y', 'z' };
+        for (unsigned int axis = 0; axis < 3; ++axis)
+        {
+            snapshotField(os, std::string("lsm9ds1.accel_") + axes[axis], imu.data.accel[axis], imu, now);
+        }
+        for (unsigned int axis = 0; axis < 3; ++axis)
+        {
+            snapshotField(os, std::string("lsm9ds1.gyro_") + axes[axis], imu.data.gyro[axis], imu, now);
+        }
+        for (unsigned int axis = 0; axis < 3; ++axis)
+        {
+            snapshotField(os, std::string("lsm9ds1.mag_") + axes[axis], imu.data.mag[axis], imu, now);
+        }
+    }
+    OrientationSample orientation;
+    if (estimates != nullptr && estimates->orientation.read(orientation))
+    {
+        snapshotField(os, "orientation.roll", orientation.data.roll, orientation, now);
+        snapshotField(os, "orientation.pitch", orientation.data.pitch, orientation, now);
+        snapshotField(os, "orientation.yaw", orientation.data.yaw, orientation, now);
+        const char components[] = { 'w', 'x', 'y', 'z' };
+        for (unsigned int i = 0; i < 4; ++i)
+        {
+            snapshotField(os, std::string("orientation.q") + components[i], orientation.data.quaternion[i],
+                          orientation, now);
+        }
+    }
+    VerticalSample vertical;
+    if (estimates != nullptr && estimates->vertical.read(vertical))
+    {
+        snapshotField(os, "vertical.altitude", vertical.data.altitude, vertical, now);
+        snapshotField(os, "vertical.velocity", vertical.data.velocity, vertical, now);
+        snapshotField(os, "vertical.accel_bias", vertical.data.accelBias, vertical, now);
+    }
+    return os.str();
+}
+
+
+// The latest orientation of the lsm9ds1 as text, Euler angles in degrees then
+// the quaternion w x y z, its sequence number and age in microseconds
+static std::string orientationString(const ImuEstimates *estimates)
+{
+    OrientationSample orientation;
+    if (estimates == nullptr)
+    {
+        return "No orientation, the lsm9ds1 is off (see -i)";
+    }
+    if (!estimates->orientation.read(orientation))
+    {
+        return "No orientation yet";
+    }
+    const Orientation &data = orientation.data;
+    std::ostringstream os;
+    os << "Roll: " << data.roll << " Pitch: " << data.pitch << " Yaw: " << data.yaw
+       << " Quaternion: " << data.quaternion[0] << " " << data.quaternion[1] << " " << data.quaternion[2] << " "
+       << data.quaternion[3] << " Sequence: " << orientation.sequence
+       << " Age: " << (monotonicNanoseconds() - orientation.timestamp) / 1000;
+    return os.str();
+}
+
+
+// The latest fused altitude (m), vertical velocity (m/s, up) and the
+// accelerometer bias taken out of it (m/s^2) as text, with the sequence number
+// and age in microseconds
+static std::string verticalString(const ImuEstimates *estimates)
+{
+    VerticalSample vertical;
+    if (estimates == nullptr)
+    {
+        return "No vertical estimate, the lsm9ds1 is off (see -i)";
+    }
+    if (!estimates->vertical.read(vertical))
+    {
+        return "No vertical estimate yet";
+    }
+    std::ostringstream os;
+    os << "Altitude: " << vertical.data.altitude << " Velocity: " << vertical.data.velocity
+       << " AccelBias: " << vertical.data.accelBias << " Sequence: " << vertical.sequence
+       << " Age: " << (monotonicNanoseconds() - vertical.timestamp) / 1000;
+    return os.str();
+}
+
+
+// The calibration the lsm9ds1's gyro and magnetometer counts are being turned
+// into physical units with as text, scale and bias for x, y and z of each,
+// with the sequence number (one for the calibration started with) and age in
+// microseconds
+static std::string calibrationString(const ImuEstimates *estimates)
+{
+    CalibrationSample calibration;
+    if (estimates == nullptr || !estimates->calibration.read(calibration))
+    {
+        return "No calibration, the lsm9ds1 is off (see -i)";
+    }
+    const AxisCalibration *axes[2] = { &calibration.data.gyro, &calibration.data.mag };
+    const char *names[2] = { "Gyro:", " Mag:" };
+    std::ostringstream os;
+    for (unsigned int i = 0; i < 2; ++i)
+    {
+        os << names[i] << " Scale: " << axes[i]->scale[0] << " " << axes[i]->scale[1] << " " << axes[i]->scale[2]
+           << " Bias: " << axes[i]->bias[0] << " " << axes[i]->bias[1] << " " << axes[i]->bias[2];
+    }
+    os << " Sequence: " << calibration.sequence
+       << " Age: " << (monotonicNanoseconds() - calibration.timestamp) / 1000;
+    return os.str();
+}
+
+
+// Saves the lsm9ds1's calibration to filename every CALIBRATION_SAVE_INTERVAL
+// if it has changed since it was last saved, forever. A failed save is
+// reported and tried again next time.
+static void saveCalibration(const std::string filename, const SampleCache<CalibrationSample> &calibration)
+{
+    uint64_t saved = calibration.count();
+    for (;;)
+    {
+        std::this_thread::sleep_for(CALIBRATION_SAVE_INTERVAL);
+        CalibrationSample latest;
+        if (calibration.count() == saved || !calibration.read(latest))
+        {
+            continue;
+        }
+        if (!saveImuCalibration(filename, latest.data))
+        {
+            std::cerr << "Could not save the lsm9ds1 calibration to " << filename << ": " << strerror(errno)
+                      << std::endl;
+            continue;
+        }
+        saved = latest.sequence;
+    }
+}
+
+
+// Reads the sensors' rates from a configuration file (see the top of this
+// file) into the same settings the options set, false with a message on
+// stderr if it doesn't make sense
+static bool readSensorConfig(const std::string &filename, double &sampleRate, bool &altitudeFifo,
+                             double &imuSampleRate, double &fifoRate)
+{
+    std::ifstream file(filename);
+    if (!file)
+    {
+        std::cerr << "Could not open " << filename << std::endl;
+        return false;
+    }
+
+    // The lsm9ds1 is off unless it is listed
+    imuSampleRate = 0.0;
+    fifoRate = 0.0;
+    std::string line;
+    unsigned int lineNumber = 0;
+    while (std::getline(file, line))
+    {
+        ++lineNumber;
+        std::istringstream fields(line.substr(0, line.find('#')));
+        std::string sensor, fifo, extra;
+        double rate;
+        if (!(fields >> sensor))
+        {
+            continue;
+        }
+        bool valid = (fields >> rate) && rate > 0;
+        if (valid && sensor == MPL3115A2_TOPIC)
+        {
+            sampleRate = rate;
+            altitudeFifo = static_cast<bool>(fields >> fifo);
+            valid = !altitudeFifo || fifo == CONFIG_FIFO;
+        }
+        else if (valid && sensor == LSM9DS1_TOPIC)
+        {
+            imuSampleRate = rate;
+            fifoRate = 0.0;
+            if (fields >> fifo)
+            {
+                valid = fifo == CONFIG_FIFO && (fields >> fifoRate) && fifoRate > 0;
+            }
+        }
+        else
+        {
+            valid = false;
+        }
+        if (!valid || (fields >> extra))
+        {
+            std::cerr << filename << ":" << lineNumber << ": expected \"<sensor> <rate> [" << CONFIG_FIFO
+                      << " [fill rate]]\" for mpl3115a2 or lsm9ds1" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+
+// The oversample ratio for ratio (1, 2, 4 ... 128), false if there isn't one
+static bool oversampleForRatio(int ratio, MPL3115A2OVERSAMPLE &oversample)
+{
+    for (uint8_t bits = 0; bits <= static_cast<uint8_t>(MPL3115A2OVERSAMPLE::OS_128); ++bits)
+    {
+        if (ratio == (1 << bits))
+        {
+            oversample = static_cast<MPL3115A2OVERSAMPLE>(bits);
+            return true;
+        }
+    }
+    return false;
+}
+
+
+// The slowest odr that is at least rate (Hz), or the fastest one there is
+static LSM9DS1ODR odrForRate(double rate)
+{
+    const LSM9DS1ODR odrs[] = {
+        LSM9DS1ODR::ODR_14_9HZ, LSM9DS1ODR::ODR_59_5HZ, LSM9DS1ODR::ODR_119HZ,
+        LSM9DS1ODR::ODR_238HZ, LSM9DS1ODR::ODR_476HZ, LSM9DS1ODR::ODR_952HZ
+    };
+    for (LSM9DS1ODR odr : odrs)
+    {
+        if (Imu::odrHz(odr) >= rate)
+        {
+            return odr;
+        }
+    }
+    return LSM9DS1ODR::ODR_952HZ;
+}
+
+
+#ifdef SIMULATED_BUS
+// Puts models of both sensors on the simulated bus for the adapter, with the
+// board sitting still and level at standard sea level pressure, and puts the
+// adapter's bus scheduler on it
+static void attachSimulatedSensors(unsigned int adapterNumber)
+{
+    std::shared_ptr<MPL3115A2Model> mpl3115a2 = std::make_shared<MPL3115A2Model>();
+    std::shared_ptr<LSM9DS1AccelGyroModel> accelGyro = std::make_shared<LSM9DS1AccelGyroModel>();
+    std::shared_ptr<LSM9DS1MagModel> mag = std::make_shared<LSM9DS1MagModel>();
+    mpl3115a2->setPressure(STANDARD_SEA_LEVEL_PRESSURE);
+    accelGyro->setAccel(0, 0, 16384);
+    mag->setMag(1200, -300, 4500);
+    SimulatedBus &bus = SimulatedBus::adapter(adapterNumber);
+    bus.attach(MPL3115A2_ADDRESS, mpl3115a2);
+    bus.attach(LSM9DS1_ACCEL_GYRO_ADDRESS, accelGyro);
+    bus.attach(LSM9DS1_MAG_ADDRESS, mag);
+    BusScheduler::useBackend(adapterNumber, std::make_shared<SimulatedBusBackend>(adapterNumber));
+}
+#endif
+
+
+static void usage(const char *name)
+{
+    std::cerr << "Usage: " << name << " [-r sample rate (Hz)] [-i lsm9ds1 sample rate (Hz)]"
+              << " [-F lsm9ds1 FIFO rate (Hz)] [-g gpiochip:line[:pin]]" << std::endl
+              << "       [-o oversample ratio] [-t time step] [-m] [-s sea level pressure (Pa)]" << std::endl
+              << "       [-H publish high-water mark] [-b] [-D history depth]" << std::endl
+              << "       [-S shared memory name] [-R ring slots] [-w flight record prefix]" << std::endl
+              << "       [-W file size (MB)] [-k files kept] [-C sensor config file]" << std::endl
+              << "       [-P real time priority] [-A cpu] [-a attempts] [-B backoff (us)]" << std::endl
+              << "       [-e error budget] [-L gpiochip:scl:sda] [-f channel=filter spec]" << std::endl
+              << "       [-G orientation filter beta] [-V altitude noise (m)] [-K calibration file]" << std::endl
+              << "       [-v] adapter" << std::endl
+              << "Please give the i2c adapter number (found using i2cdetect -l)" << std::endl
+              << "  -b publishes binary records instead of text" << std::endl
+              << "  -v prints every request as it comes in and every text sample sent back" << std::endl
+              << "  -F fills the lsm9ds1 FIFO at this rate and drains it at the -i rate" << std::endl
+              << "  -C reads the sensors' rates from a file, a line each like \"lsm9ds1 200 fifo 952\"" << std::endl
+              << "     (see the top of src/data-server.cpp), options after it override it" << std::endl
+              << "  -P runs acquisition SCHED_FIFO at this priority (1 to 99) with memory locked," << std::endl
+              << "     -A pins it to that cpu" << std::endl
+              << "  -a tries each i2c transaction this many times (default 3), the retries after" << std::endl
+              << "     the first waiting -B us (default 50) doubling up to 1 ms" << std::endl
+              << "  -e is how many samples a sensor can fail in " << ERROR_BUDGET_WINDOW.count()
+              << " s before the bus is recovered" << std::endl
+              << "     (default 20), -L clears the bus by clocking SCL on these GPIO lines" << std::endl
+              << "  -f filters the mpl3115a2, accel, gyro or mag channel, e.g. -f accel=lowpass:20:4" << std::endl
+              << "     (stages lowpass:Hz[:order], highpass:Hz[:order], average:n, median:n and" << std::endl
+              << "     decimate:n separated by commas, see src/filters.hpp)" << std::endl
+              << "  -G sets how hard the lsm9ds1 orientation is pulled towards gravity and the" << std::endl
+              << "     magnetic field, in rad/s (default " << MadgwickAhrs::DEFAULT_BETA
+              << ", 0 integrates the gyro alone)" << std::endl
+              << "  -V is the standard deviation of the mpl3115a2 altitude the vertical velocity" << std::endl
+              << "     is fused from (default " << VerticalEstimator::DEFAULT_NOISE.altitude
+              << " m), more the noisier the oversample ratio leaves it" << std::endl
+              << "  -K loads the lsm9ds1 gyro and magnetometer calibration from this file if it" << std::endl
+              << "     exists and saves what the online calibration comes up with back to it" << std::endl
+              << "  -g waits on the mpl3115a2 data ready interrupt (pin 1 or 2, default 1)" << std::endl
+              << "     wired to this GPIO line instead of polling" << std::endl
+              << "  -o sets the mpl3115a2 oversample ratio (1, 2, 4 ... 128)" << std::endl
+              << "  -t sets the mpl3115a2 time step, a sample every 2^t seconds" << std::endl
+              << "  -m keeps mpl3115a2 samples in its FIFO and drains it at the -r rate" << std::endl
+              << "  -s is the pressure at sea level that altitude is worked out from" << std::endl
+              << "  -D sets how many samples of each sensor are kept for history queries, a" << std::endl
+              << "     power of two (default 65536) or 0 to keep none" << std::endl
+              << "  -S names the shared memory ring local readers map (default "
+              << SHARED_RING_DEFAULT_NAME << ")" << std::endl
+              << "  -R sets how many samples of each sensor it holds, a power of two (default" << std::endl
+              << "     1024) or 0 to turn it off" << std::endl
+              << "  -w records every sample to prefix-0000.rec, prefix-0001.rec ... starting a" << std::endl
+              << "     new file every -W MB (default 64) and keeping the newest -k (default all)" << std::endl;
+}
 
 
 int main(int argc, char **argv)
 {
-    // Get the adapter number
-    if (argc < 2)
+    // Get the options and the adapter number
+    double sampleRate = 10.0;
+    double imuSampleRate = 0.0;  // lsm9ds1 is off unless asked for
+    double fifoRate = 0.0;  // lsm9ds1 FIFO is off unless asked for
+    std::string dataReadyLine;  // mpl3115a2 status is polled unless given
+    int oversampleRatio = 0;  // mpl3115a2 settings are left alone unless given
+    int timeStep = -1;
+    bool altitudeFifo = false;
+    double seaLevelPressure = STANDARD_SEA_LEVEL_PRESSURE;
+    int highWaterMark = 1000;
+    bool binary = false;
+    bool verbose = false;  // Requests aren't logged unless asked for
+    int historyDepth = 65536;
+    std::string ringName(SHARED_RING_DEFAULT_NAME);
+    int ringSlots = 1024;
+    std::string recordPrefix;  // Nothing is recorded unless given
+    double recordFileSize = 64.0;
+    int recordFiles = 0;
+    RealtimeSettings realtime = { 0, -1 };  // Not real time unless asked for
+    I2cRetryPolicy retryPolicy = i2cRetryPolicy();
+    int retryAttempts = retryPolicy.attempts;
+    int retryBackoff = retryPolicy.backoff.count();
+    int errorBudget = 20;
+    std::string busLines;  // Recovery only reopens the adapter without these
+    std::vector<std::pair<std::string, std::string>> filterSpecs;  // channel, spec
+    double orientationBeta = MadgwickAhrs::DEFAULT_BETA;
+    VerticalNoise verticalNoise = VerticalEstimator::DEFAULT_NOISE;
+    std::string calibrationFile;  // Calibration starts from the driver's and isn't kept unless given
+    int option;
+    while ((option = getopt(argc, argv, "r:i:H:bF:g:o:t:ms:D:S:R:w:W:k:C:P:A:a:B:e:L:f:G:V:K:v")) != -1)
+    {
+        switch (option)
+        {
+            case 'r':
+                sampleRate = atof(optarg);
+                break;
+            case 'i':
+                imuSampleRate = atof(optarg);
+                break;
+            case 'H':
+                highWaterMark = atoi(optarg);
+                break;
+            case 'b':
+                binary = true;
+                break;
+            case 'F':
+                fifoRate = atof(optarg);
+                break;
+            case 'g':
+                dataReadyLine = optarg;
+                break;
+            case 'o':
+                oversampleRatio = atoi(optarg);
+                break;
+            case 't':
+                timeStep = atoi(optarg);
+                break;
+            case 'm':
+                altitudeFifo = true;
+                break;
+            case 's':
+                seaLevelPressure = atof(optarg);
+                break;
+            case 'D':
+                historyDepth = atoi(optarg);
+                break;
+            case 'S':
+                ringName = optarg;
+                break;
+            case 'R':
+                ringSlots = atoi(optarg);
+                break;
+            case 'w':
+                recordPrefix = optarg;
+                break;
+            case 'W':
+                recordFileSize = atof(optarg);
+                break;
+            case 'k':
+                recordFiles = atoi(optarg);
+                break;
+            case 'C':
+                if (!readSensorConfig(optarg, sampleRate, altitudeFifo, imuSampleRate, fifoRate))
+                {
+                    return 1;
+                }
+                break;
+            case 'P':
+                realtime.priority = atoi(optarg);
+                break;
+            case 'A':
+                realtime.cpu = atoi(optarg);
+                break;
+            case 'a':
+                retryAttempts = atoi(optarg);
+                break;
+            case 'B':
+                retryBackoff = atoi(optarg);
+                break;
+            case 'e':
+                errorBudget = atoi(optarg);
+                break;
+            case 'L':
+                busLines = optarg;
+                break;
+            case 'f':
+            {
+                std::string filter(optarg);
+                size_t equals = filter.find('=');
+                if (equals == std::string::npos)
+                {
+                    usage(argv[0]);
+                    return 1;
+                }
+                filterSpecs.push_back(std::make_pair(filter.substr(0, equals), filter.substr(equals + 1)));
+                break;
+            }
+            case 'G':
+                orientationBeta = atof(optarg);
+                break;
+            case 'V':
+                verticalNoise.altitude = atof(optarg);
+                break;
+            case 'K':
+                calibrationFile = optarg;
+                break;
+            case 'v':
+                verbose = true;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    MPL3115A2OVERSAMPLE oversample = MPL3115A2OVERSAMPLE::OS_1;
+    if (optind >= argc || sampleRate <= 0 || imuSampleRate < 0 || fifoRate < 0 || highWaterMark < 0 ||
+        (oversampleRatio != 0 && !oversampleForRatio(oversampleRatio, oversample)) || timeStep > 15 ||
+        seaLevelPressure <= 0 || recordFileSize <= 0 || recordFiles < 0 ||
+        ringSlots < 0 || (ringSlots & (ringSlots - 1)) != 0 ||
+        historyDepth < 0 || (historyDepth & (historyDepth - 1)) != 0 ||
+        realtime.priority < 0 || realtime.priority > 99 || realtime.cpu < -1 ||
+        retryAttempts < 1 || retryBackoff < 0 || retryBackoff > retryPolicy.maxBackoff.count() ||
+        errorBudget < 0 || orientationBeta < 0 || verticalNoise.altitude <= 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    std::string adapter(argv[optind]);
+    retryPolicy.attempts = retryAttempts;
+    retryPolicy.backoff = std::chrono::microseconds(retryBackoff);
+    setI2cRetryPolicy(retryPolicy);
+    if (!busLines.empty())
+    {
+        // chip:scl:sda, e.g. /dev/gpiochip1:12:13
+        std::istringstream line(busLines);
+        std::string chip, scl, sda;
+        std::getline(line, chip, ':');
+        std::getline(line, scl, ':');
+        std::getline(line, sda, ':');
+        if (chip.empty() || scl.empty() || sda.empty())
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        I2cBusLines lines = { chip, static_cast<unsigned int>(stoi(scl)), static_cast<unsigned int>(stoi(sda)) };
+        setI2cBusLines(stoi(adapter), lines);
+    }
+    if (realtime.priority > 0)
+    {
+        lockMemory();
+    }
+#ifdef SIMULATED_BUS
+    if (altitudeFifo || fifoRate > 0)
     {
-        std::cerr << "Please give the i2c adapter number (found using i2cdetect -l)" << std::endl;
+        std::cerr << "The simulated sensors don't fill their FIFOs, -m and -F can't be used" << std::endl;
         return 1;
     }
-    std::string adapter(argv[1]);
-    MPL3115A2 mpl3115a2(stoi(adapter));
+    attachSimulatedSensors(stoi(adapter));
+#endif
+    Barometer mpl3115a2(stoi(adapter));
+    if (!dataReadyLine.empty())
+    {
+        // chip:line[:pin], e.g. /dev/gpiochip0:17:1 for INT1 wired to line 17
+        std::istringstream line(dataReadyLine);
+        std::string chip, offset, pin;
+        std::getline(line, chip, ':');
+        std::getline(line, offset, ':');
+        std::getline(line, pin, ':');
+        if (chip.empty() || offset.empty())
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        std::unique_ptr<DataReadySource> source(new GpioDataReady(chip, stoi(offset)));
+        mpl3115a2.useDataReadyInterrupt(std::move(source),
+                                        pin == "2" ? MPL3115A2INTPIN::INT2 : MPL3115A2INTPIN::INT1);
+    }
+    mpl3115a2.setSeaLevelPressure(seaLevelPressure);
+    if (oversampleRatio != 0)
+    {
+        mpl3115a2.configureOversampling(oversample);
+    }
+    if (timeStep >= 0)
+    {
+        mpl3115a2.configureTimeStep(timeStep);
+    }
+    mpl3115a2.configureFifo(altitudeFifo);
+
+    // The device only has new data at its own rate, unless the FIFO is used
+    // that's as fast as we can go
+    double effectiveRate = mpl3115a2.sampleRate();
+    if (!altitudeFifo && sampleRate < effectiveRate)
+    {
+        effectiveRate = sampleRate;
+    }
+    std::ostringstream config;
+    config << "Oversample: " << (1 << static_cast<uint8_t>(mpl3115a2.oversampling()))
+           << " TimeStep: " << static_cast<unsigned int>(mpl3115a2.timeStep())
+           << " DeviceRate: " << mpl3115a2.sampleRate() << " SampleRate: " << effectiveRate;
+    std::string configString = config.str();
+    std::cout << "mpl3115a2 " << configString << std::endl;
+    RegisterCacheStats cacheStats = mpl3115a2.registerCacheStats();
+    std::cout << "mpl3115a2 register cache saved " << cacheStats.hits << " reads and "
+              << cacheStats.skippedWrites << " writes while configuring" << std::endl;
+
+    // Each sensor's transactions should be done within its sampling period,
+    // the lsm9ds1's well within it since it is read so much more often
+    BusScheduler &scheduler = BusScheduler::adapter(stoi(adapter));
+    // Each sensor wakes up on its own timer, at its own rate
+    TimerWakeup wakeup = realtime.priority > 0 ? TimerWakeup::CLOCK_NANOSLEEP : TimerWakeup::TIMERFD;
+    makeRealtime(scheduler.workerHandle(), realtime);
+    // Waking up faster than the device converts would only block waiting for
+    // data, the FIFO is drained at the rate asked for though
+    double altitudeRate = altitudeFifo ? sampleRate : effectiveRate;
+    std::chrono::nanoseconds altitudePeriod(static_cast<int64_t>(1e9 / altitudeRate));
+    PeriodicTimer altitudeTimer(altitudePeriod, wakeup);
+    scheduler.setDeadline(MPL3115A2_ADDRESS, altitudePeriod);
+    std::unique_ptr<Imu> lsm9ds1;
+    std::unique_ptr<PeriodicTimer> imuTimer;
+    if (imuSampleRate > 0)
+    {
+        lsm9ds1.reset(new Imu(stoi(adapter)));
+        imuTimer.reset(new PeriodicTimer(std::chrono::nanoseconds(static_cast<int64_t>(1e9 / imuSampleRate)),
+                                         wakeup));
+        std::chrono::nanoseconds imuDeadline(static_cast<int64_t>(1e9 / imuSampleRate / 2));
+        scheduler.setDeadline(LSM9DS1_ACCEL_GYRO_ADDRESS, imuDeadline);
+        scheduler.setDeadline(LSM9DS1_MAG_ADDRESS, imuDeadline);
+        scheduler.setPriority(LSM9DS1_ACCEL_GYRO_ADDRESS, 1);
+        scheduler.setPriority(LSM9DS1_MAG_ADDRESS, 1);
+    }
+
+    std::unique_ptr<SharedMemoryRing> ring;
+    if (ringSlots > 0)
+    {
+        ring.reset(new SharedMemoryRing(ringName, ringSlots));
+    }
+    std::unique_ptr<FlightRecorder> recorder;
+    if (!recordPrefix.empty())
+    {
+        recorder.reset(new FlightRecorder(recordPrefix, static_cast<size_t>(recordFileSize * 1024 * 1024),
+                                          recordFiles));
+    }
+    std::unique_ptr<TimeSeriesStore<AltitudeSample>> altitudeHistory;
+    std::unique_ptr<TimeSeriesStore<ImuSample>> imuHistory;
+    if (historyDepth > 0)
+    {
+        altitudeHistory.reset(new TimeSeriesStore<AltitudeSample>(historyDepth));
+        if (lsm9ds1)
+        {
+            imuHistory.reset(new TimeSeriesStore<ImuSample>(historyDepth));
+        }
+    }
+    SampleSinks sinks = { ring.get(), recorder.get(), altitudeHistory.get(), imuHistory.get() };
 
-    //  Prepare our context and socket to setup as a server
+    // The filters run at the rate samples come from the devices, the lsm9ds1's
+    // odr if its FIFO is used
+    SampleFilters filters;
+    double imuRate = fifoRate > 0 ? Imu::odrHz(odrForRate(fifoRate)) : imuSampleRate;
+    for (const std::pair<std::string, std::string> &filter : filterSpecs)
+    {
+        try
+        {
+            if (filter.first == MPL3115A2_TOPIC)
+            {
+                filters.mpl3115a2.configure(filter.second, effectiveRate);
+            }
+            else if (lsm9ds1 && filter.first == "accel")
+            {
+                filters.accel.configure(filter.second, imuRate);
+            }
+            else if (lsm9ds1 && filter.first == "gyro")
+            {
+                filters.gyro.configure(filter.second, imuRate);
+            }
+            else if (lsm9ds1 && filter.first == "mag")
+            {
+                filters.mag.configure(filter.second, imuRate);
+            }
+            else
+            {
+                throw std::invalid_argument("No " + filter.first + " channel to filter (mpl3115a2, or accel, "
+                                            "gyro and mag with -i)");
+            }
+        }
+        catch (const std::invalid_argument &e)
+        {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+    }
+
+    //  Prepare our context and sockets to setup as a server.
+    //  The acquisition threads hand samples over on inproc PUSH sockets since
+    //  zeromq sockets can't be shared between threads.
     zmq::context_t context (1);
+    zmq::socket_t samples (context, ZMQ_PULL);
+    samples.bind (SAMPLE_ENDPOINT);
+    zmq::socket_t publisher (context, ZMQ_PUB);
+    publisher.setsockopt (ZMQ_SNDHWM, &highWaterMark, sizeof(highWaterMark));
+    publisher.bind (PUBLISH_ENDPOINT);
+
+    // Start sampling in the background and wait for the first sample so that
+    // every reply has real data in it
+    SampleCache<AltitudeSample> cache;
+    SampleCache<ImuSample> imuCache;
+    ErrorBudget altitudeBudget(errorBudget, ERROR_BUDGET_WINDOW);
+    ErrorBudget imuBudget(errorBudget, ERROR_BUDGET_WINDOW);
+
+    // The online calibration starts from the driver's, or from the last run's
+    // if it was saved
+    ImuCalibration calibration = {};
+    if (lsm9ds1)
+    {
+        calibration.gyro = lsm9ds1->gyroCalibration();
+        calibration.mag = lsm9ds1->magCalibration();
+        if (!calibrationFile.empty() && access(calibrationFile.c_str(), F_OK) == 0)
+        {
+            if (!loadImuCalibration(calibrationFile, calibration))
+            {
+                return 1;
+            }
+            lsm9ds1->setGyroCalibration(calibration.gyro);
+            lsm9ds1->setMagCalibration(calibration.mag);
+            std::cout << "lsm9ds1 calibration loaded from " << calibrationFile << std::endl;
+        }
+    }
+    else if (!calibrationFile.empty())
+    {
+        std::cerr << "-K calibrates the lsm9ds1, turn it on with -i" << std::endl;
+        return 1;
+    }
+    ImuEstimates imuEstimates(static_cast<float>(orientationBeta), verticalNoise, cache, calibration);
+    CalibrationSample initialCalibration;
+    initialCalibration.sequence = 1;
+    initialCalibration.timestamp = monotonicNanoseconds();
+    initialCalibration.data = calibration;
+    imuEstimates.calibration.publish(initialCalibration);
+    if (!calibrationFile.empty())
+    {
+        std::thread(saveCalibration, calibrationFile, std::cref(imuEstimates.calibration)).detach();
+    }
+    std::thread altitudeAcquisition(runAcquisition, realtime,
+                                    std::bind(altitudeFifo ? acquireAltitudeFifo : acquireAltitude,
+                                              std::ref(mpl3115a2), std::ref(cache), std::ref(context),
+                                              std::ref(altitudeTimer), std::ref(altitudeBudget),
+                                              std::ref(filters), binary, sinks));
+    altitudeAcquisition.detach();
+    if (lsm9ds1)
+    {
+        std::thread imuAcquisition;
+        if (fifoRate > 0)
+        {
+            imuAcquisition = std::thread(runAcquisition, realtime,
+                                         std::bind(acquireImuFifo, std::ref(*lsm9ds1), std::ref(imuCache),
+                                                   std::ref(context), std::ref(*imuTimer), std::ref(imuBudget),
+                                                   std::ref(filters), std::ref(imuEstimates), odrForRate(fifoRate),
+                                                   binary, sinks));
+        }
+        else
+        {
+            imuAcquisition = std::thread(runAcquisition, realtime,
+                                         std::bind(acquireImu, std::ref(*lsm9ds1), std::ref(imuCache),
+                                                   std::ref(context), std::ref(*imuTimer), std::ref(imuBudget),
+                                                   std::ref(filters), std::ref(imuEstimates), binary, sinks));
+        }
+        imuAcquisition.detach();
+    }
+    while (cache.count() == 0)
+    {
+        std::chrono::milliseconds timespan(1);
+        std::this_thread::sleep_for(timespan);
+    }
+
     zmq::socket_t socket (context, ZMQ_REP);
-    socket.bind ("tcp://*:5555");
+    socket.bind (REQUEST_ENDPOINT);
 
-    // Infinite loop waiting for a client request and then responding
-    // with the temperature and altitude data
+    // Infinite loop forwarding samples to subscribers, and waiting for a
+    // client request and then responding with the latest temperature and
+    // altitude data
+    zmq::pollitem_t items[] = {
+        { static_cast<void *>(samples), 0, ZMQ_POLLIN, 0 },
+        { static_cast<void *>(socket), 0, ZMQ_POLLIN, 0 }
+    };
+    LatencyHistogram requestTime;
     for (;;)
     {
-        zmq::message_t request;
+        zmq::poll (&items[0], 2, -1);
 
-        //  Wait for next request from client
-        socket.recv (&request);
-        std::cout << "Received request from client" << std::endl;
+        if (items[0].revents & ZMQ_POLLIN)
+        {
+            zmq::message_t sample;
+            samples.recv (&sample);
+            publisher.send (sample);
+        }
 
-        // Get the data
-        MPL3115A2DATA data = mpl3115a2.getAltitude();
-        std::cout << "Temperature: " << data.temperature << " (C)"<< std::endl;
-        std::cout << "Altitude: " << data.altitude << " (m)"<< std::endl;
-        std::ostringstream os;
-        os << "Temperature: " << data.temperature << " Altitude: " << data.altitude;
-        std::string replyString = os.str();
+        if (items[1].revents & ZMQ_POLLIN)
+        {
+            zmq::message_t request;
+
+            //  Get the next request from client
+            socket.recv (&request);
+            uint64_t received = metricsNow();
+            if (verbose)
+            {
+                std::cout << "Received request from client" << std::endl;
+            }
 
-        //  Send reply back to client
-        zmq::message_t reply(replyString.size());  // length of reply data
-        memcpy(reply.data(), replyString.c_str(), replyString.size());
-        socket.send(reply);
+            //  Send reply back to client
+            zmq::message_t reply;
+            if (requestIs(request, CONFIG_REQUEST))
+            {
+                reply.rebuild(configString.c_str(), configString.size());
+            }
+            else if (requestIs(request, HISTORY_QUERY) || requestIs(request, SINCE_QUERY) ||
+                     requestIs(request, DOWNSAMPLE_QUERY))
+            {
+                std::string history = historyReply(request, sinks);
+                reply.rebuild(history.data(), history.size());
+            }
+            else if (requestIs(request, STATS_REQUEST))
+            {
+                std::string stats = statsString(mpl3115a2, altitudeTimer, altitudeBudget, lsm9ds1.get(),
+                                                imuTimer.get(), imuBudget, requestTime, recorder.get());
+                reply.rebuild(stats.c_str(), stats.size());
+            }
+            else if (requestIs(request, JITTER_REQUEST))
+            {
+                std::string jitter = jitterString(altitudeTimer, imuTimer.get());
+                reply.rebuild(jitter.c_str(), jitter.size());
+            }
+            else if (requestIs(request, SNAPSHOT_REQUEST))
+            {
+                std::string snapshot = snapshotString(cache, lsm9ds1 ? &imuCache : nullptr,
+                                                      lsm9ds1 ? &imuEstimates : nullptr);
+                reply.rebuild(snapshot.c_str(), snapshot.size());
+            }
+            else if (requestIs(request, ORIENTATION_REQUEST))
+            {
+                std::string orientation = orientationString(lsm9ds1 ? &imuEstimates : nullptr);
+                reply.rebuild(orientation.c_str(), orientation.size());
+            }
+            else if (requestIs(request, VERTICAL_REQUEST))
+            {
+                std::string vertical = verticalString(lsm9ds1 ? &imuEstimates : nullptr);
+                reply.rebuild(vertical.c_str(), vertical.size());
+            }
+            else if (requestIs(request, CALIBRATION_REQUEST))
+            {
+                std::string calibration = calibrationString(lsm9ds1 ? &imuEstimates : nullptr);
+                reply.rebuild(calibration.c_str(), calibration.size());
+            }
+            else
+            {
+                // Get the data, age is in microseconds so clients can spot stale data
+                AltitudeSample sample;
+                cache.read(sample);
+                int64_t age = (monotonicNanoseconds() - sample.timestamp) / 1000;
+                if (requestIs(request, BINARY_REQUEST))
+                {
+                    reply.rebuild(WIRE_ALTITUDE_RECORD_SIZE);
+                    encodeBinary(sample, age > UINT32_MAX ? UINT32_MAX : age,
+                                 static_cast<uint8_t *>(reply.data()));
+                }
+                else
+                {
+                    std::ostringstream os;
+                    os << encodeText(sample) << " Age: " << age;
+                    std::string replyString = os.str();
+                    if (verbose)
+                    {
+                        std::cout << replyString << std::endl;
+                    }
+                    reply.rebuild(replyString.c_str(), replyString.size());
+                }
+            }
+            socket.send(reply);
+            requestTime.record(metricsNow() - received);
+        }
     }
 
     return 0;
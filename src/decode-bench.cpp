@@ -0,0 +1,102 @@
+// Compares decoding lsm9ds1 FIFO frames with decodeAxes against the one value
+// at a time reference, after checking the two agree bit for bit on every
+// length of batch. Prints the average time per frame.
+#include <chrono>
+#include <iostream>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+#include "batch-decoder.hpp"
+#include "lsm9ds1.hpp"
+
+
+constexpr unsigned int ITERATIONS = 200000;
+constexpr unsigned int MAX_FRAMES = LSM9DS1FIFOBATCH::DEPTH * 2;
+
+
+// Frames of whatever a simple generator comes up with, every value of every
+// byte turns up
+static std::vector<uint8_t> makeFrames(unsigned int count, uint32_t seed)
+{
+    std::vector<uint8_t> frames(count * 6);
+    for (uint8_t &byte : frames)
+    {
+        seed = seed * 1664525 + 1013904223;
+        byte = seed >> 24;
+    }
+    return frames;
+}
+
+
+// Checks every batch length up to MAX_FRAMES (so every tail the vector loop
+// leaves) at a few calibrations, false if any value differs
+static bool checkBitExact(void)
+{
+    const AxisCalibration calibrations[] = {
+        { { LSM9DS1_ACCEL_SENSITIVITY, LSM9DS1_ACCEL_SENSITIVITY, LSM9DS1_ACCEL_SENSITIVITY }, { 0, 0, 0 } },
+        { { LSM9DS1_GYRO_SENSITIVITY, -LSM9DS1_GYRO_SENSITIVITY, 0.0087312f }, { 0.31f, -1.7f, 1e-3f } },
+        { { 1.0f, 3.0f, 1.0f / 3.0f }, { -32768.0f, 0.1f, 12345.678f } },
+    };
+    for (const AxisCalibration &calibration : calibrations)
+    {
+        for (unsigned int count = 0; count <= MAX_FRAMES; ++count)
+        {
+            std::vector<uint8_t> frames = makeFrames(count, count + 1);
+            // One extra value either side to catch writes out of bounds
+            std::vector<float> vector(count * 3 + 2, -1.0f);
+            std::vector<float> reference(count * 3 + 2, -1.0f);
+            decodeAxes(frames.data(), count, calibration, vector.data() + 1);
+            decodeAxesReference(frames.data(), count, calibration, reference.data() + 1);
+            if (memcmp(vector.data(), reference.data(), vector.size() * sizeof(float)) != 0)
+            {
+                std::cerr << "decodeAxes differs from the reference decoding " << count << " frames" << std::endl;
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+
+int main(void)
+{
+    if (!checkBitExact())
+    {
+        return 1;
+    }
+
+    const AxisCalibration calibration = {
+        { LSM9DS1_ACCEL_SENSITIVITY, LSM9DS1_ACCEL_SENSITIVITY, LSM9DS1_ACCEL_SENSITIVITY }, { 0.01f, -0.02f, 0.03f }
+    };
+    std::vector<uint8_t> frames = makeFrames(LSM9DS1FIFOBATCH::DEPTH, 1);
+    float values[LSM9DS1FIFOBATCH::DEPTH * 3];
+
+    // Something has to depend on every decode or the compiler drops them
+    double checksum = 0.0;
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (unsigned int i = 0; i < ITERATIONS; ++i)
+    {
+        frames[i % frames.size()] = i;
+        decodeAxesReference(frames.data(), LSM9DS1FIFOBATCH::DEPTH, calibration, values);
+        checksum += values[i % (LSM9DS1FIFOBATCH::DEPTH * 3)];
+    }
+    std::chrono::duration<double, std::nano> referenceTime = std::chrono::steady_clock::now() - start;
+
+    start = std::chrono::steady_clock::now();
+    for (unsigned int i = 0; i < ITERATIONS; ++i)
+    {
+        frames[i % frames.size()] = i;
+        decodeAxes(frames.data(), LSM9DS1FIFOBATCH::DEPTH, calibration, values);
+        checksum += values[i % (LSM9DS1FIFOBATCH::DEPTH * 3)];
+    }
+    std::chrono::duration<double, std::nano> vectorTime = std::chrono::steady_clock::now() - start;
+
+    unsigned int framesDecoded = ITERATIONS * LSM9DS1FIFOBATCH::DEPTH;
+    std::cout << "Reference decode: " << referenceTime.count() / framesDecoded << " ns/frame" << std::endl;
+    std::cout << "Batch decode (" << decodeAxesImplementation() << "): " << vectorTime.count() / framesDecoded
+              << " ns/frame, bit exact" << std::endl;
+    std::cout << "Checksum: " << checksum << std::endl;
+    return 0;
+}
@@ -0,0 +1,215 @@
+// Checks the Butterworth stages' responses first: DC gain, gain at the
+// cutoff (-3 dB) and attenuation in the stopband, including cutoffs far below
+// the sample rate. Then measures what each filter stage costs per sample, all
+// three axes of a sample filtered together, against running a biquad cascade
+// over each axis separately. Prints the average time per sample. Exits with 1
+// if a response is off or the lanes don't match one axis at a time.
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <math.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "filters.hpp"
+
+
+constexpr unsigned int ITERATIONS = 1000000;
+constexpr double SAMPLE_RATE = 952.0;
+constexpr double MEASURE_SECONDS = 10.0;
+
+
+// A noisy accelerometer, a different sine on each axis
+static std::vector<FilterLanes> makeInput(void)
+{
+    std::vector<FilterLanes> input(ITERATIONS);
+    uint32_t noise = 12345;
+    for (unsigned int i = 0; i < ITERATIONS; ++i)
+    {
+        noise = noise * 1664525 + 1013904223;
+        float jitter = static_cast<float>(noise >> 20) - 2048.0f;
+        float t = i / SAMPLE_RATE;
+        FilterLanes lanes = { 4000.0f * sinf(t) + jitter, 2000.0f * sinf(3.0f * t) - jitter,
+                              16384.0f + jitter, 0.0f };
+        input[i] = lanes;
+    }
+    return input;
+}
+
+
+// Runs the whole input through spec, returning ns per sample and adding the
+// outputs to checksum so the compiler can't drop them
+static double timePipeline(const std::string &spec, const std::vector<FilterLanes> &input, double &checksum)
+{
+    FilterPipeline pipeline(spec, SAMPLE_RATE);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (const FilterLanes &sample : input)
+    {
+        FilterLanes value = sample;
+        if (pipeline.process(value))
+        {
+            checksum += value[0] + value[1] + value[2];
+        }
+    }
+    std::chrono::duration<double, std::nano> time = std::chrono::steady_clock::now() - start;
+    return time.count() / input.size();
+}
+
+
+// Steady state gain of spec at frequency (Hz, 0 for DC) after settle
+// seconds, measured by correlating the output of lane 0 with the input sine
+// over whole periods, at least MEASURE_SECONDS of them. The filter starts at
+// zero, so a DC input is a step.
+static double measureGain(const std::string &spec, double frequency, double settle)
+{
+    FilterPipeline pipeline(spec, SAMPLE_RATE);
+    const double amplitude = 1000.0;
+    FilterLanes zero = {};
+    pipeline.process(zero);
+    unsigned int settleSteps = static_cast<unsigned int>(settle * SAMPLE_RATE);
+    double periods = frequency > 0.0 ? ceil(MEASURE_SECONDS * frequency) : MEASURE_SECONDS;
+    double seconds = frequency > 0.0 ? periods / frequency : MEASURE_SECONDS;
+    unsigned int measureSteps = static_cast<unsigned int>(lround(seconds * SAMPLE_RATE));
+    double inPhase = 0.0;
+    double quadrature = 0.0;
+    for (unsigned int i = 0; i < settleSteps + measureSteps; ++i)
+    {
+        double phase = 2.0 * M_PI * frequency * i / SAMPLE_RATE;
+        float x = static_cast<float>(frequency > 0.0 ? amplitude * sin(phase) : amplitude);
+        FilterLanes value = { x, x, x, 0.0f };
+        pipeline.process(value);
+        if (i >= settleSteps)
+        {
+            inPhase += value[0] * (frequency > 0.0 ? sin(phase) : 1.0);
+            quadrature += value[0] * cos(phase);
+        }
+    }
+    if (frequency == 0.0)
+    {
+        return fabs(inPhase / measureSteps / amplitude);
+    }
+    return 2.0 * sqrt(inPhase * inPhase + quadrature * quadrature) / measureSteps / amplitude;
+}
+
+
+// Checks spec's gain at frequency is within tolerance of expected (both as
+// plain ratios), or no more than expected if atMost
+static bool checkGain(const std::string &spec, const char *what, double frequency, double settle, double expected,
+                      double tolerance, bool atMost)
+{
+    double gain = measureGain(spec, frequency, settle);
+    bool ok = atMost ? gain <= expected : fabs(gain - expected) <= tolerance;
+    std::cout << spec << " " << what << " at " << frequency << " Hz: " << gain << " (" << 20.0 * log10(gain)
+              << " dB, expected " << (atMost ? "at most " : "") << expected;
+    if (!atMost)
+    {
+        std::cout << " +-" << tolerance;
+    }
+    std::cout << ") " << (ok ? "ok" : "FAILED") << std::endl;
+    return ok;
+}
+
+
+// The responses the README's examples rely on, down to a cutoff of 1/19000
+// of the sample rate
+static bool checkResponses(void)
+{
+    const double halfPower = 1.0 / sqrt(2.0);
+    bool ok = true;
+    ok = checkGain("lowpass:0.5:2", "DC gain", 0.0, 30.0, 1.0, 1e-4, false) && ok;
+    ok = checkGain("lowpass:0.5:2", "-3 dB", 0.5, 30.0, halfPower, 0.005, false) && ok;
+    ok = checkGain("lowpass:0.5:2", "stopband", 20.0, 30.0, 0.001, 0.0, true) && ok;
+    ok = checkGain("lowpass:50:4", "DC gain", 0.0, 1.0, 1.0, 1e-4, false) && ok;
+    ok = checkGain("lowpass:50:4", "-3 dB", 50.0, 1.0, halfPower, 0.005, false) && ok;
+    ok = checkGain("lowpass:50:4", "stopband", 200.0, 1.0, 0.003, 0.0, true) && ok;
+    ok = checkGain("highpass:0.05", "DC gain", 0.0, 120.0, 1e-4, 0.0, true) && ok;
+    ok = checkGain("highpass:0.05", "-3 dB", 0.05, 120.0, halfPower, 0.005, false) && ok;
+    ok = checkGain("highpass:0.05", "passband", 5.0, 120.0, 1.0, 1e-3, false) && ok;
+    ok = checkGain("highpass:10:4", "stopband", 2.5, 5.0, 0.005, 0.0, true) && ok;
+    return ok;
+}
+
+
+// The same cascade one axis at a time, the way it would be written without
+// the lanes. Returns ns per sample (all three axes) and the largest
+// difference from the lanes' output.
+static double timeScalarCascade(const std::vector<BiquadCoefficients> &sections,
+                                const std::vector<FilterLanes> &input, double &checksum, float &difference)
+{
+    BiquadCascade cascade(sections);
+    std::vector<double> z1(sections.size() * 3, 0.0);
+    std::vector<double> z2(sections.size() * 3, 0.0);
+    difference = 0.0f;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (const FilterLanes &sample : input)
+    {
+        for (unsigned int axis = 0; axis < 3; ++axis)
+        {
+            double value = sample[axis];
+            for (unsigned int s = 0; s < sections.size(); ++s)
+            {
+                const BiquadCoefficients &c = sections[s];
+                double x = value;
+                double &s1 = z1[s * 3 + axis];
+                double &s2 = z2[s * 3 + axis];
+                value = c.b0 * x + s1;
+                s1 = c.b1 * x - c.a1 * value + s2;
+                s2 = c.b2 * x - c.a2 * value;
+            }
+            checksum += value;
+        }
+    }
+    std::chrono::duration<double, std::nano> time = std::chrono::steady_clock::now() - start;
+
+    // Check the lanes agree, starting the lanes from zero like the scalar
+    // loop did (the first sample primes them otherwise)
+    std::fill(z1.begin(), z1.end(), 0.0);
+    std::fill(z2.begin(), z2.end(), 0.0);
+    FilterLanes zero = {};
+    cascade.process(zero);
+    for (unsigned int i = 0; i < 10000; ++i)
+    {
+        FilterLanes lanes = input[i];
+        cascade.process(lanes);
+        for (unsigned int axis = 0; axis < 3; ++axis)
+        {
+            double value = input[i][axis];
+            for (unsigned int s = 0; s < sections.size(); ++s)
+            {
+                const BiquadCoefficients &c = sections[s];
+                double x = value;
+                double &s1 = z1[s * 3 + axis];
+                double &s2 = z2[s * 3 + axis];
+                value = c.b0 * x + s1;
+                s1 = c.b1 * x - c.a1 * value + s2;
+                s2 = c.b2 * x - c.a2 * value;
+            }
+            difference = std::max(difference, fabsf(static_cast<float>(value) - lanes[axis]));
+        }
+    }
+    return time.count() / input.size();
+}
+
+
+int main(void)
+{
+    bool passed = checkResponses();
+    std::vector<FilterLanes> input = makeInput();
+    double checksum = 0.0;
+
+    const char *specs[] = { "lowpass:50", "lowpass:50:4", "lowpass:50:8", "highpass:0.1:2", "average:16",
+                            "median:5", "median:9", "decimate:4", "median:3,lowpass:50:4,decimate:4" };
+    for (const char *spec : specs)
+    {
+        std::cout << spec << ": " << timePipeline(spec, input, checksum) << " ns/sample" << std::endl;
+    }
+
+    float difference;
+    double scalarTime = timeScalarCascade(butterworthLowPass(4, 50.0, SAMPLE_RATE), input, checksum, difference);
+    bool same = difference == 0.0f;
+    std::cout << "lowpass:50:4 one axis at a time: " << scalarTime << " ns/sample (largest difference "
+              << difference << (same ? ", ok" : ", FAILED") << ")" << std::endl;
+    std::cout << "Checksum: " << checksum << std::endl;
+    return passed && same ? 0 : 1;
+}
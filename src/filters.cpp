@@ -0,0 +1,466 @@
+#include <limits.h>
+#include <math.h>
+#include <sstream>
+#include <stdexcept>
+
+#include "filters.hpp"
+
+
+constexpr unsigned int MAX_BUTTERWORTH_ORDER = 8;
+
+
+FilterLanes axesToLanes(const int16_t axes[3])
+{
+    FilterLanes lanes = { static_cast<float>(axes[0]), static_cast<float>(axes[1]), static_cast<float>(axes[2]),
+                          0.0f };
+    return lanes;
+}
+
+
+void lanesToAxes(const FilterLanes &lanes, int16_t axes[3])
+{
+    for (unsigned int i = 0; i < 3; ++i)
+    {
+        float value = lanes[i];
+        if (value >= INT16_MAX)
+        {
+            axes[i] = INT16_MAX;
+        }
+        else if (value <= INT16_MIN)
+        {
+            axes[i] = INT16_MIN;
+        }
+        else
+        {
+            axes[i] = static_cast<int16_t>(lrintf(value));
+        }
+    }
+}
+
+
+// Throws unless a Butterworth filter of order at cutoff can be made
+static void checkButterworth(unsigned int order, double cutoff, double sampleRate)
+{
+    if (order < 1 || order > MAX_BUTTERWORTH_ORDER || !(cutoff > 0.0) || !(cutoff < sampleRate / 2.0))
+    {
+        std::ostringstream error;
+        error << "Can't make an order " << order << " Butterworth filter at " << cutoff << " Hz sampling at "
+              << sampleRate << " Hz (order 1 to " << MAX_BUTTERWORTH_ORDER << ", cutoff below "
+              << sampleRate / 2.0 << " Hz)";
+        throw std::invalid_argument(error.str());
+    }
+}
+
+
+// The sections of an order Butterworth filter, bilinear transformed with the
+// cutoff prewarped (the RBJ cookbook biquads at each pole pair's Q)
+static std::vector<BiquadCoefficients> butterworth(unsigned int order, double cutoff, double sampleRate,
+                                                   bool highPass)
+{
+    checkButterworth(order, cutoff, sampleRate);
+    std::vector<BiquadCoefficients> sections;
+    double w0 = 2.0 * M_PI * cutoff / sampleRate;
+    double cosW0 = cos(w0);
+
+    // Each conjugate pole pair sits at pi (2k + 1) / (2 order) from the
+    // imaginary axis, Q = 1 / (2 sin(angle))
+    for (unsigned int k = 0; k < order / 2; ++k)
+    {
+        double q = 1.0 / (2.0 * sin(M_PI * (2 * k + 1) / (2.0 * order)));
+        double alpha = sin(w0) / (2.0 * q);
+        double a0 = 1.0 + alpha;
+        double b = highPass ? (1.0 + cosW0) / 2.0 : (1.0 - cosW0) / 2.0;
+        BiquadCoefficients section;
+        section.b0 = b / a0;
+        section.b1 = (highPass ? -2.0 * b : 2.0 * b) / a0;
+        section.b2 = b / a0;
+        section.a1 = -2.0 * cosW0 / a0;
+        section.a2 = (1.0 - alpha) / a0;
+        sections.push_back(section);
+    }
+
+    // The real pole of an odd order is a first order section
+    if (order % 2 == 1)
+    {
+        double k = tan(w0 / 2.0);
+        BiquadCoefficients section;
+        section.b0 = (highPass ? 1.0 : k) / (1.0 + k);
+        section.b1 = highPass ? -section.b0 : section.b0;
+        section.b2 = 0.0;
+        section.a1 = (k - 1.0) / (k + 1.0);
+        section.a2 = 0.0;
+        sections.push_back(section);
+    }
+    return sections;
+}
+
+
+std::vector<BiquadCoefficients> butterworthLowPass(unsigned int order, double cutoff, double sampleRate)
+{
+    return butterworth(order, cutoff, sampleRate, false);
+}
+
+
+std::vector<BiquadCoefficients> butterworthHighPass(unsigned int order, double cutoff, double sampleRate)
+{
+    return butterworth(order, cutoff, sampleRate, true);
+}
+
+
+BiquadCascade::BiquadCascade(const std::vector<BiquadCoefficients> &sections)
+{
+    for (const BiquadCoefficients &coefficients : sections)
+    {
+        Section section;
+        section.coefficients = coefficients;
+        m_sections.push_back(section);
+    }
+    reset();
+}
+
+
+bool BiquadCascade::process(FilterLanes &value)
+{
+    FilterStateLanes x;
+    for (unsigned int lane = 0; lane < FILTER_LANES; ++lane)
+    {
+        x[lane] = value[lane];
+    }
+    if (!m_primed)
+    {
+        // Settle every section on value as if it had been the input forever,
+        // each one's output being its DC gain times its input
+        FilterStateLanes input = x;
+        for (Section &section : m_sections)
+        {
+            const BiquadCoefficients &c = section.coefficients;
+            double gain = (c.b0 + c.b1 + c.b2) / (1.0 + c.a1 + c.a2);
+            FilterStateLanes output = input * gain;
+            section.z1 = output - input * c.b0;
+            section.z2 = input * c.b2 - output * c.a2;
+            input = output;
+        }
+        m_primed = true;
+    }
+
+    for (Section &section : m_sections)
+    {
+        const BiquadCoefficients &c = section.coefficients;
+        FilterStateLanes input = x;
+        x = input * c.b0 + section.z1;
+        section.z1 = input * c.b1 - x * c.a1 + section.z2;
+        section.z2 = input * c.b2 - x * c.a2;
+    }
+    for (unsigned int lane = 0; lane < FILTER_LANES; ++lane)
+    {
+        value[lane] = static_cast<float>(x[lane]);
+    }
+    return true;
+}
+
+
+void BiquadCascade::reset(void)
+{
+    FilterStateLanes zero = {};
+    for (Section &section : m_sections)
+    {
+        section.z1 = zero;
+        section.z2 = zero;
+    }
+    m_primed = false;
+}
+
+
+MovingAverage::MovingAverage(unsigned int length)
+    : m_window(length)
+{
+    if (length == 0)
+    {
+        throw std::invalid_argument("Can't average over 0 samples");
+    }
+    reset();
+}
+
+
+bool MovingAverage::process(FilterLanes &value)
+{
+    unsigned int length = m_window.size();
+    if (!m_primed)
+    {
+        for (FilterLanes &slot : m_window)
+        {
+            slot = value;
+        }
+        m_sum = value * static_cast<float>(length);
+        m_primed = true;
+    }
+
+    m_sum += value - m_window[m_next];
+    m_window[m_next] = value;
+    if (++m_next == length)
+    {
+        // Adding and taking away leaves rounding behind, start the sum over
+        // once per trip around the window so it can't build up
+        m_next = 0;
+        FilterLanes sum = {};
+        for (const FilterLanes &slot : m_window)
+        {
+            sum += slot;
+        }
+        m_sum = sum;
+    }
+    value = m_sum * (1.0f / length);
+    return true;
+}
+
+
+void MovingAverage::reset(void)
+{
+    FilterLanes zero = {};
+    m_sum = zero;
+    m_next = 0;
+    m_primed = false;
+}
+
+
+MedianFilter::MedianFilter(unsigned int length)
+    : m_length(length)
+{
+    if (length == 0 || length % 2 == 0 || length > MAX_MEDIAN_LENGTH)
+    {
+        std::ostringstream error;
+        error << "Can't take the median of " << length << " samples (odd, up to " << MAX_MEDIAN_LENGTH << ")";
+        throw std::invalid_argument(error.str());
+    }
+    reset();
+}
+
+
+bool MedianFilter::process(FilterLanes &value)
+{
+    if (!m_primed)
+    {
+        for (unsigned int i = 0; i < m_length; ++i)
+        {
+            m_window[i] = value;
+        }
+        m_primed = true;
+    }
+    m_window[m_next] = value;
+    if (++m_next == m_length)
+    {
+        m_next = 0;
+    }
+
+    // Odd-even transposition sort, length passes of compare and swap between
+    // neighbours leave every lane in order
+    FilterLanes sorted[MAX_MEDIAN_LENGTH];
+    for (unsigned int i = 0; i < m_length; ++i)
+    {
+        sorted[i] = m_window[i];
+    }
+    for (unsigned int pass = 0; pass < m_length; ++pass)
+    {
+        for (unsigned int i = pass % 2; i + 1 < m_length; i += 2)
+        {
+            FilterLanes low = sorted[i] < sorted[i + 1] ? sorted[i] : sorted[i + 1];
+            FilterLanes high = sorted[i] < sorted[i + 1] ? sorted[i + 1] : sorted[i];
+            sorted[i] = low;
+            sorted[i + 1] = high;
+        }
+    }
+    value = sorted[m_length / 2];
+    return true;
+}
+
+
+void MedianFilter::reset(void)
+{
+    m_next = 0;
+    m_primed = false;
+}
+
+
+Decimator::Decimator(unsigned int factor)
+    : m_factor(factor), m_count(0)
+{
+    if (factor == 0)
+    {
+        throw std::invalid_argument("Can't decimate by 0");
+    }
+}
+
+
+bool Decimator::process(FilterLanes &)
+{
+    if (++m_count < m_factor)
+    {
+        return false;
+    }
+    m_count = 0;
+    return true;
+}
+
+
+void Decimator::reset(void)
+{
+    m_count = 0;
+}
+
+
+FilterPipeline::FilterPipeline(void)
+    : m_outputRate(0.0)
+{
+}
+
+
+FilterPipeline::FilterPipeline(const std::string &spec, double sampleRate)
+    : m_outputRate(0.0)
+{
+    configure(spec, sampleRate);
+}
+
+
+// Whether a parsed value is a whole number that an unsigned int can hold and
+// isn't 0, checked before it is cast
+static bool isCount(double value)
+{
+    return value >= 1.0 && value <= UINT_MAX && value == floor(value);
+}
+
+
+// Throws for a stage in a spec that can't be used
+static void badStage(const std::string &stage, const std::string &why)
+{
+    std::ostringstream error;
+    error << "Bad filter stage \"" << stage << "\": " << why;
+    throw std::invalid_argument(error.str());
+}
+
+
+void FilterPipeline::configure(const std::string &spec, double sampleRate)
+{
+    std::vector<std::unique_ptr<FilterStage>> stages;
+    double rate = sampleRate;
+    std::istringstream stream(spec);
+    std::string stage;
+    while (std::getline(stream, stage, ','))
+    {
+        // name:value[:order]
+        std::istringstream fields(stage);
+        std::string name;
+        double value;
+        std::getline(fields, name, ':');
+        if (!(fields >> value))
+        {
+            badStage(stage, "expected name:value");
+        }
+        double order = 2.0;
+        bool hasOrder = false;
+        char separator;
+        if (fields >> separator)
+        {
+            hasOrder = separator == ':' && (fields >> order);
+            if (!hasOrder)
+            {
+                badStage(stage, "expected name:value:order");
+            }
+        }
+        std::string rest;
+        if (fields >> rest)
+        {
+            badStage(stage, "unexpected \"" + rest + "\" after it");
+        }
+
+        std::unique_ptr<FilterStage> made;
+        try
+        {
+            bool isFilter = name == "lowpass" || name == "highpass";
+            bool isWindow = name == "average" || name == "median" || name == "decimate";
+            if (!isFilter && !isWindow)
+            {
+                throw std::invalid_argument("unknown filter (lowpass, highpass, average, median or decimate)");
+            }
+            if (isWindow && (hasOrder || !isCount(value)))
+            {
+                throw std::invalid_argument("expected name:samples with a whole number of samples");
+            }
+            if (isFilter && !isCount(order))
+            {
+                throw std::invalid_argument("expected a whole number order");
+            }
+            unsigned int count = isWindow ? static_cast<unsigned int>(value) : 0;
+
+            if (name == "lowpass")
+            {
+                made.reset(new BiquadCascade(butterworthLowPass(static_cast<unsigned int>(order), value, rate)));
+            }
+            else if (name == "highpass")
+            {
+                made.reset(new BiquadCascade(butterworthHighPass(static_cast<unsigned int>(order), value, rate)));
+            }
+            else if (name == "average")
+            {
+                made.reset(new MovingAverage(count));
+            }
+            else if (name == "median")
+            {
+                made.reset(new MedianFilter(count));
+            }
+            else
+            {
+                made.reset(new Decimator(count));
+                rate /= count;
+            }
+        }
+        catch (const std::invalid_argument &e)
+        {
+            badStage(stage, e.what());
+        }
+        stages.push_back(std::move(made));
+    }
+
+    m_stages.swap(stages);
+    m_spec = spec;
+    m_outputRate = rate;
+}
+
+
+bool FilterPipeline::process(FilterLanes &value)
+{
+    for (std::unique_ptr<FilterStage> &stage : m_stages)
+    {
+        if (!stage->process(value))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+void FilterPipeline::reset(void)
+{
+    for (std::unique_ptr<FilterStage> &stage : m_stages)
+    {
+        stage->reset();
+    }
+}
+
+
+bool FilterPipeline::empty(void) const
+{
+    return m_stages.empty();
+}
+
+
+double FilterPipeline::outputRate(void) const
+{
+    return m_outputRate;
+}
+
+
+const std::string &FilterPipeline::spec(void) const
+{
+    return m_spec;
+}
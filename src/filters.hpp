@@ -0,0 +1,178 @@
+#ifndef FILTERS_HPP
+#define FILTERS_HPP
+
+#include <memory>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+
+// Four channels filtered side by side, one per lane: x, y and z plus a spare
+// for the lsm9ds1, pressure, altitude and temperature plus a spare for the
+// mpl3115a2. GCC turns arithmetic on these into single SSE or NEON
+// instructions (four scalar ones on anything without vector registers), so a
+// stage filters every axis for the price of one.
+constexpr unsigned int FILTER_LANES = 4;
+typedef float FilterLanes __attribute__((vector_size(FILTER_LANES * sizeof(float))));
+
+// The same lanes in double, for state that float can't hold precisely
+// enough. A biquad with its cutoff far below the sample rate has poles so
+// close to the unit circle that float rounding shifts its gain noticeably.
+typedef double FilterStateLanes __attribute__((vector_size(FILTER_LANES * sizeof(double))));
+
+// Longest window a MedianFilter can take
+constexpr unsigned int MAX_MEDIAN_LENGTH = 15;
+
+
+// Converts between raw axes and lanes, rounding to the nearest count and
+// saturating on the way back. The spare lane is zero.
+FilterLanes axesToLanes(const int16_t axes[3]);
+void lanesToAxes(const FilterLanes &lanes, int16_t axes[3]);
+
+
+// This class is one step of a FilterPipeline.
+// Each stage keeps its state per lane (structure of arrays, a FilterLanes
+// for each state variable) and starts out as if it had always seen the first
+// value it is given, so a filter on a channel sitting at 101325 Pa doesn't
+// have to climb there from zero.
+class FilterStage
+{
+    public:
+        virtual ~FilterStage(void) {}
+
+        // Filters value in place, false if the stage drops it (decimation)
+        virtual bool process(FilterLanes &value) = 0;
+
+        // Forgets everything seen so far
+        virtual void reset(void) = 0;
+};
+
+
+// A biquad's coefficients normalized so a0 is 1, for the transposed direct
+// form II difference equation
+//   y = b0 x + z1,  z1 = b1 x - a1 y + z2,  z2 = b2 x - a2 y
+struct BiquadCoefficients
+{
+    public:
+        double b0;
+        double b1;
+        double b2;
+        double a1;
+        double a2;
+};
+
+
+// Butterworth filters as cascades of biquads (plus a first order section for
+// odd orders), cutoff and sampleRate in Hz. Throws std::invalid_argument
+// unless 1 <= order <= 8 and 0 < cutoff < sampleRate / 2.
+std::vector<BiquadCoefficients> butterworthLowPass(unsigned int order, double cutoff, double sampleRate);
+std::vector<BiquadCoefficients> butterworthHighPass(unsigned int order, double cutoff, double sampleRate);
+
+
+// This class runs biquad sections one after the other, e.g. low pass for the
+// accelerometer or high pass to take the drift out of the gyro. The
+// coefficients and state are double so cutoffs of a fraction of a Hz at
+// hundreds of Hz keep their DC gain and corner where they should be.
+class BiquadCascade : public FilterStage
+{
+    public:
+        explicit BiquadCascade(const std::vector<BiquadCoefficients> &sections);
+        bool process(FilterLanes &value);
+        void reset(void);
+    private:
+        struct Section
+        {
+            BiquadCoefficients coefficients;
+            FilterStateLanes z1;
+            FilterStateLanes z2;
+        };
+        std::vector<Section> m_sections;
+        bool m_primed;
+};
+
+
+// This class averages the last length values
+class MovingAverage : public FilterStage
+{
+    public:
+        explicit MovingAverage(unsigned int length);
+        bool process(FilterLanes &value);
+        void reset(void);
+    private:
+        std::vector<FilterLanes> m_window;
+        FilterLanes m_sum;
+        unsigned int m_next;  // Where the next value goes, the oldest value
+        bool m_primed;
+};
+
+
+// This class takes the median of the last length values (odd, up to
+// MAX_MEDIAN_LENGTH), which gets rid of spikes a moving average would smear.
+// The window is sorted with a sorting network of per lane min and max, so
+// every lane is sorted at once without branching.
+class MedianFilter : public FilterStage
+{
+    public:
+        explicit MedianFilter(unsigned int length);
+        bool process(FilterLanes &value);
+        void reset(void);
+    private:
+        FilterLanes m_window[MAX_MEDIAN_LENGTH];
+        unsigned int m_length;
+        unsigned int m_next;
+        bool m_primed;
+};
+
+
+// This class passes every factor'th value and drops the rest. It does nothing
+// about aliasing, put a low pass below the new Nyquist frequency before it.
+class Decimator : public FilterStage
+{
+    public:
+        explicit Decimator(unsigned int factor);
+        bool process(FilterLanes &value);
+        void reset(void);
+    private:
+        unsigned int m_factor;
+        unsigned int m_count;
+};
+
+
+// This class is a chain of filter stages chosen at startup from a spec, stage
+// after stage separated by commas:
+//   lowpass:<Hz>[:<order>]   Butterworth low pass (order 2 unless given)
+//   highpass:<Hz>[:<order>]  Butterworth high pass
+//   average:<n>              moving average of n samples
+//   median:<n>               median of n samples
+//   decimate:<n>             keep every n'th sample
+// e.g. "median:3,lowpass:20:4,decimate:4". Stages after a decimate run at
+// the lower rate, which is what their cutoffs are relative to.
+// An empty spec (or a default constructed pipeline) passes everything
+// through untouched.
+class FilterPipeline
+{
+    public:
+        FilterPipeline(void);
+
+        // Throws std::invalid_argument if spec doesn't make sense at sampleRate
+        FilterPipeline(const std::string &spec, double sampleRate);
+        void configure(const std::string &spec, double sampleRate);
+
+        // Filters value in place, false if a stage dropped it
+        bool process(FilterLanes &value);
+        void reset(void);
+        bool empty(void) const;
+
+        // The rate samples come out at, after any decimation
+        double outputRate(void) const;
+        const std::string &spec(void) const;
+
+    private:
+        FilterPipeline(const FilterPipeline &);
+        FilterPipeline &operator=(const FilterPipeline &);
+        std::vector<std::unique_ptr<FilterStage>> m_stages;
+        std::string m_spec;
+        double m_outputRate;
+};
+
+#endif
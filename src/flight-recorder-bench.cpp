@@ -0,0 +1,272 @@
+// Checks flight record files read back right after the ways a crash or a
+// failing SD card leaves them, then times FlightRecorder::record, the only
+// part of the recorder a sampling thread waits on. Exits with 1 if any check
+// fails.
+//
+// A file is recorded, then copied while its last records are written but not
+// committed yet, which is what a power cut leaves. The copy is read as it is
+// and then damaged: truncated part way through a record, its current header
+// slot corrupted, its first sector torn, both header slots corrupted and a
+// record's header corrupted. Each time readFlightRecordHeader and
+// readFlightRecords (all flight-recorder-csv uses) have to get back every
+// record before the damage, in order, and the committed ones at least.
+// The header has to give the index in the file's name, whether it was last
+// committed by the periodic sync, on closing or on moving to the next file.
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "flight-recorder.hpp"
+#include "sensor-sample.hpp"
+#include "wire-format.hpp"
+
+
+constexpr size_t FILE_SIZE = 1024 * 1024;
+constexpr unsigned int COMMITTED_RECORDS = 1000;
+constexpr unsigned int UNCOMMITTED_RECORDS = 300;
+
+// Small enough for this many records to fill the first file and start another
+constexpr size_t ROTATED_FILE_SIZE = 64 * 1024;
+constexpr unsigned int ROTATED_RECORDS = 2000;
+
+// Long enough for the writer to have committed, or at least copied, what it
+// was given
+constexpr std::chrono::milliseconds COMMIT_WAIT(1500);
+constexpr std::chrono::milliseconds WRITE_WAIT(100);
+
+// record is timed in bursts the queue can hold, with time for the writer to
+// drain it in between
+constexpr unsigned int BURSTS = 20;
+constexpr unsigned int BURST_RECORDS = 4096;
+constexpr std::chrono::milliseconds BURST_INTERVAL(50);
+
+
+// Records sequence as an mpl3115a2 sample if it is even, an lsm9ds1 one if not
+static void recordSample(FlightRecorder &recorder, uint64_t sequence)
+{
+    if (sequence % 2 == 0)
+    {
+        AltitudeSample sample = { sequence, static_cast<int64_t>(sequence) * 1000, { 101325.0, 12.5, 21.0 } };
+        recorder.record(sample);
+    }
+    else
+    {
+        ImuSample sample = { sequence, static_cast<int64_t>(sequence) * 1000,
+                             { { 1, 2, 16384 }, { -3, 4, -5 }, { 600, -700, 800 } } };
+        recorder.record(sample);
+    }
+}
+
+
+static std::vector<uint8_t> readFile(const std::string &filename)
+{
+    std::ifstream in(filename, std::ios::binary);
+    return std::vector<uint8_t>((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+}
+
+
+// Where record index starts in file, the records being back to back from
+// the header on
+static size_t recordOffset(const std::vector<uint8_t> &file, unsigned int index)
+{
+    size_t offset = FLIGHT_RECORD_HEADER_SIZE;
+    SensorId sensor;
+    size_t length;
+    for (unsigned int i = 0; i < index && decodeHeader(file.data() + offset, file.size() - offset, sensor, length);
+         ++i)
+    {
+        offset += length;
+    }
+    return offset;
+}
+
+
+// Reads file the way flight-recorder-csv does and checks it gets records
+// 0 to expected - 1 in order, a header if it should have one, and no fewer
+// records than the header says are committed (unless the damage is inside
+// the committed ones, when it mustn't get more than that either)
+static bool check(const char *name, const std::vector<uint8_t> &file, uint64_t expected, bool expectHeader,
+                  bool committedDamaged)
+{
+    FlightRecordHeader header;
+    bool haveHeader = file.size() >= FLIGHT_RECORD_HEADER_SIZE && readFlightRecordHeader(file.data(), header);
+    uint64_t next = 0;
+    bool inOrder = true;
+    uint64_t records = readFlightRecords(file.data(), file.size(),
+        [&next, &inOrder](const AltitudeSample &sample)
+        {
+            inOrder = inOrder && sample.sequence == next++ && sample.data.pressure == 101325.0;
+        },
+        [&next, &inOrder](const ImuSample &sample)
+        {
+            inOrder = inOrder && sample.sequence == next++ && sample.data.accel[2] == 16384;
+        });
+
+    bool ok = inOrder && records == expected && haveHeader == expectHeader;
+    if (haveHeader)
+    {
+        ok = ok && (committedDamaged ? records < header.committedRecords : records >= header.committedRecords);
+    }
+    std::cout << name << ": " << records << " records";
+    if (haveHeader)
+    {
+        std::cout << ", " << header.committedRecords << " committed";
+    }
+    else
+    {
+        std::cout << ", no header";
+    }
+    std::cout << (ok ? ", ok" : ", FAILED") << std::endl;
+    return ok;
+}
+
+
+// Checks the header of file, which is named for index, says it is index
+static bool checkFileIndex(const char *name, const std::vector<uint8_t> &file, uint32_t index)
+{
+    FlightRecordHeader header;
+    bool ok = file.size() >= FLIGHT_RECORD_HEADER_SIZE && readFlightRecordHeader(file.data(), header) &&
+              header.fileIndex == index;
+    std::cout << name << ": file index ";
+    if (ok)
+    {
+        std::cout << header.fileIndex << ", ok" << std::endl;
+    }
+    else
+    {
+        std::cout << "not " << index << ", FAILED" << std::endl;
+    }
+    return ok;
+}
+
+
+int main(void)
+{
+    char directory[] = "/tmp/flight-recorder-bench-XXXXXX";
+    if (mkdtemp(directory) == nullptr)
+    {
+        std::cerr << "Could not make a directory to record in" << std::endl;
+        return 1;
+    }
+    std::string prefix = std::string(directory) + "/check";
+    std::string filename = prefix + "-0000.rec";
+
+    // What a power cut leaves: the first records committed, the rest written
+    // into the mapping (so the page cache) but not committed yet
+    std::vector<uint8_t> crashed;
+    {
+        FlightRecorder recorder(prefix, FILE_SIZE, 0);
+        for (uint64_t sequence = 0; sequence < COMMITTED_RECORDS; ++sequence)
+        {
+            recordSample(recorder, sequence);
+        }
+        std::this_thread::sleep_for(COMMIT_WAIT);
+        for (uint64_t sequence = COMMITTED_RECORDS; sequence < COMMITTED_RECORDS + UNCOMMITTED_RECORDS; ++sequence)
+        {
+            recordSample(recorder, sequence);
+        }
+        std::this_thread::sleep_for(WRITE_WAIT);
+        crashed = readFile(filename);
+    }
+    std::vector<uint8_t> closed = readFile(filename);
+    unlink(filename.c_str());
+
+    const unsigned int total = COMMITTED_RECORDS + UNCOMMITTED_RECORDS;
+    bool passed = check("Closed", closed, total, true, false);
+    FlightRecordHeader header;
+    passed = readFlightRecordHeader(closed.data(), header) && header.committedRecords == total && passed;
+    passed = check("Crashed before the last commit", crashed, total, true, false) && passed;
+    passed = readFlightRecordHeader(crashed.data(), header) && header.committedRecords == COMMITTED_RECORDS &&
+             passed;
+    passed = checkFileIndex("Committed by the periodic sync", crashed, 0) && passed;
+    passed = checkFileIndex("Committed on closing", closed, 0) && passed;
+
+    // Cut off half way through a record, past the committed ones and inside
+    // them
+    std::vector<uint8_t> file(crashed.begin(), crashed.begin() + recordOffset(crashed, total - 10) + 5);
+    passed = check("Truncated after the committed records", file, total - 10, true, false) && passed;
+    file.assign(crashed.begin(), crashed.begin() + recordOffset(crashed, 500) + 5);
+    passed = check("Truncated inside the committed records", file, 500, true, true) && passed;
+
+    // The current slot is the one with the higher generation, the other one
+    // commits less but is still good
+    FlightRecordHeader current;
+    readFlightRecordHeader(crashed.data(), current);
+    size_t currentSlot = (current.generation % 2) * FLIGHT_RECORD_SECTOR_SIZE;
+    file = crashed;
+    file[currentSlot + 40] ^= 0x01;
+    passed = check("Current header slot corrupted", file, total, true, false) && passed;
+    passed = readFlightRecordHeader(file.data(), header) && header.generation == current.generation - 1 && passed;
+
+    // A sector torn part way through its write, which can only ever take out
+    // one slot
+    file = crashed;
+    std::fill(file.begin(), file.begin() + 512, 0);
+    passed = check("First sector torn", file, total, true, false) && passed;
+
+    file = crashed;
+    file[8] ^= 0xFF;
+    file[FLIGHT_RECORD_SECTOR_SIZE + 8] ^= 0xFF;
+    passed = check("Both header slots corrupted", file, total, false, false) && passed;
+
+    file = crashed;
+    file[recordOffset(crashed, 1100) + 1] = 0xEE;
+    passed = check("Record corrupted after the committed records", file, 1100, true, false) && passed;
+
+    // Enough records to go on to a second file, which is copied once the
+    // periodic sync has committed it
+    std::string rotatedPrefix = std::string(directory) + "/rotated";
+    std::vector<uint8_t> second;
+    {
+        FlightRecorder recorder(rotatedPrefix, ROTATED_FILE_SIZE, 0);
+        for (uint64_t sequence = 0; sequence < ROTATED_RECORDS; ++sequence)
+        {
+            recordSample(recorder, sequence);
+        }
+        std::this_thread::sleep_for(COMMIT_WAIT);
+        second = readFile(rotatedPrefix + "-0001.rec");
+    }
+    passed = checkFileIndex("Committed on moving to the next file", readFile(rotatedPrefix + "-0000.rec"), 0) &&
+             passed;
+    passed = checkFileIndex("Next file committed by the periodic sync", second, 1) && passed;
+    passed = checkFileIndex("Next file committed on closing", readFile(rotatedPrefix + "-0001.rec"), 1) && passed;
+    unlink((rotatedPrefix + "-0000.rec").c_str());
+    unlink((rotatedPrefix + "-0001.rec").c_str());
+
+    // Then how long record takes, bursts the queue holds with time for the
+    // writer to catch up in between
+    std::vector<int64_t> times;
+    times.reserve(BURSTS * BURST_RECORDS);
+    uint64_t dropped;
+    {
+        FlightRecorder recorder(prefix, 8 * FILE_SIZE, 0);
+        uint64_t sequence = 0;
+        for (unsigned int burst = 0; burst < BURSTS; ++burst)
+        {
+            for (unsigned int i = 0; i < BURST_RECORDS; ++i)
+            {
+                std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+                recordSample(recorder, sequence++);
+                times.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - start).count());
+            }
+            std::this_thread::sleep_for(BURST_INTERVAL);
+        }
+        dropped = recorder.dropped();
+    }
+    unlink(filename.c_str());
+    rmdir(directory);
+
+    std::sort(times.begin(), times.end());
+    std::cout << "record: p50 " << times[times.size() / 2] << " ns p99 " << times[times.size() * 99 / 100]
+              << " ns p999 " << times[times.size() * 999 / 1000] << " ns, " << dropped << " dropped" << std::endl;
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,120 @@
+// Converts flight record files (see flight-recorder.hpp) to CSV on stdout, one
+// row per record in the order they were written. Give the files in order
+// (prefix-0000.rec prefix-0001.rec ...), a shell glob does that.
+// Records written after the header was last committed (i.e. just before a
+// crash) are recovered too, up to the first one that isn't whole.
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include "flight-recorder.hpp"
+#include "sensor-sample.hpp"
+#include "wire-format.hpp"
+
+
+static void printAltitude(const AltitudeSample &sample, double unixTime)
+{
+    std::cout << "mpl3115a2," << sample.sequence << "," << sample.timestamp << "," << unixTime << ","
+              << sample.data.pressure << "," << sample.data.altitude << "," << sample.data.temperature
+              << ",,,,,,,,," << std::endl;
+}
+
+
+static void printImu(const ImuSample &sample, double unixTime)
+{
+    std::cout << "lsm9ds1," << sample.sequence << "," << sample.timestamp << "," << unixTime << ",,,";
+    for (unsigned int axis = 0; axis < 3; ++axis)
+    {
+        std::cout << "," << sample.data.accel[axis];
+    }
+    for (unsigned int axis = 0; axis < 3; ++axis)
+    {
+        std::cout << "," << sample.data.gyro[axis];
+    }
+    for (unsigned int axis = 0; axis < 3; ++axis)
+    {
+        std::cout << "," << sample.data.mag[axis];
+    }
+    std::cout << std::endl;
+}
+
+
+// Prints every record in one file, false if it couldn't be read at all
+static bool convert(const char *filename)
+{
+    std::ifstream in(filename, std::ios::binary);
+    if (!in)
+    {
+        std::cerr << filename << ": could not open" << std::endl;
+        return false;
+    }
+    std::vector<uint8_t> file((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    if (file.size() < FLIGHT_RECORD_HEADER_SIZE)
+    {
+        std::cerr << filename << ": too short to be a flight record" << std::endl;
+        return false;
+    }
+
+    // Without a header there is no way to tell the clock the records were
+    // timestamped with, but the records themselves are still good
+    FlightRecordHeader header;
+    bool haveHeader = readFlightRecordHeader(file.data(), header);
+    if (!haveHeader)
+    {
+        std::cerr << filename << ": no valid header, recovering what records there are" << std::endl;
+        header.realtime = 0;
+        header.monotonic = 0;
+        header.committedBytes = 0;
+        header.committedRecords = 0;
+    }
+
+    uint64_t records = readFlightRecords(file.data(), file.size(),
+        [&header](const AltitudeSample &sample)
+        {
+            printAltitude(sample, (header.realtime + (sample.timestamp - header.monotonic)) / 1e9);
+        },
+        [&header](const ImuSample &sample)
+        {
+            printImu(sample, (header.realtime + (sample.timestamp - header.monotonic)) / 1e9);
+        });
+
+    if (haveHeader && records < header.committedRecords)
+    {
+        std::cerr << filename << ": only " << records << " of " << header.committedRecords
+                  << " committed records could be read" << std::endl;
+    }
+    else if (records > header.committedRecords)
+    {
+        std::cerr << filename << ": recovered " << records - header.committedRecords
+                  << " records past the committed length" << std::endl;
+    }
+    return true;
+}
+
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        std::cerr << "Usage: " << argv[0] << " file..." << std::endl
+                  << "Converts flight record files to CSV on stdout" << std::endl;
+        return 1;
+    }
+
+    std::cout << std::fixed << std::setprecision(6)
+              << "sensor,sequence,timestamp_ns,unix_time,pressure,altitude,temperature,"
+              << "accel_x,accel_y,accel_z,gyro_x,gyro_y,gyro_z,mag_x,mag_y,mag_z" << std::endl;
+    int status = 0;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!convert(argv[i]))
+        {
+            status = 1;
+        }
+    }
+    return status;
+}
@@ -0,0 +1,440 @@
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <string.h>
+#include <thread>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "flight-recorder.hpp"
+#include "sensor-sample.hpp"
+#include "wire-format.hpp"
+
+
+constexpr unsigned int FlightRecorder::QUEUE_SLOTS;
+
+// How often the writer wakes up to drain the queue, and syncs and commits
+// the records
+constexpr std::chrono::milliseconds WRITE_INTERVAL(10);
+constexpr std::chrono::seconds SYNC_INTERVAL(1);
+
+// Header slot fields
+constexpr size_t SLOT_CRC_OFFSET = 56;
+
+
+static void put32(uint8_t *out, uint32_t value)
+{
+    for (unsigned int i = 0; i < 4; ++i)
+    {
+        out[i] = (value >> (8 * i)) & 0xFF;
+    }
+}
+
+
+static void put64(uint8_t *out, uint64_t value)
+{
+    for (unsigned int i = 0; i < 8; ++i)
+    {
+        out[i] = (value >> (8 * i)) & 0xFF;
+    }
+}
+
+
+static uint32_t get32(const uint8_t *in)
+{
+    uint32_t value = 0;
+    for (unsigned int i = 0; i < 4; ++i)
+    {
+        value |= static_cast<uint32_t>(in[i]) << (8 * i);
+    }
+    return value;
+}
+
+
+static uint64_t get64(const uint8_t *in)
+{
+    uint64_t value = 0;
+    for (unsigned int i = 0; i < 8; ++i)
+    {
+        value |= static_cast<uint64_t>(in[i]) << (8 * i);
+    }
+    return value;
+}
+
+
+// CRC-32 (the zlib one), only ever run over a header slot so a table isn't
+// worth it
+static uint32_t crc32(const uint8_t *data, size_t size)
+{
+    uint32_t crc = 0xFFFFFFFF;
+    for (size_t i = 0; i < size; ++i)
+    {
+        crc ^= data[i];
+        for (unsigned int bit = 0; bit < 8; ++bit)
+        {
+            crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+        }
+    }
+    return ~crc;
+}
+
+
+static int64_t clockNanoseconds(clockid_t clock)
+{
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return static_cast<int64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+
+bool readFlightRecordHeader(const uint8_t *file, FlightRecordHeader &header)
+{
+    bool found = false;
+    for (unsigned int slot = 0; slot < 2; ++slot)
+    {
+        const uint8_t *in = file + slot * FLIGHT_RECORD_SECTOR_SIZE;
+        if (memcmp(in, FLIGHT_RECORD_MAGIC, sizeof(FLIGHT_RECORD_MAGIC)) != 0 ||
+            get32(in + 8) != FLIGHT_RECORD_VERSION ||
+            get32(in + SLOT_CRC_OFFSET) != crc32(in, SLOT_CRC_OFFSET))
+        {
+            continue;
+        }
+        uint32_t generation = get32(in + 12);
+        if (found && generation < header.generation)
+        {
+            continue;
+        }
+        header.generation = generation;
+        header.fileIndex = get32(in + 16);
+        header.realtime = static_cast<int64_t>(get64(in + 24));
+        header.monotonic = static_cast<int64_t>(get64(in + 32));
+        header.committedBytes = get64(in + 40);
+        header.committedRecords = get64(in + 48);
+        found = true;
+    }
+    return found;
+}
+
+
+FlightRecorder::FlightRecorder(const std::string &prefix, size_t fileSize, unsigned int maxFiles) :
+    m_prefix(prefix),
+    m_fileSize(fileSize),
+    m_maxFiles(maxFiles),
+    m_slots(new Slot[QUEUE_SLOTS]),
+    m_enqueuePosition(0),
+    m_dequeuePosition(0),
+    m_written(0),
+    m_dropped(0),
+    m_filesStarted(0),
+    m_stopping(false),
+    m_failed(false),
+    m_file(-1),
+    m_mapping(nullptr),
+    m_nextFileIndex(0),
+    m_fileIndex(0),
+    m_generation(0),
+    m_createdRealtime(0),
+    m_createdMonotonic(0),
+    m_writeOffset(0),
+    m_committedOffset(0),
+    m_records(0)
+{
+    if (fileSize < FLIGHT_RECORD_HEADER_SIZE + WIRE_MAX_RECORD_SIZE)
+    {
+        std::ostringstream err;
+        err << "Flight record files of " << fileSize << " bytes can't hold a single record";
+        throw std::invalid_argument(err.str());
+    }
+
+    // Each slot's sequence says whose turn it is, it starts out free for the
+    // producer at its position
+    for (unsigned int i = 0; i < QUEUE_SLOTS; ++i)
+    {
+        m_slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    // The first file is made here so that problems show up straight away
+    openFile();
+    m_writer = std::thread(&FlightRecorder::writeLoop, this);
+}
+
+
+FlightRecorder::~FlightRecorder(void)
+{
+    m_stopping.store(true, std::memory_order_release);
+    m_writer.join();
+    if (m_mapping != nullptr)
+    {
+        closeFile();
+    }
+}
+
+
+bool FlightRecorder::record(const AltitudeSample &sample)
+{
+    return enqueue(sample);
+}
+
+
+bool FlightRecorder::record(const ImuSample &sample)
+{
+    return enqueue(sample);
+}
+
+
+uint64_t FlightRecorder::written(void) const
+{
+    return m_written.load(std::memory_order_relaxed);
+}
+
+
+uint64_t FlightRecorder::dropped(void) const
+{
+    return m_dropped.load(std::memory_order_relaxed);
+}
+
+
+uint32_t FlightRecorder::filesStarted(void) const
+{
+    return m_filesStarted.load(std::memory_order_relaxed);
+}
+
+
+template <typename Sample>
+bool FlightRecorder::enqueue(const Sample &sample)
+{
+    // Claim the next free slot, if the writer hasn't freed it yet the queue
+    // is full and the sample is dropped rather than waiting
+    uint64_t position = m_enqueuePosition.load(std::memory_order_relaxed);
+    Slot *slot;
+    for (;;)
+    {
+        slot = &m_slots[position & (QUEUE_SLOTS - 1)];
+        uint64_t sequence = slot->sequence.load(std::memory_order_acquire);
+        int64_t difference = static_cast<int64_t>(sequence - position);
+        if (difference == 0)
+        {
+            if (m_enqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if (difference < 0)
+        {
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        else
+        {
+            position = m_enqueuePosition.load(std::memory_order_relaxed);
+        }
+    }
+
+    // Then hand it over to the writer
+    slot->size = encodeBinary(sample, 0, slot->data);
+    slot->sequence.store(position + 1, std::memory_order_release);
+    return true;
+}
+
+
+bool FlightRecorder::dequeue(uint8_t *data, size_t &size)
+{
+    Slot &slot = m_slots[m_dequeuePosition & (QUEUE_SLOTS - 1)];
+    if (slot.sequence.load(std::memory_order_acquire) != m_dequeuePosition + 1)
+    {
+        return false;
+    }
+    size = slot.size;
+    memcpy(data, slot.data, size);
+    slot.sequence.store(m_dequeuePosition + QUEUE_SLOTS, std::memory_order_release);
+    ++m_dequeuePosition;
+    return true;
+}
+
+
+void FlightRecorder::openFile(void)
+{
+    // Skip past any files that are already there rather than overwrite them
+    std::string filename;
+    for (;;)
+    {
+        std::ostringstream name;
+        name << m_prefix << "-" << std::setw(4) << std::setfill('0') << m_nextFileIndex << ".rec";
+        filename = name.str();
+        m_file = open(filename.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (m_file >= 0)
+        {
+            break;
+        }
+        if (errno != EEXIST)
+        {
+            std::ostringstream err;
+            err << "Could not create " << filename << std::endl << strerror(errno);
+            throw std::runtime_error(err.str());
+        }
+        ++m_nextFileIndex;
+    }
+    m_fileIndex = m_nextFileIndex++;
+
+    // Allocating the whole file up front means writing into the mapping can't
+    // run out of space later on
+    int result = posix_fallocate(m_file, 0, m_fileSize);
+    if (result == 0)
+    {
+        void *mapping = mmap(nullptr, m_fileSize, PROT_READ | PROT_WRITE, MAP_SHARED, m_file, 0);
+        if (mapping == MAP_FAILED)
+        {
+            result = errno;
+        }
+        else
+        {
+            m_mapping = static_cast<uint8_t *>(mapping);
+        }
+    }
+    if (result != 0)
+    {
+        close(m_file);
+        unlink(filename.c_str());
+        m_file = -1;
+        std::ostringstream err;
+        err << "Could not allocate " << m_fileSize << " bytes for " << filename << std::endl << strerror(result);
+        throw std::runtime_error(err.str());
+    }
+
+    m_generation = 0;
+    m_createdRealtime = clockNanoseconds(CLOCK_REALTIME);
+    m_createdMonotonic = clockNanoseconds(CLOCK_MONOTONIC);
+    m_writeOffset = FLIGHT_RECORD_HEADER_SIZE;
+    m_committedOffset = 0;
+    m_records = 0;
+    syncFile();
+
+    m_files.push_back(filename);
+    m_filesStarted.fetch_add(1, std::memory_order_relaxed);
+    if (m_maxFiles != 0 && m_files.size() > m_maxFiles)
+    {
+        unlink(m_files.front().c_str());
+        m_files.pop_front();
+    }
+}
+
+
+void FlightRecorder::closeFile(void)
+{
+    // Only what was written is kept, the rest of the preallocation goes
+    syncFile();
+    munmap(m_mapping, m_fileSize);
+    m_mapping = nullptr;
+    if (ftruncate(m_file, m_writeOffset) < 0)
+    {
+        std::cerr << "Could not truncate flight record file" << std::endl << strerror(errno) << std::endl;
+    }
+    close(m_file);
+    m_file = -1;
+}
+
+
+void FlightRecorder::commitHeader(void)
+{
+    // Built on the side then copied into the slot that isn't current, so the
+    // current one stays valid until this one is complete
+    uint8_t slot[FLIGHT_RECORD_SLOT_SIZE];
+    memset(slot, 0, sizeof(slot));
+    ++m_generation;
+    memcpy(slot, FLIGHT_RECORD_MAGIC, sizeof(FLIGHT_RECORD_MAGIC));
+    put32(slot + 8, FLIGHT_RECORD_VERSION);
+    put32(slot + 12, m_generation);
+    put32(slot + 16, m_fileIndex);
+    put64(slot + 24, static_cast<uint64_t>(m_createdRealtime));
+    put64(slot + 32, static_cast<uint64_t>(m_createdMonotonic));
+    put64(slot + 40, m_writeOffset - FLIGHT_RECORD_HEADER_SIZE);
+    put64(slot + 48, m_records);
+    put32(slot + SLOT_CRC_OFFSET, crc32(slot, SLOT_CRC_OFFSET));
+    memcpy(m_mapping + (m_generation % 2) * FLIGHT_RECORD_SECTOR_SIZE, slot, sizeof(slot));
+}
+
+
+void FlightRecorder::syncFile(void)
+{
+    if (m_committedOffset == m_writeOffset)
+    {
+        return;
+    }
+
+    // Writeback could otherwise put the header on disk before the records it
+    // counts, and a power cut in between would leave it counting garbage
+    if (msync(m_mapping, m_writeOffset, MS_SYNC) < 0)
+    {
+        std::cerr << "Could not sync flight record file" << std::endl << strerror(errno) << std::endl;
+        return;
+    }
+    commitHeader();
+    if (msync(m_mapping, FLIGHT_RECORD_HEADER_SIZE, MS_SYNC) < 0)
+    {
+        std::cerr << "Could not sync flight record header" << std::endl << strerror(errno) << std::endl;
+        return;
+    }
+    m_committedOffset = m_writeOffset;
+}
+
+
+void FlightRecorder::writeLoop(void)
+{
+    uint8_t record[WIRE_MAX_RECORD_SIZE];
+    size_t size;
+    std::chrono::steady_clock::time_point nextSync = std::chrono::steady_clock::now() + SYNC_INTERVAL;
+    for (;;)
+    {
+        // Checked before draining so nothing queued before stopping is missed
+        bool stopping = m_stopping.load(std::memory_order_acquire);
+        while (dequeue(record, size))
+        {
+            if (m_failed)
+            {
+                m_dropped.fetch_add(1, std::memory_order_relaxed);
+                continue;
+            }
+            if (m_writeOffset + size > m_fileSize)
+            {
+                try
+                {
+                    closeFile();
+                    openFile();
+                }
+                catch (const std::exception &e)
+                {
+                    std::cerr << "Flight recorder stopped: " << e.what() << std::endl;
+                    m_failed = true;
+                    m_dropped.fetch_add(1, std::memory_order_relaxed);
+                    continue;
+                }
+            }
+            memcpy(m_mapping + m_writeOffset, record, size);
+            m_writeOffset += size;
+            ++m_records;
+            m_written.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        if (!m_failed && std::chrono::steady_clock::now() >= nextSync)
+        {
+            syncFile();
+            nextSync += SYNC_INTERVAL;
+        }
+        if (stopping)
+        {
+            return;
+        }
+        std::this_thread::sleep_for(WRITE_INTERVAL);
+    }
+}
@@ -0,0 +1,164 @@
+#ifndef FLIGHT_RECORDER_HPP
+#define FLIGHT_RECORDER_HPP
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <thread>
+
+#include "sensor-sample.hpp"
+#include "wire-format.hpp"
+
+
+// Flight record files are a header followed by binary records (the same
+// records as wire-format.hpp) back to back, zero filled after the last one.
+// The header is two 64 byte slots that are written alternately, each at the
+// start of its own FLIGHT_RECORD_SECTOR_SIZE bytes so a write torn part way
+// through a sector can only damage one of them. Each slot is:
+//   offset 0  char[8] magic (FLIGHT_RECORD_MAGIC)
+//   offset 8  uint32  version (FLIGHT_RECORD_VERSION)
+//   offset 12 uint32  generation, goes up by one every time a slot is written
+//   offset 16 uint32  file index, counts up across rotations
+//   offset 20 uint32  reserved (0)
+//   offset 24 int64   realtime clock when the file was made (ns since epoch)
+//   offset 32 int64   monotonic clock at the same moment (ns)
+//   offset 40 uint64  bytes of records committed after the header
+//   offset 48 uint64  records committed
+//   offset 56 uint32  CRC-32 of bytes 0 to 55
+//   offset 60 uint32  reserved (0)
+// All little-endian. The valid slot with the highest generation is current,
+// so a crash while one slot is being written leaves the other one intact.
+// A slot is only written once the records it counts are on disk, so
+// everything up to the committed length is whole. Records past it may be
+// too (they were written but not committed yet), readers can recover those
+// by checking each record's header (see readFlightRecords).
+constexpr char FLIGHT_RECORD_MAGIC[8] = { 'U', 'A', 'S', 'F', 'L', 'R', 'E', 'C' };
+constexpr uint32_t FLIGHT_RECORD_VERSION = 2;
+constexpr size_t FLIGHT_RECORD_SLOT_SIZE = 64;
+constexpr size_t FLIGHT_RECORD_SECTOR_SIZE = 4096;
+constexpr size_t FLIGHT_RECORD_HEADER_SIZE = 2 * FLIGHT_RECORD_SECTOR_SIZE;
+
+
+// The current header of a flight record file
+struct FlightRecordHeader
+{
+    public:
+        uint32_t generation;
+        uint32_t fileIndex;
+        int64_t realtime;
+        int64_t monotonic;
+        uint64_t committedBytes;
+        uint64_t committedRecords;
+};
+
+
+// Finds the current header slot in a flight record file (at least
+// FLIGHT_RECORD_HEADER_SIZE bytes), false if neither slot is valid
+bool readFlightRecordHeader(const uint8_t *file, FlightRecordHeader &header);
+
+
+// Hands every record in a flight record file of size bytes to onAltitude or
+// onImu, in the order they were written, up to the first one that isn't
+// whole, so records past the committed length are recovered too. Returns how
+// many there were.
+template <typename OnAltitude, typename OnImu>
+uint64_t readFlightRecords(const uint8_t *file, size_t size, OnAltitude onAltitude, OnImu onImu)
+{
+    size_t offset = FLIGHT_RECORD_HEADER_SIZE;
+    uint64_t records = 0;
+    SensorId sensor;
+    size_t length;
+    uint32_t age;
+    while (offset < size && decodeHeader(file + offset, size - offset, sensor, length))
+    {
+        if (sensor == SENSOR_MPL3115A2)
+        {
+            AltitudeSample sample;
+            decodeBinary(file + offset, length, sample, age);
+            onAltitude(sample);
+        }
+        else
+        {
+            ImuSample sample;
+            decodeBinary(file + offset, length, sample, age);
+            onImu(sample);
+        }
+        offset += length;
+        ++records;
+    }
+    return records;
+}
+
+
+// This class records samples to disk without ever making the caller wait on
+// storage. record encodes the sample into a lock-free queue (dropping it,
+// and counting the drop, if the queue is full) and a background thread
+// copies the queue into a preallocated memory mapped file. Every second the
+// records are synced to disk and only then committed in the header, which is
+// synced in turn.
+// When a file fills up the next one is made (prefix-0000.rec, prefix-0001.rec
+// and so on, never overwriting an existing file), keeping only the newest
+// maxFiles of them if maxFiles isn't 0. Any number of threads may record at
+// once. On destruction everything queued is written and the last file is
+// truncated to what it holds.
+// If the writer fails (e.g. the disk is full) it reports the error and
+// everything after that is dropped.
+class FlightRecorder
+{
+    public:
+        FlightRecorder(const std::string &prefix, size_t fileSize, unsigned int maxFiles);
+        ~FlightRecorder(void);
+        bool record(const AltitudeSample &sample);
+        bool record(const ImuSample &sample);
+        uint64_t written(void) const;
+        uint64_t dropped(void) const;
+        uint32_t filesStarted(void) const;
+
+    private:
+        FlightRecorder(const FlightRecorder &);
+        FlightRecorder &operator=(const FlightRecorder &);
+        static constexpr unsigned int QUEUE_SLOTS = 8192;  // Power of two
+        struct Slot
+        {
+            std::atomic<uint64_t> sequence;
+            uint8_t size;
+            uint8_t data[WIRE_MAX_RECORD_SIZE];
+        };
+        template <typename Sample>
+        bool enqueue(const Sample &sample);
+        bool dequeue(uint8_t *data, size_t &size);
+        void openFile(void);
+        void closeFile(void);
+        void commitHeader(void);
+        // Syncs the records, then commits them in the header and syncs that
+        void syncFile(void);
+        void writeLoop(void);
+        std::string m_prefix;
+        size_t m_fileSize;
+        unsigned int m_maxFiles;
+        std::unique_ptr<Slot[]> m_slots;
+        std::atomic<uint64_t> m_enqueuePosition;
+        uint64_t m_dequeuePosition;
+        std::atomic<uint64_t> m_written;
+        std::atomic<uint64_t> m_dropped;
+        std::atomic<uint32_t> m_filesStarted;
+        std::atomic<bool> m_stopping;
+        bool m_failed;
+        int m_file;
+        uint8_t *m_mapping;
+        std::deque<std::string> m_files;
+        uint32_t m_nextFileIndex;  // Where the search for a free file name starts
+        uint32_t m_fileIndex;  // The current file's
+        uint32_t m_generation;
+        int64_t m_createdRealtime;
+        int64_t m_createdMonotonic;
+        size_t m_writeOffset;  // Where the next record goes in the file
+        size_t m_committedOffset;  // Where the records the header counts end
+        uint64_t m_records;  // Records in the current file
+        std::thread m_writer;
+};
+
+#endif
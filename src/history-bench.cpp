@@ -0,0 +1,182 @@
+// Checks the windows TimeSeriesStore hands back and what downsample makes of
+// them, then times since and after on a store as deep as data-server keeps by
+// default. Exits with 1 if any check fails.
+//
+// since has to include a sample right on its boundary and after has to leave
+// out the one it is given, with runs of equal timestamps (what a FIFO batch
+// stamped no earlier than the last sample can have) kept whole. Once the
+// store has wrapped past its capacity only the newest samples are left, in
+// order, and asking for everything after one that has been overwritten gets
+// all of those. downsample has to put every sample in the right stretch with
+// the right min, mean and max, and leave out anything outside from to to.
+#include <chrono>
+#include <iostream>
+#include <stdint.h>
+#include <vector>
+
+#include "sensor-sample.hpp"
+#include "time-series-store.hpp"
+
+
+constexpr size_t DEPTH = 65536;
+constexpr unsigned int ITERATIONS = 10000;
+
+
+static AltitudeSample makeSample(uint64_t sequence, int64_t timestamp, double pressure)
+{
+    AltitudeSample sample = { sequence, timestamp, { pressure, 0.0, 20.0 } };
+    return sample;
+}
+
+
+// Whether samples are the ones numbered first to last, in order
+static bool isRun(const std::vector<AltitudeSample> &samples, uint64_t first, uint64_t last)
+{
+    if (samples.size() != last + 1 - first)
+    {
+        return false;
+    }
+    for (size_t i = 0; i < samples.size(); ++i)
+    {
+        if (samples[i].sequence != first + i)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+static bool report(const char *name, bool ok)
+{
+    std::cout << name << (ok ? ": ok" : ": FAILED") << std::endl;
+    return ok;
+}
+
+
+// Samples 1 to 40, a ms apart except 20 to 22 which share a timestamp
+static bool checkWindows(void)
+{
+    TimeSeriesStore<AltitudeSample> store(64);
+    for (uint64_t sequence = 1; sequence <= 40; ++sequence)
+    {
+        int64_t timestamp = sequence >= 20 && sequence <= 22 ? 20000000 : sequence * 1000000;
+        store.publish(makeSample(sequence, timestamp, 0.0));
+    }
+
+    std::vector<AltitudeSample> samples;
+    bool ok = store.since(0, samples) == 40 && isRun(samples, 1, 40);
+    samples.clear();
+    ok = ok && store.since(10000000, samples) == 31 && isRun(samples, 10, 40);
+    samples.clear();
+    ok = ok && store.since(10000001, samples) == 30 && isRun(samples, 11, 40);
+    samples.clear();
+    ok = ok && store.since(20000000, samples) == 21 && isRun(samples, 20, 40);
+    samples.clear();
+    ok = ok && store.since(41000000, samples) == 0 && samples.empty();
+    samples.clear();
+    ok = ok && store.after(0, samples) == 40 && isRun(samples, 1, 40);
+    samples.clear();
+    ok = ok && store.after(20, samples) == 20 && isRun(samples, 21, 40);
+    samples.clear();
+    ok = ok && store.after(39, samples) == 1 && isRun(samples, 40, 40);
+    samples.clear();
+    ok = ok && store.after(40, samples) == 0 && samples.empty();
+    return report("Window boundaries", ok);
+}
+
+
+// 100 samples through a store of 16 leaves 85 to 100
+static bool checkWraparound(void)
+{
+    TimeSeriesStore<AltitudeSample> store(16);
+    for (uint64_t sequence = 1; sequence <= 100; ++sequence)
+    {
+        store.publish(makeSample(sequence, sequence * 1000000, 0.0));
+    }
+
+    std::vector<AltitudeSample> samples;
+    bool ok = store.since(0, samples) == 16 && isRun(samples, 85, 100);
+    samples.clear();
+    ok = ok && store.since(90000000, samples) == 11 && isRun(samples, 90, 100);
+    samples.clear();
+    ok = ok && store.after(10, samples) == 16 && isRun(samples, 85, 100);
+    samples.clear();
+    ok = ok && store.after(84, samples) == 16 && isRun(samples, 85, 100);
+    samples.clear();
+    ok = ok && store.after(90, samples) == 10 && isRun(samples, 91, 100);
+    return report("Wrapped past capacity", ok);
+}
+
+
+// Four stretches of 10 ms from 100 ms: the first gets pressures 1, 2 and 6,
+// the second nothing, the third 4 and the last 10 and 20, with a sample
+// either side of the whole window that mustn't turn up anywhere
+static bool checkDownsample(void)
+{
+    std::vector<AltitudeSample> samples;
+    samples.push_back(makeSample(1, 99999999, 1000.0));
+    samples.push_back(makeSample(2, 100000000, 1.0));
+    samples.push_back(makeSample(3, 105000000, 2.0));
+    samples.push_back(makeSample(4, 109999999, 6.0));
+    samples.push_back(makeSample(5, 120000000, 4.0));
+    samples.push_back(makeSample(6, 130000000, 10.0));
+    samples.push_back(makeSample(7, 139999999, 20.0));
+    samples.push_back(makeSample(8, 140000000, 1000.0));
+    std::vector<SeriesSummary> summaries = downsample(samples, 100000000, 140000000, 4);
+
+    const uint64_t counts[] = { 3, 0, 1, 2 };
+    const double mins[] = { 1.0, 0.0, 4.0, 10.0 };
+    const double means[] = { 3.0, 0.0, 4.0, 15.0 };
+    const double maxes[] = { 6.0, 0.0, 4.0, 20.0 };
+    bool ok = summaries.size() == 4;
+    for (unsigned int point = 0; ok && point < 4; ++point)
+    {
+        const SeriesSummary &summary = summaries[point];
+        ok = summary.start == 100000000 + 10000000 * static_cast<int64_t>(point) && summary.count == counts[point];
+        if (ok && summary.count > 0)
+        {
+            ok = summary.fields == 3 && summary.min[0] == mins[point] && summary.mean[0] == means[point] &&
+                 summary.max[0] == maxes[point] && summary.mean[2] == 20.0;
+        }
+    }
+    return report("Downsampled min, mean and max", ok);
+}
+
+
+int main(void)
+{
+    bool passed = checkWindows();
+    passed = checkWraparound() && passed;
+    passed = checkDownsample() && passed;
+
+    // A full store, asked for the last second of samples taken a ms apart
+    TimeSeriesStore<AltitudeSample> store(DEPTH);
+    for (uint64_t sequence = 1; sequence <= 2 * DEPTH; ++sequence)
+    {
+        store.publish(makeSample(sequence, sequence * 1000000, 0.0));
+    }
+    std::vector<AltitudeSample> samples;
+    samples.reserve(DEPTH);
+    int64_t lastSecond = (2 * DEPTH - 999) * 1000000;
+    uint64_t returned = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (unsigned int i = 0; i < ITERATIONS; ++i)
+    {
+        samples.clear();
+        returned += store.since(lastSecond, samples);
+    }
+    std::chrono::duration<double, std::micro> sinceTime = std::chrono::steady_clock::now() - start;
+    start = std::chrono::steady_clock::now();
+    for (unsigned int i = 0; i < ITERATIONS; ++i)
+    {
+        samples.clear();
+        returned += store.after(2 * DEPTH - 1000, samples);
+    }
+    std::chrono::duration<double, std::micro> afterTime = std::chrono::steady_clock::now() - start;
+    passed = returned == 2 * ITERATIONS * 1000 && passed;
+
+    std::cout << "since, last 1000 of " << DEPTH << ": " << sinceTime.count() / ITERATIONS << " us" << std::endl
+              << "after, last 1000 of " << DEPTH << ": " << afterTime.count() / ITERATIONS << " us" << std::endl;
+    return passed ? 0 : 1;
+}
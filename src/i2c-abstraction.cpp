@@ -1,5 +1,4 @@
 #include <iostream>
-#include <memory>
 #include <stdexcept>
 #include <stdint.h>
 #include <sstream>
@@ -15,11 +14,18 @@
 #include <unistd.h>
 
 #include "i2c-abstraction.hpp"
+#include "i2c-recovery.hpp"
+#include "metrics.hpp"
 
 
+constexpr unsigned int I2cTransaction::MAX_MESSAGES;
+static_assert(I2cTransaction::MAX_MESSAGES <= I2C_RDWR_IOCTL_MAX_MSGS,
+              "An i2c transaction can't have more messages than the kernel allows");
+
 I2cAbstraction::I2cAbstraction(const unsigned int adapterNumber, const uint8_t deviceAddress)
 {
     // Basically setup an dev file to be used for i2c and handle errors
+    m_adapterNumber = adapterNumber;
     m_deviceAddress = deviceAddress;
     std::ostringstream oss;
     oss << "/dev/i2c-" << adapterNumber;
@@ -55,9 +61,56 @@ I2cAbstraction::I2cAbstraction(const unsigned int adapterNumber, const uint8_t d
 }
 
 
+I2cAbstraction::~I2cAbstraction(void)
+{
+    close(m_i2cFile);
+}
+
+
 std::vector<uint8_t> I2cAbstraction::readBytes(uint8_t reg, unsigned int size) const
 {
-    struct i2c_rdwr_ioctl_data packagedMessages;
+    std::vector<uint8_t> data(size);
+    readBytes(reg, data.data(), size);
+    return data;
+}
+
+
+void I2cAbstraction::readBytes(uint8_t reg, uint8_t *buffer, unsigned int size) const
+{
+    if (!tryReadBytes(reg, buffer, size))
+    {
+        std::ostringstream err;
+        err << "Could not perform read" << std::endl << strerror(errno);
+        throw std::runtime_error(err.str());
+    }
+}
+
+
+void I2cAbstraction::writeByte(uint8_t reg, uint8_t data) const
+{
+    if (!tryWriteByte(reg, data))
+    {
+        std::ostringstream err;
+        err << "Could not perform write" << std::endl << strerror(errno);
+        throw std::runtime_error(err.str());
+    }
+}
+
+
+void I2cAbstraction::transfer(I2cTransaction &transaction) const
+{
+    if (!tryTransfer(transaction))
+    {
+        std::ostringstream err;
+        err << "Could not perform transaction of " << transaction.messageCount() << " messages"
+            << std::endl << strerror(errno);
+        throw std::runtime_error(err.str());
+    }
+}
+
+
+bool I2cAbstraction::tryReadBytes(uint8_t reg, uint8_t *buffer, unsigned int size) const
+{
     struct i2c_msg messages[2];
 
     // This message is responsible for telling the device which register we want data from
@@ -66,29 +119,19 @@ std::vector<uint8_t> I2cAbstraction::readBytes(uint8_t reg, unsigned int size) c
     messages[0].len = sizeof(reg);
     messages[0].buf = &reg;
 
-    // This message contains the data from the register
-    std::unique_ptr<uint8_t[]> data(new uint8_t[size]);
+    // This message contains the data from the register, straight into the caller's buffer
     messages[1].addr  = m_deviceAddress;
     messages[1].flags = I2C_M_RD;
     messages[1].len   = size;
-    messages[1].buf   = data.get();
+    messages[1].buf   = buffer;
 
     // Ask for the transaction to take place
-    packagedMessages.msgs = messages;
-    packagedMessages.nmsgs = 2;
-    if(ioctl(m_i2cFile, I2C_RDWR, &packagedMessages) < 0)
-    {
-        std::ostringstream err;
-        err << "Could not perform read" << std::endl << strerror(errno);
-        throw std::runtime_error(err.str());
-    }
-    return std::vector<uint8_t>(data.get(), data.get() + size);
+    return performTransaction(messages, 2, true);
 }
 
 
-void I2cAbstraction::writeByte(uint8_t reg, uint8_t data) const
+bool I2cAbstraction::tryWriteByte(uint8_t reg, uint8_t data) const
 {
-    struct i2c_rdwr_ioctl_data packagedMessages;
     struct i2c_msg message;
 
     // This message contains the register to write to as well as the data to write
@@ -102,12 +145,210 @@ void I2cAbstraction::writeByte(uint8_t reg, uint8_t data) const
 
 
     // Ask for the transaction to take place
-    packagedMessages.msgs = &message;
-    packagedMessages.nmsgs = 1;
-    if(ioctl(m_i2cFile, I2C_RDWR, &packagedMessages) < 0)
+    return performTransaction(&message, 1, true);
+}
+
+
+bool I2cAbstraction::tryTransfer(I2cTransaction &transaction) const
+{
+    if (transaction.empty())
     {
-        std::ostringstream err;
-        err << "Could not perform write" << std::endl << strerror(errno);
-        throw std::runtime_error(err.str());
+        return true;
+    }
+
+    // Build the messages now that the buffer won't move anymore
+    struct i2c_msg messages[I2cTransaction::MAX_MESSAGES];
+    unsigned int messageCount = transaction.buildMessages(messages);
+
+    // Ask for the whole transaction to take place
+    return performTransaction(messages, messageCount, transaction.repeatable());
+}
+
+
+bool I2cAbstraction::recover(void)
+{
+    // The bus is cleared first so the reopened adapter starts on an idle bus
+    if (!recoverI2cBus(m_adapterNumber))
+    {
+        return false;
+    }
+    int i2cFile = open(m_i2cFilename.c_str(), O_RDWR);
+    if (i2cFile < 0)
+    {
+        return false;
+    }
+    if (ioctl(i2cFile, I2C_SLAVE, m_deviceAddress) < 0)
+    {
+        int ioctlErrno = errno;
+        close(i2cFile);
+        errno = ioctlErrno;
+        return false;
     }
+    close(m_i2cFile);
+    m_i2cFile = i2cFile;
+    return true;
+}
+
+
+uint8_t I2cAbstraction::deviceAddress(void) const
+{
+    return m_deviceAddress;
+}
+
+
+bool I2cAbstraction::performTransaction(struct i2c_msg *messages, unsigned int count, bool repeatable) const
+{
+    struct i2c_rdwr_ioctl_data packagedMessages;
+    packagedMessages.msgs = messages;
+    packagedMessages.nmsgs = count;
+    I2cDeviceMetrics &metrics = i2cDeviceMetrics(m_deviceAddress);
+
+    // Glitches like losing arbitration to another master are worth another
+    // go, anything else is an error. Part of a failed transaction may still
+    // have happened, so one that isn't repeatable only gets the one go.
+    uint64_t start = metricsNow();
+    bool performed;
+    if (repeatable)
+    {
+        performed = retryI2c(metrics, [&]() { return ioctl(m_i2cFile, I2C_RDWR, &packagedMessages) >= 0; });
+    }
+    else
+    {
+        performed = ioctl(m_i2cFile, I2C_RDWR, &packagedMessages) >= 0;
+    }
+    metrics.recordTransaction(metricsNow() - start);
+    if (!performed)
+    {
+        int ioctlErrno = errno;
+        metrics.recordError();
+        errno = ioctlErrno;
+        return false;
+    }
+
+    for (unsigned int i = 0; i < count; ++i)
+    {
+        if (messages[i].flags & I2C_M_RD)
+        {
+            i2cDeviceMetrics(messages[i].addr).recordBytes(messages[i].len, 0);
+        }
+        else
+        {
+            i2cDeviceMetrics(messages[i].addr).recordBytes(0, messages[i].len);
+        }
+    }
+    return true;
+}
+
+
+unsigned int I2cTransaction::read(uint8_t deviceAddress, uint8_t reg, unsigned int size)
+{
+    if (m_messageCount + 2 > MAX_MESSAGES)
+    {
+        throw std::length_error("Too many messages for a single i2c transaction");
+    }
+
+    // The register goes right before the space for the data
+    m_buffer.push_back(reg);
+    Operation operation;
+    operation.deviceAddress = deviceAddress;
+    operation.isRead = true;
+    operation.offset = m_buffer.size();
+    operation.size = size;
+    m_buffer.resize(m_buffer.size() + size);
+    m_operations.push_back(operation);
+    m_reads.push_back(m_operations.size() - 1);
+    m_messageCount += 2;
+    return m_reads.size() - 1;
+}
+
+
+void I2cTransaction::write(uint8_t deviceAddress, uint8_t reg, uint8_t data)
+{
+    if (m_messageCount + 1 > MAX_MESSAGES)
+    {
+        throw std::length_error("Too many messages for a single i2c transaction");
+    }
+
+    Operation operation;
+    operation.deviceAddress = deviceAddress;
+    operation.isRead = false;
+    operation.offset = m_buffer.size();
+    operation.size = 2;
+    m_buffer.push_back(reg);
+    m_buffer.push_back(data);
+    m_operations.push_back(operation);
+    m_messageCount += 1;
+}
+
+
+unsigned int I2cTransaction::buildMessages(struct i2c_msg *messages)
+{
+    // A read is a write of the register followed by the read of the data
+    unsigned int messageCount = 0;
+    uint8_t *buffer = m_buffer.data();
+    for (const Operation &operation : m_operations)
+    {
+        if (operation.isRead)
+        {
+            messages[messageCount].addr = operation.deviceAddress;
+            messages[messageCount].flags = 0;
+            messages[messageCount].len = 1;
+            messages[messageCount].buf = buffer + operation.offset - 1;
+            ++messageCount;
+            messages[messageCount].addr = operation.deviceAddress;
+            messages[messageCount].flags = I2C_M_RD;
+            messages[messageCount].len = operation.size;
+            messages[messageCount].buf = buffer + operation.offset;
+            ++messageCount;
+        }
+        else
+        {
+            messages[messageCount].addr = operation.deviceAddress;
+            messages[messageCount].flags = 0;
+            messages[messageCount].len = operation.size;
+            messages[messageCount].buf = buffer + operation.offset;
+            ++messageCount;
+        }
+    }
+    return messageCount;
+}
+
+
+const uint8_t *I2cTransaction::result(unsigned int index) const
+{
+    return m_buffer.data() + m_operations[m_reads.at(index)].offset;
+}
+
+
+unsigned int I2cTransaction::messageCount(void) const
+{
+    return m_messageCount;
+}
+
+
+bool I2cTransaction::empty(void) const
+{
+    return m_operations.empty();
+}
+
+
+void I2cTransaction::clear(void)
+{
+    // Keeps the memory around so a transaction can be reused without allocating
+    m_operations.clear();
+    m_reads.clear();
+    m_buffer.clear();
+    m_messageCount = 0;
+}
+
+
+void I2cTransaction::setRepeatable(bool repeatable)
+{
+    m_repeatable = repeatable;
+}
+
+
+bool I2cTransaction::repeatable(void) const
+{
+    return m_repeatable;
 }
@@ -5,18 +5,94 @@
 #include <string>
 #include <vector>
 
+struct i2c_msg;
+
+// This class queues up several reads and writes so they can all be handed to
+// the adapter at once (in a single ioctl on linux) by I2cAbstraction::transfer.
+// The reads and writes may be for any slave address on the same adapter.
+// Each read is two messages (the register then the data) and each write is
+// one, with at most MAX_MESSAGES messages in a single transaction.
+// After the transfer, result(index) gives the data for the read that returned
+// index when it was queued. All the results live in one buffer.
+// setRepeatable(false) says doing the transaction twice isn't the same as
+// doing it once, e.g. its reads pop a FIFO, so a transport never retries it
+// and a BusScheduler never puts it in with anything else. A transaction is
+// repeatable until that is set, and clear leaves it as it is.
+class I2cTransaction
+{
+    public:
+        // Same as the kernel's limit (I2C_RDWR_IOCTL_MAX_MSGS)
+        static constexpr unsigned int MAX_MESSAGES = 42;
+
+        unsigned int read(uint8_t deviceAddress, uint8_t reg, unsigned int size);
+        void write(uint8_t deviceAddress, uint8_t reg, uint8_t data);
+        const uint8_t *result(unsigned int index) const;
+        unsigned int messageCount(void) const;
+        bool empty(void) const;
+        void clear(void);
+        void setRepeatable(bool repeatable);
+        bool repeatable(void) const;
+
+    private:
+        friend class I2cAbstraction;
+        friend class ScheduledI2c;
+        friend class SimulatedI2c;
+        struct Operation
+        {
+            uint8_t deviceAddress;
+            bool isRead;
+            unsigned int offset;  // Where in m_buffer this operation's bytes live
+            unsigned int size;  // Bytes sent for a write or received for a read
+        };
+        // Fills in the messages for the whole transaction (messageCount of
+        // them), pointing into m_buffer
+        unsigned int buildMessages(struct i2c_msg *messages);
+        std::vector<Operation> m_operations;
+        std::vector<unsigned int> m_reads;  // Indices into m_operations
+        std::vector<uint8_t> m_buffer;  // Register bytes, write data and read results
+        unsigned int m_messageCount = 0;
+        bool m_repeatable = true;
+};
+
 
 // This class is an abstraction for a i2c connection to a single device.
 // The current implementation is based on linux
-// readBytes provides a function to read sequential registers from a device.
+// readBytes provides a function to read sequential registers from a device,
+// either into a new vector or into a buffer the caller owns (which never
+// allocates).
 // writeByte provides a way to write to a register.
+// transfer performs a batch of reads and writes (for any device on the same
+// adapter) at once.
+// Each of those throws if it fails, tryReadBytes, tryWriteByte and
+// tryTransfer do the same but return false with errno set instead, which is
+// what anything sampling in a loop should use so a failure costs no more
+// than the failed ioctl.
+// Every transaction is timed and counted (see i2cDeviceMetrics), and retried
+// under the i2cRetryPolicy if it fails with a transient error, unless it is
+// a transaction that isn't repeatable.
+// recover clears the bus if setI2cBusLines gave it lines to do it with, then
+// reopens the adapter, false with errno set if either didn't work.
 class I2cAbstraction
 {
     public:
         I2cAbstraction(const unsigned int adapterNumber, const uint8_t deviceAddress);
+        ~I2cAbstraction(void);
         std::vector<uint8_t> readBytes(uint8_t reg, unsigned int size) const;
+        void readBytes(uint8_t reg, uint8_t *buffer, unsigned int size) const;
         void writeByte(uint8_t reg, uint8_t data) const;
+        void transfer(I2cTransaction &transaction) const;
+        bool tryReadBytes(uint8_t reg, uint8_t *buffer, unsigned int size) const;
+        bool tryWriteByte(uint8_t reg, uint8_t data) const;
+        bool tryTransfer(I2cTransaction &transaction) const;
+        bool recover(void);
+        uint8_t deviceAddress(void) const;
     private:
+        I2cAbstraction(const I2cAbstraction &);
+        I2cAbstraction &operator=(const I2cAbstraction &);
+        // Does the ioctl, retried if repeatable, false (with errno set) if it
+        // failed
+        bool performTransaction(struct i2c_msg *messages, unsigned int count, bool repeatable) const;
+        unsigned int m_adapterNumber;
         std::string m_i2cFilename;
         int m_i2cFile;
         uint8_t m_deviceAddress;
@@ -0,0 +1,259 @@
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <stdint.h>
+#include <string>
+#include <string.h>
+#include <thread>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/gpio.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "i2c-recovery.hpp"
+#include "metrics.hpp"
+
+
+// Clock pulses it can take a slave to finish the byte it was sending, 8 data
+// bits and the acknowledge
+constexpr unsigned int CLEAR_CLOCKS = 9;
+
+// Half of an SCL period while clearing the bus, 100 kHz like standard mode
+constexpr std::chrono::microseconds CLEAR_HALF_PERIOD(5);
+
+static std::atomic<unsigned int> retryAttempts(3);
+static std::atomic<int64_t> retryBackoff(50);  // Microseconds
+static std::atomic<int64_t> retryMaxBackoff(1000);
+
+// Lines each adapter can be cleared through, by adapter number
+static std::mutex busLinesMutex;
+static std::map<unsigned int, I2cBusLines> busLines;
+
+
+void setI2cRetryPolicy(const I2cRetryPolicy &policy)
+{
+    if (policy.attempts == 0 || policy.backoff.count() < 0 || policy.maxBackoff < policy.backoff)
+    {
+        throw std::invalid_argument("An i2c retry policy needs at least one attempt and "
+                                    "a maximum backoff no less than its backoff");
+    }
+    retryAttempts.store(policy.attempts, std::memory_order_relaxed);
+    retryBackoff.store(policy.backoff.count(), std::memory_order_relaxed);
+    retryMaxBackoff.store(policy.maxBackoff.count(), std::memory_order_relaxed);
+}
+
+
+I2cRetryPolicy i2cRetryPolicy(void)
+{
+    I2cRetryPolicy policy;
+    policy.attempts = retryAttempts.load(std::memory_order_relaxed);
+    policy.backoff = std::chrono::microseconds(retryBackoff.load(std::memory_order_relaxed));
+    policy.maxBackoff = std::chrono::microseconds(retryMaxBackoff.load(std::memory_order_relaxed));
+    return policy;
+}
+
+
+bool isTransientI2cError(int error)
+{
+    // EAGAIN is lost arbitration, ENXIO and EREMOTEIO a NAK depending on the
+    // adapter's driver, ETIMEDOUT a slave stretching the clock too long
+    return error == EAGAIN || error == ENXIO || error == EREMOTEIO || error == ETIMEDOUT || error == EIO;
+}
+
+
+void setI2cBusLines(unsigned int adapterNumber, const I2cBusLines &lines)
+{
+    std::lock_guard<std::mutex> lock(busLinesMutex);
+    busLines[adapterNumber] = lines;
+}
+
+
+// Requests line from chipFile as an open drain output at value or as an
+// input, returning the line handle's file or -1 with errno set
+static int requestLine(int chipFile, unsigned int line, bool output, uint8_t value)
+{
+    struct gpiohandle_request request;
+    memset(&request, 0, sizeof(request));
+    request.lineoffsets[0] = line;
+    request.lines = 1;
+    if (output)
+    {
+        request.flags = GPIOHANDLE_REQUEST_OUTPUT | GPIOHANDLE_REQUEST_OPEN_DRAIN;
+        request.default_values[0] = value;
+    }
+    else
+    {
+        request.flags = GPIOHANDLE_REQUEST_INPUT;
+    }
+    strncpy(request.consumer_label, "i2c-recovery", sizeof(request.consumer_label) - 1);
+    if (ioctl(chipFile, GPIO_GET_LINEHANDLE_IOCTL, &request) < 0)
+    {
+        return -1;
+    }
+    return request.fd;
+}
+
+
+// Drives (or releases, for 1) the line lineFile has, false with errno set if
+// it couldn't
+static bool setLine(int lineFile, uint8_t value)
+{
+    struct gpiohandle_data data;
+    memset(&data, 0, sizeof(data));
+    data.values[0] = value;
+    bool set = ioctl(lineFile, GPIOHANDLE_SET_LINE_VALUES_IOCTL, &data) >= 0;
+    std::this_thread::sleep_for(CLEAR_HALF_PERIOD);
+    return set;
+}
+
+
+// Reads the line lineFile has into value, false with errno set if it couldn't
+static bool getLine(int lineFile, uint8_t &value)
+{
+    struct gpiohandle_data data;
+    memset(&data, 0, sizeof(data));
+    if (ioctl(lineFile, GPIOHANDLE_GET_LINE_VALUES_IOCTL, &data) < 0)
+    {
+        return false;
+    }
+    value = data.values[0];
+    return true;
+}
+
+
+// Closes file without losing errno
+static void closeKeepingErrno(int file)
+{
+    int error = errno;
+    close(file);
+    errno = error;
+}
+
+
+bool clearI2cBus(const I2cBusLines &lines)
+{
+    int chipFile = open(lines.chip.c_str(), O_RDONLY | O_CLOEXEC);
+    if (chipFile < 0)
+    {
+        return false;
+    }
+    int sclFile = requestLine(chipFile, lines.scl, true, 1);
+    if (sclFile < 0)
+    {
+        closeKeepingErrno(chipFile);
+        return false;
+    }
+    int sdaFile = requestLine(chipFile, lines.sda, false, 1);
+    if (sdaFile < 0)
+    {
+        closeKeepingErrno(sclFile);
+        closeKeepingErrno(chipFile);
+        return false;
+    }
+
+    // Clock until the slave has sent what it thought it was sending and lets
+    // go of SDA
+    bool driven = true;
+    uint8_t sda = 0;
+    for (unsigned int clock = 0; driven && clock < CLEAR_CLOCKS; ++clock)
+    {
+        driven = getLine(sdaFile, sda);
+        if (!driven || sda)
+        {
+            break;
+        }
+        driven = setLine(sclFile, 0) && setLine(sclFile, 1);
+    }
+    if (driven)
+    {
+        driven = getLine(sdaFile, sda);
+    }
+    closeKeepingErrno(sdaFile);
+
+    // Then a STOP (SDA rising while SCL is high) so every slave is idle
+    if (driven)
+    {
+        driven = setLine(sclFile, 0);
+        sdaFile = driven ? requestLine(chipFile, lines.sda, true, 0) : -1;
+        driven = sdaFile >= 0 && setLine(sclFile, 1) && setLine(sdaFile, 1);
+        if (sdaFile >= 0)
+        {
+            closeKeepingErrno(sdaFile);
+        }
+    }
+    closeKeepingErrno(sclFile);
+    closeKeepingErrno(chipFile);
+    if (driven && !sda)
+    {
+        errno = EBUSY;
+        return false;
+    }
+    return driven;
+}
+
+
+bool recoverI2cBus(unsigned int adapterNumber)
+{
+    I2cBusLines lines;
+    {
+        std::lock_guard<std::mutex> lock(busLinesMutex);
+        std::map<unsigned int, I2cBusLines>::const_iterator found = busLines.find(adapterNumber);
+        if (found == busLines.end())
+        {
+            return true;
+        }
+        lines = found->second;
+    }
+    return clearI2cBus(lines);
+}
+
+
+ErrorBudget::ErrorBudget(unsigned int allowed, std::chrono::nanoseconds window) :
+    m_allowed(allowed),
+    m_window(window.count()),
+    m_windowStart(metricsNow()),
+    m_spent(0),
+    m_failures(0),
+    m_exhausted(0)
+{
+    if (window.count() <= 0)
+    {
+        throw std::invalid_argument("ErrorBudget window must be positive");
+    }
+}
+
+
+bool ErrorBudget::spend(void)
+{
+    m_failures.fetch_add(1, std::memory_order_relaxed);
+    uint64_t now = metricsNow();
+    if (now - m_windowStart >= m_window)
+    {
+        m_windowStart = now;
+        m_spent = 0;
+    }
+    if (++m_spent <= m_allowed)
+    {
+        return true;
+    }
+    m_exhausted.fetch_add(1, std::memory_order_relaxed);
+    m_windowStart = now;
+    m_spent = 0;
+    return false;
+}
+
+
+uint64_t ErrorBudget::failures(void) const
+{
+    return m_failures.load(std::memory_order_relaxed);
+}
+
+
+uint64_t ErrorBudget::exhausted(void) const
+{
+    return m_exhausted.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,125 @@
+#ifndef I2C_RECOVERY_HPP
+#define I2C_RECOVERY_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <stdint.h>
+#include <string>
+#include <thread>
+
+#include <errno.h>
+
+#include "metrics.hpp"
+
+
+// How a failed i2c transaction is tried again, shared by every transport in
+// the program (see setI2cRetryPolicy).
+// A transaction is tried at most attempts times. The first retry goes
+// straight away since most glitches (a lost arbitration, a NAK from a device
+// busy for a moment) are over by then, after that each retry waits backoff,
+// doubling every time up to maxBackoff.
+struct I2cRetryPolicy
+{
+    public:
+        unsigned int attempts;
+        std::chrono::microseconds backoff;
+        std::chrono::microseconds maxBackoff;
+};
+
+
+// Which GPIO lines an adapter's SCL and SDA can also be driven through to
+// clear the bus (see clearI2cBus). The lines have to be free to request,
+// i.e. muxed as GPIO and not claimed by the i2c controller's driver.
+struct I2cBusLines
+{
+    public:
+        std::string chip;  // e.g. /dev/gpiochip0
+        unsigned int scl;
+        unsigned int sda;
+};
+
+
+// The policy used from now on, by any thread. The default is 3 attempts with
+// 50 us of backoff doubling up to 1 ms.
+void setI2cRetryPolicy(const I2cRetryPolicy &policy);
+I2cRetryPolicy i2cRetryPolicy(void);
+
+// Whether a transaction that failed with error might work if it is tried
+// again: lost arbitration, no acknowledge, a timeout or an I/O error on the
+// bus, but not a bad request or a missing adapter
+bool isTransientI2cError(int error);
+
+// Does attempt (which returns false with errno set when it fails) until it
+// works, the error isn't transient or the policy's attempts are used up,
+// counting each retry in metrics. False with errno set to the last error if
+// it never worked.
+template <typename Attempt>
+bool retryI2c(I2cDeviceMetrics &metrics, Attempt attempt)
+{
+    I2cRetryPolicy policy = i2cRetryPolicy();
+    std::chrono::microseconds backoff(0);
+    for (unsigned int tried = 1; ; ++tried)
+    {
+        if (attempt())
+        {
+            return true;
+        }
+        int error = errno;
+        if (tried >= policy.attempts || !isTransientI2cError(error))
+        {
+            errno = error;
+            return false;
+        }
+        metrics.recordRetry();
+        if (backoff.count() > 0)
+        {
+            std::this_thread::sleep_for(backoff);
+            backoff = std::min(backoff * 2, policy.maxBackoff);
+        }
+        else
+        {
+            backoff = policy.backoff;
+        }
+    }
+}
+
+
+// Says the bus on adapterNumber can be cleared through lines, from now on
+void setI2cBusLines(unsigned int adapterNumber, const I2cBusLines &lines);
+
+// Frees a bus a slave is holding SDA low on (e.g. it was reset or glitched
+// part way through sending a byte) by clocking SCL through lines until the
+// slave lets go, at most 9 times, then sending a STOP. False with errno set
+// if the lines couldn't be driven or SDA is still held low afterwards.
+bool clearI2cBus(const I2cBusLines &lines);
+
+// Clears the bus on adapterNumber if it has lines set, true if it has none
+bool recoverI2cBus(unsigned int adapterNumber);
+
+
+// This class is how many failures something is allowed within a window of
+// time. spend counts one and says whether that is still within the budget,
+// once it isn't the failures are no longer glitches worth retrying and
+// something should be done about them (e.g. recovering the bus). The window
+// starts over after it ends or the budget runs out.
+// spend should be called from one thread, the counts can be read from any.
+class ErrorBudget
+{
+    public:
+        ErrorBudget(unsigned int allowed, std::chrono::nanoseconds window);
+        bool spend(void);
+        uint64_t failures(void) const;
+        uint64_t exhausted(void) const;  // Times the budget ran out
+    private:
+        ErrorBudget(const ErrorBudget &);
+        ErrorBudget &operator=(const ErrorBudget &);
+        unsigned int m_allowed;
+        uint64_t m_window;
+        uint64_t m_windowStart;
+        unsigned int m_spent;  // In the current window
+        std::atomic<uint64_t> m_failures;
+        std::atomic<uint64_t> m_exhausted;
+};
+
+#endif
@@ -0,0 +1,375 @@
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <math.h>
+#include <sstream>
+#include <string>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "imu-calibration.hpp"
+
+
+// Magnetometer fit: what it starts from (a 0.5 gauss sphere at the origin)
+// and how sure of that it is, how slowly it forgets (a reading's weight
+// halves every ~7000 after it) and the most its covariance may grow to by
+// forgetting
+constexpr double MAG_INITIAL_RADIUS = 0.5;
+constexpr double MAG_INITIAL_VARIANCE = 100.0;
+constexpr double MAG_FORGETTING = 0.9999;
+constexpr double MAG_MAX_TRACE = 6 * MAG_INITIAL_VARIANCE;
+
+// When a magnetometer fit is believed: after this many readings, spanning at
+// least this much of the ellipsoid's diameter on every axis, with radii
+// (gauss) in this range and no more than this far from round
+constexpr uint64_t MAG_MIN_READINGS = 200;
+constexpr double MAG_MIN_SPAN = 0.75;
+constexpr double MAG_MIN_RADIUS = 0.1;
+constexpr double MAG_MAX_RADIUS = 1.5;
+constexpr double MAG_MAX_ECCENTRICITY = 1.5;  // Longest radius over shortest
+
+// Gyro stillness: the moving average's weight on each new sample, the most
+// the variances (degrees per second squared, summed over the axes) can add
+// up to, how far from 1 g the accelerometer can be, how many samples in a
+// row that has to hold and how far from the estimate (degrees per second)
+// the gyro can read once there is one
+constexpr double GYRO_AVERAGE_WEIGHT = 1.0 / 32;
+constexpr double GYRO_STILL_VARIANCE = 1.0;
+constexpr double GYRO_STILL_ACCEL = 0.05;
+constexpr unsigned int GYRO_STILL_SAMPLES = 64;
+constexpr double GYRO_STILL_RATE = 2.0;
+
+// Gyro bias estimate: how sure it starts out (not at all), how slowly it
+// forgets and how many still samples make an estimate
+constexpr double GYRO_INITIAL_VARIANCE = 1e6;
+constexpr double GYRO_FORGETTING = 0.9995;
+constexpr uint64_t GYRO_MIN_SAMPLES = 200;
+
+// Names of the lines in a calibration file
+constexpr const char *GYRO_LINE = "gyro";
+constexpr const char *MAG_LINE = "mag";
+
+constexpr unsigned int MagnetometerCalibrator::PARAMETERS;
+
+
+// One line of a calibration file, the name then scale and bias x y z
+static void writeAxisCalibration(std::ostream &os, const char *name, const AxisCalibration &calibration)
+{
+    os << name;
+    for (unsigned int axis = 0; axis < 3; ++axis)
+    {
+        os << " " << calibration.scale[axis];
+    }
+    for (unsigned int axis = 0; axis < 3; ++axis)
+    {
+        os << " " << calibration.bias[axis];
+    }
+    os << std::endl;
+}
+
+
+bool loadImuCalibration(const std::string &filename, ImuCalibration &calibration)
+{
+    std::ifstream file(filename);
+    if (!file)
+    {
+        std::cerr << "Could not open " << filename << std::endl;
+        return false;
+    }
+
+    bool gyro = false;
+    bool mag = false;
+    std::string line;
+    unsigned int lineNumber = 0;
+    while (std::getline(file, line))
+    {
+        ++lineNumber;
+        std::istringstream fields(line.substr(0, line.find('#')));
+        std::string name, extra;
+        if (!(fields >> name))
+        {
+            continue;
+        }
+        AxisCalibration axes;
+        bool valid = (name == GYRO_LINE || name == MAG_LINE);
+        for (unsigned int axis = 0; valid && axis < 3; ++axis)
+        {
+            valid = static_cast<bool>(fields >> axes.scale[axis]);
+        }
+        for (unsigned int axis = 0; valid && axis < 3; ++axis)
+        {
+            valid = static_cast<bool>(fields >> axes.bias[axis]);
+        }
+        if (!valid || (fields >> extra))
+        {
+            std::cerr << filename << ":" << lineNumber << ": expected \"<" << GYRO_LINE << " or " << MAG_LINE
+                      << "> <scale x y z> <bias x y z>\"" << std::endl;
+            return false;
+        }
+        if (name == GYRO_LINE)
+        {
+            calibration.gyro = axes;
+            gyro = true;
+        }
+        else
+        {
+            calibration.mag = axes;
+            mag = true;
+        }
+    }
+    if (!gyro || !mag)
+    {
+        std::cerr << filename << ": needs a " << GYRO_LINE << " and a " << MAG_LINE << " line" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+
+bool saveImuCalibration(const std::string &filename, const ImuCalibration &calibration)
+{
+    // Enough digits that every float reads back the same
+    std::ostringstream os;
+    os << std::setprecision(9)
+       << "# lsm9ds1 calibration, value = count * scale + bias: name, scale x y z, bias x y z" << std::endl;
+    writeAxisCalibration(os, GYRO_LINE, calibration.gyro);
+    writeAxisCalibration(os, MAG_LINE, calibration.mag);
+    std::string text = os.str();
+
+    // Synced before the rename so a power cut leaves the old file or the
+    // new one, never an empty one
+    std::string temporary = filename + ".tmp";
+    int file = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (file < 0)
+    {
+        return false;
+    }
+    bool written = write(file, text.data(), text.size()) == static_cast<ssize_t>(text.size()) &&
+                   fsync(file) == 0;
+    int error = errno;
+    close(file);
+    if (!written || rename(temporary.c_str(), filename.c_str()) < 0)
+    {
+        error = written ? errno : error;
+        unlink(temporary.c_str());
+        errno = error;
+        return false;
+    }
+    return true;
+}
+
+
+MagnetometerCalibrator::MagnetometerCalibrator(const AxisCalibration &base)
+    : m_base(base)
+{
+    reset();
+}
+
+
+void MagnetometerCalibrator::reset(void)
+{
+    double sphere = 1.0 / (MAG_INITIAL_RADIUS * MAG_INITIAL_RADIUS);
+    for (unsigned int i = 0; i < PARAMETERS; ++i)
+    {
+        m_theta[i] = i < 3 ? sphere : 0.0;
+        for (unsigned int j = 0; j < PARAMETERS; ++j)
+        {
+            m_p[i][j] = i == j ? MAG_INITIAL_VARIANCE : 0.0;
+        }
+    }
+    for (unsigned int axis = 0; axis < 3; ++axis)
+    {
+        m_min[axis] = HUGE_VAL;
+        m_max[axis] = -HUGE_VAL;
+    }
+    m_count = 0;
+}
+
+
+void MagnetometerCalibrator::update(const int16_t raw[3])
+{
+    double m[3];
+    for (unsigned int axis = 0; axis < 3; ++axis)
+    {
+        m[axis] = raw[axis] * static_cast<double>(m_base.scale[axis]) + m_base.bias[axis];
+        m_min[axis] = m[axis] < m_min[axis] ? m[axis] : m_min[axis];
+        m_max[axis] = m[axis] > m_max[axis] ? m[axis] : m_max[axis];
+    }
+    const double phi[PARAMETERS] = { m[0] * m[0], m[1] * m[1], m[2] * m[2], m[0], m[1], m[2] };
+
+    // Gain k = P phi / (lambda + phi' P phi), P is symmetric so P phi is
+    // also phi' P
+    double pPhi[PARAMETERS];
+    double trace = 0.0;
+    double error = 1.0;
+    for (unsigned int i = 0; i < PARAMETERS; ++i)
+    {
+        pPhi[i] = 0.0;
+        for (unsigned int j = 0; j < PARAMETERS; ++j)
+        {
+            pPhi[i] += m_p[i][j] * phi[j];
+        }
+        trace += m_p[i][i];
+        error -= m_theta[i] * phi[i];
+    }
+    double forgetting = trace < MAG_MAX_TRACE ? MAG_FORGETTING : 1.0;
+    double denominator = forgetting;
+    for (unsigned int i = 0; i < PARAMETERS; ++i)
+    {
+        denominator += phi[i] * pPhi[i];
+    }
+
+    // theta += k error, P = (P - k phi' P) / lambda, the products worked out
+    // the same way round either side of the diagonal so P stays symmetric
+    for (unsigned int i = 0; i < PARAMETERS; ++i)
+    {
+        m_theta[i] += pPhi[i] / denominator * error;
+        for (unsigned int j = 0; j < PARAMETERS; ++j)
+        {
+            m_p[i][j] = (m_p[i][j] - pPhi[i] * pPhi[j] / denominator) / forgetting;
+        }
+    }
+    ++m_count;
+}
+
+
+bool MagnetometerCalibrator::calibration(AxisCalibration &result) const
+{
+    if (m_count < MAG_MIN_READINGS)
+    {
+        return false;
+    }
+
+    // Completing the square, a (x - cx)^2 + b (y - cy)^2 + c (z - cz)^2 = k
+    double centre[3];
+    double k = 1.0;
+    for (unsigned int axis = 0; axis < 3; ++axis)
+    {
+        if (!(m_theta[axis] > 0.0))
+        {
+            return false;
+        }
+        centre[axis] = -m_theta[axis + 3] / (2.0 * m_theta[axis]);
+        k += m_theta[axis] * centre[axis] * centre[axis];
+    }
+    double radius[3];
+    double shortest = HUGE_VAL;
+    double longest = 0.0;
+    for (unsigned int axis = 0; axis < 3; ++axis)
+    {
+        radius[axis] = sqrt(k / m_theta[axis]);
+        shortest = radius[axis] < shortest ? radius[axis] : shortest;
+        longest = radius[axis] > longest ? radius[axis] : longest;
+        if (m_max[axis] - m_min[axis] < MAG_MIN_SPAN * 2.0 * radius[axis])
+        {
+            return false;
+        }
+    }
+    if (shortest < MAG_MIN_RADIUS || longest > MAG_MAX_RADIUS || longest > MAG_MAX_ECCENTRICITY * shortest)
+    {
+        return false;
+    }
+
+    // Every axis scaled to the mean radius, so the field keeps its strength
+    double mean = cbrt(radius[0] * radius[1] * radius[2]);
+    for (unsigned int axis = 0; axis < 3; ++axis)
+    {
+        double gain = mean / radius[axis];
+        result.scale[axis] = static_cast<float>(m_base.scale[axis] * gain);
+        result.bias[axis] = static_cast<float>((m_base.bias[axis] - centre[axis]) * gain);
+    }
+    return true;
+}
+
+
+uint64_t MagnetometerCalibrator::count(void) const
+{
+    return m_count;
+}
+
+
+GyroBiasCalibrator::GyroBiasCalibrator(const AxisCalibration &base)
+    : m_base(base)
+{
+    reset();
+}
+
+
+void GyroBiasCalibrator::reset(void)
+{
+    for (unsigned int axis = 0; axis < 3; ++axis)
+    {
+        m_mean[axis] = 0.0;
+        m_variance[axis] = 0.0;
+        m_bias[axis] = 0.0;
+    }
+    m_primed = false;
+    m_stillFor = 0;
+    m_p = GYRO_INITIAL_VARIANCE;
+    m_count = 0;
+}
+
+
+void GyroBiasCalibrator::update(const int16_t gyro[3], const float accel[3])
+{
+    double g[3];
+    double variance = 0.0;
+    double offset = 0.0;  // From the estimate, squared
+    for (unsigned int axis = 0; axis < 3; ++axis)
+    {
+        g[axis] = gyro[axis] * static_cast<double>(m_base.scale[axis]) + m_base.bias[axis];
+        if (!m_primed)
+        {
+            m_mean[axis] = g[axis];
+        }
+        double difference = g[axis] - m_mean[axis];
+        m_mean[axis] += GYRO_AVERAGE_WEIGHT * difference;
+        m_variance[axis] += GYRO_AVERAGE_WEIGHT * (difference * difference - m_variance[axis]);
+        variance += m_variance[axis];
+        offset += (g[axis] - m_bias[axis]) * (g[axis] - m_bias[axis]);
+    }
+    m_primed = true;
+
+    double gravity = sqrt(accel[0] * accel[0] + accel[1] * accel[1] + accel[2] * accel[2]);
+    bool still = variance < GYRO_STILL_VARIANCE && fabs(gravity - 1.0) < GYRO_STILL_ACCEL &&
+                 (m_count < GYRO_MIN_SAMPLES || offset < GYRO_STILL_RATE * GYRO_STILL_RATE);
+    m_stillFor = still ? m_stillFor + 1 : 0;
+    if (m_stillFor < GYRO_STILL_SAMPLES)
+    {
+        return;
+    }
+
+    // Recursive least squares on a constant: the regressor is 1, so the gain
+    // is the same for every axis
+    double gain = m_p / (GYRO_FORGETTING + m_p);
+    for (unsigned int axis = 0; axis < 3; ++axis)
+    {
+        m_bias[axis] += gain * (g[axis] - m_bias[axis]);
+    }
+    m_p = (1.0 - gain) * m_p / GYRO_FORGETTING;
+    ++m_count;
+}
+
+
+bool GyroBiasCalibrator::calibration(AxisCalibration &result) const
+{
+    if (m_count < GYRO_MIN_SAMPLES)
+    {
+        return false;
+    }
+    result = m_base;
+    for (unsigned int axis = 0; axis < 3; ++axis)
+    {
+        result.bias[axis] = static_cast<float>(m_base.bias[axis] - m_bias[axis]);
+    }
+    return true;
+}
+
+
+uint64_t GyroBiasCalibrator::count(void) const
+{
+    return m_count;
+}
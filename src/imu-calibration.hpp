@@ -0,0 +1,108 @@
+#ifndef IMU_CALIBRATION_HPP
+#define IMU_CALIBRATION_HPP
+
+#include <stdint.h>
+#include <string>
+
+#include "batch-decoder.hpp"
+
+
+// What an lsm9ds1's gyro and magnetometer counts are turned into degrees per
+// second and gauss with
+struct ImuCalibration
+{
+    public:
+        AxisCalibration gyro;
+        AxisCalibration mag;
+};
+
+
+// Reads a calibration saved by saveImuCalibration, false with a message on
+// stderr if the file can't be opened or doesn't make sense
+bool loadImuCalibration(const std::string &filename, ImuCalibration &calibration);
+
+// Writes calibration to filename as text, replacing any file there in one go
+// (a temporary file renamed over it) so a reader never sees half of one.
+// False with errno set if it couldn't be written.
+bool saveImuCalibration(const std::string &filename, const ImuCalibration &calibration);
+
+
+// This class fits an ellipsoid to magnetometer readings as they come in,
+// for the hard iron offset (its centre) and the soft iron scaling along each
+// axis (its radii), by recursive least squares on
+//   a x^2 + b y^2 + c z^2 + d x + e y + f z = 1
+// Each reading is a fixed amount of work on a 6 x 6 covariance and nothing
+// is stored, so it can run for a whole flight. Old readings are slowly
+// forgotten so the fit follows the magnetic environment changing, unless
+// the readings stop telling it anything new (flying straight and level) in
+// which case forgetting stops rather than letting the covariance blow up.
+// The ellipsoid's axes are taken to line up with the sensor's since that is
+// all an AxisCalibration can correct. A fit is only believed once the
+// readings have spanned most of the field's range on every axis.
+class MagnetometerCalibrator
+{
+    public:
+        // base turns counts into roughly gauss, which the fit is done in
+        explicit MagnetometerCalibrator(const AxisCalibration &base);
+
+        // Adds a reading, raw counts
+        void update(const int16_t raw[3]);
+
+        // The calibration that moves the ellipsoid's centre to zero and
+        // scales each axis so the field has the same strength every way
+        // round, false if there isn't a believable fit yet
+        bool calibration(AxisCalibration &result) const;
+
+        // Readings added since construction or reset()
+        uint64_t count(void) const;
+
+        void reset(void);
+
+    private:
+        static constexpr unsigned int PARAMETERS = 6;
+        AxisCalibration m_base;
+        double m_theta[PARAMETERS];
+        double m_p[PARAMETERS][PARAMETERS];
+        double m_min[3];  // Range of the readings on each axis
+        double m_max[3];
+        uint64_t m_count;
+};
+
+
+// This class estimates the gyro's bias, what it reads while the sensor is
+// still. The sensor counts as still once the gyro's variance over the last
+// few dozen samples has been small, and the accelerometer has read 1 g, for a
+// while. Once there is an estimate the gyro also has to read close to it,
+// before that a perfectly steady turn can pass for still. Still readings go
+// into a recursive least squares estimate of a constant (a slowly forgetting
+// average), moving ones are ignored. Constant work and memory per sample.
+class GyroBiasCalibrator
+{
+    public:
+        // base turns counts into roughly degrees per second
+        explicit GyroBiasCalibrator(const AxisCalibration &base);
+
+        // Adds a sample, gyro in raw counts and accel in g
+        void update(const int16_t gyro[3], const float accel[3]);
+
+        // base with the bias taken out, false if the sensor hasn't been still
+        // for long enough to say what it is yet
+        bool calibration(AxisCalibration &result) const;
+
+        // Still samples the estimate is made of
+        uint64_t count(void) const;
+
+        void reset(void);
+
+    private:
+        AxisCalibration m_base;
+        double m_mean[3];  // Moving average and variance for spotting stillness
+        double m_variance[3];
+        bool m_primed;  // Whether the moving average has started
+        unsigned int m_stillFor;
+        double m_bias[3];
+        double m_p;
+        uint64_t m_count;
+};
+
+#endif
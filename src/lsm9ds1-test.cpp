@@ -1,23 +1,20 @@
+// Giving "sim" as the adapter runs against a simulated device instead
+#include <array>
+#include <chrono>
 #include <iostream>
+#include <memory>
 #include <string>
 #include <thread>
-#include <vector>
 #include "lsm9ds1.hpp"
+#include "simulated-i2c.hpp"
 
 
-int main(int argc, char **argv)
+template <typename Sensor>
+static void run(Sensor &lsm9ds1)
 {
-    if (argc < 2)
-    {
-        std::cerr << "Please give the i2c adapter number (found using i2cdetect -l)" << std::endl;
-        return 1;
-    }
-    std::string adapter(argv[1]);
-    LSM9DS1 lsm9ds1(stoi(adapter));
-
     for (;;)
     {
-        std::vector<int16_t> accel, gyro, mag;
+        std::array<int16_t, 3> accel, gyro, mag;
         accel = lsm9ds1.getAccel();
         gyro = lsm9ds1.getGyro();
         mag = lsm9ds1.getMag();
@@ -30,6 +27,33 @@ int main(int argc, char **argv)
         std::chrono::seconds timespan(1);
         std::this_thread::sleep_for(timespan);
     }
+}
+
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        std::cerr << "Please give the i2c adapter number (found using i2cdetect -l)" << std::endl;
+        return 1;
+    }
+    std::string adapter(argv[1]);
+    if (adapter == "sim")
+    {
+        std::shared_ptr<LSM9DS1AccelGyroModel> accelGyro = std::make_shared<LSM9DS1AccelGyroModel>();
+        std::shared_ptr<LSM9DS1MagModel> mag = std::make_shared<LSM9DS1MagModel>();
+        accelGyro->setAccel(0, 0, 16384);
+        mag->setMag(1200, -300, 4500);
+        SimulatedBus::adapter(0).attach(0x6A, accelGyro);
+        SimulatedBus::adapter(0).attach(0x1C, mag);
+        SimulatedLSM9DS1 lsm9ds1(0);
+        run(lsm9ds1);
+    }
+    else
+    {
+        LSM9DS1 lsm9ds1(stoi(adapter));
+        run(lsm9ds1);
+    }
 
     return 0;
 }
@@ -6,11 +6,19 @@
 // making the LSB for both XL/G and M 0 when doing i2c addressing.
 
 
+#include <array>
+#include <stdexcept>
 #include <stdint.h>
 #include <sstream>
+#include <string.h>
 
+#include <errno.h>
+
+#include "bus-scheduler.hpp"
 #include "i2c-abstraction.hpp"
 #include "lsm9ds1.hpp"
+#include "metrics.hpp"
+#include "simulated-i2c.hpp"
 
 
 // Register addresses
@@ -20,6 +28,12 @@ constexpr uint8_t WHO_AM_I_M = 0x0F;
 constexpr uint8_t DEVICE_ID_M = 0x3D;
 constexpr uint8_t WHO_AM_I_XLG = 0x0F;
 constexpr uint8_t DEVICE_ID_XLG = 0x68;
+constexpr uint8_t CTRL_REG1_G = 0x10;
+constexpr uint8_t CTRL_REG6_XL = 0x20;
+constexpr uint8_t CTRL_REG3_M = 0x22;
+constexpr uint8_t CTRL_REG9 = 0x23;
+constexpr uint8_t FIFO_CTRL = 0x2E;
+constexpr uint8_t FIFO_SRC = 0x2F;
 constexpr uint8_t OUT_X_L_G = 0x18;
 constexpr uint8_t OUT_X_H_G = 0x19;
 constexpr uint8_t OUT_Y_L_G = 0x1A;
@@ -39,11 +53,60 @@ constexpr uint8_t OUT_Y_H_M = 0x2B;
 constexpr uint8_t OUT_Z_L_M = 0x2C;
 constexpr uint8_t OUT_Z_H_M = 0x2D;
 
+// Register values
+constexpr uint8_t CTRL_REG1_G_ODR_119HZ = 0x60;
+constexpr uint8_t CTRL_REG6_XL_ODR_119HZ = 0x60;
+constexpr uint8_t CTRL_REG3_M_CONTINUOUS = 0x00;
+constexpr uint8_t ODR_SHIFT = 5;  // Same place in CTRL_REG1_G and CTRL_REG6_XL
+constexpr uint8_t CTRL_REG9_FIFO_EN = 0x02;
+constexpr uint8_t FIFO_CTRL_CONTINUOUS = 0xC0;  // FMODE = 110
+
+// Register masks
+constexpr uint8_t FIFO_SRC_OVRN_MASK = 0x40;
+constexpr uint8_t FIFO_SRC_FSS_MASK = 0x3F;  // Number of unread samples
+
+// The magnetometer only moves on to the next register during a read if the
+// sub-address has its MSB set (datasheet 5.1.1), the accelerometer/gyro does
+// it by itself (IF_ADD_INC in CTRL_REG8 is set from power on)
+constexpr uint8_t MAG_AUTO_INCREMENT = 0x80;
+
+// Each FIFO frame is a gyro read then an accelerometer read, two messages each
+constexpr unsigned int FIFO_FRAMES_PER_TRANSACTION = I2cTransaction::MAX_MESSAGES / 4;
+
+constexpr unsigned int LSM9DS1FIFOBATCH::DEPTH;
 
-LSM9DS1::LSM9DS1(const unsigned int adapterNumber) :
-    m_magConn(new I2cAbstraction(adapterNumber, LSM9DS1_M_ADDRESS)),
-    m_xlgConn(new I2cAbstraction(adapterNumber, LSM9DS1_XLG_ADDRESS))
+
+// Scales a sensor's counts by sensitivity on every axis, with no bias
+static AxisCalibration sensitivityCalibration(float sensitivity)
 {
+    AxisCalibration calibration = { { sensitivity, sensitivity, sensitivity }, { 0.0f, 0.0f, 0.0f } };
+    return calibration;
+}
+
+
+// Throws what went wrong along with errno, for the functions that throw
+// rather than return false
+static void throwI2cError(const char *what)
+{
+    std::ostringstream err;
+    err << what << std::endl << strerror(errno);
+    throw std::runtime_error(err.str());
+}
+
+
+template <typename Transport>
+BasicLSM9DS1<Transport>::BasicLSM9DS1(const unsigned int adapterNumber) :
+    m_magConn(new Transport(adapterNumber, LSM9DS1_M_ADDRESS)),
+    m_xlgConn(new Transport(adapterNumber, LSM9DS1_XLG_ADDRESS)),
+    m_odrBits(CTRL_REG1_G_ODR_119HZ),
+    m_fifoEnabled(false),
+    m_accelCalibration(sensitivityCalibration(LSM9DS1_ACCEL_SENSITIVITY)),
+    m_gyroCalibration(sensitivityCalibration(LSM9DS1_GYRO_SENSITIVITY)),
+    m_magCalibration(sensitivityCalibration(LSM9DS1_MAG_SENSITIVITY))
+{
+    // Reading a FIFO frame pops it, so a drain can't be retried
+    m_fifoTransaction.setRepeatable(false);
+
     // Confirm that the device at this address is indeed the LSM9DS1
     uint8_t whoIsThis = m_magConn->readBytes(WHO_AM_I_M, 1)[0];
     if (whoIsThis != DEVICE_ID_M)
@@ -55,7 +118,7 @@ LSM9DS1::LSM9DS1(const unsigned int adapterNumber) :
         throw std::runtime_error(err.str());
     }
     whoIsThis = m_xlgConn->readBytes(WHO_AM_I_XLG, 1)[0];
-    if (whoIsThis != DEVICE_ID_M)
+    if (whoIsThis != DEVICE_ID_XLG)
     {
         std::ostringstream err;
         err << "WHO_AM_I_XLG register contained: " << std::hex
@@ -63,49 +126,340 @@ LSM9DS1::LSM9DS1(const unsigned int adapterNumber) :
             << "Expected: " << std::hex << DEVICE_ID_XLG << std::endl;
         throw std::runtime_error(err.str());
     }
+
+    // Everything powers up in power-down mode, so turn on the gyro and
+    // accelerometer at 119 Hz and put the magnetometer in continuous conversion
+    m_xlgConn->writeByte(CTRL_REG1_G, CTRL_REG1_G_ODR_119HZ);
+    m_xlgConn->writeByte(CTRL_REG6_XL, CTRL_REG6_XL_ODR_119HZ);
+    m_magConn->writeByte(CTRL_REG3_M, CTRL_REG3_M_CONTINUOUS);
+}
+
+
+template <typename Transport>
+std::array<int16_t, 3> BasicLSM9DS1<Transport>::getAccel(void) const
+{
+    return readAxes(*m_xlgConn, OUT_X_L_XL);
+}
+
+
+template <typename Transport>
+std::array<int16_t, 3> BasicLSM9DS1<Transport>::getGyro(void) const
+{
+    return readAxes(*m_xlgConn, OUT_X_L_G);
+}
+
+
+template <typename Transport>
+std::array<int16_t, 3> BasicLSM9DS1<Transport>::getMag(void) const
+{
+    return readAxes(*m_magConn, OUT_X_L_M | MAG_AUTO_INCREMENT);
+}
+
+
+template <typename Transport>
+bool BasicLSM9DS1<Transport>::tryGetMag(std::array<int16_t, 3> &mag) const
+{
+    return tryReadAxes(*m_magConn, OUT_X_L_M | MAG_AUTO_INCREMENT, mag);
+}
+
+
+template <typename Transport>
+std::array<int16_t, 3> BasicLSM9DS1<Transport>::readAxes(const Transport &connection, uint8_t reg)
+{
+    std::array<int16_t, 3> axes;
+    if (!tryReadAxes(connection, reg, axes))
+    {
+        throwI2cError("Could not perform read");
+    }
+    return axes;
+}
+
+
+template <typename Transport>
+bool BasicLSM9DS1<Transport>::tryReadAxes(const Transport &connection, uint8_t reg, std::array<int16_t, 3> &axes)
+{
+    // Each axis is a little endian int16_t, x then y then z
+    uint8_t data[6];
+    if (!connection.tryReadBytes(reg, data, sizeof(data)))
+    {
+        return false;
+    }
+    for (unsigned int axis = 0; axis < 3; ++axis)
+    {
+        axes[axis] = (data[2 * axis + 1] << 8) | data[2 * axis];
+    }
+    return true;
+}
+
+
+template <typename Transport>
+LSM9DS1DATA BasicLSM9DS1<Transport>::getSample(void)
+{
+    LSM9DS1DATA data;
+    if (!tryGetSample(data))
+    {
+        throwI2cError("Could not get a sample");
+    }
+    return data;
+}
+
+
+template <typename Transport>
+bool BasicLSM9DS1<Transport>::tryGetSample(LSM9DS1DATA &data)
+{
+    // Both devices hang off the same adapter so one connection can do it all
+    m_sampleTransaction.clear();
+    unsigned int accelIndex = m_sampleTransaction.read(LSM9DS1_XLG_ADDRESS, OUT_X_L_XL, 6);
+    unsigned int gyroIndex = m_sampleTransaction.read(LSM9DS1_XLG_ADDRESS, OUT_X_L_G, 6);
+    unsigned int magIndex = m_sampleTransaction.read(LSM9DS1_M_ADDRESS, OUT_X_L_M | MAG_AUTO_INCREMENT, 6);
+    if (!m_xlgConn->tryTransfer(m_sampleTransaction))
+    {
+        return false;
+    }
+
+    const uint8_t *accel = m_sampleTransaction.result(accelIndex);
+    const uint8_t *gyro = m_sampleTransaction.result(gyroIndex);
+    const uint8_t *mag = m_sampleTransaction.result(magIndex);
+    uint64_t decodeStart = metricsNow();
+    for (unsigned int axis = 0; axis < 3; ++axis)
+    {
+        data.accel[axis] = (accel[2 * axis + 1] << 8) | accel[2 * axis];
+        data.gyro[axis] = (gyro[2 * axis + 1] << 8) | gyro[2 * axis];
+        data.mag[axis] = (mag[2 * axis + 1] << 8) | mag[2 * axis];
+    }
+    m_metrics.decodeTime.record(metricsNow() - decodeStart);
+    return true;
+}
+
+
+template <typename Transport>
+void BasicLSM9DS1<Transport>::configureFifo(LSM9DS1ODR odr)
+{
+    // With the gyro on, the accelerometer runs at the gyro's rate and every
+    // FIFO slot holds one of each
+    uint8_t odrBits = static_cast<uint8_t>(odr) << ODR_SHIFT;
+    I2cTransaction transaction;
+    transaction.write(LSM9DS1_XLG_ADDRESS, CTRL_REG1_G, odrBits);
+    transaction.write(LSM9DS1_XLG_ADDRESS, CTRL_REG6_XL, odrBits);
+    transaction.write(LSM9DS1_XLG_ADDRESS, CTRL_REG9, CTRL_REG9_FIFO_EN);
+    transaction.write(LSM9DS1_XLG_ADDRESS, FIFO_CTRL, FIFO_CTRL_CONTINUOUS);
+    m_xlgConn->transfer(transaction);
+    m_odrBits = odrBits;
+    m_fifoEnabled = true;
+}
+
+
+template <typename Transport>
+bool BasicLSM9DS1<Transport>::recover(void)
+{
+    // Both connections are on the one adapter, so it is only recovered
+    // once, through the accelerometer and gyro's. The bus being cleared
+    // leaves the magnetometer's connection as good as it was.
+    if (!m_xlgConn->recover())
+    {
+        return false;
+    }
+
+    // Everything the constructor and configureFifo set, in one transaction
+    I2cTransaction transaction;
+    transaction.write(LSM9DS1_XLG_ADDRESS, CTRL_REG1_G, m_odrBits);
+    transaction.write(LSM9DS1_XLG_ADDRESS, CTRL_REG6_XL, m_odrBits);
+    if (m_fifoEnabled)
+    {
+        transaction.write(LSM9DS1_XLG_ADDRESS, CTRL_REG9, CTRL_REG9_FIFO_EN);
+        transaction.write(LSM9DS1_XLG_ADDRESS, FIFO_CTRL, FIFO_CTRL_CONTINUOUS);
+    }
+    transaction.write(LSM9DS1_M_ADDRESS, CTRL_REG3_M, CTRL_REG3_M_CONTINUOUS);
+    return m_xlgConn->tryTransfer(transaction);
+}
+
+
+template <typename Transport>
+LSM9DS1FIFOBATCH BasicLSM9DS1<Transport>::readFifo(void)
+{
+    LSM9DS1FIFOBATCH batch;
+    if (!tryReadFifo(batch))
+    {
+        throwI2cError("Could not read the FIFO");
+    }
+    return batch;
+}
+
+
+template <typename Transport>
+bool BasicLSM9DS1<Transport>::drainFifo(unsigned int &count, bool &overrun, const uint8_t *&gyro,
+                                        const uint8_t *&accel)
+{
+    uint8_t fifoStatus;
+    if (!m_xlgConn->tryReadBytes(FIFO_SRC, &fifoStatus, 1))
+    {
+        return false;
+    }
+    count = fifoStatus & FIFO_SRC_FSS_MASK;
+    overrun = fifoStatus & FIFO_SRC_OVRN_MASK;
+    if (count > LSM9DS1FIFOBATCH::DEPTH)
+    {
+        count = LSM9DS1FIFOBATCH::DEPTH;
+    }
+    if (count == 0)
+    {
+        return true;
+    }
+
+    // The FIFO only moves on to the next slot once OUT_Z_H_XL has been read, so
+    // each frame is its own gyro read then accelerometer read. As many frames
+    // as fit go in each transaction.
+    for (unsigned int first = 0; first < count; first += FIFO_FRAMES_PER_TRANSACTION)
+    {
+        unsigned int frames = count - first;
+        if (frames > FIFO_FRAMES_PER_TRANSACTION)
+        {
+            frames = FIFO_FRAMES_PER_TRANSACTION;
+        }
+        m_fifoTransaction.clear();
+        for (unsigned int frame = 0; frame < frames; ++frame)
+        {
+            m_fifoTransaction.read(LSM9DS1_XLG_ADDRESS, OUT_X_L_G, 6);
+            m_fifoTransaction.read(LSM9DS1_XLG_ADDRESS, OUT_X_L_XL, 6);
+        }
+        if (!m_xlgConn->tryTransfer(m_fifoTransaction))
+        {
+            return false;
+        }
+        for (unsigned int frame = 0; frame < frames; ++frame)
+        {
+            memcpy(m_fifoGyro + 6 * (first + frame), m_fifoTransaction.result(2 * frame), 6);
+            memcpy(m_fifoAccel + 6 * (first + frame), m_fifoTransaction.result(2 * frame + 1), 6);
+        }
+    }
+    gyro = m_fifoGyro;
+    accel = m_fifoAccel;
+    return true;
+}
+
+
+template <typename Transport>
+bool BasicLSM9DS1<Transport>::tryReadFifo(LSM9DS1FIFOBATCH &batch)
+{
+    const uint8_t *gyro;
+    const uint8_t *accel;
+    if (!drainFifo(batch.count, batch.overrun, gyro, accel))
+    {
+        return false;
+    }
+    if (batch.count == 0)
+    {
+        return true;
+    }
+    uint64_t decodeStart = metricsNow();
+    for (unsigned int i = 0; i < batch.count; ++i)
+    {
+        for (unsigned int axis = 0; axis < 3; ++axis)
+        {
+            unsigned int offset = 6 * i + 2 * axis;
+            batch.samples[i].gyro[axis] = (gyro[offset + 1] << 8) | gyro[offset];
+            batch.samples[i].accel[axis] = (accel[offset + 1] << 8) | accel[offset];
+        }
+    }
+    m_metrics.decodeTime.record(metricsNow() - decodeStart);
+    return true;
+}
+
+
+template <typename Transport>
+bool BasicLSM9DS1<Transport>::tryReadFifoScaled(LSM9DS1FIFOSCALED &batch)
+{
+    const uint8_t *gyro;
+    const uint8_t *accel;
+    if (!drainFifo(batch.count, batch.overrun, gyro, accel))
+    {
+        return false;
+    }
+    if (batch.count == 0)
+    {
+        return true;
+    }
+    uint64_t decodeStart = metricsNow();
+    decodeAxes(gyro, batch.count, m_gyroCalibration, batch.gyro);
+    decodeAxes(accel, batch.count, m_accelCalibration, batch.accel);
+    m_metrics.decodeTime.record(metricsNow() - decodeStart);
+    return true;
+}
+
+
+template <typename Transport>
+void BasicLSM9DS1<Transport>::setAccelCalibration(const AxisCalibration &calibration)
+{
+    m_accelCalibration = calibration;
+}
+
+
+template <typename Transport>
+void BasicLSM9DS1<Transport>::setGyroCalibration(const AxisCalibration &calibration)
+{
+    m_gyroCalibration = calibration;
+}
+
+
+template <typename Transport>
+const AxisCalibration &BasicLSM9DS1<Transport>::accelCalibration(void) const
+{
+    return m_accelCalibration;
+}
+
+
+template <typename Transport>
+const AxisCalibration &BasicLSM9DS1<Transport>::gyroCalibration(void) const
+{
+    return m_gyroCalibration;
 }
 
 
-std::vector<int16_t> LSM9DS1::getAccel(void) const
+template <typename Transport>
+void BasicLSM9DS1<Transport>::setMagCalibration(const AxisCalibration &calibration)
 {
-    std::vector<uint8_t> data = m_xlgConn->readBytes(OUT_X_L_XL, 6);
-    int16_t accelerationX, accelerationY, accelerationZ;
-    accelerationX = (data[1] << 8) | data[0];
-    accelerationY = (data[3] << 8) | data[2];
-    accelerationZ = (data[5] << 8) | data[4];
-    std::vector<int16_t> accelData;
-    accelData[0] = accelerationX;
-    accelData[1] = accelerationY;
-    accelData[2] = accelerationZ;
-    return accelData;
+    m_magCalibration = calibration;
 }
 
 
-std::vector<int16_t> LSM9DS1::getGyro(void) const
+template <typename Transport>
+const AxisCalibration &BasicLSM9DS1<Transport>::magCalibration(void) const
 {
-    std::vector<uint8_t> data = m_xlgConn->readBytes(OUT_X_L_G, 6);
-    int16_t rotationX, rotationY, rotationZ;
-    rotationX = (data[1] << 8) | data[0];
-    rotationY = (data[3] << 8) | data[2];
-    rotationZ = (data[5] << 8) | data[4];
-    std::vector<int16_t> gyroData;
-    gyroData[0] = rotationX;
-    gyroData[1] = rotationY;
-    gyroData[2] = rotationZ;
-    return gyroData;
+    return m_magCalibration;
 }
 
 
-std::vector<int16_t> LSM9DS1::getMag(void) const
+template <typename Transport>
+const DriverMetrics &BasicLSM9DS1<Transport>::metrics(void) const
 {
-    std::vector<uint8_t> data = m_magConn->readBytes(OUT_X_L_M, 6);
-    int16_t magX, magY, magZ;
-    magX = (data[1] << 8) | data[0];
-    magY = (data[3] << 8) | data[2];
-    magZ = (data[5] << 8) | data[4];
-    std::vector<int16_t> magData;
-    magData[0] = magX;
-    magData[1] = magY;
-    magData[2] = magZ;
-    return magData;
+    return m_metrics;
 }
+
+
+template <typename Transport>
+double BasicLSM9DS1<Transport>::odrHz(LSM9DS1ODR odr)
+{
+    switch (odr)
+    {
+        case LSM9DS1ODR::ODR_14_9HZ:
+            return 14.9;
+        case LSM9DS1ODR::ODR_59_5HZ:
+            return 59.5;
+        case LSM9DS1ODR::ODR_119HZ:
+            return 119.0;
+        case LSM9DS1ODR::ODR_238HZ:
+            return 238.0;
+        case LSM9DS1ODR::ODR_476HZ:
+            return 476.0;
+        case LSM9DS1ODR::ODR_952HZ:
+            return 952.0;
+    }
+    return 0.0;
+}
+
+
+// The drivers that get built, on a real adapter, on the simulated bus and
+// through a bus scheduler
+template class BasicLSM9DS1<I2cAbstraction>;
+template class BasicLSM9DS1<SimulatedI2c>;
+template class BasicLSM9DS1<ScheduledI2c>;
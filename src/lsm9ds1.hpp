@@ -1,40 +1,191 @@
 // TODO: Add check for data available before getting data
-// TODO: Add some form of filtering for the data
 // TODO: Add some kind of interpretation of the data
 #ifndef LSM9DS1_HPP
 #define LSM9DS1_HPP
 
+#include <array>
 #include <memory>
+#include <stdint.h>
 
+#include "batch-decoder.hpp"
 #include "i2c-abstraction.hpp"
+#include "metrics.hpp"
+
+
+// This struct holds the raw values of all three sensors (x, y, z each)
+struct LSM9DS1DATA
+{
+    public:
+        int16_t accel[3];
+        int16_t gyro[3];
+        int16_t mag[3];
+};
+
+
+// One slot of the accelerometer/gyro FIFO (x, y, z each)
+struct LSM9DS1IMU
+{
+    public:
+        int16_t accel[3];
+        int16_t gyro[3];
+};
+
+
+// Everything drained from the FIFO in one go, oldest sample first.
+// overrun is set if the FIFO filled up and samples were lost since the last
+// drain.
+struct LSM9DS1FIFOBATCH
+{
+    public:
+        static constexpr unsigned int DEPTH = 32;
+        unsigned int count;
+        bool overrun;
+        LSM9DS1IMU samples[DEPTH];
+};
+
+
+// A FIFO batch in physical units (see setAccelCalibration), accel in g and
+// gyro in degrees per second, x y z for each sample, oldest sample first
+struct LSM9DS1FIFOSCALED
+{
+    public:
+        unsigned int count;
+        bool overrun;
+        float accel[LSM9DS1FIFOBATCH::DEPTH * 3];
+        float gyro[LSM9DS1FIFOBATCH::DEPTH * 3];
+};
+
+
+// Sensitivities at the full scales the device is left at: +-2 g, +-245
+// degrees per second and +-4 gauss
+constexpr float LSM9DS1_ACCEL_SENSITIVITY = 0.000061f;  // g per count
+constexpr float LSM9DS1_GYRO_SENSITIVITY = 0.00875f;  // Degrees per second per count
+constexpr float LSM9DS1_MAG_SENSITIVITY = 0.00014f;  // Gauss per count
+
+
+// The magnetometer's axes aren't the accelerometer and gyro's: its x axis
+// points the opposite way (datasheet figure 1), y and z agree. Turns a
+// magnetometer vector, in whatever units, into the accelerometer/gyro frame,
+// which anything fusing the three has to do first.
+inline void magToAccelGyroFrame(const float mag[3], float frame[3])
+{
+    frame[0] = -mag[0];
+    frame[1] = mag[1];
+    frame[2] = mag[2];
+}
+
+
+// Output data rates of the accelerometer and gyro (the value is the ODR bits)
+enum class LSM9DS1ODR : uint8_t
+{
+    ODR_14_9HZ = 1,
+    ODR_59_5HZ = 2,
+    ODR_119HZ = 3,
+    ODR_238HZ = 4,
+    ODR_476HZ = 5,
+    ODR_952HZ = 6
+};
 
 
 // This class represents the LSM9DS1.
-class LSM9DS1
+// Transport is what talks to the bus (see BasicMPL3115A2), LSM9DS1 is the
+// driver for a real adapter, SimulatedLSM9DS1 for a SimulatedBus and
+// ScheduledLSM9DS1 for an adapter shared through its BusScheduler.
+// The get and read functions throw if the bus fails, the try ones return
+// false with errno set instead (see BasicMPL3115A2).
+template <typename Transport>
+class BasicLSM9DS1
 {
     public:
         // Attempts to open the i2c connections at the adapterNumber
-        LSM9DS1(const unsigned int adapterNumber);
+        BasicLSM9DS1(const unsigned int adapterNumber);
 
         // Returns the raw values of acceleration x, y, z
-        // These really need to be filtered (low pass for accelerometer)
-        std::vector<int16_t> getAccel(void) const;
+        // These really need to be filtered (low pass for accelerometer, see
+        // filters.hpp)
+        std::array<int16_t, 3> getAccel(void) const;
 
         // Returns the raw values of angular something something TODO
         // These should be filtered with a high pass filter and error
         // corrected for drift
-        std::vector<int16_t> getGyro(void) const;
+        std::array<int16_t, 3> getGyro(void) const;
 
         // Returns the raw values of magnetic something TODO
-        // These should be filtered TODO
-        std::vector<int16_t> getMag(void) const;
+        // These can be filtered through a FilterPipeline (see filters.hpp)
+        std::array<int16_t, 3> getMag(void) const;
+
+        // Returns the raw values of all three sensors, read in a single
+        // i2c transaction
+        LSM9DS1DATA getSample(void);
+        bool tryGetSample(LSM9DS1DATA &data);
+        bool tryGetMag(std::array<int16_t, 3> &mag) const;
+
+        // Runs the accelerometer and gyro at odr and has them fill the on-chip
+        // FIFO continuously (the oldest sample is dropped when it is full)
+        void configureFifo(LSM9DS1ODR odr);
+
+        // Drains every sample waiting in the FIFO in a single transaction,
+        // configureFifo must have been called first
+        LSM9DS1FIFOBATCH readFifo(void);
+        bool tryReadFifo(LSM9DS1FIFOBATCH &batch);
+
+        // Same as tryReadFifo but decoded straight into physical units with
+        // the calibrations, the whole batch at once (see decodeAxes)
+        bool tryReadFifoScaled(LSM9DS1FIFOSCALED &batch);
+
+        // What tryReadFifoScaled turns counts into units with, the
+        // sensitivities and no bias unless set
+        void setAccelCalibration(const AxisCalibration &calibration);
+        void setGyroCalibration(const AxisCalibration &calibration);
+        const AxisCalibration &accelCalibration(void) const;
+        const AxisCalibration &gyroCalibration(void) const;
+
+        // What magnetometer counts are turned into gauss with (see
+        // calibrateAxes), in the magnetometer's own frame. Fusing the field
+        // with the accelerometer or gyro needs magToAccelGyroFrame after.
+        void setMagCalibration(const AxisCalibration &calibration);
+        const AxisCalibration &magCalibration(void) const;
+
+        // Recovers the bus (see I2cAbstraction::recover), once for both the
+        // accelerometer/gyro and the magnetometer, then configures the device
+        // again, since it may have been reset along with the bus.
+        // False with errno set if either failed.
+        bool recover(void);
+
+        // Samples per second for odr
+        static double odrHz(LSM9DS1ODR odr);
+
+        // Time spent decoding samples (a whole FIFO batch at a time for
+        // readFifo), nothing waits for data ready so waitTime stays empty
+        const DriverMetrics &metrics(void) const;
 
     private:
-        std::unique_ptr<I2cAbstraction> m_magConn;
-        std::unique_ptr<I2cAbstraction> m_xlgConn;
+        std::unique_ptr<Transport> m_magConn;
+        std::unique_ptr<Transport> m_xlgConn;
+        I2cTransaction m_sampleTransaction;
+        I2cTransaction m_fifoTransaction;
+        uint8_t m_fifoGyro[LSM9DS1FIFOBATCH::DEPTH * 6];  // Frames drained from the FIFO, raw
+        uint8_t m_fifoAccel[LSM9DS1FIFOBATCH::DEPTH * 6];
+        DriverMetrics m_metrics;
+        uint8_t m_odrBits;  // What the accelerometer and gyro run at
+        bool m_fifoEnabled;
+        AxisCalibration m_accelCalibration;
+        AxisCalibration m_gyroCalibration;
+        AxisCalibration m_magCalibration;
+        // Reads every sample waiting in the FIFO, leaving gyro and accel
+        // pointing at count frames of each in m_fifoGyro and m_fifoAccel
+        bool drainFifo(unsigned int &count, bool &overrun, const uint8_t *&gyro, const uint8_t *&accel);
+        static std::array<int16_t, 3> readAxes(const Transport &connection, uint8_t reg);
+        static bool tryReadAxes(const Transport &connection, uint8_t reg, std::array<int16_t, 3> &axes);
         //bool isAccelReady(void) const;
         //bool isGyroReady(void) const;
         //bool isMagReady(void) const;
 };
 
+class ScheduledI2c;
+class SimulatedI2c;
+typedef BasicLSM9DS1<I2cAbstraction> LSM9DS1;
+typedef BasicLSM9DS1<SimulatedI2c> SimulatedLSM9DS1;
+typedef BasicLSM9DS1<ScheduledI2c> ScheduledLSM9DS1;
+
 #endif
@@ -0,0 +1,217 @@
+#include <atomic>
+#include <iomanip>
+#include <sstream>
+#include <stdint.h>
+#include <string>
+
+#include "metrics.hpp"
+
+
+constexpr unsigned int LatencySnapshot::BUCKETS;
+
+// Every 7 bit slave address gets its own metrics
+constexpr unsigned int ADDRESS_COUNT = 128;
+
+
+// The bucket a duration is counted in, one per power of two
+static unsigned int bucketFor(uint64_t nanoseconds)
+{
+    unsigned int bucket = 0;
+    while (nanoseconds != 0 && bucket < LatencySnapshot::BUCKETS - 1)
+    {
+        nanoseconds >>= 1;
+        ++bucket;
+    }
+    return bucket;
+}
+
+
+uint64_t LatencySnapshot::percentile(double fraction) const
+{
+    if (count == 0)
+    {
+        return 0;
+    }
+    uint64_t wanted = static_cast<uint64_t>(fraction * count);
+    uint64_t seen = 0;
+    for (unsigned int bucket = 0; bucket < BUCKETS; ++bucket)
+    {
+        seen += buckets[bucket];
+        if (seen > wanted || bucket == BUCKETS - 1)
+        {
+            // Nothing took longer than max, which beats the bucket's bound
+            uint64_t upper = bucket == 0 ? 0 : (1ull << bucket) - 1;
+            return upper < max ? upper : max;
+        }
+    }
+    return max;
+}
+
+
+double LatencySnapshot::mean(void) const
+{
+    return count == 0 ? 0.0 : static_cast<double>(sum) / count;
+}
+
+
+LatencyHistogram::LatencyHistogram(void) :
+    m_sum(0),
+    m_max(0)
+{
+    for (std::atomic<uint64_t> &bucket : m_buckets)
+    {
+        bucket.store(0, std::memory_order_relaxed);
+    }
+}
+
+
+void LatencyHistogram::record(uint64_t nanoseconds)
+{
+    m_buckets[bucketFor(nanoseconds)].fetch_add(1, std::memory_order_relaxed);
+    m_sum.fetch_add(nanoseconds, std::memory_order_relaxed);
+    uint64_t max = m_max.load(std::memory_order_relaxed);
+    while (nanoseconds > max && !m_max.compare_exchange_weak(max, nanoseconds, std::memory_order_relaxed))
+    {
+    }
+}
+
+
+LatencySnapshot LatencyHistogram::snapshot(void) const
+{
+    // The count is worked out from the buckets, which keeps it consistent
+    // with them even though recording carries on while they are read
+    LatencySnapshot snapshot;
+    snapshot.count = 0;
+    for (unsigned int bucket = 0; bucket < LatencySnapshot::BUCKETS; ++bucket)
+    {
+        snapshot.buckets[bucket] = m_buckets[bucket].load(std::memory_order_relaxed);
+        snapshot.count += snapshot.buckets[bucket];
+    }
+    snapshot.sum = m_sum.load(std::memory_order_relaxed);
+    snapshot.max = m_max.load(std::memory_order_relaxed);
+    return snapshot;
+}
+
+
+I2cDeviceMetrics::I2cDeviceMetrics(void) :
+    m_bytesRead(0),
+    m_bytesWritten(0),
+    m_errors(0),
+    m_retries(0)
+{
+}
+
+
+void I2cDeviceMetrics::recordTransaction(uint64_t nanoseconds)
+{
+    m_ioctlTime.record(nanoseconds);
+}
+
+
+void I2cDeviceMetrics::recordBytes(uint64_t read, uint64_t written)
+{
+    if (read != 0)
+    {
+        m_bytesRead.fetch_add(read, std::memory_order_relaxed);
+    }
+    if (written != 0)
+    {
+        m_bytesWritten.fetch_add(written, std::memory_order_relaxed);
+    }
+}
+
+
+void I2cDeviceMetrics::recordError(void)
+{
+    m_errors.fetch_add(1, std::memory_order_relaxed);
+}
+
+
+void I2cDeviceMetrics::recordRetry(void)
+{
+    m_retries.fetch_add(1, std::memory_order_relaxed);
+}
+
+
+I2cDeviceSnapshot I2cDeviceMetrics::snapshot(void) const
+{
+    I2cDeviceSnapshot snapshot;
+    snapshot.bytesRead = m_bytesRead.load(std::memory_order_relaxed);
+    snapshot.bytesWritten = m_bytesWritten.load(std::memory_order_relaxed);
+    snapshot.errors = m_errors.load(std::memory_order_relaxed);
+    snapshot.retries = m_retries.load(std::memory_order_relaxed);
+    snapshot.ioctlTime = m_ioctlTime.snapshot();
+    snapshot.transactions = snapshot.ioctlTime.count;
+    return snapshot;
+}
+
+
+I2cDeviceMetrics &i2cDeviceMetrics(uint8_t deviceAddress)
+{
+    // Built before main runs so recording never has to check
+    static I2cDeviceMetrics metrics[ADDRESS_COUNT];
+    return metrics[deviceAddress % ADDRESS_COUNT];
+}
+
+
+std::string formatLatency(const LatencySnapshot &snapshot)
+{
+    std::ostringstream os;
+    os << std::fixed << std::setprecision(1)
+       << "count: " << snapshot.count
+       << " mean: " << snapshot.mean() / 1000.0
+       << " p50: " << snapshot.percentile(0.5) / 1000.0
+       << " p99: " << snapshot.percentile(0.99) / 1000.0
+       << " p999: " << snapshot.percentile(0.999) / 1000.0
+       << " max: " << snapshot.max / 1000.0 << " us";
+    return os.str();
+}
+
+
+std::string formatHistogram(const LatencySnapshot &snapshot)
+{
+    std::ostringstream os;
+    os << std::fixed << std::setprecision(1);
+    for (unsigned int bucket = 0; bucket < LatencySnapshot::BUCKETS; ++bucket)
+    {
+        if (snapshot.buckets[bucket] == 0)
+        {
+            continue;
+        }
+        // The last bucket has no upper bound, only the one of the bucket before
+        if (bucket == LatencySnapshot::BUCKETS - 1)
+        {
+            os << "> " << ((1ull << (bucket - 1)) - 1) / 1000.0;
+        }
+        else
+        {
+            os << "<= " << (bucket == 0 ? 0 : (1ull << bucket) - 1) / 1000.0;
+        }
+        os << " us: " << snapshot.buckets[bucket] << std::endl;
+    }
+    return os.str();
+}
+
+
+std::string formatI2cMetrics(void)
+{
+    std::ostringstream os;
+    for (unsigned int address = 0; address < ADDRESS_COUNT; ++address)
+    {
+        I2cDeviceSnapshot snapshot = i2cDeviceMetrics(address).snapshot();
+        if (snapshot.transactions == 0 && snapshot.bytesRead == 0 && snapshot.bytesWritten == 0 &&
+            snapshot.errors == 0)
+        {
+            continue;
+        }
+        os << "i2c 0x" << std::hex << std::setw(2) << std::setfill('0') << address
+           << std::dec << std::setfill(' ')
+           << " transactions: " << snapshot.transactions
+           << " read: " << snapshot.bytesRead
+           << " written: " << snapshot.bytesWritten
+           << " errors: " << snapshot.errors
+           << " retries: " << snapshot.retries
+           << " ioctl " << formatLatency(snapshot.ioctlTime) << std::endl;
+    }
+    return os.str();
+}
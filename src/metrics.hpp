@@ -0,0 +1,123 @@
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <atomic>
+#include <chrono>
+#include <stdint.h>
+#include <string>
+
+
+// Everything a LatencyHistogram had counted at one point in time, all times
+// are in nanoseconds
+struct LatencySnapshot
+{
+    public:
+        static constexpr unsigned int BUCKETS = 40;
+        uint64_t count;
+        uint64_t sum;
+        uint64_t max;
+        uint64_t buckets[BUCKETS];
+
+        // Upper bound of the bucket that fraction (e.g. 0.99) of the
+        // durations fall under, 0 if nothing was recorded
+        uint64_t percentile(double fraction) const;
+        double mean(void) const;
+};
+
+
+// This class counts durations into fixed buckets, one per power of two
+// nanoseconds (bucket 0 is 0 ns, bucket i is [2^(i-1), 2^i) ns, the last
+// bucket takes everything longer). Recording is two relaxed atomic adds (the
+// count comes from the buckets) and, only while the duration is a new
+// maximum, a compare-exchange loop on the max. So it is lock-free and cheap
+// enough to leave on in the hot path, and any thread can take a snapshot while
+// others record.
+class LatencyHistogram
+{
+    public:
+        LatencyHistogram(void);
+        void record(uint64_t nanoseconds);
+        LatencySnapshot snapshot(void) const;
+    private:
+        LatencyHistogram(const LatencyHistogram &);
+        LatencyHistogram &operator=(const LatencyHistogram &);
+        std::atomic<uint64_t> m_sum;
+        std::atomic<uint64_t> m_max;
+        std::atomic<uint64_t> m_buckets[LatencySnapshot::BUCKETS];
+};
+
+
+// What an I2cDeviceMetrics had counted at one point in time
+struct I2cDeviceSnapshot
+{
+    public:
+        uint64_t transactions;
+        uint64_t bytesRead;
+        uint64_t bytesWritten;
+        uint64_t errors;
+        uint64_t retries;
+        LatencySnapshot ioctlTime;
+};
+
+
+// This class counts the bus traffic for one slave address. Transactions,
+// errors, retries and their time are counted against the device whose
+// connection started them, the bytes against the device each message was
+// for (a transaction can have messages for several devices).
+// Like LatencyHistogram, recording is lock-free.
+class I2cDeviceMetrics
+{
+    public:
+        I2cDeviceMetrics(void);
+        void recordTransaction(uint64_t nanoseconds);
+        void recordBytes(uint64_t read, uint64_t written);
+        void recordError(void);
+        void recordRetry(void);
+        I2cDeviceSnapshot snapshot(void) const;
+    private:
+        I2cDeviceMetrics(const I2cDeviceMetrics &);
+        I2cDeviceMetrics &operator=(const I2cDeviceMetrics &);
+        std::atomic<uint64_t> m_bytesRead;
+        std::atomic<uint64_t> m_bytesWritten;
+        std::atomic<uint64_t> m_errors;
+        std::atomic<uint64_t> m_retries;
+        LatencyHistogram m_ioctlTime;
+};
+
+
+// The metrics for the device at deviceAddress (7 bit), shared by every
+// connection to that address in the program (on any adapter)
+I2cDeviceMetrics &i2cDeviceMetrics(uint8_t deviceAddress);
+
+
+// Time a driver spent waiting for its device to have data ready, and
+// decoding the raw data once it did
+struct DriverMetrics
+{
+    public:
+        LatencyHistogram waitTime;
+        LatencyHistogram decodeTime;
+};
+
+
+// Nanoseconds on the steady clock, for timing what gets recorded
+inline uint64_t metricsNow(void)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+// A single line like "count: N mean: M p50: A p99: B p999: C max: D" in
+// microseconds
+std::string formatLatency(const LatencySnapshot &snapshot);
+
+// The whole histogram, a line for every bucket anything was counted in like
+// "<= 15.9 us: N" (the bucket's upper bound)
+std::string formatHistogram(const LatencySnapshot &snapshot);
+
+// One line per address that has seen any traffic, like
+// "i2c 0x60 transactions: N ... ioctl count: ..."
+std::string formatI2cMetrics(void);
+
+#endif
@@ -1,30 +1,19 @@
 // This either prints the data read from the MPL3115A2 to stdout or to
 // a file (indicated by the command line arguments provided)
+// Giving "sim" as the adapter runs against a simulated device instead
 #include <chrono>
 #include <fstream>
 #include <iostream>
+#include <memory>
 #include <string>
 #include <thread>
 #include "mpl3115a2.hpp"
+#include "simulated-i2c.hpp"
 
 
-int main(int argc, char **argv)
+template <typename Sensor>
+static void run(Sensor &mpl3115a2, bool logToFile, char *filename)
 {
-    bool logToFile = false;
-    char *filename = nullptr;
-    if (argc < 2)
-    {
-        std::cerr << "Please give the i2c adapter number (found using i2cdetect -l)" << std::endl;
-        return 1;
-    }
-    else if (argc == 3)
-    {
-        logToFile = true;
-        filename = argv[2];
-    }
-    std::string adapter(argv[1]);
-    MPL3115A2 mpl3115a2(stoi(adapter));
-
     if (logToFile)
     {
         std::ofstream file(filename);
@@ -49,6 +38,35 @@ int main(int argc, char **argv)
             std::this_thread::sleep_for(timespan);
         }
     }
+}
+
+
+int main(int argc, char **argv)
+{
+    bool logToFile = false;
+    char *filename = nullptr;
+    if (argc < 2)
+    {
+        std::cerr << "Please give the i2c adapter number (found using i2cdetect -l)" << std::endl;
+        return 1;
+    }
+    else if (argc == 3)
+    {
+        logToFile = true;
+        filename = argv[2];
+    }
+    std::string adapter(argv[1]);
+    if (adapter == "sim")
+    {
+        SimulatedBus::adapter(0).attach(0x60, std::make_shared<MPL3115A2Model>());
+        SimulatedMPL3115A2 mpl3115a2(0);
+        run(mpl3115a2, logToFile, filename);
+    }
+    else
+    {
+        MPL3115A2 mpl3115a2(stoi(adapter));
+        run(mpl3115a2, logToFile, filename);
+    }
 
     return 0;
 }
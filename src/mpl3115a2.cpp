@@ -1,4 +1,6 @@
+#include <array>
 #include <chrono>
+#include <initializer_list>
 #include <iostream>
 #include <memory>
 #include <sstream>
@@ -7,18 +9,35 @@
 #include <string>
 #include <string.h>
 #include <thread>
-#include <vector>
+#include <utility>
 
+#include <errno.h>
+
+#include "barometric.hpp"
+#include "bus-scheduler.hpp"
+#include "i2c-abstraction.hpp"
+#include "metrics.hpp"
 #include "mpl3115a2.hpp"
+#include "simulated-i2c.hpp"
+
 
+template <typename Transport>
+constexpr unsigned int BasicMPL3115A2<Transport>::DATA_SIZE;
 
 // Register addresses
 constexpr uint8_t MPL3115A2_ADDRESS = 0x60;
 constexpr uint8_t STATUS = 0x00;
 constexpr uint8_t DATA_READY = 0x06;
 constexpr uint8_t WHO_AM_I = 0x0C;
+constexpr uint8_t F_STATUS = 0x0D;
+constexpr uint8_t F_DATA = 0x0E;
+constexpr uint8_t F_SETUP = 0x0F;
 constexpr uint8_t PT_DATA_CFG = 0x13;
 constexpr uint8_t CTRL_REG1 = 0x26;
+constexpr uint8_t CTRL_REG2 = 0x27;
+constexpr uint8_t CTRL_REG3 = 0x28;
+constexpr uint8_t CTRL_REG4 = 0x29;
+constexpr uint8_t CTRL_REG5 = 0x2A;
 constexpr uint8_t PRESSURE_MSB = 0x01;
 constexpr uint8_t PRESSURE_CSB = 0x02;
 constexpr uint8_t PRESSURE_LSB = 0x03;
@@ -37,13 +56,53 @@ constexpr uint8_t PT_DATA_CFG_PDEFE_MASK  = 0x02;
 constexpr uint8_t STATUS_TDR_MASK = 0x02;
 constexpr uint8_t STATUS_PDR_MASK =  0x04;
 constexpr uint8_t STATUS_PTDR_MASK = 0x08;
+constexpr uint8_t CTRL_REG1_OS_MASK = 0x38;
+constexpr uint8_t CTRL_REG1_OS_SHIFT = 3;
+constexpr uint8_t CTRL_REG2_ST_MASK = 0x0F;
+constexpr uint8_t F_STATUS_F_OVF_MASK = 0x80;
+constexpr uint8_t F_STATUS_F_CNT_MASK = 0x3F;
+constexpr uint8_t CTRL_REG4_INT_EN_DRDY_MASK = 0x80;
+constexpr uint8_t CTRL_REG5_INT_CFG_DRDY_MASK = 0x80;  // Set routes data ready to INT1, clear to INT2
+
+// Register values
+constexpr uint8_t CTRL_REG3_ACTIVE_LOW_PUSH_PULL = 0x00;
+constexpr uint8_t F_SETUP_DISABLED = 0x00;
+constexpr uint8_t F_SETUP_CIRCULAR = 0x40;  // F_MODE = 01, oldest sample dropped when full
+constexpr uint8_t MAX_TIME_STEP = 15;
+
+// Minimum time a conversion takes for each oversample ratio (OS bits), in ms
+constexpr double CONVERSION_TIME_MS[] = { 6, 10, 18, 34, 66, 130, 258, 512 };
+
+constexpr unsigned int MPL3115A2FIFOBATCH::DEPTH;
+
+// How long to wait on a data ready interrupt before checking the status
+// register anyways, in case an edge was missed
+constexpr int DATA_READY_TIMEOUT_MS = 2000;
+
 
+// Throws what went wrong along with errno, for the functions that throw
+// rather than return false
+static void throwI2cError(const char *what)
+{
+    std::ostringstream err;
+    err << what << std::endl << strerror(errno);
+    throw std::runtime_error(err.str());
+}
 
-MPL3115A2::MPL3115A2(const unsigned int adapterNumber) :
-    m_connection(new I2cAbstraction(adapterNumber, MPL3115A2_ADDRESS))
+
+template <typename Transport>
+BasicMPL3115A2<Transport>::BasicMPL3115A2(const unsigned int adapterNumber) :
+    m_connection(new Transport(adapterNumber, MPL3115A2_ADDRESS)),
+    m_oversample(MPL3115A2OVERSAMPLE::OS_1),
+    m_timeStep(0),
+    m_seaLevelPressure(STANDARD_SEA_LEVEL_PRESSURE),
+    m_registers({ PT_DATA_CFG, CTRL_REG1, CTRL_REG2, CTRL_REG3, CTRL_REG4, CTRL_REG5, F_SETUP })
 {
+    // Reading F_DATA pops the FIFO, so a drain can't be retried
+    m_fifoTransaction.setRepeatable(false);
+
     // Confirm that the device at this address is indeed the MPL3115A2
-    uint8_t whoIsThis = m_connection->readBytes(WHO_AM_I, 1)[0];
+    uint8_t whoIsThis = readRegister(WHO_AM_I);
     if (whoIsThis != DEVICE_ID)
     {
         std::ostringstream err;
@@ -59,75 +118,189 @@ MPL3115A2::MPL3115A2(const unsigned int adapterNumber) :
     }
 
     configureDataReadyFlag();
-    configureAltimeterMode();
+    configureBarometerMode();
+
+    // Pick up whatever oversampling and time step the device was left with
+    uint8_t controlRegisterData = readRegister(CTRL_REG1);
+    m_oversample = static_cast<MPL3115A2OVERSAMPLE>((controlRegisterData & CTRL_REG1_OS_MASK) >> CTRL_REG1_OS_SHIFT);
+    m_timeStep = readRegister(CTRL_REG2) & CTRL_REG2_ST_MASK;
 }
 
 
-uint8_t MPL3115A2::enterStandbyMode(void) const
+template <typename Transport>
+void BasicMPL3115A2<Transport>::writeConfiguration(std::initializer_list<RegisterWrite> writes, uint8_t controlRegisterData)
 {
-    // Enter standby mode to allow register writing
-    // Return the register data to allow it to be restored to previous state
-    uint8_t controlRegisterData = m_connection->readBytes(CTRL_REG1, 1)[0];
-    m_connection->writeByte(CTRL_REG1, controlRegisterData & ~STANDBY_BAR_MASK);  // Clear standby bar bit
-    return controlRegisterData;
+    // Control registers can only be changed in standby, so the standby-bar
+    // bit gets cleared first (unless it already is)
+    uint8_t currentControlRegisterData = readRegister(CTRL_REG1);
+    bool isActive = currentControlRegisterData & STANDBY_BAR_MASK;
+    I2cTransaction transaction;
+    if (isActive)
+    {
+        transaction.write(MPL3115A2_ADDRESS, CTRL_REG1, currentControlRegisterData & ~STANDBY_BAR_MASK);
+    }
+
+    // Only the writes that change something go out, if nothing does there's
+    // no need to touch the bus at all
+    unsigned int changes = 0;
+    for (const RegisterWrite &write : writes)
+    {
+        if (m_registers.needsWrite(write.reg, write.value))
+        {
+            transaction.write(MPL3115A2_ADDRESS, write.reg, write.value);
+            ++changes;
+        }
+    }
+    if (changes == 0 && currentControlRegisterData == controlRegisterData)
+    {
+        return;
+    }
+
+    // Then the new control register 1 (normally active again) goes last
+    if (isActive)
+    {
+        m_registers.needsWrite(CTRL_REG1, currentControlRegisterData & ~STANDBY_BAR_MASK);
+    }
+    if (m_registers.needsWrite(CTRL_REG1, controlRegisterData))
+    {
+        transaction.write(MPL3115A2_ADDRESS, CTRL_REG1, controlRegisterData);
+    }
+    transfer(transaction);
 }
 
 
-void MPL3115A2::configureAltimeterMode(void)
+template <typename Transport>
+void BasicMPL3115A2<Transport>::configureAltimeterMode(void)
 {
-    // Clear the standby-bar bit to activate standby mode
-    uint8_t controlRegisterData = enterStandbyMode();
-
     // Set the mode to altimeter and set the standby-bar bit to deactivate standby mode
-    m_connection->writeByte(CTRL_REG1, controlRegisterData | ALTIMETER_MASK | STANDBY_BAR_MASK);
+    uint8_t controlRegisterData = readRegister(CTRL_REG1);
+    writeConfiguration({}, controlRegisterData | ALTIMETER_MASK | STANDBY_BAR_MASK);
     isAltimeterMode = true;
     isBarometerMode = false;
 }
 
 
-void MPL3115A2::configureBarometerMode(void)
+template <typename Transport>
+void BasicMPL3115A2<Transport>::configureBarometerMode(void)
 {
-    // Clear the standby-bar bit to activate standby mode
-    uint8_t controlRegisterData = enterStandbyMode();
-
     // Set the mode to barometer and set the standby-bar bit to deactivate standby mode
-    m_connection->writeByte(CTRL_REG1, (controlRegisterData & ~ALTIMETER_MASK) | STANDBY_BAR_MASK);
+    uint8_t controlRegisterData = readRegister(CTRL_REG1);
+    writeConfiguration({}, (controlRegisterData & ~ALTIMETER_MASK) | STANDBY_BAR_MASK);
     isAltimeterMode = false;
     isBarometerMode = true;
 }
 
 
-void MPL3115A2::configureDataReadyFlag(void) const
+template <typename Transport>
+void BasicMPL3115A2<Transport>::configureDataReadyFlag(void)
 {
-    // Clear the standby-bar bit to activate standby mode
+    // Configure the sensor data register to raise a status flag when any new data is available
     // Entering standby mode maybe unnecessary to change this register but we'll do it anyways
-    uint8_t controlRegisterData = enterStandbyMode();
+    uint8_t controlRegisterData = readRegister(CTRL_REG1);
+    writeConfiguration({ { PT_DATA_CFG, PT_DATA_CFG_DREM_MASK | PT_DATA_CFG_TDEFE_MASK | PT_DATA_CFG_PDEFE_MASK } },
+                       controlRegisterData | STANDBY_BAR_MASK);
+}
 
-    // Configure the sensor data register to raise a status flag when any new data is available
-    m_connection->writeByte(PT_DATA_CFG, PT_DATA_CFG_DREM_MASK | PT_DATA_CFG_TDEFE_MASK | PT_DATA_CFG_PDEFE_MASK);
 
-    // Set device back to active mode
-    m_connection->writeByte(CTRL_REG1, controlRegisterData | STANDBY_BAR_MASK);
+template <typename Transport>
+MPL3115A2DATA BasicMPL3115A2<Transport>::getPressure(void)
+{
+    if (!isBarometerMode)
+    {
+        configureBarometerMode();
+    }
+
+    std::array<uint8_t, DATA_SIZE> rawData;
+    if (!waitForData() || !getData(rawData))
+    {
+        throwI2cError("Could not read the pressure");
+    }
+    uint64_t decodeStart = metricsNow();
+    MPL3115A2DATA data;
+    data.pressure = decodePressure(rawData.data());
+    data.temperature = calculateTemperature(rawData[3], rawData[4]);
+    m_metrics.decodeTime.record(metricsNow() - decodeStart);
+    return data;
+}
+
+
+template <typename Transport>
+MPL3115A2DATA BasicMPL3115A2<Transport>::getSample(void)
+{
+    MPL3115A2DATA data;
+    if (!tryGetSample(data))
+    {
+        throwI2cError("Could not get a sample");
+    }
+    return data;
 }
 
 
-MPL3115A2DATA MPL3115A2::getPressure(void)
+template <typename Transport>
+bool BasicMPL3115A2<Transport>::tryGetSample(MPL3115A2DATA &data)
 {
+    // Staying in barometer mode means no mode switch (and the extra
+    // conversion that comes with it), altitude is worked out here instead.
+    // Switching only happens after getAltitude, which throws anyways.
     if (!isBarometerMode)
     {
-        configureBarometerMode();
+        try
+        {
+            configureBarometerMode();
+        }
+        catch (const std::runtime_error &)
+        {
+            errno = EIO;
+            return false;
+        }
     }
 
-    // Poll until there is data available
-    uint8_t status = m_connection->readBytes(STATUS, 1)[0];
-    while (!(status & STATUS_PTDR_MASK))
+    std::array<uint8_t, DATA_SIZE> rawData;
+    if (!waitForData() || !getData(rawData))
     {
-        status = m_connection->readBytes(STATUS, 1)[0];
-        std::chrono::milliseconds timespan(10);
-        std::this_thread::sleep_for(timespan);
+        return false;
     }
+    uint64_t decodeStart = metricsNow();
+    data.pressure = decodePressure(rawData.data());
+    data.altitude = pressureToAltitude(data.pressure, m_seaLevelPressure);
+    data.temperature = calculateTemperature(rawData[3], rawData[4]);
+    m_metrics.decodeTime.record(metricsNow() - decodeStart);
+    return true;
+}
+
+
+template <typename Transport>
+void BasicMPL3115A2<Transport>::setSeaLevelPressure(double pascals)
+{
+    m_seaLevelPressure = pascals;
+}
 
-    std::vector<uint8_t> rawData = getData();
+
+template <typename Transport>
+MPL3115A2DATA BasicMPL3115A2<Transport>::getAltitude(void)
+{
+    if (!isAltimeterMode)
+    {
+        configureAltimeterMode();
+    }
+
+    std::array<uint8_t, DATA_SIZE> rawData;
+    if (!waitForData() || !getData(rawData))
+    {
+        throwI2cError("Could not read the altitude");
+    }
+    uint64_t decodeStart = metricsNow();
+    MPL3115A2DATA data;
+    data.altitude = decodeAltitude(rawData.data());
+    data.temperature = calculateTemperature(rawData[3], rawData[4]);
+    m_metrics.decodeTime.record(metricsNow() - decodeStart);
+    return data;
+}
+
+
+template <typename Transport>
+double BasicMPL3115A2<Transport>::decodePressure(const uint8_t *rawData)
+{
     // Upper two bytes + top two bits in LSB represent the 18 bit unsigned integer portion in Pascals
     // Bits 5-4 of LSB represent fractional portion
     uint8_t MSB = rawData[0];
@@ -147,31 +320,14 @@ MPL3115A2DATA MPL3115A2::getPressure(void)
     fractionalPortion >>= 6;
 
     // Calculate pressure
-    double fraction = LSB / 4.0;
-    double pressure = intPortion + fraction;
-
-    MPL3115A2DATA data;
-    data.pressure = pressure;
-    data.temperature = calculateTemperature(rawData[3], rawData[4]);
-    return data;
+    double fraction = fractionalPortion / 4.0;
+    return intPortion + fraction;
 }
 
 
-MPL3115A2DATA MPL3115A2::getAltitude(void)
+template <typename Transport>
+double BasicMPL3115A2<Transport>::decodeAltitude(const uint8_t *rawData)
 {
-    if (!isAltimeterMode)
-    {
-        configureAltimeterMode();
-    }
-    uint8_t status = m_connection->readBytes(STATUS, 1)[0];
-    while (!(status & STATUS_PTDR_MASK))
-    {
-        status = m_connection->readBytes(STATUS, 1)[0];
-        std::chrono::milliseconds timespan(10);
-        std::this_thread::sleep_for(timespan);
-    }
-
-    std::vector<uint8_t> rawData = getData();
     // MSB and CSB represent signed int portion in meters, bits 7-4 represent fractional portion
     uint8_t MSB = rawData[0];
     uint8_t CSB = rawData[1];
@@ -182,46 +338,391 @@ MPL3115A2DATA MPL3115A2::getAltitude(void)
     intPortion <<= 8;
     intPortion |= CSB;
 
-    // Get fraction
+    // Get fraction. The whole thing is one two's complement number, so the
+    // integer portion is rounded down and the fraction always adds to it
+    // (-3.5 m is -4 and 8/16)
     uint8_t temp = LSB;
     temp >>= 4;
     double fraction = temp / 16.0;
-    if (intPortion < 0)
-    {
-      fraction *= -1;
-    }
 
-    double altitude = intPortion + fraction;
-
-    MPL3115A2DATA data;
-    data.altitude = altitude;
-    data.temperature = calculateTemperature(rawData[3], rawData[4]);
-    return data;
+    return intPortion + fraction;
 }
 
 
-double MPL3115A2::calculateTemperature(uint8_t MSB, uint8_t LSB)
+template <typename Transport>
+double BasicMPL3115A2<Transport>::calculateTemperature(uint8_t MSB, uint8_t LSB)
 {
   // MSB is integer portion, LSB 7-4 is fractional, in Celcius
   int8_t intPortion = MSB;
   uint8_t fractionalPortion = LSB;
 
-  // Get fraction
+  // Get fraction, which adds to the integer portion even when it is negative
+  // like it does for decodeAltitude
   uint8_t temp = fractionalPortion;
   temp >>= 4;
   double fraction = temp / 16.0;
-  if (intPortion < 0)
-  {
-      fraction *= -1;
-  }
 
   double temperature = intPortion + fraction;
   return temperature;
 }
 
 
-std::vector<uint8_t> MPL3115A2::getData(void) const
+template <typename Transport>
+bool BasicMPL3115A2<Transport>::getData(std::array<uint8_t, DATA_SIZE> &data) const
 {
     // Get all the data in one transaction
-    return m_connection->readBytes(PRESSURE_MSB, 5);
+    return m_connection->tryReadBytes(PRESSURE_MSB, data.data(), DATA_SIZE);
+}
+
+
+template <typename Transport>
+uint8_t BasicMPL3115A2<Transport>::readRegister(uint8_t reg)
+{
+    uint8_t data;
+    if (!tryReadRegister(reg, data))
+    {
+        throwI2cError("Could not perform read");
+    }
+    return data;
 }
+
+
+template <typename Transport>
+bool BasicMPL3115A2<Transport>::tryReadRegister(uint8_t reg, uint8_t &data)
+{
+    // Control registers come from the cache once they've been read or written
+    if (m_registers.lookup(reg, data))
+    {
+        return true;
+    }
+    if (!m_connection->tryReadBytes(reg, &data, 1))
+    {
+        return false;
+    }
+    m_registers.update(reg, data);
+    return true;
+}
+
+
+template <typename Transport>
+void BasicMPL3115A2<Transport>::transfer(I2cTransaction &transaction)
+{
+    // If the transfer fails there's no telling which writes made it
+    try
+    {
+        m_connection->transfer(transaction);
+    }
+    catch (...)
+    {
+        m_registers.invalidate();
+        throw;
+    }
+}
+
+
+template <typename Transport>
+bool BasicMPL3115A2<Transport>::recover(void)
+{
+    if (!m_connection->recover())
+    {
+        return false;
+    }
+
+    // A device that was reset comes back in standby with its defaults, so
+    // anything that differs from the cache is written back in standby with
+    // control register 1 (and so going active again) last
+    uint8_t controlRegisterData;
+    uint8_t cachedControlRegisterData;
+    if (!m_connection->tryReadBytes(CTRL_REG1, &controlRegisterData, 1))
+    {
+        return false;
+    }
+    I2cTransaction transaction;
+    transaction.write(MPL3115A2_ADDRESS, CTRL_REG1, controlRegisterData & ~STANDBY_BAR_MASK);
+    unsigned int changes = 0;
+    for (unsigned int reg = 0; reg <= UINT8_MAX; ++reg)
+    {
+        uint8_t cached;
+        uint8_t actual;
+        if (reg == CTRL_REG1 || !m_registers.peek(reg, cached))
+        {
+            continue;
+        }
+        if (!m_connection->tryReadBytes(reg, &actual, 1))
+        {
+            return false;
+        }
+        if (actual != cached)
+        {
+            transaction.write(MPL3115A2_ADDRESS, reg, cached);
+            ++changes;
+        }
+    }
+    if (!m_registers.peek(CTRL_REG1, cachedControlRegisterData))
+    {
+        cachedControlRegisterData = controlRegisterData;
+    }
+    if (changes == 0 && controlRegisterData == cachedControlRegisterData)
+    {
+        return true;
+    }
+    transaction.write(MPL3115A2_ADDRESS, CTRL_REG1, cachedControlRegisterData);
+    if (!m_connection->tryTransfer(transaction))
+    {
+        int transferErrno = errno;
+        m_registers.invalidate();
+        errno = transferErrno;
+        return false;
+    }
+    return true;
+}
+
+
+template <typename Transport>
+void BasicMPL3115A2<Transport>::invalidateRegisterCache(void)
+{
+    m_registers.invalidate();
+}
+
+
+template <typename Transport>
+bool BasicMPL3115A2<Transport>::verifyRegisterCache(void)
+{
+    // Read back every cached register, anything that doesn't match is fixed up
+    bool allMatched = true;
+    for (unsigned int reg = 0; reg <= UINT8_MAX; ++reg)
+    {
+        uint8_t cached;
+        if (!m_registers.peek(reg, cached))
+        {
+            continue;
+        }
+        uint8_t actual;
+        m_connection->readBytes(reg, &actual, 1);
+        if (actual != cached)
+        {
+            m_registers.update(reg, actual);
+            allMatched = false;
+        }
+    }
+
+    // The mode and settings we keep track of come from control register 1
+    uint8_t controlRegisterData = readRegister(CTRL_REG1);
+    isAltimeterMode = controlRegisterData & ALTIMETER_MASK;
+    isBarometerMode = !isAltimeterMode;
+    m_oversample = static_cast<MPL3115A2OVERSAMPLE>((controlRegisterData & CTRL_REG1_OS_MASK) >> CTRL_REG1_OS_SHIFT);
+    m_timeStep = readRegister(CTRL_REG2) & CTRL_REG2_ST_MASK;
+    return allMatched;
+}
+
+
+template <typename Transport>
+RegisterCacheStats BasicMPL3115A2<Transport>::registerCacheStats(void) const
+{
+    return m_registers.stats();
+}
+
+
+template <typename Transport>
+const DriverMetrics &BasicMPL3115A2<Transport>::metrics(void) const
+{
+    return m_metrics;
+}
+
+
+template <typename Transport>
+void BasicMPL3115A2<Transport>::useDataReadyInterrupt(std::unique_ptr<DataReadySource> source, MPL3115A2INTPIN pin)
+{
+    // Active low push-pull on both pins, data ready as the only interrupt source
+    uint8_t controlRegisterData = readRegister(CTRL_REG1);
+    uint8_t interruptPin = pin == MPL3115A2INTPIN::INT1 ? CTRL_REG5_INT_CFG_DRDY_MASK : 0;
+    writeConfiguration({ { CTRL_REG3, CTRL_REG3_ACTIVE_LOW_PUSH_PULL },
+                         { CTRL_REG4, CTRL_REG4_INT_EN_DRDY_MASK },
+                         { CTRL_REG5, interruptPin } },
+                       controlRegisterData | STANDBY_BAR_MASK);
+    m_dataReady = std::move(source);
+}
+
+
+template <typename Transport>
+bool BasicMPL3115A2<Transport>::waitForData(void)
+{
+    // Data may already be waiting, in which case there won't be another edge
+    // until it has been read
+    uint64_t waitStart = metricsNow();
+    uint8_t status;
+    if (!tryReadRegister(STATUS, status))
+    {
+        return false;
+    }
+    while (!(status & STATUS_PTDR_MASK))
+    {
+        if (m_dataReady)
+        {
+            // The edge may be a stale one, left from a conversion whose data
+            // was read before anything waited for it, so the status is read
+            // again whether it fired or timed out
+            m_dataReady->wait(DATA_READY_TIMEOUT_MS);
+        }
+        else
+        {
+            // Poll until there is data available
+            std::chrono::milliseconds timespan(10);
+            std::this_thread::sleep_for(timespan);
+        }
+        if (!tryReadRegister(STATUS, status))
+        {
+            return false;
+        }
+    }
+    m_metrics.waitTime.record(metricsNow() - waitStart);
+    return true;
+}
+
+
+template <typename Transport>
+void BasicMPL3115A2<Transport>::configureOversampling(MPL3115A2OVERSAMPLE ratio)
+{
+    uint8_t controlRegisterData = readRegister(CTRL_REG1);
+    controlRegisterData &= ~CTRL_REG1_OS_MASK;
+    controlRegisterData |= static_cast<uint8_t>(ratio) << CTRL_REG1_OS_SHIFT;
+    writeConfiguration({}, controlRegisterData | STANDBY_BAR_MASK);
+    m_oversample = ratio;
+}
+
+
+template <typename Transport>
+void BasicMPL3115A2<Transport>::configureTimeStep(uint8_t step)
+{
+    if (step > MAX_TIME_STEP)
+    {
+        std::ostringstream err;
+        err << "Time step " << static_cast<unsigned int>(step) << " is more than the maximum of "
+            << static_cast<unsigned int>(MAX_TIME_STEP);
+        throw std::invalid_argument(err.str());
+    }
+
+    // Only the time step bits of CTRL_REG2 are used, so no need to read it
+    uint8_t controlRegisterData = readRegister(CTRL_REG1);
+    writeConfiguration({ { CTRL_REG2, static_cast<uint8_t>(step & CTRL_REG2_ST_MASK) } },
+                       controlRegisterData | STANDBY_BAR_MASK);
+    m_timeStep = step;
+}
+
+
+template <typename Transport>
+void BasicMPL3115A2<Transport>::configureFifo(bool enable)
+{
+    // The FIFO mode has to be disabled before it can be changed to another mode
+    uint8_t controlRegisterData = readRegister(CTRL_REG1);
+    uint8_t fifoSetup = readRegister(F_SETUP);
+    if (!enable)
+    {
+        writeConfiguration({ { F_SETUP, F_SETUP_DISABLED } }, controlRegisterData | STANDBY_BAR_MASK);
+    }
+    else if (fifoSetup != F_SETUP_CIRCULAR)
+    {
+        writeConfiguration({ { F_SETUP, F_SETUP_DISABLED }, { F_SETUP, F_SETUP_CIRCULAR } },
+                           controlRegisterData | STANDBY_BAR_MASK);
+    }
+}
+
+
+template <typename Transport>
+MPL3115A2FIFOBATCH BasicMPL3115A2<Transport>::readFifo(void)
+{
+    MPL3115A2FIFOBATCH batch;
+    if (!tryReadFifo(batch))
+    {
+        throwI2cError("Could not read the FIFO");
+    }
+    return batch;
+}
+
+
+template <typename Transport>
+bool BasicMPL3115A2<Transport>::tryReadFifo(MPL3115A2FIFOBATCH &batch)
+{
+    uint8_t fifoStatus;
+    if (!tryReadRegister(F_STATUS, fifoStatus))
+    {
+        return false;
+    }
+    batch.count = fifoStatus & F_STATUS_F_CNT_MASK;
+    batch.overrun = fifoStatus & F_STATUS_F_OVF_MASK;
+    if (batch.count > MPL3115A2FIFOBATCH::DEPTH)
+    {
+        batch.count = MPL3115A2FIFOBATCH::DEPTH;
+    }
+    if (batch.count == 0)
+    {
+        return true;
+    }
+
+    // F_DATA doesn't auto increment, so one long read drains every sample
+    m_fifoTransaction.clear();
+    m_fifoTransaction.read(MPL3115A2_ADDRESS, F_DATA, batch.count * DATA_SIZE);
+    if (!m_connection->tryTransfer(m_fifoTransaction))
+    {
+        return false;
+    }
+    const uint8_t *rawData = m_fifoTransaction.result(0);
+    uint64_t decodeStart = metricsNow();
+    for (unsigned int i = 0; i < batch.count; ++i)
+    {
+        const uint8_t *sample = rawData + i * DATA_SIZE;
+        MPL3115A2DATA &data = batch.samples[i];
+        data.pressure = 0;
+        data.altitude = 0;
+        if (isAltimeterMode)
+        {
+            data.altitude = decodeAltitude(sample);
+        }
+        else
+        {
+            data.pressure = decodePressure(sample);
+            data.altitude = pressureToAltitude(data.pressure, m_seaLevelPressure);
+        }
+        data.temperature = calculateTemperature(sample[3], sample[4]);
+    }
+    m_metrics.decodeTime.record(metricsNow() - decodeStart);
+    return true;
+}
+
+
+template <typename Transport>
+double BasicMPL3115A2<Transport>::sampleRate(void) const
+{
+    // A new sample comes every time step, unless the conversion takes longer
+    double conversion = conversionTime(m_oversample);
+    double timeStep = static_cast<double>(1u << m_timeStep);
+    return 1.0 / (conversion > timeStep ? conversion : timeStep);
+}
+
+
+template <typename Transport>
+MPL3115A2OVERSAMPLE BasicMPL3115A2<Transport>::oversampling(void) const
+{
+    return m_oversample;
+}
+
+
+template <typename Transport>
+uint8_t BasicMPL3115A2<Transport>::timeStep(void) const
+{
+    return m_timeStep;
+}
+
+
+template <typename Transport>
+double BasicMPL3115A2<Transport>::conversionTime(MPL3115A2OVERSAMPLE ratio)
+{
+    return CONVERSION_TIME_MS[static_cast<uint8_t>(ratio)] / 1000.0;
+}
+
+
+// The drivers that get built, on a real adapter, on the simulated bus and
+// through a bus scheduler
+template class BasicMPL3115A2<I2cAbstraction>;
+template class BasicMPL3115A2<SimulatedI2c>;
+template class BasicMPL3115A2<ScheduledI2c>;
@@ -1,18 +1,22 @@
 #ifndef MPL3115A2_HPP
 #define MPL3115A2_HPP
 
+#include <array>
+#include <initializer_list>
 #include <memory>
 #include <stdint.h>
 #include <string>
-#include <vector>
 
+#include "data-ready.hpp"
 #include "i2c-abstraction.hpp"
+#include "metrics.hpp"
+#include "register-cache.hpp"
 
 
 // This struct represents the data available from the device.
-// Note that the get functions in MPL3115A2 only fill two fields,
+// Note that getPressure and getAltitude in MPL3115A2 only fill two fields,
 // the device can only read pressure and temperature, or altitude and
-// temperature.
+// temperature. getSample fills all three.
 struct MPL3115A2DATA
 {
     public:
@@ -22,27 +26,142 @@ struct MPL3115A2DATA
 };
 
 
+// Everything drained from the FIFO in one go, oldest sample first.
+// Like the get functions, each sample only has pressure or altitude filled
+// in, depending on the mode the device was in. overrun is set if the FIFO
+// filled up and samples were lost since the last drain.
+struct MPL3115A2FIFOBATCH
+{
+    public:
+        static constexpr unsigned int DEPTH = 32;
+        unsigned int count;
+        bool overrun;
+        MPL3115A2DATA samples[DEPTH];
+};
+
+
+// Oversample ratios, more samples means less noise but a longer conversion
+// (6 ms at 1x up to 512 ms at 128x). The value is the OS bits.
+enum class MPL3115A2OVERSAMPLE : uint8_t
+{
+    OS_1 = 0,
+    OS_2 = 1,
+    OS_4 = 2,
+    OS_8 = 3,
+    OS_16 = 4,
+    OS_32 = 5,
+    OS_64 = 6,
+    OS_128 = 7
+};
+
+
+// The MPL3115A2's interrupt pins
+enum class MPL3115A2INTPIN
+{
+    INT1,
+    INT2
+};
+
+
 // This class represents the MPL3115A2.
 // Using getPressure and getPressure/getAltitude will return a data struct with
 // temperature and pressure/altitude data, depending on the function used.
-class MPL3115A2
+// Switching between those costs a mode change and a fresh conversion, so
+// getSample stays in barometer mode and works out the altitude from the
+// pressure itself (relative to setSeaLevelPressure, standard by default),
+// giving all three from one conversion.
+// By default those poll the status register until a new conversion is done.
+// useDataReadyInterrupt routes the data ready interrupt to a pin instead and
+// waits on source (e.g. the GPIO line the pin is wired to) so the data is read
+// the moment the conversion finishes.
+// The device converts on its own every 2^step seconds (configureTimeStep),
+// or as fast as the oversample ratio allows if that's slower. sampleRate gives
+// the resulting samples per second. With configureFifo the samples are kept
+// on the device (up to 32) and readFifo drains them all at once (in
+// barometer mode with the altitude worked out like getSample), the get
+// functions shouldn't be used while it's enabled.
+// Control registers are shadowed in a RegisterCache, so changing the
+// configuration only writes the registers that actually change. If something
+// else might have touched the device, invalidateRegisterCache makes the next
+// accesses go to the bus and verifyRegisterCache reads every cached register
+// back (fixing up the cache, false if anything didn't match).
+// getPressure, getAltitude, getSample and readFifo throw if the bus fails,
+// tryGetSample and tryReadFifo return false with errno set instead so that a
+// sampling loop can skip the sample and carry on. recover recovers the bus
+// (see I2cAbstraction::recover) and, in case the device was reset along with
+// it, writes back any cached register that no longer matches.
+// metrics has the time spent waiting for each conversion and decoding it
+// (a whole FIFO batch at a time for readFifo).
+// Transport is what talks to the bus, anything with I2cAbstraction's
+// interface. It is a template parameter rather than a virtual interface so
+// the real driver (MPL3115A2) pays nothing for the indirection, while
+// SimulatedMPL3115A2 runs against a SimulatedBus without the hardware and
+// ScheduledMPL3115A2 shares the adapter through its BusScheduler.
+template <typename Transport>
+class BasicMPL3115A2
 {
     public:
         // Attempts to open the i2c connection at the adapterNumber
-        MPL3115A2(const unsigned int adapterNumber);
+        BasicMPL3115A2(const unsigned int adapterNumber);
         MPL3115A2DATA getPressure(void);
         MPL3115A2DATA getAltitude(void);
+        MPL3115A2DATA getSample(void);
+        bool tryGetSample(MPL3115A2DATA &data);
+        void setSeaLevelPressure(double pascals);
+        void useDataReadyInterrupt(std::unique_ptr<DataReadySource> source, MPL3115A2INTPIN pin);
+        void configureOversampling(MPL3115A2OVERSAMPLE ratio);
+        void configureTimeStep(uint8_t step);
+        void configureFifo(bool enable);
+        MPL3115A2FIFOBATCH readFifo(void);
+        bool tryReadFifo(MPL3115A2FIFOBATCH &batch);
+        bool recover(void);
+        double sampleRate(void) const;
+        MPL3115A2OVERSAMPLE oversampling(void) const;
+        uint8_t timeStep(void) const;
+        // Seconds a single conversion takes at ratio
+        static double conversionTime(MPL3115A2OVERSAMPLE ratio);
+        void invalidateRegisterCache(void);
+        bool verifyRegisterCache(void);
+        RegisterCacheStats registerCacheStats(void) const;
+        const DriverMetrics &metrics(void) const;
 
     private:
-        double calculateTemperature(uint8_t MSB, uint8_t LSB);
-        uint8_t enterStandbyMode(void) const;
-        void configureDataReadyFlag(void) const;
+        static double calculateTemperature(uint8_t MSB, uint8_t LSB);
+        static double decodePressure(const uint8_t *rawData);
+        static double decodeAltitude(const uint8_t *rawData);
+        struct RegisterWrite
+        {
+            uint8_t reg;
+            uint8_t value;
+        };
+        void writeConfiguration(std::initializer_list<RegisterWrite> writes, uint8_t controlRegisterData);
+        void configureDataReadyFlag(void);
         void configureAltimeterMode(void);
         void configureBarometerMode(void);
-        std::vector<uint8_t> getData(void) const;
-        std::unique_ptr<I2cAbstraction> m_connection;
+        // Pressure/altitude (3 bytes) and temperature (2 bytes)
+        static constexpr unsigned int DATA_SIZE = 5;
+        bool getData(std::array<uint8_t, DATA_SIZE> &data) const;
+        uint8_t readRegister(uint8_t reg);
+        bool tryReadRegister(uint8_t reg, uint8_t &data);
+        void transfer(I2cTransaction &transaction);
+        // False with errno set if the status couldn't be read
+        bool waitForData(void);
+        std::unique_ptr<Transport> m_connection;
+        std::unique_ptr<DataReadySource> m_dataReady;
         bool isAltimeterMode;
         bool isBarometerMode;
+        MPL3115A2OVERSAMPLE m_oversample;
+        uint8_t m_timeStep;
+        double m_seaLevelPressure;
+        RegisterCache m_registers;
+        I2cTransaction m_fifoTransaction;
+        DriverMetrics m_metrics;
 };
 
+class ScheduledI2c;
+class SimulatedI2c;
+typedef BasicMPL3115A2<I2cAbstraction> MPL3115A2;
+typedef BasicMPL3115A2<SimulatedI2c> SimulatedMPL3115A2;
+typedef BasicMPL3115A2<ScheduledI2c> ScheduledMPL3115A2;
+
 #endif
@@ -0,0 +1,249 @@
+// Checks MadgwickAhrs against known rotations, the sensor readings worked out
+// from the true orientation at every step, then that a field read the way the
+// lsm9ds1's magnetometer reports it ends up in the accelerometer/gyro frame,
+// then measures how long an update takes. Exits with 1 if any estimate is
+// further off than it should be.
+#include <chrono>
+#include <iostream>
+#include <math.h>
+#include <vector>
+
+#include "lsm9ds1.hpp"
+#include "orientation.hpp"
+
+
+constexpr double SAMPLE_RATE = 952.0;
+constexpr unsigned int ITERATIONS = 1000000;
+
+// The earth's field in the earth frame (gauss, north and down), roughly what
+// it is at mid latitudes
+constexpr double FIELD[3] = { 0.2, 0.0, -0.45 };
+
+
+// A quaternion w, x, y, z in doubles, the truth the estimates are held to
+struct Quaternion
+{
+    public:
+        double w;
+        double x;
+        double y;
+        double z;
+};
+
+
+static Quaternion multiply(const Quaternion &a, const Quaternion &b)
+{
+    Quaternion q = {
+        a.w * b.w - a.x * b.x - a.y * b.y - a.z * b.z,
+        a.w * b.x + a.x * b.w + a.y * b.z - a.z * b.y,
+        a.w * b.y - a.x * b.z + a.y * b.w + a.z * b.x,
+        a.w * b.z + a.x * b.y - a.y * b.x + a.z * b.w
+    };
+    return q;
+}
+
+
+// Rotation of angle (radians) about axis, which must be unit length
+static Quaternion rotation(double angle, double x, double y, double z)
+{
+    double s = sin(angle / 2.0);
+    Quaternion q = { cos(angle / 2.0), x * s, y * s, z * s };
+    return q;
+}
+
+
+// Aerospace (z-y-x) Euler angles in degrees
+static Quaternion fromEuler(double roll, double pitch, double yaw)
+{
+    const double radians = M_PI / 180.0;
+    return multiply(multiply(rotation(yaw * radians, 0, 0, 1), rotation(pitch * radians, 0, 1, 0)),
+                    rotation(roll * radians, 1, 0, 0));
+}
+
+
+// Takes an earth frame vector into the sensor frame q is the orientation of
+static void toSensor(const Quaternion &q, const double earth[3], float sensor[3])
+{
+    Quaternion v = { 0.0, earth[0], earth[1], earth[2] };
+    Quaternion conjugate = { q.w, -q.x, -q.y, -q.z };
+    Quaternion rotated = multiply(multiply(conjugate, v), q);
+    sensor[0] = static_cast<float>(rotated.x);
+    sensor[1] = static_cast<float>(rotated.y);
+    sensor[2] = static_cast<float>(rotated.z);
+}
+
+
+// Degrees between the estimated and true orientations
+static double angleBetween(const Orientation &estimate, const Quaternion &truth)
+{
+    double dot = fabs(estimate.quaternion[0] * truth.w + estimate.quaternion[1] * truth.x +
+                      estimate.quaternion[2] * truth.y + estimate.quaternion[3] * truth.z);
+    return 2.0 * acos(dot > 1.0 ? 1.0 : dot) * 180.0 / M_PI;
+}
+
+
+// Degrees between where the estimate and the truth have up, which is all
+// that can be known without the magnetometer
+static double tiltBetween(const Orientation &estimate, const Quaternion &truth)
+{
+    const double up[3] = { 0.0, 0.0, 1.0 };
+    float trueUp[3];
+    toSensor(truth, up, trueUp);
+    Quaternion q = { estimate.quaternion[0], estimate.quaternion[1], estimate.quaternion[2],
+                     estimate.quaternion[3] };
+    float estimatedUp[3];
+    toSensor(q, up, estimatedUp);
+    double dot = trueUp[0] * estimatedUp[0] + trueUp[1] * estimatedUp[1] + trueUp[2] * estimatedUp[2];
+    return acos(dot > 1.0 ? 1.0 : dot) * 180.0 / M_PI;
+}
+
+
+// Turns at rate (degrees per second about the sensor's own axes) from start
+// for seconds, the gyro reading rate plus bias, and returns the largest error
+// after the first settle seconds
+static double run(const char *name, const Quaternion &start, const double rate[3], const double bias[3],
+                  double seconds, double settle, bool useMag, double limit, bool &passed)
+{
+    MadgwickAhrs ahrs;
+    const double gravity[3] = { 0.0, 0.0, 1.0 };
+    double dt = 1.0 / SAMPLE_RATE;
+    double speed = sqrt(rate[0] * rate[0] + rate[1] * rate[1] + rate[2] * rate[2]);
+    Quaternion turn = { 1.0, 0.0, 0.0, 0.0 };
+    if (speed > 0.0)
+    {
+        turn = rotation(speed * M_PI / 180.0 * dt, rate[0] / speed, rate[1] / speed, rate[2] / speed);
+    }
+
+    Quaternion truth = start;
+    double worst = 0.0;
+    unsigned int steps = static_cast<unsigned int>(seconds * SAMPLE_RATE);
+    for (unsigned int i = 0; i < steps; ++i)
+    {
+        // The gyro measures the turn that got the sensor to where it is now
+        float gyro[3] = { static_cast<float>(rate[0] + bias[0]), static_cast<float>(rate[1] + bias[1]),
+                          static_cast<float>(rate[2] + bias[2]) };
+        if (i > 0)
+        {
+            truth = multiply(truth, turn);
+        }
+        float accel[3];
+        float mag[3] = { 0.0f, 0.0f, 0.0f };
+        toSensor(truth, gravity, accel);
+        if (useMag)
+        {
+            toSensor(truth, FIELD, mag);
+        }
+        ahrs.update(gyro, accel, mag, static_cast<float>(dt));
+        if (i >= settle * SAMPLE_RATE)
+        {
+            Orientation estimate = ahrs.orientation();
+            double error = useMag ? angleBetween(estimate, truth) : tiltBetween(estimate, truth);
+            worst = error > worst ? error : worst;
+        }
+    }
+
+    bool ok = worst <= limit;
+    passed = passed && ok;
+    std::cout << name << ": worst error " << worst << " degrees (limit " << limit << ") "
+              << (ok ? "ok" : "FAILED") << std::endl;
+    return worst;
+}
+
+
+// Holds the sensor still at orientation for a couple of seconds, the field
+// given to the filter as the lsm9ds1 reports it (its own frame) and then put
+// through magToAccelGyroFrame, and checks the estimate comes out right. The
+// same readings fused without the conversion have to come out wrong, or the
+// check couldn't tell the frames apart.
+static void checkMagFrame(const char *name, const Quaternion &orientation, bool &passed)
+{
+    const double gravity[3] = { 0.0, 0.0, 1.0 };
+    const float still[3] = { 0.0f, 0.0f, 0.0f };
+    float accel[3];
+    float field[3];
+    toSensor(orientation, gravity, accel);
+    toSensor(orientation, FIELD, field);
+    // What the magnetometer reads is the field with its x axis flipped
+    const float reading[3] = { -field[0], field[1], field[2] };
+    float mag[3];
+    magToAccelGyroFrame(reading, mag);
+
+    MadgwickAhrs converted;
+    MadgwickAhrs unconverted;
+    unsigned int steps = static_cast<unsigned int>(2.0 * SAMPLE_RATE);
+    for (unsigned int i = 0; i < steps; ++i)
+    {
+        converted.update(still, accel, mag, static_cast<float>(1.0 / SAMPLE_RATE));
+        unconverted.update(still, accel, reading, static_cast<float>(1.0 / SAMPLE_RATE));
+    }
+    double error = angleBetween(converted.orientation(), orientation);
+    double wrong = angleBetween(unconverted.orientation(), orientation);
+    bool ok = error <= 0.5 && wrong > 10.0;
+    passed = passed && ok;
+    std::cout << name << ": error " << error << " degrees, " << wrong << " without the conversion "
+              << (ok ? "ok" : "FAILED") << std::endl;
+}
+
+
+int main(void)
+{
+    bool passed = true;
+    const double still[3] = { 0.0, 0.0, 0.0 };
+    const double yawing[3] = { 0.0, 0.0, 90.0 };
+    const double tumbling[3] = { 40.0, -25.0, 60.0 };
+    const double biased[3] = { 0.3, -0.3, 0.5 };
+    run("Still, tilted", fromEuler(30.0, -20.0, 120.0), still, still, 10.0, 0.0, true, 0.5, passed);
+    run("Upside down", fromEuler(180.0, 0.0, -45.0), still, still, 2.0, 0.0, true, 0.5, passed);
+    run("Yawing 90 deg/s", fromEuler(0.0, 0.0, 0.0), yawing, still, 8.0, 0.0, true, 1.0, passed);
+    run("Tumbling", fromEuler(10.0, 5.0, 200.0), tumbling, still, 20.0, 0.0, true, 2.0, passed);
+    // Madgwick's filter has no bias state, a biased gyro leaves it lagging a
+    // few degrees behind
+    run("Tumbling, gyro biased", fromEuler(10.0, 5.0, 200.0), tumbling, biased, 20.0, 5.0, true, 5.0, passed);
+    run("Tumbling, no magnetometer (tilt)", fromEuler(-15.0, 25.0, 0.0), tumbling, still, 20.0, 0.0, false,
+        2.0, passed);
+    checkMagFrame("Magnetometer frame, level", fromEuler(0.0, 0.0, 30.0), passed);
+    checkMagFrame("Magnetometer frame, tilted", fromEuler(30.0, -20.0, 120.0), passed);
+    checkMagFrame("Magnetometer frame, upside down", fromEuler(180.0, 0.0, -45.0), passed);
+
+    // Throughput over a minute or so of tumbling, readings worked out first
+    // so only the updates are timed
+    std::vector<float> readings(ITERATIONS * 9);
+    const double gravity[3] = { 0.0, 0.0, 1.0 };
+    double dt = 1.0 / SAMPLE_RATE;
+    Quaternion truth = fromEuler(10.0, 5.0, 200.0);
+    double speed = sqrt(tumbling[0] * tumbling[0] + tumbling[1] * tumbling[1] + tumbling[2] * tumbling[2]);
+    Quaternion turn = rotation(speed * M_PI / 180.0 * dt, tumbling[0] / speed, tumbling[1] / speed,
+                               tumbling[2] / speed);
+    for (unsigned int i = 0; i < ITERATIONS; ++i)
+    {
+        float *reading = &readings[i * 9];
+        for (unsigned int axis = 0; axis < 3; ++axis)
+        {
+            reading[axis] = static_cast<float>(tumbling[axis]);
+        }
+        toSensor(truth, gravity, reading + 3);
+        toSensor(truth, FIELD, reading + 6);
+        truth = multiply(truth, turn);
+    }
+
+    // Something has to depend on every update or the compiler drops them
+    double checksum = 0.0;
+    const float noField[3] = { 0.0f, 0.0f, 0.0f };
+    const bool magnetometer[] = { true, false };
+    for (bool useMag : magnetometer)
+    {
+        MadgwickAhrs ahrs;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (unsigned int i = 0; i < ITERATIONS; ++i)
+        {
+            const float *reading = &readings[i * 9];
+            ahrs.update(reading, reading + 3, useMag ? reading + 6 : noField, static_cast<float>(dt));
+        }
+        std::chrono::duration<double, std::nano> time = std::chrono::steady_clock::now() - start;
+        checksum += ahrs.orientation().quaternion[0];
+        std::cout << (useMag ? "Update with magnetometer: " : "Update without magnetometer: ")
+                  << time.count() / ITERATIONS << " ns" << std::endl;
+    }
+    std::cout << "Checksum: " << checksum << std::endl;
+    return passed ? 0 : 1;
+}
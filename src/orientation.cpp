@@ -0,0 +1,279 @@
+#include <math.h>
+
+#include "orientation.hpp"
+
+
+constexpr float DEGREES_TO_RADIANS = static_cast<float>(M_PI / 180.0);
+constexpr float RADIANS_TO_DEGREES = static_cast<float>(180.0 / M_PI);
+
+constexpr float MadgwickAhrs::DEFAULT_BETA;
+
+
+// Scales v to unit length, false (leaving it alone) if it has none
+static bool normalize(float v[3])
+{
+    float norm = v[0] * v[0] + v[1] * v[1] + v[2] * v[2];
+    if (!(norm > 0.0f))
+    {
+        return false;
+    }
+    float scale = 1.0f / sqrtf(norm);
+    v[0] *= scale;
+    v[1] *= scale;
+    v[2] *= scale;
+    return true;
+}
+
+
+static void cross(const float a[3], const float b[3], float result[3])
+{
+    result[0] = a[1] * b[2] - a[2] * b[1];
+    result[1] = a[2] * b[0] - a[0] * b[2];
+    result[2] = a[0] * b[1] - a[1] * b[0];
+}
+
+
+MadgwickAhrs::MadgwickAhrs(float beta)
+    : m_beta(beta)
+{
+    reset();
+}
+
+
+void MadgwickAhrs::reset(void)
+{
+    m_q[0] = 1.0f;
+    m_q[1] = 0.0f;
+    m_q[2] = 0.0f;
+    m_q[3] = 0.0f;
+    m_settled = false;
+}
+
+
+void MadgwickAhrs::settle(const float accel[3], const float mag[3])
+{
+    // The earth's axes seen from the sensor are the rows of the rotation
+    // from the sensor frame into the earth frame
+    float up[3] = { accel[0], accel[1], accel[2] };
+    if (!normalize(up))
+    {
+        return;
+    }
+    float west[3];
+    cross(up, mag, west);
+    if (!normalize(west))
+    {
+        // No field, or it points straight up or down, so call whichever of
+        // the sensor's x or y axes is further from vertical north
+        const float x[3] = { 1.0f, 0.0f, 0.0f };
+        const float y[3] = { 0.0f, 1.0f, 0.0f };
+        cross(up, fabsf(up[0]) < fabsf(up[1]) ? x : y, west);
+        normalize(west);
+    }
+    float north[3];
+    cross(west, up, north);
+    const float *r[3] = { north, west, up };
+
+    // Rotation matrix to quaternion, from whichever term is largest so
+    // nothing is divided by something near zero
+    float trace = r[0][0] + r[1][1] + r[2][2];
+    if (trace > 0.0f)
+    {
+        float s = 0.5f / sqrtf(trace + 1.0f);
+        m_q[0] = 0.25f / s;
+        m_q[1] = (r[2][1] - r[1][2]) * s;
+        m_q[2] = (r[0][2] - r[2][0]) * s;
+        m_q[3] = (r[1][0] - r[0][1]) * s;
+    }
+    else if (r[0][0] > r[1][1] && r[0][0] > r[2][2])
+    {
+        float s = 2.0f * sqrtf(1.0f + r[0][0] - r[1][1] - r[2][2]);
+        m_q[0] = (r[2][1] - r[1][2]) / s;
+        m_q[1] = 0.25f * s;
+        m_q[2] = (r[0][1] + r[1][0]) / s;
+        m_q[3] = (r[0][2] + r[2][0]) / s;
+    }
+    else if (r[1][1] > r[2][2])
+    {
+        float s = 2.0f * sqrtf(1.0f + r[1][1] - r[0][0] - r[2][2]);
+        m_q[0] = (r[0][2] - r[2][0]) / s;
+        m_q[1] = (r[0][1] + r[1][0]) / s;
+        m_q[2] = 0.25f * s;
+        m_q[3] = (r[1][2] + r[2][1]) / s;
+    }
+    else
+    {
+        float s = 2.0f * sqrtf(1.0f + r[2][2] - r[0][0] - r[1][1]);
+        m_q[0] = (r[1][0] - r[0][1]) / s;
+        m_q[1] = (r[0][2] + r[2][0]) / s;
+        m_q[2] = (r[1][2] + r[2][1]) / s;
+        m_q[3] = 0.25f * s;
+    }
+    m_settled = true;
+}
+
+
+void MadgwickAhrs::update(const float gyro[3], const float accel[3], const float mag[3], float dt)
+{
+    if (!m_settled)
+    {
+        settle(accel, mag);
+    }
+    step(gyro, accel, mag, dt);
+}
+
+
+void MadgwickAhrs::step(const float gyro[3], const float accel[3], const float mag[3], float dt)
+{
+    float q0 = m_q[0];
+    float q1 = m_q[1];
+    float q2 = m_q[2];
+    float q3 = m_q[3];
+    float gx = gyro[0] * DEGREES_TO_RADIANS;
+    float gy = gyro[1] * DEGREES_TO_RADIANS;
+    float gz = gyro[2] * DEGREES_TO_RADIANS;
+
+    // Rate of change of the quaternion from the gyro
+    float qDot0 = 0.5f * (-q1 * gx - q2 * gy - q3 * gz);
+    float qDot1 = 0.5f * (q0 * gx + q2 * gz - q3 * gy);
+    float qDot2 = 0.5f * (q0 * gy - q1 * gz + q3 * gx);
+    float qDot3 = 0.5f * (q0 * gz + q1 * gy - q2 * gx);
+
+    float a[3] = { accel[0], accel[1], accel[2] };
+    float m[3] = { mag[0], mag[1], mag[2] };
+    if (normalize(a))
+    {
+        float ax = a[0];
+        float ay = a[1];
+        float az = a[2];
+        float s0;
+        float s1;
+        float s2;
+        float s3;
+        float _2q0 = 2.0f * q0;
+        float _2q1 = 2.0f * q1;
+        float _2q2 = 2.0f * q2;
+        float _2q3 = 2.0f * q3;
+        float q0q0 = q0 * q0;
+        float q1q1 = q1 * q1;
+        float q2q2 = q2 * q2;
+        float q3q3 = q3 * q3;
+        if (normalize(m))
+        {
+            // The gradient of how far gravity and the field are from where
+            // q puts them, the field's reference being its direction in the
+            // earth frame as q has it now (north and down, no west)
+            float mx = m[0];
+            float my = m[1];
+            float mz = m[2];
+            float _2q0mx = 2.0f * q0 * mx;
+            float _2q0my = 2.0f * q0 * my;
+            float _2q0mz = 2.0f * q0 * mz;
+            float _2q1mx = 2.0f * q1 * mx;
+            float _2q0q2 = 2.0f * q0 * q2;
+            float _2q2q3 = 2.0f * q2 * q3;
+            float q0q1 = q0 * q1;
+            float q0q2 = q0 * q2;
+            float q0q3 = q0 * q3;
+            float q1q2 = q1 * q2;
+            float q1q3 = q1 * q3;
+            float q2q3 = q2 * q3;
+            float hx = mx * q0q0 - _2q0my * q3 + _2q0mz * q2 + mx * q1q1 + _2q1 * my * q2 + _2q1 * mz * q3 -
+                       mx * q2q2 - mx * q3q3;
+            float hy = _2q0mx * q3 + my * q0q0 - _2q0mz * q1 + _2q1mx * q2 - my * q1q1 + my * q2q2 +
+                       _2q2 * mz * q3 - my * q3q3;
+            float _2bx = sqrtf(hx * hx + hy * hy);
+            float _2bz = -_2q0mx * q2 + _2q0my * q1 + mz * q0q0 + _2q1mx * q3 - mz * q1q1 + _2q2 * my * q3 -
+                         mz * q2q2 + mz * q3q3;
+            float _4bx = 2.0f * _2bx;
+            float _4bz = 2.0f * _2bz;
+
+            float gravityX = 2.0f * q1q3 - _2q0q2 - ax;
+            float gravityY = 2.0f * q0q1 + _2q2q3 - ay;
+            float gravityZ = 1.0f - 2.0f * q1q1 - 2.0f * q2q2 - az;
+            float fieldX = _2bx * (0.5f - q2q2 - q3q3) + _2bz * (q1q3 - q0q2) - mx;
+            float fieldY = _2bx * (q1q2 - q0q3) + _2bz * (q0q1 + q2q3) - my;
+            float fieldZ = _2bx * (q0q2 + q1q3) + _2bz * (0.5f - q1q1 - q2q2) - mz;
+            s0 = -_2q2 * gravityX + _2q1 * gravityY - _2bz * q2 * fieldX + (-_2bx * q3 + _2bz * q1) * fieldY +
+                 _2bx * q2 * fieldZ;
+            s1 = _2q3 * gravityX + _2q0 * gravityY - 4.0f * q1 * gravityZ + _2bz * q3 * fieldX +
+                 (_2bx * q2 + _2bz * q0) * fieldY + (_2bx * q3 - _4bz * q1) * fieldZ;
+            s2 = -_2q0 * gravityX + _2q3 * gravityY - 4.0f * q2 * gravityZ + (-_4bx * q2 - _2bz * q0) * fieldX +
+                 (_2bx * q1 + _2bz * q3) * fieldY + (_2bx * q0 - _4bz * q2) * fieldZ;
+            s3 = _2q1 * gravityX + _2q2 * gravityY + (-_4bx * q3 + _2bz * q1) * fieldX +
+                 (-_2bx * q0 + _2bz * q2) * fieldY + _2bx * q1 * fieldZ;
+        }
+        else
+        {
+            // Gravity alone
+            float _4q0 = 4.0f * q0;
+            float _4q1 = 4.0f * q1;
+            float _4q2 = 4.0f * q2;
+            float _8q1 = 8.0f * q1;
+            float _8q2 = 8.0f * q2;
+            s0 = _4q0 * q2q2 + _2q2 * ax + _4q0 * q1q1 - _2q1 * ay;
+            s1 = _4q1 * q3q3 - _2q3 * ax + 4.0f * q0q0 * q1 - _2q0 * ay - _4q1 + _8q1 * q1q1 + _8q1 * q2q2 +
+                 _4q1 * az;
+            s2 = 4.0f * q0q0 * q2 + _2q0 * ax + _4q2 * q3q3 - _2q3 * ay - _4q2 + _8q2 * q1q1 + _8q2 * q2q2 +
+                 _4q2 * az;
+            s3 = 4.0f * q1q1 * q3 - _2q1 * ax + 4.0f * q2q2 * q3 - _2q2 * ay;
+        }
+
+        // Only the direction of the gradient counts, beta sets the size
+        float norm = s0 * s0 + s1 * s1 + s2 * s2 + s3 * s3;
+        if (norm > 0.0f)
+        {
+            float scale = m_beta / sqrtf(norm);
+            qDot0 -= s0 * scale;
+            qDot1 -= s1 * scale;
+            qDot2 -= s2 * scale;
+            qDot3 -= s3 * scale;
+        }
+    }
+
+    q0 += qDot0 * dt;
+    q1 += qDot1 * dt;
+    q2 += qDot2 * dt;
+    q3 += qDot3 * dt;
+    float scale = 1.0f / sqrtf(q0 * q0 + q1 * q1 + q2 * q2 + q3 * q3);
+    m_q[0] = q0 * scale;
+    m_q[1] = q1 * scale;
+    m_q[2] = q2 * scale;
+    m_q[3] = q3 * scale;
+}
+
+
+void rotateToEarth(const Orientation &orientation, const float sensor[3], float earth[3])
+{
+    const float *q = orientation.quaternion;
+    float x = sensor[0];
+    float y = sensor[1];
+    float z = sensor[2];
+    earth[0] = (1.0f - 2.0f * (q[2] * q[2] + q[3] * q[3])) * x + 2.0f * (q[1] * q[2] - q[0] * q[3]) * y +
+               2.0f * (q[1] * q[3] + q[0] * q[2]) * z;
+    earth[1] = 2.0f * (q[1] * q[2] + q[0] * q[3]) * x + (1.0f - 2.0f * (q[1] * q[1] + q[3] * q[3])) * y +
+               2.0f * (q[2] * q[3] - q[0] * q[1]) * z;
+    earth[2] = 2.0f * (q[1] * q[3] - q[0] * q[2]) * x + 2.0f * (q[2] * q[3] + q[0] * q[1]) * y +
+               (1.0f - 2.0f * (q[1] * q[1] + q[2] * q[2])) * z;
+}
+
+
+Orientation MadgwickAhrs::orientation(void) const
+{
+    float q0 = m_q[0];
+    float q1 = m_q[1];
+    float q2 = m_q[2];
+    float q3 = m_q[3];
+    Orientation result;
+    for (unsigned int i = 0; i < 4; ++i)
+    {
+        result.quaternion[i] = m_q[i];
+    }
+    result.roll = atan2f(2.0f * (q0 * q1 + q2 * q3), 1.0f - 2.0f * (q1 * q1 + q2 * q2)) * RADIANS_TO_DEGREES;
+    // Rounding can take the sine just past 1 looking straight up or down
+    float sinPitch = 2.0f * (q0 * q2 - q3 * q1);
+    sinPitch = sinPitch > 1.0f ? 1.0f : (sinPitch < -1.0f ? -1.0f : sinPitch);
+    result.pitch = asinf(sinPitch) * RADIANS_TO_DEGREES;
+    result.yaw = atan2f(2.0f * (q0 * q3 + q1 * q2), 1.0f - 2.0f * (q2 * q2 + q3 * q3)) * RADIANS_TO_DEGREES;
+    return result;
+}
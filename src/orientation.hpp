@@ -0,0 +1,60 @@
+#ifndef ORIENTATION_HPP
+#define ORIENTATION_HPP
+
+
+// Which way the sensor is pointing: the unit quaternion w, x, y, z that
+// rotates vectors from the sensor frame into the earth frame (x magnetic
+// north, y west, z up), and the same as aerospace (z-y-x) Euler angles in
+// degrees, yaw counterclockwise from magnetic north seen from above
+struct Orientation
+{
+    public:
+        float quaternion[4];
+        float roll;
+        float pitch;
+        float yaw;
+};
+
+
+// Rotates a vector from the sensor frame into the earth frame
+void rotateToEarth(const Orientation &orientation, const float sensor[3], float earth[3]);
+
+
+// This class estimates orientation from a gyro, accelerometer and
+// magnetometer with Madgwick's gradient descent filter. The gyro is
+// integrated every step and the result nudged by beta (radians per second)
+// towards where gravity and the magnetic field say it should be: more beta
+// trusts the gyro less.
+// The first step settles straight onto the accelerometer and magnetometer
+// instead of spending seconds converging from level and north. A step costs
+// a few dozen float multiplies and one square root per normalization, with
+// the whole state in 32 bytes.
+class MadgwickAhrs
+{
+    public:
+        static constexpr float DEFAULT_BETA = 0.1f;
+        explicit MadgwickAhrs(float beta = DEFAULT_BETA);
+
+        // One step dt seconds after the last, gyro in degrees per second.
+        // accel and mag only need to point the right way (in the same frame
+        // as the gyro), they are normalized. Without a magnetometer reading
+        // (all zero) the step uses gravity alone and yaw drifts.
+        void update(const float gyro[3], const float accel[3], const float mag[3], float dt);
+
+        Orientation orientation(void) const;
+
+        // Starts over, settling on the next step's readings
+        void reset(void);
+
+    private:
+        // Points the quaternion straight at where gravity and the field say it
+        // is (up from accel, north from the part of mag at right angles to
+        // it), any north will do without a magnetometer reading
+        void settle(const float accel[3], const float mag[3]);
+        void step(const float gyro[3], const float accel[3], const float mag[3], float dt);
+        alignas(16) float m_q[4];
+        float m_beta;
+        bool m_settled;
+};
+
+#endif
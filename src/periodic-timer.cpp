@@ -0,0 +1,144 @@
+#include <atomic>
+#include <chrono>
+#include <sstream>
+#include <stdexcept>
+#include <stdint.h>
+#include <string.h>
+
+#include <errno.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "metrics.hpp"
+#include "periodic-timer.hpp"
+
+
+// Monotonic clock nanoseconds, the clock both ways of waking up go by
+static int64_t monotonicNow(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return static_cast<int64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+
+PeriodicTimer::PeriodicTimer(std::chrono::nanoseconds period, TimerWakeup wakeup) :
+    m_wakeup(wakeup),
+    m_timerFile(-1),
+    m_period(period),
+    m_missed(0)
+{
+    if (period.count() <= 0)
+    {
+        throw std::invalid_argument("PeriodicTimer period must be positive");
+    }
+    m_next = monotonicNow() + period.count();
+    if (wakeup != TimerWakeup::TIMERFD)
+    {
+        return;
+    }
+
+    m_timerFile = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (m_timerFile < 0)
+    {
+        std::ostringstream err;
+        err << "Could not create a timer" << std::endl << strerror(errno);
+        throw std::runtime_error(err.str());
+    }
+    // Absolute so the timer's periods line up with m_next exactly
+    struct itimerspec spec;
+    spec.it_interval.tv_sec = period.count() / 1000000000;
+    spec.it_interval.tv_nsec = period.count() % 1000000000;
+    spec.it_value.tv_sec = m_next / 1000000000;
+    spec.it_value.tv_nsec = m_next % 1000000000;
+    if (timerfd_settime(m_timerFile, TFD_TIMER_ABSTIME, &spec, nullptr) < 0)
+    {
+        int settimeErrno = errno;
+        close(m_timerFile);
+        std::ostringstream err;
+        err << "Could not start a timer with a period of " << period.count() << " ns"
+            << std::endl << strerror(settimeErrno);
+        throw std::runtime_error(err.str());
+    }
+}
+
+
+PeriodicTimer::~PeriodicTimer(void)
+{
+    if (m_timerFile >= 0)
+    {
+        close(m_timerFile);
+    }
+}
+
+
+uint64_t PeriodicTimer::wait(void)
+{
+    uint64_t expirations = 0;
+    if (m_wakeup == TimerWakeup::TIMERFD)
+    {
+        ssize_t result;
+        do
+        {
+            result = read(m_timerFile, &expirations, sizeof(expirations));
+        } while (result < 0 && errno == EINTR);
+        if (result != sizeof(expirations))
+        {
+            std::ostringstream err;
+            err << "Could not wait on a timer" << std::endl << strerror(errno);
+            throw std::runtime_error(err.str());
+        }
+    }
+    else
+    {
+        struct timespec next;
+        next.tv_sec = m_next / 1000000000;
+        next.tv_nsec = m_next % 1000000000;
+        int result;
+        do
+        {
+            result = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, nullptr);
+        } while (result == EINTR);
+        if (result != 0)
+        {
+            std::ostringstream err;
+            err << "Could not sleep until the end of a period" << std::endl << strerror(result);
+            throw std::runtime_error(err.str());
+        }
+    }
+
+    // The timerfd counts the periods that ended itself, clock_nanosleep
+    // returns straight away if the period has already ended so count them
+    int64_t now = monotonicNow();
+    if (m_wakeup != TimerWakeup::TIMERFD)
+    {
+        expirations = 1 + (now > m_next ? (now - m_next) / m_period.count() : 0);
+    }
+    int64_t ended = m_next + static_cast<int64_t>(expirations - 1) * m_period.count();
+    m_lateness.record(now > ended ? now - ended : 0);
+    if (expirations > 1)
+    {
+        m_missed.fetch_add(expirations - 1, std::memory_order_relaxed);
+    }
+    m_next = ended + m_period.count();
+    return expirations;
+}
+
+
+std::chrono::nanoseconds PeriodicTimer::period(void) const
+{
+    return m_period;
+}
+
+
+uint64_t PeriodicTimer::missed(void) const
+{
+    return m_missed.load(std::memory_order_relaxed);
+}
+
+
+const LatencyHistogram &PeriodicTimer::lateness(void) const
+{
+    return m_lateness;
+}
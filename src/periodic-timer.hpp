@@ -0,0 +1,57 @@
+#ifndef PERIODIC_TIMER_HPP
+#define PERIODIC_TIMER_HPP
+
+#include <atomic>
+#include <chrono>
+#include <stdint.h>
+
+#include "metrics.hpp"
+
+
+// How a PeriodicTimer sleeps until the end of a period
+enum class TimerWakeup
+{
+    TIMERFD,  // read() on a periodic timerfd
+    CLOCK_NANOSLEEP  // clock_nanosleep to the absolute end of the period
+};
+
+
+// This class wakes a thread up once every period, against the monotonic clock
+// so the periods don't drift with however long the work between waits takes.
+// Each acquisition loop has its own, so every sensor runs at its own rate.
+// If the work overran one or more periods wait returns straight away without
+// trying to catch up, and the periods that were skipped are counted in missed.
+// How late each wake up was, from the end of the period it was for to
+// wait returning, is counted in lateness, which is the sampling jitter.
+class PeriodicTimer
+{
+    public:
+        // The first period ends one period from now
+        explicit PeriodicTimer(std::chrono::nanoseconds period, TimerWakeup wakeup = TimerWakeup::TIMERFD);
+        ~PeriodicTimer(void);
+
+        // Waits for the current period to end, returning how many periods
+        // ended since the last wait (more than 1 if some were missed)
+        uint64_t wait(void);
+
+        std::chrono::nanoseconds period(void) const;
+
+        // Periods that ended while the thread was still busy, safe to read
+        // from any thread
+        uint64_t missed(void) const;
+
+        // Same, for how late the wake ups were
+        const LatencyHistogram &lateness(void) const;
+
+    private:
+        PeriodicTimer(const PeriodicTimer &);
+        PeriodicTimer &operator=(const PeriodicTimer &);
+        TimerWakeup m_wakeup;
+        int m_timerFile;  // -1 unless m_wakeup is TIMERFD
+        std::chrono::nanoseconds m_period;
+        int64_t m_next;  // When the current period ends, monotonic nanoseconds
+        std::atomic<uint64_t> m_missed;
+        LatencyHistogram m_lateness;
+};
+
+#endif
@@ -0,0 +1,81 @@
+#include <sstream>
+#include <stdexcept>
+#include <stddef.h>
+#include <string.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include "realtime.hpp"
+
+
+// Stack each real time thread gets mapped in up front, well beyond what the
+// acquisition loops use
+constexpr size_t PREFAULT_STACK_SIZE = 256 * 1024;
+
+
+void lockMemory(void)
+{
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+    {
+        std::ostringstream err;
+        err << "Could not lock memory" << std::endl << strerror(errno);
+        throw std::runtime_error(err.str());
+    }
+}
+
+
+void prefaultStack(void)
+{
+    // Written through a volatile pointer so the writes aren't optimised away
+    unsigned char stack[PREFAULT_STACK_SIZE];
+    volatile unsigned char *page = stack;
+    for (size_t offset = 0; offset < PREFAULT_STACK_SIZE; offset += 4096)
+    {
+        page[offset] = 0;
+    }
+}
+
+
+void makeRealtime(pthread_t thread, const RealtimeSettings &settings)
+{
+    if (settings.priority == 0)
+    {
+        return;
+    }
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = settings.priority;
+    int result = pthread_setschedparam(thread, SCHED_FIFO, &param);
+    if (result != 0)
+    {
+        std::ostringstream err;
+        err << "Could not set SCHED_FIFO priority " << settings.priority << std::endl << strerror(result);
+        throw std::runtime_error(err.str());
+    }
+    if (settings.cpu >= 0)
+    {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(settings.cpu, &cpus);
+        result = pthread_setaffinity_np(thread, sizeof(cpus), &cpus);
+        if (result != 0)
+        {
+            std::ostringstream err;
+            err << "Could not pin a thread to cpu " << settings.cpu << std::endl << strerror(result);
+            throw std::runtime_error(err.str());
+        }
+    }
+}
+
+
+void makeRealtime(const RealtimeSettings &settings)
+{
+    makeRealtime(pthread_self(), settings);
+    if (settings.priority != 0)
+    {
+        prefaultStack();
+    }
+}
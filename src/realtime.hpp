@@ -0,0 +1,35 @@
+#ifndef REALTIME_HPP
+#define REALTIME_HPP
+
+#include <pthread.h>
+
+
+// How the acquisition threads are run in real time mode. Threads are put in
+// the SCHED_FIFO class so nothing running at normal priority (the navigation
+// stack, logging) can hold them up, optionally pinned to a single core.
+// Needs root or CAP_SYS_NICE and CAP_IPC_LOCK.
+struct RealtimeSettings
+{
+    public:
+        int priority;  // SCHED_FIFO priority, 1 to 99, 0 to leave threads as they are
+        int cpu;  // Core the threads are pinned to, -1 for any
+};
+
+
+// Locks every page the process has and will ever have into memory, so the
+// acquisition threads never take a page fault (memory mapped flight record
+// files included, they count towards RLIMIT_MEMLOCK without CAP_IPC_LOCK)
+void lockMemory(void);
+
+// Touches PREFAULT_STACK_SIZE bytes of the calling thread's stack so that it
+// is all mapped in (and locked, after lockMemory) before it is needed
+void prefaultStack(void);
+
+// Puts thread in SCHED_FIFO at settings.priority and pins it to settings.cpu
+// if one is given, does nothing if settings.priority is 0
+void makeRealtime(pthread_t thread, const RealtimeSettings &settings);
+
+// Same for the calling thread, then prefaults its stack
+void makeRealtime(const RealtimeSettings &settings);
+
+#endif
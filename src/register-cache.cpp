@@ -0,0 +1,104 @@
+#include <initializer_list>
+#include <stdint.h>
+#include <string.h>
+
+#include "register-cache.hpp"
+
+
+constexpr unsigned int RegisterCache::REGISTERS;
+
+
+RegisterCache::RegisterCache(std::initializer_list<uint8_t> cacheable) :
+    m_hits(0),
+    m_misses(0),
+    m_writes(0),
+    m_skippedWrites(0)
+{
+    memset(m_cacheable, 0, sizeof(m_cacheable));
+    memset(m_valid, 0, sizeof(m_valid));
+    memset(m_values, 0, sizeof(m_values));
+    for (uint8_t reg : cacheable)
+    {
+        m_cacheable[reg] = true;
+    }
+}
+
+
+bool RegisterCache::isCacheable(uint8_t reg) const
+{
+    return m_cacheable[reg];
+}
+
+
+bool RegisterCache::lookup(uint8_t reg, uint8_t &value)
+{
+    if (!m_cacheable[reg])
+    {
+        return false;
+    }
+    if (!m_valid[reg])
+    {
+        m_misses.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    m_hits.fetch_add(1, std::memory_order_relaxed);
+    value = m_values[reg];
+    return true;
+}
+
+
+bool RegisterCache::peek(uint8_t reg, uint8_t &value) const
+{
+    if (!m_valid[reg])
+    {
+        return false;
+    }
+    value = m_values[reg];
+    return true;
+}
+
+
+void RegisterCache::update(uint8_t reg, uint8_t value)
+{
+    if (m_cacheable[reg])
+    {
+        m_values[reg] = value;
+        m_valid[reg] = true;
+    }
+}
+
+
+bool RegisterCache::needsWrite(uint8_t reg, uint8_t value)
+{
+    if (m_valid[reg] && m_values[reg] == value)
+    {
+        m_skippedWrites.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    m_writes.fetch_add(1, std::memory_order_relaxed);
+    update(reg, value);
+    return true;
+}
+
+
+void RegisterCache::invalidate(void)
+{
+    memset(m_valid, 0, sizeof(m_valid));
+}
+
+
+void RegisterCache::invalidate(uint8_t reg)
+{
+    m_valid[reg] = false;
+}
+
+
+RegisterCacheStats RegisterCache::stats(void) const
+{
+    RegisterCacheStats stats;
+    stats.hits = m_hits.load(std::memory_order_relaxed);
+    stats.misses = m_misses.load(std::memory_order_relaxed);
+    stats.writes = m_writes.load(std::memory_order_relaxed);
+    stats.skippedWrites = m_skippedWrites.load(std::memory_order_relaxed);
+    return stats;
+}
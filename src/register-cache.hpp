@@ -0,0 +1,67 @@
+#ifndef REGISTER_CACHE_HPP
+#define REGISTER_CACHE_HPP
+
+#include <atomic>
+#include <initializer_list>
+#include <stdint.h>
+
+
+// Counts of what the cache did, every hit and skipped write is one bus
+// operation saved
+struct RegisterCacheStats
+{
+    public:
+        uint64_t hits;  // Reads answered from the cache
+        uint64_t misses;  // Reads of cacheable registers that went to the bus
+        uint64_t writes;  // Writes that went to the bus
+        uint64_t skippedWrites;  // Writes of a value the register already held
+};
+
+
+// This class shadows a single device's registers in memory so that reading a
+// control register doesn't need the bus, and writing a value the register
+// already holds can be skipped.
+// Only the registers marked cacheable are ever kept. Those should be ones
+// that only change when written (not status or data registers, or bits the
+// device clears itself).
+// Drivers call lookup before reading a register and update after reading it
+// from the bus, and call needsWrite before writing one. If the device might
+// have changed behind our back (a failed transfer, a reset) invalidate makes
+// the next access go to the bus.
+// The cache itself belongs to one thread at a time, but stats can be read
+// from any.
+class RegisterCache
+{
+    public:
+        RegisterCache(std::initializer_list<uint8_t> cacheable);
+        bool isCacheable(uint8_t reg) const;
+
+        // Gets the cached value of reg, false if it isn't cached
+        bool lookup(uint8_t reg, uint8_t &value);
+
+        // Same as lookup but doesn't count towards the stats
+        bool peek(uint8_t reg, uint8_t &value) const;
+
+        // Records a value read from the bus
+        void update(uint8_t reg, uint8_t value);
+
+        // Whether writing value to reg needs to go to the bus, if it does the
+        // cache takes on the new value (write-through)
+        bool needsWrite(uint8_t reg, uint8_t value);
+
+        void invalidate(void);
+        void invalidate(uint8_t reg);
+        RegisterCacheStats stats(void) const;
+
+    private:
+        static constexpr unsigned int REGISTERS = 256;
+        bool m_cacheable[REGISTERS];
+        bool m_valid[REGISTERS];
+        uint8_t m_values[REGISTERS];
+        std::atomic<uint64_t> m_hits;
+        std::atomic<uint64_t> m_misses;
+        std::atomic<uint64_t> m_writes;
+        std::atomic<uint64_t> m_skippedWrites;
+};
+
+#endif
@@ -0,0 +1,140 @@
+// Measures data-server request round trips: text, binary and config requests
+// are each sent -n times (1000 by default) one after the other, printing the
+// p50/p99/p999 round trip and requests per second for each.
+// For comparison it then reads the latest sample from the server's shared
+// memory ring (-s names it) the same number of times, like a local client
+// would instead of making a request.
+// The endpoint defaults to the local data-server, `make bench` runs this
+// against data-server-sim so it needs no hardware.
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <iomanip>
+#include <iostream>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+#include <zmq.hpp>
+
+#include "sensor-sample.hpp"
+#include "shared-memory-ring.hpp"
+
+
+constexpr const char *DEFAULT_ENDPOINT = "tcp://localhost:5555";
+constexpr unsigned int WARMUP_REQUESTS = 10;
+
+
+// Sends request count times, printing how long the round trips took
+static void bench(zmq::socket_t &socket, const char *request, unsigned int count)
+{
+    std::vector<int64_t> times(count);
+    for (unsigned int i = 0; i < WARMUP_REQUESTS + count; ++i)
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        zmq::message_t message(request, strlen(request));
+        socket.send(message);
+        zmq::message_t reply;
+        socket.recv(&reply);
+        if (i >= WARMUP_REQUESTS)
+        {
+            times[i - WARMUP_REQUESTS] = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count();
+        }
+    }
+
+    int64_t total = 0;
+    for (int64_t time : times)
+    {
+        total += time;
+    }
+    std::sort(times.begin(), times.end());
+    std::cout << std::left << std::setw(12) << request << std::right
+              << std::setw(10) << times[count / 2] / 1000
+              << std::setw(10) << times[count * 99 / 100] / 1000
+              << std::setw(10) << times[count * 999 / 1000] / 1000
+              << std::setw(12) << static_cast<int64_t>(count * 1e9 / total) << std::endl;
+}
+
+
+// Reads the latest mpl3115a2 sample from the ring count times, printing how
+// long the reads took (in nanoseconds, they are far too quick for us)
+static void benchSharedMemory(const SharedMemoryRingReader &reader, unsigned int count)
+{
+    std::vector<int64_t> times(count);
+    AltitudeSample sample;
+    uint64_t checksum = 0;
+    for (unsigned int i = 0; i < count; ++i)
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        reader.latest(sample);
+        times[i] = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        checksum += sample.sequence;
+    }
+
+    std::sort(times.begin(), times.end());
+    std::cout << "shared memory latest p50: " << times[count / 2] << " ns p99: " << times[count * 99 / 100]
+              << " ns p999: " << times[count * 999 / 1000] << " ns (checksum " << checksum << ")" << std::endl;
+}
+
+
+static void usage(const char *name)
+{
+    std::cerr << "Usage: " << name << " [-n requests] [-s shared memory name] [endpoint]" << std::endl;
+}
+
+
+int main(int argc, char **argv)
+{
+    unsigned int count = 1000;
+    std::string ringName(SHARED_RING_DEFAULT_NAME);
+    int option;
+    while ((option = getopt(argc, argv, "n:s:")) != -1)
+    {
+        switch (option)
+        {
+            case 'n':
+                count = atoi(optarg);
+                break;
+            case 's':
+                ringName = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (count == 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    std::string endpoint = optind < argc ? argv[optind] : DEFAULT_ENDPOINT;
+
+    zmq::context_t context(1);
+    zmq::socket_t socket(context, ZMQ_REQ);
+    socket.connect(endpoint.c_str());
+
+    std::cout << count << " round trips each to " << endpoint << std::endl;
+    std::cout << std::left << std::setw(12) << "" << std::right
+              << std::setw(10) << "p50 us" << std::setw(10) << "p99 us" << std::setw(10) << "p999 us"
+              << std::setw(12) << "requests/s" << std::endl;
+    bench(socket, "text", count);
+    bench(socket, "binary", count);
+    bench(socket, "config", count);
+
+    // Only there if the server is on this machine with its ring turned on
+    try
+    {
+        SharedMemoryRingReader reader(ringName);
+        benchSharedMemory(reader, count);
+    }
+    catch (const std::exception &e)
+    {
+        std::cout << "No shared memory ring to read: " << e.what() << std::endl;
+    }
+    return 0;
+}
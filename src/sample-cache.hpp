@@ -0,0 +1,100 @@
+#ifndef SAMPLE_CACHE_HPP
+#define SAMPLE_CACHE_HPP
+
+#include <atomic>
+#include <stdint.h>
+#include <string.h>
+#include <type_traits>
+
+
+// This class holds the latest value published by a single writer thread so
+// that any number of reader threads can get at it without locking.
+// It is a seqlock: the writer bumps the sequence to an odd number, stores the
+// value, then bumps it back to an even number. A reader copies the value out
+// and retries if the sequence was odd or changed while it was copying.
+// The value is stored as relaxed atomic words so a torn read is never a data
+// race, it just gets thrown away. T must be trivially copyable.
+template <typename T>
+class SampleCache
+{
+    public:
+        SampleCache(void);
+
+        // Only one thread may publish
+        void publish(const T &value);
+
+        // Copies the latest value into value, returns false if nothing has
+        // been published yet
+        bool read(T &value) const;
+
+        // Number of values published so far
+        uint64_t count(void) const;
+
+    private:
+        static constexpr unsigned int WORDS = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+        std::atomic<uint64_t> m_sequence;
+        std::atomic<uint64_t> m_words[WORDS];
+};
+
+
+template <typename T>
+SampleCache<T>::SampleCache(void) : m_sequence(0)
+{
+    static_assert(std::is_trivially_copyable<T>::value, "SampleCache needs a trivially copyable type");
+    for (unsigned int i = 0; i < WORDS; ++i)
+    {
+        m_words[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+
+template <typename T>
+void SampleCache<T>::publish(const T &value)
+{
+    uint64_t words[WORDS] = {};
+    memcpy(words, &value, sizeof(T));
+
+    // Odd sequence tells readers a write is in progress
+    uint64_t sequence = m_sequence.load(std::memory_order_relaxed);
+    m_sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (unsigned int i = 0; i < WORDS; ++i)
+    {
+        m_words[i].store(words[i], std::memory_order_relaxed);
+    }
+    m_sequence.store(sequence + 2, std::memory_order_release);
+}
+
+
+template <typename T>
+bool SampleCache<T>::read(T &value) const
+{
+    uint64_t words[WORDS];
+    uint64_t before, after;
+    do
+    {
+        before = m_sequence.load(std::memory_order_acquire);
+        for (unsigned int i = 0; i < WORDS; ++i)
+        {
+            words[i] = m_words[i].load(std::memory_order_relaxed);
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        after = m_sequence.load(std::memory_order_relaxed);
+    } while ((before & 1) || before != after);
+
+    if (before == 0)
+    {
+        return false;
+    }
+    memcpy(&value, words, sizeof(T));
+    return true;
+}
+
+
+template <typename T>
+uint64_t SampleCache<T>::count(void) const
+{
+    return m_sequence.load(std::memory_order_acquire) / 2;
+}
+
+#endif
@@ -0,0 +1,681 @@
+// Measures the per-sample cost of the sampling hot path against the simulated
+// bus: raw register reads through the transport, and the MPL3115A2 and
+// LSM9DS1 drivers reading and decoding samples (one at a time and drained from
+// the FIFO). For each it prints the p50/p99/p999 time per call, the bus
+// transactions per sample (each one is a single ioctl on a real adapter),
+// heap allocations per sample and throughput.
+//
+// Before the drivers are timed, pressureToAltitude is checked against the
+// formula the mpl3115a2's altitude mode uses over its whole pressure range,
+// a sample from each is checked against what the simulated lsm9ds1 holds,
+// and recovering a wedged bus has to clear it just once. The mpl3115a2's
+// register cache has to save the bus transactions it claims to, and
+// invalidating or verifying it has to cost the ones it should. Its data ready
+// interrupt, driven by an eventfd, has to get a sample as soon as it fires,
+// fall back to the status register if it never does, and not be fooled by an
+// edge left over from a sample already read. Before the FIFO is timed each
+// slot of it is loaded with a different sample and every frame the drivers
+// drain is checked against its slot. A drain that fails part way mustn't be
+// retried, since the frames already read are gone, and a retry backing off in
+// the scheduler mustn't hold up another device. The sampling paths mustn't
+// allocate once they are warmed up. Exits with 1 if anything comes back wrong
+// or allocates.
+//
+// The drivers are also timed through the bus scheduler (ScheduledI2c), then
+// the lsm9ds1 is timed while several threads keep reading the mpl3115a2 on
+// the same bus, once going straight to the bus and once through the
+// scheduler where the lsm9ds1 has the shorter deadline, with at least
+// CONTENTION_LATENCY_NS per transaction so there is something to fight over.
+//
+// -l adds latency (ns) to every simulated transaction, 0 by default so only
+// the cost on our side of the bus is measured.
+// -a reads from a real adapter as well (e.g. one made by the i2c-stub kernel
+// module) to measure I2cAbstraction::readBytes itself, at the -d address.
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <math.h>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "barometric.hpp"
+#include "bus-scheduler.hpp"
+#include "data-ready.hpp"
+#include "i2c-abstraction.hpp"
+#include "i2c-recovery.hpp"
+#include "lsm9ds1.hpp"
+#include "mpl3115a2.hpp"
+#include "simulated-i2c.hpp"
+
+
+constexpr unsigned int ITERATIONS = 100000;
+constexpr unsigned int WARMUP_ITERATIONS = 1000;
+
+// The contention runs are far slower, every transaction taking real time
+constexpr unsigned int CONTENTION_ITERATIONS = 10000;
+constexpr unsigned int CONTENTION_THREADS = 3;
+constexpr long CONTENTION_LATENCY_NS = 20000;
+constexpr int64_t CONTENTION_DEADLINE_NS = 1000000;
+
+// The mpl3115a2's pressure range and resolution (Pa), and how far
+// pressureToAltitude may be from its altitude mode (m)
+constexpr double MIN_PRESSURE = 20000.0;
+constexpr double MAX_PRESSURE = 110000.0;
+constexpr double PRESSURE_STEP = 0.25;
+constexpr double ALTITUDE_TOLERANCE = 0.04;
+
+// Sea level pressures the altitude is checked at, a deep low to a strong high
+constexpr double SEA_LEVEL_PRESSURES[] = { 95000.0, STANDARD_SEA_LEVEL_PRESSURE, 105000.0 };
+
+// How long the data ready checks leave the mpl3115a2 converting before it
+// has data, and the least the driver waits for an edge before it reads the
+// status anyway
+constexpr std::chrono::milliseconds CONVERSION_DELAY(20);
+constexpr std::chrono::milliseconds DATA_READY_FALLBACK(1000);
+
+// How long the backoff check's retry waits, far longer than a transaction
+constexpr std::chrono::milliseconds RETRY_BACKOFF(50);
+
+// The simulated bus the sensors are attached to
+constexpr unsigned int SIMULATED_ADAPTER = 0;
+constexpr uint8_t MPL3115A2_ADDRESS = 0x60;
+constexpr uint8_t LSM9DS1_XLG_ADDRESS = 0x6A;
+constexpr uint8_t LSM9DS1_M_ADDRESS = 0x1C;
+
+// Every allocation in the program goes through here so they can be counted
+static std::atomic<uint64_t> allocations(0);
+
+
+void *operator new(size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    void *memory = malloc(size == 0 ? 1 : size);
+    if (memory == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+    return memory;
+}
+
+
+void operator delete(void *memory) noexcept
+{
+    free(memory);
+}
+
+
+// Something has to depend on every result or the compiler drops the work
+static uint64_t checksum = 0;
+
+
+// Runs operation (which handles samplesPerCall samples) ITERATIONS times and
+// prints what each call and sample cost. bus is where the transactions are
+// counted, nullptr if operation doesn't use the simulated bus. False if
+// operation allocated after the warm up.
+template <typename Operation>
+static bool bench(const char *name, unsigned int samplesPerCall, SimulatedBus *bus, Operation operation)
+{
+    std::vector<int64_t> times(ITERATIONS);
+    for (unsigned int i = 0; i < WARMUP_ITERATIONS; ++i)
+    {
+        operation();
+    }
+
+    if (bus != nullptr)
+    {
+        bus->resetCounts();
+    }
+    uint64_t allocationsBefore = allocations.load(std::memory_order_relaxed);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (unsigned int i = 0; i < ITERATIONS; ++i)
+    {
+        std::chrono::steady_clock::time_point callStart = std::chrono::steady_clock::now();
+        operation();
+        times[i] = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - callStart).count();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    uint64_t allocationCount = allocations.load(std::memory_order_relaxed) - allocationsBefore;
+
+    std::sort(times.begin(), times.end());
+    double samples = static_cast<double>(ITERATIONS) * samplesPerCall;
+    std::cout << std::left << std::setw(32) << name << std::right
+              << std::setw(9) << times[ITERATIONS / 2]
+              << std::setw(9) << times[ITERATIONS * 99 / 100]
+              << std::setw(9) << times[ITERATIONS * 999 / 1000]
+              << std::fixed << std::setprecision(3);
+    if (bus != nullptr)
+    {
+        std::cout << std::setw(10) << bus->transactionCount() / samples;
+    }
+    else
+    {
+        std::cout << std::setw(10) << 1.0 / samplesPerCall;
+    }
+    std::cout << std::setw(10) << allocationCount / samples
+              << std::setprecision(0) << std::setw(12) << samples / elapsed.count()
+              << std::defaultfloat << (allocationCount == 0 ? "" : "  allocates, FAILED") << std::endl;
+    return allocationCount == 0;
+}
+
+
+// Times lsm9ds1 getSample while CONTENTION_THREADS threads keep reading the
+// mpl3115a2 through their own Transport, printing the p50/p99/p999 time
+template <typename Transport, typename Imu>
+static void benchContention(const char *name, Imu &lsm9ds1)
+{
+    std::atomic<bool> stopping(false);
+    std::vector<std::thread> readers;
+    for (unsigned int i = 0; i < CONTENTION_THREADS; ++i)
+    {
+        readers.push_back(std::thread([&stopping]()
+        {
+            Transport connection(SIMULATED_ADAPTER, MPL3115A2_ADDRESS);
+            uint8_t data[5];
+            while (!stopping.load(std::memory_order_relaxed))
+            {
+                connection.readBytes(0x01, data, sizeof(data));
+            }
+        }));
+    }
+
+    std::vector<int64_t> times(CONTENTION_ITERATIONS);
+    for (unsigned int i = 0; i < CONTENTION_ITERATIONS; ++i)
+    {
+        std::chrono::steady_clock::time_point callStart = std::chrono::steady_clock::now();
+        LSM9DS1DATA data = lsm9ds1.getSample();
+        times[i] = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - callStart).count();
+        checksum += data.accel[2];
+    }
+    stopping.store(true, std::memory_order_relaxed);
+    for (std::thread &reader : readers)
+    {
+        reader.join();
+    }
+
+    std::sort(times.begin(), times.end());
+    std::cout << std::left << std::setw(32) << name << std::right
+              << std::setw(9) << times[CONTENTION_ITERATIONS / 2]
+              << std::setw(9) << times[CONTENTION_ITERATIONS * 99 / 100]
+              << std::setw(9) << times[CONTENTION_ITERATIONS * 999 / 1000] << std::endl;
+}
+
+
+// Checks pressureToAltitude against the barometric formula the mpl3115a2
+// works altitude out with in altitude mode, at every pressure it can report
+static bool checkAltitude(void)
+{
+    bool ok = true;
+    for (double seaLevelPressure : SEA_LEVEL_PRESSURES)
+    {
+        double worst = 0.0;
+        double worstPressure = MIN_PRESSURE;
+        for (double pressure = MIN_PRESSURE; pressure <= MAX_PRESSURE; pressure += PRESSURE_STEP)
+        {
+            double altitude = 44330.77 * (1.0 - pow(pressure / seaLevelPressure, 0.1902632));
+            double error = fabs(pressureToAltitude(pressure, seaLevelPressure) - altitude);
+            if (error > worst)
+            {
+                worst = error;
+                worstPressure = pressure;
+            }
+        }
+        ok = ok && worst <= ALTITUDE_TOLERANCE;
+        std::cout << "pressureToAltitude, sea level " << seaLevelPressure << " Pa: worst " << worst * 100
+                  << " cm at " << worstPressure << " Pa" << (worst <= ALTITUDE_TOLERANCE ? ", ok" : ", FAILED")
+                  << std::endl;
+    }
+    return ok;
+}
+
+
+// Checks lsm9ds1 reads the magnetometer the model holds, x y z, both on its
+// own and as part of a whole sample
+template <typename Imu>
+static bool checkMag(const char *name, Imu &lsm9ds1, LSM9DS1MagModel &model)
+{
+    const int16_t expected[3] = { 1234, -567, 890 };
+    model.setMag(expected[0], expected[1], expected[2]);
+    std::array<int16_t, 3> mag = lsm9ds1.getMag();
+    LSM9DS1DATA data = lsm9ds1.getSample();
+    bool ok = true;
+    for (unsigned int axis = 0; axis < 3; ++axis)
+    {
+        ok = ok && mag[axis] == expected[axis] && data.mag[axis] == expected[axis];
+    }
+    std::cout << name << " magnetometer: " << (ok ? "x y z, ok" : "wrong, FAILED") << std::endl;
+    return ok;
+}
+
+
+// Wedges the bus and has lsm9ds1 recover it, which has to clear the bus once
+// (not once per connection) and leave the device sampling again
+template <typename Imu>
+static bool checkRecover(const char *name, Imu &lsm9ds1, SimulatedBus &bus)
+{
+    uint64_t recoveries = bus.recoveryCount();
+    bus.wedge();
+    LSM9DS1DATA data;
+    bool ok = !lsm9ds1.tryGetSample(data);
+    ok = lsm9ds1.recover() && ok;
+    uint64_t recovered = bus.recoveryCount() - recoveries;
+    ok = ok && recovered == 1 && lsm9ds1.tryGetSample(data);
+    std::cout << name << " recover: bus recovered " << recovered << " time(s)" << (ok ? ", ok" : ", FAILED")
+              << std::endl;
+    return ok;
+}
+
+
+// Counts the bus transactions the mpl3115a2's register cache costs and saves.
+// Invalidated, verifying it has nothing to read back and reads the two
+// control registers it keeps track of from the bus. Verified again it reads
+// back just those two. Configuring what it already holds then goes nowhere
+// near the bus, until a register changed behind its back is found by
+// verifying and configuring the old value again writes it.
+template <typename Barometer>
+static bool checkRegisterCache(const char *name, Barometer &mpl3115a2, MPL3115A2Model &model, SimulatedBus &bus)
+{
+    constexpr uint8_t CTRL_REG2 = 0x27;
+    uint8_t step = mpl3115a2.timeStep();
+    uint8_t changedStep = (step + 1) % 16;
+    RegisterCacheStats before = mpl3115a2.registerCacheStats();
+
+    mpl3115a2.invalidateRegisterCache();
+    uint64_t start = bus.transactionCount();
+    bool ok = mpl3115a2.verifyRegisterCache();
+    uint64_t invalidated = bus.transactionCount() - start;
+
+    start = bus.transactionCount();
+    ok = mpl3115a2.verifyRegisterCache() && ok;
+    uint64_t verified = bus.transactionCount() - start;
+
+    start = bus.transactionCount();
+    mpl3115a2.configureOversampling(mpl3115a2.oversampling());
+    mpl3115a2.configureTimeStep(step);
+    uint64_t unchanged = bus.transactionCount() - start;
+
+    model.poke(CTRL_REG2, changedStep);
+    ok = !mpl3115a2.verifyRegisterCache() && mpl3115a2.timeStep() == changedStep && ok;
+    start = bus.transactionCount();
+    mpl3115a2.configureTimeStep(step);
+    uint64_t changed = bus.transactionCount() - start;
+    ok = ok && model.peek(CTRL_REG2) == step;
+
+    RegisterCacheStats after = mpl3115a2.registerCacheStats();
+    ok = ok && invalidated == 2 && verified == 2 && unchanged == 0 && changed > 0 &&
+         after.hits > before.hits && after.skippedWrites > before.skippedWrites;
+    std::cout << name << " register cache: " << invalidated << " transactions invalidated, " << verified
+              << " verified, " << unchanged << " configuring what it holds, " << changed
+              << " rewriting a changed register" << (ok ? ", ok" : ", FAILED") << std::endl;
+    return ok;
+}
+
+
+// Has the mpl3115a2 model finish a conversion after CONVERSION_DELAY,
+// signalling data ready if signalled is set, and times tryGetSample waiting
+// for it
+template <typename Barometer>
+static std::chrono::milliseconds timeConversion(Barometer &mpl3115a2, MPL3115A2Model &model,
+                                                EventFdDataReady &dataReady, bool signalled, bool &sampled)
+{
+    model.setStatusStuck(true);
+    std::thread conversion([&model, &dataReady, signalled]()
+    {
+        std::this_thread::sleep_for(CONVERSION_DELAY);
+        model.setStatusStuck(false);
+        if (signalled)
+        {
+            dataReady.signal();
+        }
+    });
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    MPL3115A2DATA data;
+    sampled = mpl3115a2.tryGetSample(data);
+    std::chrono::steady_clock::duration waited = std::chrono::steady_clock::now() - start;
+    conversion.join();
+    return std::chrono::duration_cast<std::chrono::milliseconds>(waited);
+}
+
+
+// Wires an eventfd in as the mpl3115a2's data ready interrupt on INT1, which
+// has to route data ready there and nothing else. A sample has to come as
+// soon as data ready fires, or once the driver gives up on the edge and reads
+// the status if it never does. An edge for a sample that was read without
+// waiting stays queued, and the next sample still has to wait for its own
+// conversion rather than take that edge for it.
+static bool checkDataReady(MPL3115A2Model &model)
+{
+    constexpr uint8_t CTRL_REG3 = 0x28;
+    constexpr uint8_t CTRL_REG4 = 0x29;
+    constexpr uint8_t CTRL_REG5 = 0x2A;
+    constexpr uint8_t INT_DRDY = 0x80;
+    SimulatedMPL3115A2 mpl3115a2(SIMULATED_ADAPTER);
+    // A plain new has GCC take the free in operator delete above for a
+    // mismatched one (-Wmismatched-new-delete)
+    EventFdDataReady *dataReady = new (std::nothrow) EventFdDataReady();
+    if (dataReady == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+    mpl3115a2.useDataReadyInterrupt(std::unique_ptr<DataReadySource>(dataReady), MPL3115A2INTPIN::INT1);
+    bool ok = model.peek(CTRL_REG3) == 0 && model.peek(CTRL_REG4) == INT_DRDY && model.peek(CTRL_REG5) == INT_DRDY;
+
+    bool sampled;
+    std::chrono::milliseconds signalled = timeConversion(mpl3115a2, model, *dataReady, true, sampled);
+    ok = ok && sampled && signalled >= CONVERSION_DELAY && signalled < DATA_READY_FALLBACK;
+    std::chrono::milliseconds missed = timeConversion(mpl3115a2, model, *dataReady, false, sampled);
+    ok = ok && sampled && missed >= DATA_READY_FALLBACK;
+
+    MPL3115A2DATA data;
+    dataReady->signal();
+    ok = mpl3115a2.tryGetSample(data) && ok;
+    std::chrono::milliseconds stale = timeConversion(mpl3115a2, model, *dataReady, true, sampled);
+    ok = ok && sampled && stale >= CONVERSION_DELAY && stale < DATA_READY_FALLBACK;
+
+    std::cout << "mpl3115a2 data ready: " << signalled.count() << " ms signalled, " << missed.count()
+              << " ms missed, " << stale.count() << " ms after a stale edge" << (ok ? ", ok" : ", FAILED")
+              << std::endl;
+    return ok;
+}
+
+
+// Loads count samples into the FIFO model, each different, then drains them
+// through lsm9ds1 raw and scaled and checks every frame is its own slot
+template <typename Imu>
+static bool checkFifoFrames(const char *name, Imu &lsm9ds1, LSM9DS1AccelGyroModel &model, unsigned int count)
+{
+    int16_t samples[LSM9DS1FIFOBATCH::DEPTH][6];
+    for (unsigned int slot = 0; slot < count; ++slot)
+    {
+        for (unsigned int value = 0; value < 6; ++value)
+        {
+            samples[slot][value] = static_cast<int16_t>(1000 * (value + 1) + 31 * slot - 3000);
+        }
+    }
+    model.loadFifo(samples, count, false);
+    LSM9DS1FIFOBATCH batch = lsm9ds1.readFifo();
+    bool ok = batch.count == count;
+    for (unsigned int slot = 0; ok && slot < count; ++slot)
+    {
+        for (unsigned int axis = 0; axis < 3; ++axis)
+        {
+            ok = ok && batch.samples[slot].gyro[axis] == samples[slot][axis] &&
+                 batch.samples[slot].accel[axis] == samples[slot][3 + axis];
+        }
+    }
+
+    model.loadFifo(samples, count, false);
+    LSM9DS1FIFOSCALED scaled;
+    ok = ok && lsm9ds1.tryReadFifoScaled(scaled) && scaled.count == count;
+    for (unsigned int slot = 0; ok && slot < count; ++slot)
+    {
+        for (unsigned int axis = 0; axis < 3; ++axis)
+        {
+            float gyro = samples[slot][axis] * lsm9ds1.gyroCalibration().scale[axis];
+            float accel = samples[slot][3 + axis] * lsm9ds1.accelCalibration().scale[axis];
+            ok = ok && fabsf(scaled.gyro[3 * slot + axis] - gyro) <= 1e-6f * fabsf(gyro) &&
+                 fabsf(scaled.accel[3 * slot + axis] - accel) <= 1e-6f * fabsf(accel);
+        }
+    }
+    std::cout << name << " FIFO, " << count << " frames: " << (ok ? "each from its own slot, ok" : "wrong, FAILED")
+              << std::endl;
+    return ok;
+}
+
+
+// Loads the FIFO then has the bus fail a drain part way through, after
+// FIFO_SRC and two frames have been read. The drain has to fail rather than
+// be retried (which would hand back later frames in the wrong slots), and the
+// next drain has to get the frames that were left, each from its own slot.
+template <typename Imu>
+static bool checkFifoFailure(const char *name, Imu &lsm9ds1, LSM9DS1AccelGyroModel &model, SimulatedBus &bus)
+{
+    constexpr unsigned int COUNT = 13;
+    constexpr unsigned int READ = 2;
+    int16_t samples[COUNT][6];
+    for (unsigned int slot = 0; slot < COUNT; ++slot)
+    {
+        for (unsigned int value = 0; value < 6; ++value)
+        {
+            samples[slot][value] = static_cast<int16_t>(-1000 * (value + 1) + 17 * slot);
+        }
+    }
+    model.loadFifo(samples, COUNT, false);
+    bus.injectNak(LSM9DS1_XLG_ADDRESS, 1, 1 + 2 * READ);
+    LSM9DS1FIFOBATCH batch;
+    bool ok = !lsm9ds1.tryReadFifo(batch);
+    ok = ok && lsm9ds1.tryReadFifo(batch) && batch.count == COUNT - READ;
+    for (unsigned int slot = 0; ok && slot < batch.count; ++slot)
+    {
+        for (unsigned int axis = 0; axis < 3; ++axis)
+        {
+            ok = ok && batch.samples[slot].gyro[axis] == samples[READ + slot][axis] &&
+                 batch.samples[slot].accel[axis] == samples[READ + slot][3 + axis];
+        }
+    }
+    std::cout << name << " FIFO, failed part way: " << (ok ? "not retried, ok" : "retried, FAILED") << std::endl;
+    return ok;
+}
+
+
+// Has a scheduled mpl3115a2 read fail twice so its second retry backs off
+// RETRY_BACKOFF, and reads the lsm9ds1 through the scheduler meanwhile. That
+// has to go straight through, and the mpl3115a2 read has to work in the end.
+static bool checkRetryBackoff(SimulatedBus &bus)
+{
+    I2cRetryPolicy policy = i2cRetryPolicy();
+    I2cRetryPolicy slow = policy;
+    slow.attempts = 3;
+    slow.backoff = RETRY_BACKOFF;
+    slow.maxBackoff = RETRY_BACKOFF;
+    setI2cRetryPolicy(slow);
+    bus.injectNak(MPL3115A2_ADDRESS, 2, 0);
+
+    bool retried = false;
+    std::thread retrying([&retried]()
+    {
+        ScheduledI2c mpl3115a2(SIMULATED_ADAPTER, MPL3115A2_ADDRESS);
+        uint8_t data[5];
+        retried = mpl3115a2.tryReadBytes(0x01, data, sizeof(data));
+    });
+    std::this_thread::sleep_for(RETRY_BACKOFF / 5);
+    ScheduledI2c lsm9ds1(SIMULATED_ADAPTER, LSM9DS1_XLG_ADDRESS);
+    uint8_t data[6];
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    bool read = lsm9ds1.tryReadBytes(0x28, data, sizeof(data));
+    std::chrono::steady_clock::duration waited = std::chrono::steady_clock::now() - start;
+    retrying.join();
+    setI2cRetryPolicy(policy);
+
+    bool ok = read && retried && waited < RETRY_BACKOFF / 5;
+    std::cout << "scheduled lsm9ds1 read while the mpl3115a2 backs off: waited "
+              << std::chrono::duration_cast<std::chrono::microseconds>(waited).count() << " us"
+              << (ok ? ", ok" : ", FAILED") << std::endl;
+    return ok;
+}
+
+
+static void usage(const char *name)
+{
+    std::cerr << "Usage: " << name << " [-l simulated latency (ns)] [-a adapter [-d address]]" << std::endl
+              << "  -a also times I2cAbstraction::readBytes on a real adapter (e.g. i2c-stub)" << std::endl
+              << "  -d is the address to read from there, 0x60 by default" << std::endl;
+}
+
+
+int main(int argc, char **argv)
+{
+    long latency = 0;
+    int realAdapter = -1;
+    long realAddress = MPL3115A2_ADDRESS;
+    int option;
+    while ((option = getopt(argc, argv, "l:a:d:")) != -1)
+    {
+        switch (option)
+        {
+            case 'l':
+                latency = atol(optarg);
+                break;
+            case 'a':
+                realAdapter = atoi(optarg);
+                break;
+            case 'd':
+                realAddress = strtol(optarg, nullptr, 0);
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (latency < 0 || realAddress < 0 || realAddress > 0x7F)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    std::shared_ptr<MPL3115A2Model> mplModel = std::make_shared<MPL3115A2Model>();
+    std::shared_ptr<LSM9DS1AccelGyroModel> accelGyroModel = std::make_shared<LSM9DS1AccelGyroModel>();
+    std::shared_ptr<LSM9DS1MagModel> magModel = std::make_shared<LSM9DS1MagModel>();
+    mplModel->setPressure(98765.25);
+    mplModel->setTemperature(21.5);
+    accelGyroModel->setAccel(120, -340, 16250);
+    accelGyroModel->setGyro(-12, 7, 3);
+    magModel->setMag(1200, -300, 4500);
+    SimulatedBus &bus = SimulatedBus::adapter(SIMULATED_ADAPTER);
+    bus.attach(MPL3115A2_ADDRESS, mplModel);
+    bus.attach(LSM9DS1_XLG_ADDRESS, accelGyroModel);
+    bus.attach(LSM9DS1_M_ADDRESS, magModel);
+    bus.setLatency(std::chrono::nanoseconds(latency));
+
+    SimulatedI2c connection(SIMULATED_ADAPTER, MPL3115A2_ADDRESS);
+    SimulatedMPL3115A2 mpl3115a2(SIMULATED_ADAPTER);
+    SimulatedLSM9DS1 lsm9ds1(SIMULATED_ADAPTER);
+    BusScheduler::useBackend(SIMULATED_ADAPTER, std::make_shared<SimulatedBusBackend>(SIMULATED_ADAPTER));
+    ScheduledMPL3115A2 scheduledMpl3115a2(SIMULATED_ADAPTER);
+    ScheduledLSM9DS1 scheduledLsm9ds1(SIMULATED_ADAPTER);
+
+    bool passed = checkAltitude();
+    passed = checkMag("lsm9ds1", lsm9ds1, *magModel) && passed;
+    passed = checkMag("scheduled lsm9ds1", scheduledLsm9ds1, *magModel) && passed;
+    passed = checkRecover("lsm9ds1", lsm9ds1, bus) && passed;
+    passed = checkRecover("scheduled lsm9ds1", scheduledLsm9ds1, bus) && passed;
+    passed = checkRegisterCache("mpl3115a2", mpl3115a2, *mplModel, bus) && passed;
+    passed = checkRegisterCache("scheduled mpl3115a2", scheduledMpl3115a2, *mplModel, bus) && passed;
+    passed = checkDataReady(*mplModel) && passed;
+    magModel->setMag(1200, -300, 4500);
+
+    std::cout << ITERATIONS << " calls each, simulated bus latency " << latency << " ns" << std::endl
+              << "Times are per call, ioctls and allocs per sample" << std::endl;
+    std::cout << std::left << std::setw(32) << "" << std::right
+              << std::setw(9) << "p50 ns" << std::setw(9) << "p99 ns" << std::setw(9) << "p999 ns"
+              << std::setw(10) << "ioctls" << std::setw(10) << "allocs"
+              << std::setw(12) << "samples/s" << std::endl;
+
+    passed = bench("transport readBytes (5 bytes)", 1, &bus, [&]()
+    {
+        uint8_t data[5];
+        connection.readBytes(0x01, data, sizeof(data));
+        checksum += data[0];
+    }) && passed;
+    passed = bench("mpl3115a2 getSample", 1, &bus, [&]()
+    {
+        MPL3115A2DATA data = mpl3115a2.getSample();
+        checksum += static_cast<uint64_t>(data.pressure);
+    }) && passed;
+    mpl3115a2.configureFifo(true);
+    passed = bench("mpl3115a2 readFifo (32)", MPL3115A2FIFOBATCH::DEPTH, &bus, [&]()
+    {
+        mplModel->setFifoLevel(MPL3115A2FIFOBATCH::DEPTH, false);
+        MPL3115A2FIFOBATCH batch = mpl3115a2.readFifo();
+        checksum += batch.count;
+    }) && passed;
+    mpl3115a2.configureFifo(false);
+    passed = bench("mpl3115a2 getAltitude", 1, &bus, [&]()
+    {
+        MPL3115A2DATA data = mpl3115a2.getAltitude();
+        checksum += static_cast<uint64_t>(data.altitude);
+    }) && passed;
+    passed = bench("lsm9ds1 getSample", 1, &bus, [&]()
+    {
+        LSM9DS1DATA data = lsm9ds1.getSample();
+        checksum += data.accel[2];
+    }) && passed;
+    passed = bench("scheduled mpl3115a2 getSample", 1, &bus, [&]()
+    {
+        MPL3115A2DATA data = scheduledMpl3115a2.getSample();
+        checksum += static_cast<uint64_t>(data.pressure);
+    }) && passed;
+    passed = bench("scheduled lsm9ds1 getSample", 1, &bus, [&]()
+    {
+        LSM9DS1DATA data = scheduledLsm9ds1.getSample();
+        checksum += data.accel[2];
+    }) && passed;
+    lsm9ds1.configureFifo(LSM9DS1ODR::ODR_952HZ);
+    std::cout << std::endl;
+    for (unsigned int count : { 1u, 13u, LSM9DS1FIFOBATCH::DEPTH })
+    {
+        passed = checkFifoFrames("lsm9ds1", lsm9ds1, *accelGyroModel, count) && passed;
+        passed = checkFifoFrames("scheduled lsm9ds1", scheduledLsm9ds1, *accelGyroModel, count) && passed;
+    }
+    passed = checkFifoFailure("lsm9ds1", lsm9ds1, *accelGyroModel, bus) && passed;
+    passed = checkFifoFailure("scheduled lsm9ds1", scheduledLsm9ds1, *accelGyroModel, bus) && passed;
+    passed = checkRetryBackoff(bus) && passed;
+    std::cout << std::endl;
+    passed = bench("lsm9ds1 readFifo (32)", LSM9DS1FIFOBATCH::DEPTH, &bus, [&]()
+    {
+        accelGyroModel->setFifoLevel(LSM9DS1FIFOBATCH::DEPTH, false);
+        LSM9DS1FIFOBATCH batch = lsm9ds1.readFifo();
+        checksum += batch.count;
+    }) && passed;
+    passed = bench("lsm9ds1 readFifoScaled (32)", LSM9DS1FIFOBATCH::DEPTH, &bus, [&]()
+    {
+        accelGyroModel->setFifoLevel(LSM9DS1FIFOBATCH::DEPTH, false);
+        LSM9DS1FIFOSCALED batch;
+        lsm9ds1.tryReadFifoScaled(batch);
+        checksum += batch.count;
+    }) && passed;
+    passed = bench("scheduled lsm9ds1 readFifo (32)", LSM9DS1FIFOBATCH::DEPTH, &bus, [&]()
+    {
+        accelGyroModel->setFifoLevel(LSM9DS1FIFOBATCH::DEPTH, false);
+        LSM9DS1FIFOBATCH batch = scheduledLsm9ds1.readFifo();
+        checksum += batch.count;
+    }) && passed;
+
+    // The lsm9ds1 is what has to keep up, so it gets the short deadline
+    BusScheduler &scheduler = BusScheduler::adapter(SIMULATED_ADAPTER);
+    scheduler.setDeadline(LSM9DS1_XLG_ADDRESS, std::chrono::nanoseconds(CONTENTION_DEADLINE_NS));
+    scheduler.setDeadline(LSM9DS1_M_ADDRESS, std::chrono::nanoseconds(CONTENTION_DEADLINE_NS));
+    long contentionLatency = latency > CONTENTION_LATENCY_NS ? latency : CONTENTION_LATENCY_NS;
+    bus.setLatency(std::chrono::nanoseconds(contentionLatency));
+    std::cout << std::endl << "lsm9ds1 getSample, " << CONTENTION_ITERATIONS << " calls while "
+              << CONTENTION_THREADS << " threads read the mpl3115a2, simulated bus latency "
+              << contentionLatency << " ns" << std::endl;
+    benchContention<SimulatedI2c>("direct", lsm9ds1);
+    benchContention<ScheduledI2c>("scheduled", scheduledLsm9ds1);
+    std::cout << BusScheduler::formatStats();
+    bus.setLatency(std::chrono::nanoseconds(latency));
+
+    if (realAdapter >= 0)
+    {
+        I2cAbstraction realConnection(realAdapter, realAddress);
+        passed = bench("I2cAbstraction readBytes (5)", 1, nullptr, [&]()
+        {
+            uint8_t data[5];
+            realConnection.readBytes(0x01, data, sizeof(data));
+            checksum += data[0];
+        }) && passed;
+    }
+
+    std::cout << "Checksum: " << checksum << std::endl;
+    return passed ? 0 : 1;
+}
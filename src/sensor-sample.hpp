@@ -0,0 +1,61 @@
+#ifndef SENSOR_SAMPLE_HPP
+#define SENSOR_SAMPLE_HPP
+
+#include <stdint.h>
+
+#include "imu-calibration.hpp"
+#include "lsm9ds1.hpp"
+#include "mpl3115a2.hpp"
+#include "orientation.hpp"
+#include "vertical-estimator.hpp"
+
+
+// A single mpl3115a2 reading along with when it was taken.
+// sequence starts at 1 and increments with every sample taken, timestamp is
+// nanoseconds on the steady (monotonic) clock.
+struct AltitudeSample
+{
+    uint64_t sequence;
+    int64_t timestamp;
+    MPL3115A2DATA data;
+};
+
+
+// Same as AltitudeSample but for the raw lsm9ds1 axes
+struct ImuSample
+{
+    uint64_t sequence;
+    int64_t timestamp;
+    LSM9DS1DATA data;
+};
+
+
+// Same as AltitudeSample but for the orientation worked out from the lsm9ds1
+struct OrientationSample
+{
+    uint64_t sequence;
+    int64_t timestamp;
+    Orientation data;
+};
+
+
+// Same as AltitudeSample but for the altitude and vertical velocity fused
+// from both sensors
+struct VerticalSample
+{
+    uint64_t sequence;
+    int64_t timestamp;
+    VerticalEstimate data;
+};
+
+
+// Same as AltitudeSample but for the calibration the lsm9ds1 samples are
+// turned into physical units with, a sample each time it changes
+struct CalibrationSample
+{
+    uint64_t sequence;
+    int64_t timestamp;
+    ImuCalibration data;
+};
+
+#endif
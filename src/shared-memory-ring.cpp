@@ -0,0 +1,286 @@
+#include <atomic>
+#include <new>
+#include <sstream>
+#include <stdexcept>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <string.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sensor-sample.hpp"
+#include "shared-memory-ring.hpp"
+#include "wire-format.hpp"
+
+
+constexpr unsigned int SharedRingSlot::WORDS;
+
+static_assert(sizeof(SharedRingSlot) == SHARED_RING_SLOT_SIZE, "Slots must be one block");
+static_assert(sizeof(SharedRingChannel) == SHARED_RING_SLOT_SIZE, "Channels must be one block");
+static_assert(SharedRingSlot::WORDS * sizeof(uint64_t) >= WIRE_MAX_RECORD_SIZE, "Records must fit in a slot");
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "Other processes can only see lock-free atomics");
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "Readers expect little-endian");
+
+// Header fields
+constexpr size_t HEADER_VERSION_OFFSET = 8;
+constexpr size_t HEADER_CHANNELS_OFFSET = 12;
+constexpr size_t HEADER_SLOTS_OFFSET = 16;
+constexpr size_t HEADER_SLOT_SIZE_OFFSET = 20;
+constexpr size_t HEADER_REALTIME_OFFSET = 24;
+constexpr size_t HEADER_MONOTONIC_OFFSET = 32;
+
+
+static int64_t clockNanoseconds(clockid_t clock)
+{
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return static_cast<int64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+
+// Bytes for the header, the channels and their slots
+static size_t ringSize(unsigned int slots)
+{
+    return (1 + SHARED_RING_CHANNELS + static_cast<size_t>(SHARED_RING_CHANNELS) * slots) * SHARED_RING_SLOT_SIZE;
+}
+
+
+SharedMemoryRing::SharedMemoryRing(const std::string &name, unsigned int slots) :
+    m_name(name),
+    m_slots(slots),
+    m_size(ringSize(slots)),
+    m_mapping(nullptr),
+    m_channels(nullptr),
+    m_slotArray(nullptr)
+{
+    if (slots == 0 || (slots & (slots - 1)) != 0)
+    {
+        std::ostringstream err;
+        err << "Shared memory ring slots must be a power of two, not " << slots;
+        throw std::invalid_argument(err.str());
+    }
+
+    // A fresh object every time, readers still mapping an old one (e.g. from
+    // before a crash) see it stop moving and can open the new one
+    shm_unlink(name.c_str());
+    int file = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (file < 0)
+    {
+        std::ostringstream err;
+        err << "Could not create shared memory " << name << std::endl << strerror(errno);
+        throw std::runtime_error(err.str());
+    }
+    void *mapping = MAP_FAILED;
+    if (ftruncate(file, m_size) == 0)
+    {
+        mapping = mmap(nullptr, m_size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+    }
+    int error = errno;
+    close(file);
+    if (mapping == MAP_FAILED)
+    {
+        shm_unlink(name.c_str());
+        std::ostringstream err;
+        err << "Could not map " << m_size << " bytes of shared memory " << name << std::endl << strerror(error);
+        throw std::runtime_error(err.str());
+    }
+    m_mapping = static_cast<uint8_t *>(mapping);
+
+    // The object starts out zeroed, which is what every count and sequence
+    // starts at, so the atomics only need constructing in place
+    m_channels = reinterpret_cast<SharedRingChannel *>(m_mapping + SHARED_RING_SLOT_SIZE);
+    m_slotArray = reinterpret_cast<SharedRingSlot *>(m_mapping + (1 + SHARED_RING_CHANNELS) * SHARED_RING_SLOT_SIZE);
+    for (unsigned int channel = 0; channel < SHARED_RING_CHANNELS; ++channel)
+    {
+        new (&m_channels[channel]) SharedRingChannel();
+        m_channels[channel].published.store(0, std::memory_order_relaxed);
+    }
+    m_channels[SHARED_RING_MPL3115A2].sensor = SENSOR_MPL3115A2;
+    m_channels[SHARED_RING_LSM9DS1].sensor = SENSOR_LSM9DS1;
+    for (size_t slot = 0; slot < static_cast<size_t>(SHARED_RING_CHANNELS) * slots; ++slot)
+    {
+        new (&m_slotArray[slot]) SharedRingSlot();
+    }
+
+    uint32_t version = SHARED_RING_VERSION;
+    uint32_t channels = SHARED_RING_CHANNELS;
+    uint32_t slotSize = SHARED_RING_SLOT_SIZE;
+    int64_t realtime = clockNanoseconds(CLOCK_REALTIME);
+    int64_t monotonic = clockNanoseconds(CLOCK_MONOTONIC);
+    memcpy(m_mapping + HEADER_VERSION_OFFSET, &version, sizeof(version));
+    memcpy(m_mapping + HEADER_CHANNELS_OFFSET, &channels, sizeof(channels));
+    memcpy(m_mapping + HEADER_SLOTS_OFFSET, &slots, sizeof(uint32_t));
+    memcpy(m_mapping + HEADER_SLOT_SIZE_OFFSET, &slotSize, sizeof(slotSize));
+    memcpy(m_mapping + HEADER_REALTIME_OFFSET, &realtime, sizeof(realtime));
+    memcpy(m_mapping + HEADER_MONOTONIC_OFFSET, &monotonic, sizeof(monotonic));
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(m_mapping, SHARED_RING_MAGIC, sizeof(SHARED_RING_MAGIC));
+}
+
+
+SharedMemoryRing::~SharedMemoryRing(void)
+{
+    munmap(m_mapping, m_size);
+    shm_unlink(m_name.c_str());
+}
+
+
+void SharedMemoryRing::publish(const AltitudeSample &sample)
+{
+    publish(SHARED_RING_MPL3115A2, sample);
+}
+
+
+void SharedMemoryRing::publish(const ImuSample &sample)
+{
+    publish(SHARED_RING_LSM9DS1, sample);
+}
+
+
+template <typename Sample>
+void SharedMemoryRing::publish(unsigned int channel, const Sample &sample)
+{
+    uint64_t words[SharedRingSlot::WORDS] = {};
+    encodeBinary(sample, 0, reinterpret_cast<uint8_t *>(words));
+
+    // Same dance as SampleCache::publish, with the record number in the
+    // sequence so readers can tell which record a slot holds
+    SharedRingChannel &header = m_channels[channel];
+    uint64_t record = header.published.load(std::memory_order_relaxed);
+    SharedRingSlot &slot = m_slotArray[static_cast<size_t>(channel) * m_slots + (record & (m_slots - 1))];
+    slot.sequence.store(2 * record + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (unsigned int i = 0; i < SharedRingSlot::WORDS; ++i)
+    {
+        slot.words[i].store(words[i], std::memory_order_relaxed);
+    }
+    slot.sequence.store(2 * record + 2, std::memory_order_release);
+    header.published.store(record + 1, std::memory_order_release);
+}
+
+
+SharedMemoryRingReader::SharedMemoryRingReader(const std::string &name) :
+    m_size(0),
+    m_mapping(nullptr),
+    m_slots(0),
+    m_channels(nullptr),
+    m_slotArray(nullptr)
+{
+    int file = shm_open(name.c_str(), O_RDONLY, 0);
+    if (file < 0)
+    {
+        std::ostringstream err;
+        err << "Could not open shared memory " << name << std::endl << strerror(errno);
+        throw std::runtime_error(err.str());
+    }
+    struct stat status;
+    void *mapping = MAP_FAILED;
+    if (fstat(file, &status) == 0 && static_cast<size_t>(status.st_size) >= ringSize(0))
+    {
+        m_size = status.st_size;
+        mapping = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, file, 0);
+    }
+    close(file);
+    if (mapping == MAP_FAILED)
+    {
+        std::ostringstream err;
+        err << "Could not map shared memory " << name;
+        throw std::runtime_error(err.str());
+    }
+    m_mapping = static_cast<const uint8_t *>(mapping);
+
+    uint32_t version, channels, slots, slotSize;
+    bool valid = memcmp(m_mapping, SHARED_RING_MAGIC, sizeof(SHARED_RING_MAGIC)) == 0;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    memcpy(&version, m_mapping + HEADER_VERSION_OFFSET, sizeof(version));
+    memcpy(&channels, m_mapping + HEADER_CHANNELS_OFFSET, sizeof(channels));
+    memcpy(&slots, m_mapping + HEADER_SLOTS_OFFSET, sizeof(slots));
+    memcpy(&slotSize, m_mapping + HEADER_SLOT_SIZE_OFFSET, sizeof(slotSize));
+    if (!valid || version != SHARED_RING_VERSION || channels != SHARED_RING_CHANNELS ||
+        slotSize != SHARED_RING_SLOT_SIZE || slots == 0 || (slots & (slots - 1)) != 0 ||
+        ringSize(slots) > m_size)
+    {
+        munmap(const_cast<uint8_t *>(m_mapping), m_size);
+        std::ostringstream err;
+        err << "Shared memory " << name << " isn't a sample ring this version understands";
+        throw std::runtime_error(err.str());
+    }
+    m_slots = slots;
+    m_channels = reinterpret_cast<const SharedRingChannel *>(m_mapping + SHARED_RING_SLOT_SIZE);
+    m_slotArray = reinterpret_cast<const SharedRingSlot *>(m_mapping +
+                                                            (1 + SHARED_RING_CHANNELS) * SHARED_RING_SLOT_SIZE);
+}
+
+
+SharedMemoryRingReader::~SharedMemoryRingReader(void)
+{
+    munmap(const_cast<uint8_t *>(m_mapping), m_size);
+}
+
+
+uint64_t SharedMemoryRingReader::published(unsigned int channel) const
+{
+    return m_channels[channel].published.load(std::memory_order_acquire);
+}
+
+
+bool SharedMemoryRingReader::readRecord(unsigned int channel, uint64_t index, uint8_t *record) const
+{
+    const SharedRingSlot &slot = m_slotArray[static_cast<size_t>(channel) * m_slots + (index & (m_slots - 1))];
+    uint64_t complete = 2 * index + 2;
+    if (slot.sequence.load(std::memory_order_acquire) != complete)
+    {
+        return false;
+    }
+    uint64_t words[SharedRingSlot::WORDS];
+    for (unsigned int i = 0; i < SharedRingSlot::WORDS; ++i)
+    {
+        words[i] = slot.words[i].load(std::memory_order_relaxed);
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot.sequence.load(std::memory_order_relaxed) != complete)
+    {
+        return false;
+    }
+    memcpy(record, words, WIRE_MAX_RECORD_SIZE);
+    return true;
+}
+
+
+bool SharedMemoryRingReader::latest(AltitudeSample &sample) const
+{
+    return latest(SHARED_RING_MPL3115A2, sample);
+}
+
+
+bool SharedMemoryRingReader::latest(ImuSample &sample) const
+{
+    return latest(SHARED_RING_LSM9DS1, sample);
+}
+
+
+template <typename Sample>
+bool SharedMemoryRingReader::latest(unsigned int channel, Sample &sample) const
+{
+    // Only fails if the writer lapped the whole ring mid copy, so try again
+    uint8_t record[WIRE_MAX_RECORD_SIZE];
+    uint32_t age;
+    for (;;)
+    {
+        uint64_t count = published(channel);
+        if (count == 0)
+        {
+            return false;
+        }
+        if (readRecord(channel, count - 1, record))
+        {
+            return decodeBinary(record, sizeof(record), sample, age);
+        }
+    }
+}
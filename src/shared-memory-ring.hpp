@@ -0,0 +1,130 @@
+#ifndef SHARED_MEMORY_RING_HPP
+#define SHARED_MEMORY_RING_HPP
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+#include "sensor-sample.hpp"
+#include "wire-format.hpp"
+
+
+// The shared memory object (/dev/shm/<name>) is made of 64 byte blocks:
+// a header, one block per channel, then each channel's slots in turn.
+// Header:
+//   offset 0  char[8] magic (SHARED_RING_MAGIC), written last
+//   offset 8  uint32  version (SHARED_RING_VERSION)
+//   offset 12 uint32  channel count
+//   offset 16 uint32  slots per channel (a power of two)
+//   offset 20 uint32  slot size (SHARED_RING_SLOT_SIZE)
+//   offset 24 int64   realtime clock when it was made (ns since epoch)
+//   offset 32 int64   monotonic clock at the same moment (ns)
+// Channel c, at (1 + c) * 64:
+//   offset 0  uint64  records published so far
+//   offset 8  uint8   sensor id (SensorId)
+// Slot s of channel c, at (1 + channels + c * slots + s) * 64:
+//   offset 0  uint64  sequence
+//   offset 8  binary record (wire-format.hpp, age is always 0)
+// Record n (counting from 0) goes in slot n % slots. Its slot's sequence is
+// 2n + 1 while it is being written and 2n + 2 once it is complete, then the
+// channel's published count becomes n + 1. To read record n, read the
+// sequence, copy the record, then read the sequence again: the copy is good
+// if both were 2n + 2, otherwise it was overwritten (or is being) meanwhile.
+// The latest record is published - 1 and the slots hold the newest `slots`
+// records. Everything is in the host's byte order, which is little-endian.
+constexpr char SHARED_RING_MAGIC[8] = { 'U', 'A', 'S', 'S', 'H', 'R', 'N', 'G' };
+constexpr uint32_t SHARED_RING_VERSION = 1;
+constexpr size_t SHARED_RING_SLOT_SIZE = 64;
+constexpr const char *SHARED_RING_DEFAULT_NAME = "/uas-collect-samples";
+
+// Channels, in order
+constexpr unsigned int SHARED_RING_MPL3115A2 = 0;
+constexpr unsigned int SHARED_RING_LSM9DS1 = 1;
+constexpr unsigned int SHARED_RING_CHANNELS = 2;
+
+
+// One slot as laid out in the shared memory. The record is kept as relaxed
+// atomic words (like SampleCache) so a reader racing the writer gets a torn
+// copy it throws away rather than a data race.
+struct SharedRingSlot
+{
+    public:
+        static constexpr unsigned int WORDS = SHARED_RING_SLOT_SIZE / sizeof(uint64_t) - 1;
+        std::atomic<uint64_t> sequence;
+        std::atomic<uint64_t> words[WORDS];
+};
+
+
+// One channel's block as laid out in the shared memory
+struct SharedRingChannel
+{
+    public:
+        std::atomic<uint64_t> published;
+        uint8_t sensor;
+        uint8_t reserved[SHARED_RING_SLOT_SIZE - sizeof(uint64_t) - 1];
+};
+
+
+// This class publishes samples into a POSIX shared memory ring that local
+// processes can read without a syscall per sample and without ever holding
+// up the writer (see the layout above, examples/data-client.py reads it from
+// Python). Any stale object with the same name is replaced, and the object is
+// removed again on destruction.
+// Only one thread may publish each sensor's samples, publishing never blocks
+// or allocates.
+class SharedMemoryRing
+{
+    public:
+        SharedMemoryRing(const std::string &name, unsigned int slots);
+        ~SharedMemoryRing(void);
+        void publish(const AltitudeSample &sample);
+        void publish(const ImuSample &sample);
+
+    private:
+        SharedMemoryRing(const SharedMemoryRing &);
+        SharedMemoryRing &operator=(const SharedMemoryRing &);
+        template <typename Sample>
+        void publish(unsigned int channel, const Sample &sample);
+        std::string m_name;
+        unsigned int m_slots;
+        size_t m_size;
+        uint8_t *m_mapping;
+        SharedRingChannel *m_channels;
+        SharedRingSlot *m_slotArray;
+};
+
+
+// This class reads a SharedMemoryRing made by another process (or the same
+// one). It only ever reads the shared memory, so it can't disturb the writer
+// or other readers.
+class SharedMemoryRingReader
+{
+    public:
+        explicit SharedMemoryRingReader(const std::string &name);
+        ~SharedMemoryRingReader(void);
+
+        // Records published so far on channel
+        uint64_t published(unsigned int channel) const;
+
+        // Copies record index of channel into record (WIRE_MAX_RECORD_SIZE
+        // bytes), false if it hasn't been published or has been overwritten
+        bool readRecord(unsigned int channel, uint64_t index, uint8_t *record) const;
+
+        // The latest sample of each kind, false if there isn't one yet
+        bool latest(AltitudeSample &sample) const;
+        bool latest(ImuSample &sample) const;
+
+    private:
+        SharedMemoryRingReader(const SharedMemoryRingReader &);
+        SharedMemoryRingReader &operator=(const SharedMemoryRingReader &);
+        template <typename Sample>
+        bool latest(unsigned int channel, Sample &sample) const;
+        size_t m_size;
+        const uint8_t *m_mapping;
+        unsigned int m_slots;
+        const SharedRingChannel *m_channels;
+        const SharedRingSlot *m_slotArray;
+};
+
+#endif
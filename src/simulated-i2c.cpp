@@ -0,0 +1,714 @@
+#include <chrono>
+#include <map>
+#include <math.h>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+#include <errno.h>
+#include <linux/i2c.h>
+
+#include "i2c-abstraction.hpp"
+#include "i2c-recovery.hpp"
+#include "metrics.hpp"
+#include "simulated-i2c.hpp"
+
+
+// MPL3115A2 registers
+constexpr uint8_t MPL_STATUS = 0x00;
+constexpr uint8_t MPL_OUT_P_MSB = 0x01;
+constexpr uint8_t MPL_OUT_T_LSB = 0x05;
+constexpr uint8_t MPL_DR_STATUS = 0x06;
+constexpr uint8_t MPL_WHO_AM_I = 0x0C;
+constexpr uint8_t MPL_F_STATUS = 0x0D;
+constexpr uint8_t MPL_F_DATA = 0x0E;
+constexpr uint8_t MPL_F_SETUP = 0x0F;
+constexpr uint8_t MPL_CTRL_REG1 = 0x26;
+constexpr uint8_t MPL_DEVICE_ID = 0xC4;
+constexpr uint8_t MPL_CTRL_REG1_SBYB = 0x01;
+constexpr uint8_t MPL_CTRL_REG1_ALT = 0x80;
+constexpr uint8_t MPL_STATUS_ALL_READY = 0x0E;  // PTDR, PDR and TDR
+constexpr uint8_t MPL_F_SETUP_MODE_MASK = 0xC0;
+constexpr uint8_t MPL_F_STATUS_OVF = 0x80;
+constexpr uint8_t MPL_F_STATUS_CNT_MASK = 0x3F;
+constexpr unsigned int MPL_SAMPLE_SIZE = 5;
+constexpr unsigned int MPL_FIFO_DEPTH = 32;
+constexpr double MPL_SEA_LEVEL_PRESSURE = 101326.0;
+
+// LSM9DS1 registers
+constexpr uint8_t LSM_WHO_AM_I = 0x0F;
+constexpr uint8_t LSM_DEVICE_ID_XLG = 0x68;
+constexpr uint8_t LSM_DEVICE_ID_M = 0x3D;
+constexpr uint8_t LSM_OUT_X_L_G = 0x18;
+constexpr uint8_t LSM_OUT_Z_H_G = 0x1D;
+constexpr uint8_t LSM_CTRL_REG8 = 0x22;
+constexpr uint8_t LSM_CTRL_REG9 = 0x23;
+constexpr uint8_t LSM_OUT_X_L_XL = 0x28;
+constexpr uint8_t LSM_OUT_Z_H_XL = 0x2D;
+constexpr uint8_t LSM_FIFO_CTRL = 0x2E;
+constexpr uint8_t LSM_FIFO_SRC = 0x2F;
+constexpr uint8_t LSM_OUT_X_L_M = 0x28;
+constexpr uint8_t LSM_M_AUTO_INCREMENT = 0x80;  // In the sub-address
+constexpr uint8_t LSM_CTRL_REG8_IF_ADD_INC = 0x04;
+constexpr uint8_t LSM_CTRL_REG9_FIFO_EN = 0x02;
+constexpr uint8_t LSM_FIFO_CTRL_FMODE_MASK = 0xE0;
+constexpr uint8_t LSM_FIFO_SRC_OVRN = 0x40;
+constexpr uint8_t LSM_FIFO_SRC_FSS_MASK = 0x3F;
+constexpr unsigned int LSM_FIFO_DEPTH = 32;
+
+
+// Puts a little endian x, y, z triple into the registers starting at reg
+static void putAxes(uint8_t *registers, uint8_t reg, int16_t x, int16_t y, int16_t z)
+{
+    int16_t axes[3] = { x, y, z };
+    for (unsigned int axis = 0; axis < 3; ++axis)
+    {
+        uint16_t value = static_cast<uint16_t>(axes[axis]);
+        registers[reg + 2 * axis] = value & 0xFF;
+        registers[reg + 2 * axis + 1] = value >> 8;
+    }
+}
+
+
+uint8_t SimulatedDevice::selectRegister(uint8_t subAddress)
+{
+    return subAddress;
+}
+
+
+uint8_t SimulatedDevice::nextRegister(uint8_t reg) const
+{
+    return reg + 1;
+}
+
+
+RegisterMapDevice::RegisterMapDevice(void)
+{
+    memset(m_registers, 0, sizeof(m_registers));
+}
+
+
+uint8_t RegisterMapDevice::readRegister(uint8_t reg)
+{
+    return m_registers[reg];
+}
+
+
+void RegisterMapDevice::writeRegister(uint8_t reg, uint8_t data)
+{
+    m_registers[reg] = data;
+}
+
+
+uint8_t RegisterMapDevice::peek(uint8_t reg) const
+{
+    return m_registers[reg];
+}
+
+
+void RegisterMapDevice::poke(uint8_t reg, uint8_t data)
+{
+    m_registers[reg] = data;
+}
+
+
+MPL3115A2Model::MPL3115A2Model(void) :
+    m_pressure(MPL_SEA_LEVEL_PRESSURE),
+    m_temperature(20.0),
+    m_fifoLevel(0),
+    m_fifoOverflow(false),
+    m_fifoByte(0),
+    m_statusStuck(false)
+{
+    m_registers[MPL_WHO_AM_I] = MPL_DEVICE_ID;
+    memset(m_fifoSample, 0, sizeof(m_fifoSample));
+}
+
+
+uint8_t MPL3115A2Model::readRegister(uint8_t reg)
+{
+    if (reg == MPL_STATUS || reg == MPL_DR_STATUS)
+    {
+        bool isActive = m_registers[MPL_CTRL_REG1] & MPL_CTRL_REG1_SBYB;
+        return isActive && !m_statusStuck ? MPL_STATUS_ALL_READY : 0;
+    }
+    if (reg >= MPL_OUT_P_MSB && reg <= MPL_OUT_T_LSB)
+    {
+        uint8_t data[MPL_SAMPLE_SIZE];
+        latchData(data);
+        return data[reg - MPL_OUT_P_MSB];
+    }
+    if (reg == MPL_F_STATUS)
+    {
+        if (!(m_registers[MPL_F_SETUP] & MPL_F_SETUP_MODE_MASK))
+        {
+            return 0;
+        }
+        return (m_fifoLevel & MPL_F_STATUS_CNT_MASK) | (m_fifoOverflow ? MPL_F_STATUS_OVF : 0);
+    }
+    if (reg == MPL_F_DATA)
+    {
+        if (m_fifoLevel == 0)
+        {
+            return 0;
+        }
+        if (m_fifoByte == 0)
+        {
+            latchData(m_fifoSample);
+        }
+        uint8_t data = m_fifoSample[m_fifoByte++];
+        if (m_fifoByte == MPL_SAMPLE_SIZE)
+        {
+            m_fifoByte = 0;
+            --m_fifoLevel;
+            m_fifoOverflow = m_fifoOverflow && m_fifoLevel > 0;
+        }
+        return data;
+    }
+    return RegisterMapDevice::readRegister(reg);
+}
+
+
+uint8_t MPL3115A2Model::nextRegister(uint8_t reg) const
+{
+    // F_DATA is read over and over to drain the FIFO
+    return reg == MPL_F_DATA ? reg : reg + 1;
+}
+
+
+void MPL3115A2Model::setPressure(double pascals)
+{
+    m_pressure = pascals;
+}
+
+
+void MPL3115A2Model::setTemperature(double celsius)
+{
+    m_temperature = celsius;
+}
+
+
+void MPL3115A2Model::setFifoLevel(unsigned int level, bool overflow)
+{
+    m_fifoLevel = level > MPL_FIFO_DEPTH ? MPL_FIFO_DEPTH : level;
+    m_fifoOverflow = overflow;
+    m_fifoByte = 0;
+}
+
+
+void MPL3115A2Model::setStatusStuck(bool stuck)
+{
+    m_statusStuck = stuck;
+}
+
+
+void MPL3115A2Model::latchData(uint8_t *data) const
+{
+    // Pressure is unsigned Q18.2 and altitude signed Q16.4, both 20 bits
+    // left aligned in the three OUT_P registers. Temperature is signed Q8.4.
+    uint32_t raw;
+    if (m_registers[MPL_CTRL_REG1] & MPL_CTRL_REG1_ALT)
+    {
+        double altitude = 44330.77 * (1.0 - pow(m_pressure / MPL_SEA_LEVEL_PRESSURE, 0.1902632));
+        raw = static_cast<uint32_t>(static_cast<int32_t>(lround(altitude * 16.0)));
+    }
+    else
+    {
+        raw = static_cast<uint32_t>(lround(m_pressure * 4.0));
+    }
+    raw &= 0xFFFFF;
+    data[0] = raw >> 12;
+    data[1] = (raw >> 4) & 0xFF;
+    data[2] = (raw & 0x0F) << 4;
+
+    uint32_t temperature = static_cast<uint32_t>(static_cast<int32_t>(lround(m_temperature * 16.0)));
+    data[3] = (temperature >> 4) & 0xFF;
+    data[4] = (temperature & 0x0F) << 4;
+}
+
+
+LSM9DS1AccelGyroModel::LSM9DS1AccelGyroModel(void) :
+    m_fifoLevel(0),
+    m_fifoOverrun(false),
+    m_fifoLoaded(0),
+    m_fifoNext(0)
+{
+    m_registers[LSM_WHO_AM_I] = LSM_DEVICE_ID_XLG;
+    m_registers[LSM_CTRL_REG8] = LSM_CTRL_REG8_IF_ADD_INC;
+}
+
+
+uint8_t LSM9DS1AccelGyroModel::readRegister(uint8_t reg)
+{
+    if (reg == LSM_FIFO_SRC)
+    {
+        if (!fifoEnabled())
+        {
+            return 0;
+        }
+        return (m_fifoLevel & LSM_FIFO_SRC_FSS_MASK) | (m_fifoOverrun ? LSM_FIFO_SRC_OVRN : 0);
+    }
+    uint8_t data = RegisterMapDevice::readRegister(reg);
+    if (reg == LSM_OUT_Z_H_XL && fifoEnabled() && m_fifoLevel > 0)
+    {
+        --m_fifoLevel;
+        m_fifoOverrun = m_fifoOverrun && m_fifoLevel > 0;
+        ++m_fifoNext;
+        showFifoSample();
+    }
+    return data;
+}
+
+
+uint8_t LSM9DS1AccelGyroModel::nextRegister(uint8_t reg) const
+{
+    // With the FIFO on, reads wrap around each output block
+    if (fifoEnabled())
+    {
+        if (reg == LSM_OUT_Z_H_G)
+        {
+            return LSM_OUT_X_L_G;
+        }
+        if (reg == LSM_OUT_Z_H_XL)
+        {
+            return LSM_OUT_X_L_XL;
+        }
+    }
+    return reg + 1;
+}
+
+
+void LSM9DS1AccelGyroModel::setAccel(int16_t x, int16_t y, int16_t z)
+{
+    putAxes(m_registers, LSM_OUT_X_L_XL, x, y, z);
+}
+
+
+void LSM9DS1AccelGyroModel::setGyro(int16_t x, int16_t y, int16_t z)
+{
+    putAxes(m_registers, LSM_OUT_X_L_G, x, y, z);
+}
+
+
+void LSM9DS1AccelGyroModel::setFifoLevel(unsigned int level, bool overrun)
+{
+    m_fifoLevel = level > LSM_FIFO_DEPTH ? LSM_FIFO_DEPTH : level;
+    m_fifoOverrun = overrun;
+    m_fifoLoaded = 0;
+}
+
+
+void LSM9DS1AccelGyroModel::loadFifo(const int16_t (*samples)[6], unsigned int count, bool overrun)
+{
+    setFifoLevel(count, overrun);
+    memcpy(m_fifoSamples, samples, m_fifoLevel * sizeof(m_fifoSamples[0]));
+    m_fifoLoaded = m_fifoLevel;
+    m_fifoNext = 0;
+    showFifoSample();
+}
+
+
+void LSM9DS1AccelGyroModel::showFifoSample(void)
+{
+    if (m_fifoNext < m_fifoLoaded)
+    {
+        const int16_t *sample = m_fifoSamples[m_fifoNext];
+        putAxes(m_registers, LSM_OUT_X_L_G, sample[0], sample[1], sample[2]);
+        putAxes(m_registers, LSM_OUT_X_L_XL, sample[3], sample[4], sample[5]);
+    }
+}
+
+
+bool LSM9DS1AccelGyroModel::fifoEnabled(void) const
+{
+    return (m_registers[LSM_CTRL_REG9] & LSM_CTRL_REG9_FIFO_EN)
+        && (m_registers[LSM_FIFO_CTRL] & LSM_FIFO_CTRL_FMODE_MASK);
+}
+
+
+LSM9DS1MagModel::LSM9DS1MagModel(void) :
+    m_autoIncrement(false)
+{
+    m_registers[LSM_WHO_AM_I] = LSM_DEVICE_ID_M;
+}
+
+
+uint8_t LSM9DS1MagModel::selectRegister(uint8_t subAddress)
+{
+    m_autoIncrement = subAddress & LSM_M_AUTO_INCREMENT;
+    return static_cast<uint8_t>(subAddress & ~LSM_M_AUTO_INCREMENT);
+}
+
+
+uint8_t LSM9DS1MagModel::nextRegister(uint8_t reg) const
+{
+    return m_autoIncrement ? reg + 1 : reg;
+}
+
+
+void LSM9DS1MagModel::setMag(int16_t x, int16_t y, int16_t z)
+{
+    putAxes(m_registers, LSM_OUT_X_L_M, x, y, z);
+}
+
+
+SimulatedBus::SimulatedBus(void) :
+    m_wedged(false),
+    m_latency(0),
+    m_transactionCount(0),
+    m_messageCount(0),
+    m_recoveryCount(0)
+{
+}
+
+
+SimulatedBus &SimulatedBus::adapter(unsigned int adapterNumber)
+{
+    // Buses live for the rest of the program so references never dangle
+    static std::mutex adaptersMutex;
+    static std::map<unsigned int, std::unique_ptr<SimulatedBus>> adapters;
+    std::lock_guard<std::mutex> lock(adaptersMutex);
+    std::unique_ptr<SimulatedBus> &bus = adapters[adapterNumber];
+    if (!bus)
+    {
+        bus.reset(new SimulatedBus());
+    }
+    return *bus;
+}
+
+
+void SimulatedBus::attach(uint8_t deviceAddress, std::shared_ptr<SimulatedDevice> device)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_devices[deviceAddress] = device;
+}
+
+
+void SimulatedBus::detach(uint8_t deviceAddress)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_devices.erase(deviceAddress);
+}
+
+
+void SimulatedBus::setLatency(std::chrono::nanoseconds latency)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_latency = latency;
+}
+
+
+void SimulatedBus::injectNak(uint8_t deviceAddress, unsigned int count, unsigned int after)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_naks[deviceAddress] = count;
+    m_nakAfter[deviceAddress] = after;
+}
+
+
+void SimulatedBus::wedge(void)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_wedged = true;
+}
+
+
+void SimulatedBus::recover(void)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_wedged = false;
+    ++m_recoveryCount;
+}
+
+
+uint64_t SimulatedBus::transactionCount(void) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_transactionCount;
+}
+
+
+uint64_t SimulatedBus::messageCount(void) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_messageCount;
+}
+
+
+uint64_t SimulatedBus::recoveryCount(void) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_recoveryCount;
+}
+
+
+void SimulatedBus::resetCounts(void)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_transactionCount = 0;
+    m_messageCount = 0;
+    m_recoveryCount = 0;
+}
+
+
+bool SimulatedBus::perform(const Message *messages, unsigned int count)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    ++m_transactionCount;
+    if (m_latency.count() > 0)
+    {
+        // Sleeping can overshoot by far more than a bus transaction takes
+        std::chrono::steady_clock::time_point done = std::chrono::steady_clock::now() + m_latency;
+        while (std::chrono::steady_clock::now() < done)
+        {
+        }
+    }
+    if (m_wedged)
+    {
+        errno = ETIMEDOUT;
+        return false;
+    }
+
+    // Messages go out in order until one isn't acknowledged, like on the wire
+    for (unsigned int i = 0; i < count; ++i)
+    {
+        const Message &message = messages[i];
+        m_messageCount += message.isRead ? 2 : 1;
+        std::map<uint8_t, unsigned int>::iterator nak = m_naks.find(message.deviceAddress);
+        if (nak != m_naks.end() && nak->second > 0)
+        {
+            unsigned int &after = m_nakAfter[message.deviceAddress];
+            if (after > 0)
+            {
+                --after;
+            }
+            else
+            {
+                --nak->second;
+                errno = EREMOTEIO;
+                return false;
+            }
+        }
+        std::map<uint8_t, std::shared_ptr<SimulatedDevice>>::iterator found = m_devices.find(message.deviceAddress);
+        if (found == m_devices.end())
+        {
+            errno = EREMOTEIO;
+            return false;
+        }
+
+        SimulatedDevice &device = *found->second;
+        uint8_t reg = device.selectRegister(message.reg);
+        for (unsigned int byte = 0; byte < message.size; ++byte)
+        {
+            if (message.isRead)
+            {
+                message.data[byte] = device.readRegister(reg);
+            }
+            else
+            {
+                device.writeRegister(reg, message.data[byte]);
+            }
+            reg = device.nextRegister(reg);
+        }
+    }
+    return true;
+}
+
+
+SimulatedI2c::SimulatedI2c(const unsigned int adapterNumber, const uint8_t deviceAddress) :
+    m_bus(SimulatedBus::adapter(adapterNumber)),
+    m_deviceAddress(deviceAddress)
+{
+}
+
+
+std::vector<uint8_t> SimulatedI2c::readBytes(uint8_t reg, unsigned int size) const
+{
+    std::vector<uint8_t> data(size);
+    readBytes(reg, data.data(), size);
+    return data;
+}
+
+
+void SimulatedI2c::readBytes(uint8_t reg, uint8_t *buffer, unsigned int size) const
+{
+    if (!tryReadBytes(reg, buffer, size))
+    {
+        std::ostringstream err;
+        err << "Could not perform read" << std::endl << strerror(errno);
+        throw std::runtime_error(err.str());
+    }
+}
+
+
+void SimulatedI2c::writeByte(uint8_t reg, uint8_t data) const
+{
+    if (!tryWriteByte(reg, data))
+    {
+        std::ostringstream err;
+        err << "Could not perform write" << std::endl << strerror(errno);
+        throw std::runtime_error(err.str());
+    }
+}
+
+
+void SimulatedI2c::transfer(I2cTransaction &transaction) const
+{
+    if (!tryTransfer(transaction))
+    {
+        std::ostringstream err;
+        err << "Could not perform transaction of " << transaction.messageCount() << " messages"
+            << std::endl << strerror(errno);
+        throw std::runtime_error(err.str());
+    }
+}
+
+
+bool SimulatedI2c::tryReadBytes(uint8_t reg, uint8_t *buffer, unsigned int size) const
+{
+    SimulatedBus::Message message = { m_deviceAddress, true, reg, buffer, size };
+    return performTransaction(&message, 1, true);
+}
+
+
+bool SimulatedI2c::tryWriteByte(uint8_t reg, uint8_t data) const
+{
+    SimulatedBus::Message message = { m_deviceAddress, false, reg, &data, 1 };
+    return performTransaction(&message, 1, true);
+}
+
+
+bool SimulatedI2c::tryTransfer(I2cTransaction &transaction) const
+{
+    if (transaction.empty())
+    {
+        return true;
+    }
+
+    // Same layout as I2cAbstraction::transfer, the register sits right before
+    // a read's data and a write is the register then the data
+    SimulatedBus::Message messages[I2cTransaction::MAX_MESSAGES];
+    unsigned int count = 0;
+    uint8_t *buffer = transaction.m_buffer.data();
+    for (const I2cTransaction::Operation &operation : transaction.m_operations)
+    {
+        SimulatedBus::Message &message = messages[count++];
+        message.deviceAddress = operation.deviceAddress;
+        message.isRead = operation.isRead;
+        if (operation.isRead)
+        {
+            message.reg = buffer[operation.offset - 1];
+            message.data = buffer + operation.offset;
+            message.size = operation.size;
+        }
+        else
+        {
+            message.reg = buffer[operation.offset];
+            message.data = buffer + operation.offset + 1;
+            message.size = operation.size - 1;
+        }
+    }
+    return performTransaction(messages, count, transaction.repeatable());
+}
+
+
+bool SimulatedI2c::recover(void)
+{
+    m_bus.recover();
+    return true;
+}
+
+
+uint8_t SimulatedI2c::deviceAddress(void) const
+{
+    return m_deviceAddress;
+}
+
+
+bool SimulatedI2c::performTransaction(const SimulatedBus::Message *messages, unsigned int count,
+                                      bool repeatable) const
+{
+    // Counted and retried the same way I2cAbstraction does the real thing
+    I2cDeviceMetrics &metrics = i2cDeviceMetrics(m_deviceAddress);
+    uint64_t start = metricsNow();
+    bool performed;
+    if (repeatable)
+    {
+        performed = retryI2c(metrics, [&]() { return m_bus.perform(messages, count); });
+    }
+    else
+    {
+        performed = m_bus.perform(messages, count);
+    }
+    metrics.recordTransaction(metricsNow() - start);
+    if (!performed)
+    {
+        int performErrno = errno;
+        metrics.recordError();
+        errno = performErrno;
+        return false;
+    }
+    for (unsigned int i = 0; i < count; ++i)
+    {
+        // A read also writes the register, a write's size is just the data
+        if (messages[i].isRead)
+        {
+            i2cDeviceMetrics(messages[i].deviceAddress).recordBytes(messages[i].size, 1);
+        }
+        else
+        {
+            i2cDeviceMetrics(messages[i].deviceAddress).recordBytes(0, messages[i].size + 1);
+        }
+    }
+    return true;
+}
+
+
+SimulatedBusBackend::SimulatedBusBackend(unsigned int adapterNumber) :
+    m_bus(SimulatedBus::adapter(adapterNumber))
+{
+}
+
+
+bool SimulatedBusBackend::transfer(struct i2c_msg *messages, unsigned int count)
+{
+    SimulatedBus::Message translated[I2cTransaction::MAX_MESSAGES];
+    unsigned int translatedCount = 0;
+    for (unsigned int i = 0; i < count; ++i)
+    {
+        if (translatedCount == I2cTransaction::MAX_MESSAGES || (messages[i].flags & I2C_M_RD))
+        {
+            errno = EINVAL;
+            return false;
+        }
+        SimulatedBus::Message &message = translated[translatedCount++];
+        message.deviceAddress = messages[i].addr;
+        message.reg = messages[i].len > 0 ? messages[i].buf[0] : 0;
+        if (messages[i].len == 1 && i + 1 < count && (messages[i + 1].flags & I2C_M_RD) &&
+            messages[i + 1].addr == messages[i].addr)
+        {
+            ++i;
+            message.isRead = true;
+            message.data = messages[i].buf;
+            message.size = messages[i].len;
+        }
+        else
+        {
+            message.isRead = false;
+            message.data = messages[i].buf + 1;
+            message.size = messages[i].len > 0 ? messages[i].len - 1 : 0;
+        }
+    }
+    return m_bus.perform(translated, translatedCount);
+}
+
+
+bool SimulatedBusBackend::recover(void)
+{
+    m_bus.recover();
+    return true;
+}
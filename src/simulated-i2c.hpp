@@ -0,0 +1,224 @@
+#ifndef SIMULATED_I2C_HPP
+#define SIMULATED_I2C_HPP
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <vector>
+
+#include "bus-scheduler.hpp"
+#include "i2c-abstraction.hpp"
+
+
+// This class is a device on a SimulatedBus, modelled as its register map.
+// Each message starts at the register selectRegister makes of the
+// sub-address sent (the same register unless the device takes flags from
+// it). Reads and writes are a byte at a time, after each one the device's
+// address pointer moves to nextRegister (the next register unless the device
+// wraps or doesn't auto increment there) so bursts behave like they do on
+// the chip.
+class SimulatedDevice
+{
+    public:
+        virtual ~SimulatedDevice(void) {}
+        virtual uint8_t readRegister(uint8_t reg) = 0;
+        virtual void writeRegister(uint8_t reg, uint8_t data) = 0;
+        virtual uint8_t selectRegister(uint8_t subAddress);
+        virtual uint8_t nextRegister(uint8_t reg) const;
+};
+
+
+// This class is a device that is nothing but 256 plain registers, which the
+// chip models build on. peek and poke get at the registers without acting
+// like a bus access.
+class RegisterMapDevice : public SimulatedDevice
+{
+    public:
+        RegisterMapDevice(void);
+        uint8_t readRegister(uint8_t reg);
+        void writeRegister(uint8_t reg, uint8_t data);
+        uint8_t peek(uint8_t reg) const;
+        void poke(uint8_t reg, uint8_t data);
+    protected:
+        uint8_t m_registers[256];
+};
+
+
+// This class models the MPL3115A2.
+// A conversion is always ready while the device is active, with whatever
+// setPressure and setTemperature were last given (altitude is worked out from
+// the pressure in altimeter mode). setFifoLevel says how many samples the
+// FIFO holds, reading them from F_DATA drains it.
+// setStatusStuck makes STATUS (and DR_STATUS) read as nothing ready forever,
+// like a device that has stopped converting, and can be called while another
+// thread is reading it.
+class MPL3115A2Model : public RegisterMapDevice
+{
+    public:
+        MPL3115A2Model(void);
+        uint8_t readRegister(uint8_t reg);
+        uint8_t nextRegister(uint8_t reg) const;
+        void setPressure(double pascals);
+        void setTemperature(double celsius);
+        void setFifoLevel(unsigned int level, bool overflow);
+        void setStatusStuck(bool stuck);
+    private:
+        void latchData(uint8_t *data) const;
+        double m_pressure;
+        double m_temperature;
+        unsigned int m_fifoLevel;
+        bool m_fifoOverflow;
+        unsigned int m_fifoByte;  // Position within the F_DATA sample being read
+        uint8_t m_fifoSample[5];
+        std::atomic<bool> m_statusStuck;
+};
+
+
+// This class models the accelerometer/gyro half of the LSM9DS1.
+// The output registers hold whatever setAccel and setGyro were last given.
+// With the FIFO enabled the output blocks wrap like the chip does and
+// FIFO_SRC reports setFifoLevel samples, reading the last accelerometer
+// register of a sample drains one. loadFifo fills it with samples of its own
+// instead, each in the output registers until it is drained.
+class LSM9DS1AccelGyroModel : public RegisterMapDevice
+{
+    public:
+        LSM9DS1AccelGyroModel(void);
+        uint8_t readRegister(uint8_t reg);
+        uint8_t nextRegister(uint8_t reg) const;
+        void setAccel(int16_t x, int16_t y, int16_t z);
+        void setGyro(int16_t x, int16_t y, int16_t z);
+        void setFifoLevel(unsigned int level, bool overrun);
+        // Each sample is gyro x y z then accel x y z, oldest first
+        void loadFifo(const int16_t (*samples)[6], unsigned int count, bool overrun);
+    private:
+        bool fifoEnabled(void) const;
+        void showFifoSample(void);
+        unsigned int m_fifoLevel;
+        bool m_fifoOverrun;
+        int16_t m_fifoSamples[32][6];
+        unsigned int m_fifoLoaded;  // How many of m_fifoSamples loadFifo gave
+        unsigned int m_fifoNext;  // The one in the output registers
+};
+
+
+// This class models the magnetometer half of the LSM9DS1, the output
+// registers hold whatever setMag was last given. Like the chip it only auto
+// increments through a read when the sub-address has its MSB set, otherwise
+// every byte comes from the same register.
+class LSM9DS1MagModel : public RegisterMapDevice
+{
+    public:
+        LSM9DS1MagModel(void);
+        uint8_t selectRegister(uint8_t subAddress);
+        uint8_t nextRegister(uint8_t reg) const;
+        void setMag(int16_t x, int16_t y, int16_t z);
+    private:
+        bool m_autoIncrement;  // Whether the current message asked for it
+};
+
+
+// This class is an in-memory stand in for an i2c adapter. Devices are
+// attached at their slave address and every SimulatedI2c opened on the same
+// adapter number talks to the same bus (adapter gets or makes it).
+// Each transaction (a readBytes, writeByte or transfer) takes setLatency to
+// complete, spun out so short latencies are still accurate, and happens
+// under one lock like the kernel holds the adapter for an ioctl.
+// Faults can be injected: injectNak makes the next count transactions that
+// address a device fail (EREMOTEIO), as does talking to an address with
+// nothing attached. The first after messages to the device still go through
+// first, so a transaction can fail part way. wedge models a slave holding SDA
+// low, every transaction fails (ETIMEDOUT) until recover clears the bus.
+// transactionCount and messageCount say how much bus traffic there has been,
+// recoveryCount how many times the bus has been recovered.
+class SimulatedBus
+{
+    public:
+        static SimulatedBus &adapter(unsigned int adapterNumber);
+        void attach(uint8_t deviceAddress, std::shared_ptr<SimulatedDevice> device);
+        void detach(uint8_t deviceAddress);
+        void setLatency(std::chrono::nanoseconds latency);
+        void injectNak(uint8_t deviceAddress, unsigned int count, unsigned int after);
+        void wedge(void);
+        void recover(void);
+        uint64_t transactionCount(void) const;
+        uint64_t messageCount(void) const;
+        uint64_t recoveryCount(void) const;
+        void resetCounts(void);
+
+    private:
+        friend class SimulatedBusBackend;
+        friend class SimulatedI2c;
+        SimulatedBus(void);
+        SimulatedBus(const SimulatedBus &);
+        SimulatedBus &operator=(const SimulatedBus &);
+        struct Message
+        {
+            uint8_t deviceAddress;
+            bool isRead;
+            uint8_t reg;
+            uint8_t *data;  // Where a read goes or what a write sends
+            unsigned int size;
+        };
+        // False with errno set if a message wasn't acknowledged
+        bool perform(const Message *messages, unsigned int count);
+        mutable std::mutex m_mutex;
+        std::map<uint8_t, std::shared_ptr<SimulatedDevice>> m_devices;
+        std::map<uint8_t, unsigned int> m_naks;
+        std::map<uint8_t, unsigned int> m_nakAfter;  // Messages acknowledged before the NAK
+        bool m_wedged;
+        std::chrono::nanoseconds m_latency;
+        uint64_t m_transactionCount;
+        uint64_t m_messageCount;
+        uint64_t m_recoveryCount;
+};
+
+
+// This class has the same interface as I2cAbstraction but talks to a
+// SimulatedBus instead of /dev/i2c-N, so the drivers can use it as their
+// transport (e.g. SimulatedMPL3115A2) and run without the hardware.
+// Failures throw (or for the try functions, set errno) the same way a failed
+// ioctl does and are retried under the i2cRetryPolicy (unless the transaction
+// isn't repeatable), and the traffic is
+// counted in i2cDeviceMetrics like it is for a real adapter. recover clears
+// a wedged bus.
+class SimulatedI2c
+{
+    public:
+        SimulatedI2c(const unsigned int adapterNumber, const uint8_t deviceAddress);
+        std::vector<uint8_t> readBytes(uint8_t reg, unsigned int size) const;
+        void readBytes(uint8_t reg, uint8_t *buffer, unsigned int size) const;
+        void writeByte(uint8_t reg, uint8_t data) const;
+        void transfer(I2cTransaction &transaction) const;
+        bool tryReadBytes(uint8_t reg, uint8_t *buffer, unsigned int size) const;
+        bool tryWriteByte(uint8_t reg, uint8_t data) const;
+        bool tryTransfer(I2cTransaction &transaction) const;
+        bool recover(void);
+        uint8_t deviceAddress(void) const;
+    private:
+        bool performTransaction(const SimulatedBus::Message *messages, unsigned int count, bool repeatable) const;
+        SimulatedBus &m_bus;
+        uint8_t m_deviceAddress;
+};
+
+
+// This class puts a BusScheduler on a SimulatedBus, so ScheduledI2c can run
+// without the hardware too. The i2c_msg messages are turned back into
+// register reads and writes: a one byte write followed by a read of the same
+// device is a register read, any other write is the register then the data.
+// A read without its register write has no meaning on the simulated bus and
+// fails.
+class SimulatedBusBackend : public BusBackend
+{
+    public:
+        explicit SimulatedBusBackend(unsigned int adapterNumber);
+        bool transfer(struct i2c_msg *messages, unsigned int count);
+        bool recover(void);
+    private:
+        SimulatedBus &m_bus;
+};
+
+#endif
@@ -0,0 +1,26 @@
+#include "sensor-sample.hpp"
+#include "time-series-store.hpp"
+
+
+constexpr unsigned int SeriesSummary::MAX_FIELDS;
+
+
+unsigned int summaryFields(const AltitudeSample &sample, double *fields)
+{
+    fields[0] = sample.data.pressure;
+    fields[1] = sample.data.altitude;
+    fields[2] = sample.data.temperature;
+    return 3;
+}
+
+
+unsigned int summaryFields(const ImuSample &sample, double *fields)
+{
+    for (unsigned int axis = 0; axis < 3; ++axis)
+    {
+        fields[axis] = sample.data.accel[axis];
+        fields[3 + axis] = sample.data.gyro[axis];
+        fields[6 + axis] = sample.data.mag[axis];
+    }
+    return 9;
+}
@@ -0,0 +1,261 @@
+#ifndef TIME_SERIES_STORE_HPP
+#define TIME_SERIES_STORE_HPP
+
+#include <atomic>
+#include <memory>
+#include <stddef.h>
+#include <stdexcept>
+#include <stdint.h>
+#include <string.h>
+#include <type_traits>
+#include <vector>
+
+#include "sensor-sample.hpp"
+
+
+// This class keeps the last capacity samples published by a single writer
+// thread, so readers can ask for a window of them: everything since a
+// timestamp or everything after a sequence number. Memory is allocated once
+// up front and never grows.
+// Each slot is a seqlock like SampleCache, tagged with which sample it holds,
+// so readers never block the writer. Samples being overwritten while a reader
+// looks at them are the oldest ones and are simply left out.
+// Samples must be published in order of both sequence and timestamp, which is
+// how the acquisition loops take them. T must be trivially copyable with
+// sequence and timestamp members (AltitudeSample, ImuSample).
+template <typename T>
+class TimeSeriesStore
+{
+    public:
+        // capacity must be a power of two
+        explicit TimeSeriesStore(size_t capacity);
+
+        // Only one thread may publish
+        void publish(const T &value);
+
+        // Appends every sample with a timestamp at or after from to samples,
+        // oldest first, returning how many were appended
+        size_t since(int64_t from, std::vector<T> &samples) const;
+
+        // Same but for every sample with a sequence number after sequence
+        size_t after(uint64_t sequence, std::vector<T> &samples) const;
+
+        size_t capacity(void) const;
+
+    private:
+        TimeSeriesStore(const TimeSeriesStore &);
+        TimeSeriesStore &operator=(const TimeSeriesStore &);
+        static constexpr unsigned int WORDS = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+        struct Slot
+        {
+            std::atomic<uint64_t> sequence;
+            std::atomic<uint64_t> words[WORDS];
+        };
+        bool read(uint64_t index, T &value) const;
+        template <typename Before>
+        size_t copyFrom(Before before, std::vector<T> &samples) const;
+        size_t m_capacity;
+        std::unique_ptr<Slot[]> m_slots;
+        std::atomic<uint64_t> m_published;
+};
+
+
+// Summary of one stretch of samples, the fields are each sample's values in
+// the order summaryFields gives them
+struct SeriesSummary
+{
+    public:
+        static constexpr unsigned int MAX_FIELDS = 9;
+        int64_t start;  // Timestamp the stretch starts at
+        uint64_t count;  // Samples in it, the fields mean nothing if 0
+        unsigned int fields;
+        double min[MAX_FIELDS];
+        double mean[MAX_FIELDS];
+        double max[MAX_FIELDS];
+};
+
+
+// A sample's values as doubles, returning how many there are
+unsigned int summaryFields(const AltitudeSample &sample, double *fields);
+unsigned int summaryFields(const ImuSample &sample, double *fields);
+
+// Splits from to to into points equal stretches, summarising the samples
+// (oldest first) that fall in each one
+template <typename T>
+std::vector<SeriesSummary> downsample(const std::vector<T> &samples, int64_t from, int64_t to,
+                                      unsigned int points);
+
+
+template <typename T>
+TimeSeriesStore<T>::TimeSeriesStore(size_t capacity) :
+    m_capacity(capacity),
+    m_slots(new Slot[capacity]),
+    m_published(0)
+{
+    static_assert(std::is_trivially_copyable<T>::value, "TimeSeriesStore needs a trivially copyable type");
+    if (capacity == 0 || (capacity & (capacity - 1)) != 0)
+    {
+        throw std::invalid_argument("TimeSeriesStore capacity must be a power of two");
+    }
+    for (size_t slot = 0; slot < capacity; ++slot)
+    {
+        m_slots[slot].sequence.store(0, std::memory_order_relaxed);
+    }
+}
+
+
+template <typename T>
+void TimeSeriesStore<T>::publish(const T &value)
+{
+    uint64_t words[WORDS] = {};
+    memcpy(words, &value, sizeof(T));
+
+    // Sample n is 2n + 1 while it is written and 2n + 2 once it is done
+    uint64_t index = m_published.load(std::memory_order_relaxed);
+    Slot &slot = m_slots[index & (m_capacity - 1)];
+    slot.sequence.store(2 * index + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (unsigned int i = 0; i < WORDS; ++i)
+    {
+        slot.words[i].store(words[i], std::memory_order_relaxed);
+    }
+    slot.sequence.store(2 * index + 2, std::memory_order_release);
+    m_published.store(index + 1, std::memory_order_release);
+}
+
+
+template <typename T>
+bool TimeSeriesStore<T>::read(uint64_t index, T &value) const
+{
+    const Slot &slot = m_slots[index & (m_capacity - 1)];
+    uint64_t complete = 2 * index + 2;
+    if (slot.sequence.load(std::memory_order_acquire) != complete)
+    {
+        return false;
+    }
+    uint64_t words[WORDS];
+    for (unsigned int i = 0; i < WORDS; ++i)
+    {
+        words[i] = slot.words[i].load(std::memory_order_relaxed);
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot.sequence.load(std::memory_order_relaxed) != complete)
+    {
+        return false;
+    }
+    memcpy(&value, words, sizeof(T));
+    return true;
+}
+
+
+template <typename T>
+template <typename Before>
+size_t TimeSeriesStore<T>::copyFrom(Before before, std::vector<T> &samples) const
+{
+    // Binary search for the first sample that isn't before the window, one
+    // that can't be read has been overwritten so is older than any that can
+    uint64_t end = m_published.load(std::memory_order_acquire);
+    uint64_t low = end > m_capacity ? end - m_capacity : 0;
+    uint64_t high = end;
+    T value;
+    while (low < high)
+    {
+        uint64_t middle = low + (high - low) / 2;
+        if (!read(middle, value) || before(value))
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+
+    size_t appended = 0;
+    for (uint64_t index = low; index < end; ++index)
+    {
+        if (read(index, value))
+        {
+            samples.push_back(value);
+            ++appended;
+        }
+    }
+    return appended;
+}
+
+
+template <typename T>
+size_t TimeSeriesStore<T>::since(int64_t from, std::vector<T> &samples) const
+{
+    return copyFrom([from](const T &value) { return value.timestamp < from; }, samples);
+}
+
+
+template <typename T>
+size_t TimeSeriesStore<T>::after(uint64_t sequence, std::vector<T> &samples) const
+{
+    return copyFrom([sequence](const T &value) { return value.sequence <= sequence; }, samples);
+}
+
+
+template <typename T>
+size_t TimeSeriesStore<T>::capacity(void) const
+{
+    return m_capacity;
+}
+
+
+template <typename T>
+std::vector<SeriesSummary> downsample(const std::vector<T> &samples, int64_t from, int64_t to,
+                                      unsigned int points)
+{
+    std::vector<SeriesSummary> summaries(points);
+    if (points == 0 || to <= from)
+    {
+        return summaries;
+    }
+    int64_t span = to - from;
+    for (unsigned int point = 0; point < points; ++point)
+    {
+        summaries[point].start = from + span * point / points;
+        summaries[point].count = 0;
+        summaries[point].fields = 0;
+    }
+
+    double fields[SeriesSummary::MAX_FIELDS];
+    for (const T &sample : samples)
+    {
+        if (sample.timestamp < from || sample.timestamp >= to)
+        {
+            continue;
+        }
+        SeriesSummary &summary = summaries[(sample.timestamp - from) * points / span];
+        unsigned int count = summaryFields(sample, fields);
+        for (unsigned int field = 0; field < count; ++field)
+        {
+            if (summary.count == 0)
+            {
+                summary.min[field] = fields[field];
+                summary.mean[field] = 0;
+                summary.max[field] = fields[field];
+            }
+            summary.min[field] = fields[field] < summary.min[field] ? fields[field] : summary.min[field];
+            summary.max[field] = fields[field] > summary.max[field] ? fields[field] : summary.max[field];
+            summary.mean[field] += fields[field];
+        }
+        summary.fields = count;
+        ++summary.count;
+    }
+
+    // The means were summed up as they went
+    for (SeriesSummary &summary : summaries)
+    {
+        for (unsigned int field = 0; field < summary.fields; ++field)
+        {
+            summary.mean[field] /= summary.count;
+        }
+    }
+    return summaries;
+}
+
+#endif
@@ -0,0 +1,182 @@
+// Runs VerticalEstimator over synthetic flights, noisy barometer and
+// accelerometer readings worked out from a known altitude, and checks how far
+// its altitude and velocity stray from the truth. Prints how far velocity from
+// differencing the barometer strays for comparison, then measures how long a
+// step takes. Exits with 1 if any estimate is further off than it should be.
+#include <chrono>
+#include <iostream>
+#include <math.h>
+#include <random>
+#include <vector>
+
+#include "vertical-estimator.hpp"
+
+
+constexpr double IMU_RATE = 952.0;
+constexpr double BAROMETER_RATE = 10.0;
+constexpr double BAROMETER_NOISE = 0.5;  // m
+constexpr double ACCEL_NOISE = 0.05;  // m/s^2
+constexpr unsigned int ITERATIONS = 10000000;
+
+
+// Altitude (m) and its first two derivatives at a time in the flight
+struct Trajectory
+{
+    public:
+        double altitude;
+        double velocity;
+        double accel;
+};
+
+
+static Trajectory hover(double)
+{
+    Trajectory point = { 100.0, 0.0, 0.0 };
+    return point;
+}
+
+
+// Up and down 20 m every 10 s, peaking at 12.6 m/s and 7.9 m/s^2
+static Trajectory bobbing(double t)
+{
+    const double w = 2.0 * M_PI / 10.0;
+    Trajectory point = { 50.0 + 20.0 * sin(w * t), 20.0 * w * cos(w * t), -20.0 * w * w * sin(w * t) };
+    return point;
+}
+
+
+// Climbs at 5 m/s for 10 s then holds, easing in and out over a second
+static Trajectory climb(double t)
+{
+    const double rate = 5.0;
+    Trajectory point = { 0.0, 0.0, 0.0 };
+    if (t < 5.0)
+    {
+        return point;
+    }
+    t -= 5.0;
+    // A raised cosine of acceleration over the first and last second
+    double ease = 1.0;
+    if (t < ease)
+    {
+        point.accel = rate / ease * (1.0 - cos(2.0 * M_PI * t / ease));
+        point.velocity = rate / ease * (t - ease / (2.0 * M_PI) * sin(2.0 * M_PI * t / ease));
+        point.altitude = rate / ease * (t * t / 2.0 + ease * ease / (4.0 * M_PI * M_PI) *
+                                        (cos(2.0 * M_PI * t / ease) - 1.0));
+        return point;
+    }
+    // Eased in, then 5 m/s until 10 s in, then eased out the same way
+    double easedIn = rate * ease / 2.0;
+    if (t < 10.0)
+    {
+        point.velocity = rate;
+        point.altitude = easedIn + rate * (t - ease);
+        return point;
+    }
+    double end = easedIn + rate * (10.0 - ease);
+    if (t < 10.0 + ease)
+    {
+        Trajectory in = climb(5.0 + (t - 10.0));
+        point.accel = -in.accel;
+        point.velocity = rate - in.velocity;
+        point.altitude = end + rate * (t - 10.0) - in.altitude;
+        return point;
+    }
+    point.altitude = end + easedIn;
+    return point;
+}
+
+
+// Flies trajectory for seconds with the accelerometer off by bias (m/s^2),
+// returning the RMS errors after the first settle seconds
+static void run(const char *name, Trajectory (*trajectory)(double), double bias, double seconds, double settle,
+                double altitudeLimit, double velocityLimit, bool &passed)
+{
+    std::mt19937 random(1);
+    std::normal_distribution<double> barometerNoise(0.0, BAROMETER_NOISE);
+    std::normal_distribution<double> accelNoise(0.0, ACCEL_NOISE);
+    VerticalEstimator estimator;
+    double dt = 1.0 / IMU_RATE;
+    unsigned int stepsPerReading = static_cast<unsigned int>(IMU_RATE / BAROMETER_RATE);
+    unsigned int steps = static_cast<unsigned int>(seconds * IMU_RATE);
+
+    // The barometer's readings over the last second, to difference
+    std::vector<double> readings;
+    double altitudeError = 0.0;
+    double velocityError = 0.0;
+    double differencedError = 0.0;
+    unsigned int counted = 0;
+    unsigned int differenced = 0;
+    for (unsigned int i = 0; i < steps; ++i)
+    {
+        double t = i * dt;
+        Trajectory truth = trajectory(t);
+        estimator.predict(truth.accel + bias + accelNoise(random), dt);
+        if (i % stepsPerReading == 0)
+        {
+            double reading = truth.altitude + barometerNoise(random);
+            estimator.correct(reading);
+            readings.push_back(reading);
+            if (t >= settle && readings.size() > BAROMETER_RATE)
+            {
+                double velocity = reading - readings[readings.size() - 1 - static_cast<size_t>(BAROMETER_RATE)];
+                differencedError += (velocity - truth.velocity) * (velocity - truth.velocity);
+                ++differenced;
+            }
+        }
+        if (t >= settle)
+        {
+            VerticalEstimate estimate = estimator.estimate();
+            altitudeError += (estimate.altitude - truth.altitude) * (estimate.altitude - truth.altitude);
+            velocityError += (estimate.velocity - truth.velocity) * (estimate.velocity - truth.velocity);
+            ++counted;
+        }
+    }
+    altitudeError = sqrt(altitudeError / counted);
+    velocityError = sqrt(velocityError / counted);
+    differencedError = sqrt(differencedError / differenced);
+
+    bool ok = altitudeError <= altitudeLimit && velocityError <= velocityLimit;
+    passed = passed && ok;
+    std::cout << name << ": altitude RMS error " << altitudeError << " m (limit " << altitudeLimit
+              << "), velocity " << velocityError << " m/s (limit " << velocityLimit << ", barometer over 1 s "
+              << differencedError << "), bias " << estimator.estimate().accelBias << " m/s^2 "
+              << (ok ? "ok" : "FAILED") << std::endl;
+}
+
+
+int main(void)
+{
+    bool passed = true;
+    run("Hovering", hover, 0.0, 60.0, 5.0, 0.3, 0.1, passed);
+    run("Bobbing 20 m", bobbing, 0.0, 60.0, 5.0, 0.3, 0.2, passed);
+    run("Climbing 50 m", climb, 0.0, 30.0, 5.0, 0.3, 0.2, passed);
+    run("Bobbing 20 m, accel biased 0.3 m/s^2", bobbing, 0.3, 60.0, 20.0, 0.3, 0.2, passed);
+
+    // Throughput of a step, a barometer correction every IMU_RATE /
+    // BAROMETER_RATE of them like in flight
+    std::vector<double> accels(1024);
+    std::mt19937 random(2);
+    std::normal_distribution<double> noise(0.0, 1.0);
+    for (double &accel : accels)
+    {
+        accel = noise(random);
+    }
+    unsigned int stepsPerReading = static_cast<unsigned int>(IMU_RATE / BAROMETER_RATE);
+    VerticalEstimator estimator;
+    estimator.correct(0.0);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (unsigned int i = 0; i < ITERATIONS; ++i)
+    {
+        estimator.predict(accels[i % accels.size()], 1.0 / IMU_RATE);
+        if (i % stepsPerReading == 0)
+        {
+            estimator.correct(accels[(i / stepsPerReading) % accels.size()]);
+        }
+    }
+    std::chrono::duration<double, std::nano> time = std::chrono::steady_clock::now() - start;
+    // Something has to depend on every step or the compiler drops them
+    std::cout << "Step: " << time.count() / ITERATIONS << " ns" << std::endl
+              << "Checksum: " << estimator.estimate().altitude << std::endl;
+    return passed ? 0 : 1;
+}
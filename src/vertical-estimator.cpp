@@ -0,0 +1,125 @@
+#include "vertical-estimator.hpp"
+
+
+// How unsure the estimate is of the velocity (m/s) and bias (m/s^2) it starts
+// with, the altitude being as unsure as a barometer reading
+constexpr double INITIAL_VELOCITY_DEVIATION = 1.0;
+constexpr double INITIAL_BIAS_DEVIATION = 0.2;
+
+const VerticalNoise VerticalEstimator::DEFAULT_NOISE = { 0.3, 0.01, 0.5 };
+
+
+VerticalEstimator::VerticalEstimator(const VerticalNoise &noise)
+    : m_noise(noise)
+{
+    reset();
+}
+
+
+void VerticalEstimator::reset(void)
+{
+    for (unsigned int i = 0; i < 3; ++i)
+    {
+        m_x[i] = 0.0;
+        for (unsigned int j = 0; j < 3; ++j)
+        {
+            m_p[i][j] = 0.0;
+        }
+    }
+    m_started = false;
+}
+
+
+void VerticalEstimator::predict(double accel, double dt)
+{
+    if (!m_started)
+    {
+        return;
+    }
+
+    // x = F x + G accel with
+    //   F = | 1 dt -dt^2/2 |   G = | dt^2/2 |
+    //       | 0  1    -dt  |       |   dt   |
+    //       | 0  0      1  |       |    0   |
+    double halfDt2 = 0.5 * dt * dt;
+    double a = accel - m_x[2];
+    m_x[0] += m_x[1] * dt + a * halfDt2;
+    m_x[1] += a * dt;
+
+    // P = F P F' + Q, F P worked out first then times F', every term written
+    // out since most of F is zeros and ones
+    double fp[3][3];
+    for (unsigned int j = 0; j < 3; ++j)
+    {
+        fp[0][j] = m_p[0][j] + dt * m_p[1][j] - halfDt2 * m_p[2][j];
+        fp[1][j] = m_p[1][j] - dt * m_p[2][j];
+        fp[2][j] = m_p[2][j];
+    }
+    for (unsigned int i = 0; i < 3; ++i)
+    {
+        m_p[i][0] = fp[i][0] + dt * fp[i][1] - halfDt2 * fp[i][2];
+        m_p[i][1] = fp[i][1] - dt * fp[i][2];
+        m_p[i][2] = fp[i][2];
+    }
+
+    // Q is the acceleration noise coming in through G, plus the bias walking
+    double accelVariance = m_noise.accel * m_noise.accel;
+    m_p[0][0] += accelVariance * halfDt2 * halfDt2;
+    m_p[0][1] += accelVariance * halfDt2 * dt;
+    m_p[1][0] += accelVariance * halfDt2 * dt;
+    m_p[1][1] += accelVariance * dt * dt;
+    m_p[2][2] += m_noise.accelBiasDrift * m_noise.accelBiasDrift * dt;
+}
+
+
+void VerticalEstimator::correct(double altitude)
+{
+    if (!m_started)
+    {
+        m_x[0] = altitude;
+        m_p[0][0] = m_noise.altitude * m_noise.altitude;
+        m_p[1][1] = INITIAL_VELOCITY_DEVIATION * INITIAL_VELOCITY_DEVIATION;
+        m_p[2][2] = INITIAL_BIAS_DEVIATION * INITIAL_BIAS_DEVIATION;
+        m_started = true;
+        return;
+    }
+
+    // Only the altitude is measured, so the innovation covariance is a
+    // scalar and the gain the first column of P over it
+    double innovation = altitude - m_x[0];
+    double s = m_p[0][0] + m_noise.altitude * m_noise.altitude;
+    double gain[3] = { m_p[0][0] / s, m_p[1][0] / s, m_p[2][0] / s };
+    double row[3] = { m_p[0][0], m_p[0][1], m_p[0][2] };
+    for (unsigned int i = 0; i < 3; ++i)
+    {
+        m_x[i] += gain[i] * innovation;
+        for (unsigned int j = 0; j < 3; ++j)
+        {
+            m_p[i][j] -= gain[i] * row[j];
+        }
+    }
+
+    // Rounding would otherwise let P drift away from symmetric
+    for (unsigned int i = 0; i < 3; ++i)
+    {
+        for (unsigned int j = i + 1; j < 3; ++j)
+        {
+            double mean = 0.5 * (m_p[i][j] + m_p[j][i]);
+            m_p[i][j] = mean;
+            m_p[j][i] = mean;
+        }
+    }
+}
+
+
+bool VerticalEstimator::started(void) const
+{
+    return m_started;
+}
+
+
+VerticalEstimate VerticalEstimator::estimate(void) const
+{
+    VerticalEstimate result = { m_x[0], m_x[1], m_x[2] };
+    return result;
+}
@@ -0,0 +1,73 @@
+#ifndef VERTICAL_ESTIMATOR_HPP
+#define VERTICAL_ESTIMATOR_HPP
+
+
+// Standard gravity, what the accelerometer's g are converted to m/s^2 with
+constexpr double STANDARD_GRAVITY = 9.80665;
+
+
+// Where the sensor is vertically: altitude (m, on the barometer's scale),
+// vertical velocity (m/s, up) and the accelerometer bias along up (m/s^2)
+// that the estimate has taken out
+struct VerticalEstimate
+{
+    public:
+        double altitude;
+        double velocity;
+        double accelBias;
+};
+
+
+// How much the estimator trusts each input, standard deviations
+struct VerticalNoise
+{
+    public:
+        double accel;  // m/s^2, vertical acceleration noise at each step
+        double accelBiasDrift;  // m/s^2 per square root second
+        double altitude;  // m, each barometer reading
+};
+
+
+// This class fuses barometric altitude with vertical acceleration in a three
+// state Kalman filter: altitude, vertical velocity and accelerometer bias.
+// Every accelerometer sample predicts the state forward, integrating the
+// acceleration (less the bias), and every barometer reading corrects it the
+// moment it arrives. So altitude and velocity come out at the accelerometer's
+// rate, the velocity without the lag of differencing a slow noisy altitude,
+// and the bias stops a small error in the acceleration (from the
+// accelerometer or the orientation it was rotated with) integrating away.
+// The state and covariance are fixed size doubles, each step is a few dozen
+// multiplies with no allocation, and the altitude stays precise to well
+// under a millimetre at any height.
+class VerticalEstimator
+{
+    public:
+        static const VerticalNoise DEFAULT_NOISE;
+        explicit VerticalEstimator(const VerticalNoise &noise = DEFAULT_NOISE);
+
+        // Moves the state dt seconds on, accel being the acceleration up
+        // (m/s^2) with gravity taken out. Does nothing until the first
+        // correct() has said where to start.
+        void predict(double accel, double dt);
+
+        // Corrects the state with a barometer altitude (m), the first one
+        // starting the estimate there at rest
+        void correct(double altitude);
+
+        // Whether correct() has been called since construction or reset()
+        bool started(void) const;
+
+        VerticalEstimate estimate(void) const;
+
+        // Starts over, waiting for the next correct()
+        void reset(void);
+
+    private:
+        // x is altitude, velocity and bias, p their covariance
+        double m_x[3];
+        double m_p[3][3];
+        VerticalNoise m_noise;
+        bool m_started;
+};
+
+#endif
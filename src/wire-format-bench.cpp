@@ -0,0 +1,51 @@
+// Compares the cost of encoding a sample as a binary record against building
+// the text reply data-server used to send. Prints the average time per encode.
+#include <chrono>
+#include <iostream>
+#include <stdint.h>
+#include <string>
+
+#include "sensor-sample.hpp"
+#include "wire-format.hpp"
+
+
+constexpr unsigned int ITERATIONS = 1000000;
+
+
+int main(void)
+{
+    AltitudeSample sample;
+    sample.sequence = 1;
+    sample.timestamp = 123456789;
+    sample.data.pressure = 101325.25;
+    sample.data.altitude = 212.5625;
+    sample.data.temperature = 21.875;
+
+    // Something has to depend on every encode or the compiler drops them
+    uint64_t checksum = 0;
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    uint8_t record[WIRE_MAX_RECORD_SIZE];
+    for (unsigned int i = 0; i < ITERATIONS; ++i)
+    {
+        ++sample.sequence;
+        checksum += encodeBinary(sample, 0, record);
+        checksum += record[8];
+    }
+    std::chrono::duration<double, std::nano> binaryTime = std::chrono::steady_clock::now() - start;
+
+    start = std::chrono::steady_clock::now();
+    for (unsigned int i = 0; i < ITERATIONS; ++i)
+    {
+        ++sample.sequence;
+        std::string text = encodeText(sample);
+        checksum += text.size();
+    }
+    std::chrono::duration<double, std::nano> textTime = std::chrono::steady_clock::now() - start;
+
+    std::cout << "Binary encode: " << binaryTime.count() / ITERATIONS << " ns ("
+              << WIRE_ALTITUDE_RECORD_SIZE << " bytes)" << std::endl;
+    std::cout << "Text encode: " << textTime.count() / ITERATIONS << " ns" << std::endl;
+    std::cout << "Checksum: " << checksum << std::endl;
+    return 0;
+}
@@ -0,0 +1,245 @@
+#include <sstream>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <string.h>
+
+#include "sensor-sample.hpp"
+#include "wire-format.hpp"
+
+
+// Writers for each little-endian field, returning the position after the field
+static uint8_t *put8(uint8_t *out, uint8_t value)
+{
+    out[0] = value;
+    return out + 1;
+}
+
+
+static uint8_t *put16(uint8_t *out, uint16_t value)
+{
+    out[0] = value & 0xFF;
+    out[1] = value >> 8;
+    return out + 2;
+}
+
+
+static uint8_t *put32(uint8_t *out, uint32_t value)
+{
+    for (unsigned int i = 0; i < 4; ++i)
+    {
+        out[i] = (value >> (8 * i)) & 0xFF;
+    }
+    return out + 4;
+}
+
+
+static uint8_t *put64(uint8_t *out, uint64_t value)
+{
+    for (unsigned int i = 0; i < 8; ++i)
+    {
+        out[i] = (value >> (8 * i)) & 0xFF;
+    }
+    return out + 8;
+}
+
+
+static uint8_t *putFloat(uint8_t *out, double value)
+{
+    float single = static_cast<float>(value);
+    uint32_t bits;
+    memcpy(&bits, &single, sizeof(bits));
+    return put32(out, bits);
+}
+
+
+static uint8_t *putHeader(uint8_t *out, SensorId sensor, uint16_t length, uint32_t age,
+                          uint64_t sequence, int64_t timestamp)
+{
+    out = put8(out, WIRE_FORMAT_VERSION);
+    out = put8(out, sensor);
+    out = put16(out, length);
+    out = put32(out, age);
+    out = put64(out, sequence);
+    return put64(out, static_cast<uint64_t>(timestamp));
+}
+
+
+// Readers matching the writers above
+static const uint8_t *get16(const uint8_t *in, uint16_t &value)
+{
+    value = static_cast<uint16_t>(in[0] | (in[1] << 8));
+    return in + 2;
+}
+
+
+static const uint8_t *get32(const uint8_t *in, uint32_t &value)
+{
+    value = 0;
+    for (unsigned int i = 0; i < 4; ++i)
+    {
+        value |= static_cast<uint32_t>(in[i]) << (8 * i);
+    }
+    return in + 4;
+}
+
+
+static const uint8_t *get64(const uint8_t *in, uint64_t &value)
+{
+    value = 0;
+    for (unsigned int i = 0; i < 8; ++i)
+    {
+        value |= static_cast<uint64_t>(in[i]) << (8 * i);
+    }
+    return in + 8;
+}
+
+
+static const uint8_t *getFloat(const uint8_t *in, double &value)
+{
+    uint32_t bits;
+    in = get32(in, bits);
+    float single;
+    memcpy(&single, &bits, sizeof(single));
+    value = single;
+    return in;
+}
+
+
+// Checks the header is for the expected sensor and record size, then reads
+// the fields every record has, returning the start of the body
+static const uint8_t *getHeader(const uint8_t *in, size_t size, SensorId expected, size_t expectedLength,
+                                uint32_t &age, uint64_t &sequence, int64_t &timestamp)
+{
+    SensorId sensor;
+    size_t length;
+    if (!decodeHeader(in, size, sensor, length) || sensor != expected || length != expectedLength)
+    {
+        return nullptr;
+    }
+    in = get32(in + 4, age);
+    in = get64(in, sequence);
+    uint64_t bits;
+    in = get64(in, bits);
+    timestamp = static_cast<int64_t>(bits);
+    return in;
+}
+
+
+size_t encodeBinary(const AltitudeSample &sample, uint32_t age, uint8_t *buffer)
+{
+    uint8_t *out = putHeader(buffer, SENSOR_MPL3115A2, WIRE_ALTITUDE_RECORD_SIZE, age,
+                             sample.sequence, sample.timestamp);
+    out = putFloat(out, sample.data.pressure);
+    out = putFloat(out, sample.data.altitude);
+    out = putFloat(out, sample.data.temperature);
+    return out - buffer;
+}
+
+
+size_t encodeBinary(const ImuSample &sample, uint32_t age, uint8_t *buffer)
+{
+    uint8_t *out = putHeader(buffer, SENSOR_LSM9DS1, WIRE_IMU_RECORD_SIZE, age,
+                             sample.sequence, sample.timestamp);
+    for (unsigned int axis = 0; axis < 3; ++axis)
+    {
+        out = put16(out, static_cast<uint16_t>(sample.data.accel[axis]));
+    }
+    for (unsigned int axis = 0; axis < 3; ++axis)
+    {
+        out = put16(out, static_cast<uint16_t>(sample.data.gyro[axis]));
+    }
+    for (unsigned int axis = 0; axis < 3; ++axis)
+    {
+        out = put16(out, static_cast<uint16_t>(sample.data.mag[axis]));
+    }
+    return out - buffer;
+}
+
+
+bool decodeHeader(const uint8_t *buffer, size_t size, SensorId &sensor, size_t &length)
+{
+    if (size < WIRE_HEADER_SIZE || buffer[0] != WIRE_FORMAT_VERSION)
+    {
+        return false;
+    }
+    uint16_t recordLength;
+    get16(buffer + 2, recordLength);
+    if (buffer[1] == SENSOR_MPL3115A2 && recordLength == WIRE_ALTITUDE_RECORD_SIZE)
+    {
+        sensor = SENSOR_MPL3115A2;
+    }
+    else if (buffer[1] == SENSOR_LSM9DS1 && recordLength == WIRE_IMU_RECORD_SIZE)
+    {
+        sensor = SENSOR_LSM9DS1;
+    }
+    else
+    {
+        return false;
+    }
+    length = recordLength;
+    return length <= size;
+}
+
+
+bool decodeBinary(const uint8_t *buffer, size_t size, AltitudeSample &sample, uint32_t &age)
+{
+    const uint8_t *in = getHeader(buffer, size, SENSOR_MPL3115A2, WIRE_ALTITUDE_RECORD_SIZE,
+                                  age, sample.sequence, sample.timestamp);
+    if (in == nullptr)
+    {
+        return false;
+    }
+    in = getFloat(in, sample.data.pressure);
+    in = getFloat(in, sample.data.altitude);
+    getFloat(in, sample.data.temperature);
+    return true;
+}
+
+
+bool decodeBinary(const uint8_t *buffer, size_t size, ImuSample &sample, uint32_t &age)
+{
+    const uint8_t *in = getHeader(buffer, size, SENSOR_LSM9DS1, WIRE_IMU_RECORD_SIZE,
+                                  age, sample.sequence, sample.timestamp);
+    if (in == nullptr)
+    {
+        return false;
+    }
+    uint16_t value;
+    for (unsigned int axis = 0; axis < 3; ++axis)
+    {
+        in = get16(in, value);
+        sample.data.accel[axis] = static_cast<int16_t>(value);
+    }
+    for (unsigned int axis = 0; axis < 3; ++axis)
+    {
+        in = get16(in, value);
+        sample.data.gyro[axis] = static_cast<int16_t>(value);
+    }
+    for (unsigned int axis = 0; axis < 3; ++axis)
+    {
+        in = get16(in, value);
+        sample.data.mag[axis] = static_cast<int16_t>(value);
+    }
+    return true;
+}
+
+
+std::string encodeText(const AltitudeSample &sample)
+{
+    std::ostringstream os;
+    os << "Temperature: " << sample.data.temperature << " Altitude: " << sample.data.altitude
+       << " Pressure: " << sample.data.pressure << " Sequence: " << sample.sequence;
+    return os.str();
+}
+
+
+std::string encodeText(const ImuSample &sample)
+{
+    std::ostringstream os;
+    os << "Accel: " << sample.data.accel[0] << " " << sample.data.accel[1] << " " << sample.data.accel[2]
+       << " Gyro: " << sample.data.gyro[0] << " " << sample.data.gyro[1] << " " << sample.data.gyro[2]
+       << " Mag: " << sample.data.mag[0] << " " << sample.data.mag[1] << " " << sample.data.mag[2]
+       << " Sequence: " << sample.sequence;
+    return os.str();
+}
@@ -0,0 +1,55 @@
+#ifndef WIRE_FORMAT_HPP
+#define WIRE_FORMAT_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+#include "sensor-sample.hpp"
+
+
+// Binary records are fixed layout and little-endian regardless of the host.
+// Every record starts with this header:
+//   offset 0  uint8   version (WIRE_FORMAT_VERSION)
+//   offset 1  uint8   sensor id (SensorId)
+//   offset 2  uint16  length of the whole record in bytes
+//   offset 4  uint32  age of the sample in microseconds when it was sent
+//   offset 8  uint64  sequence number
+//   offset 16 int64   timestamp, nanoseconds on the monotonic clock
+// The mpl3115a2 body is float32 pressure (Pa), altitude (m), temperature (C).
+// The lsm9ds1 body is int16 accel x, y, z, gyro x, y, z, mag x, y, z.
+constexpr uint8_t WIRE_FORMAT_VERSION = 1;
+constexpr size_t WIRE_HEADER_SIZE = 24;
+constexpr size_t WIRE_ALTITUDE_RECORD_SIZE = WIRE_HEADER_SIZE + 3 * sizeof(float);
+constexpr size_t WIRE_IMU_RECORD_SIZE = WIRE_HEADER_SIZE + 9 * sizeof(int16_t);
+constexpr size_t WIRE_MAX_RECORD_SIZE = WIRE_ALTITUDE_RECORD_SIZE > WIRE_IMU_RECORD_SIZE ?
+                                        WIRE_ALTITUDE_RECORD_SIZE : WIRE_IMU_RECORD_SIZE;
+
+enum SensorId : uint8_t
+{
+    SENSOR_MPL3115A2 = 1,
+    SENSOR_LSM9DS1 = 2
+};
+
+
+// Encode a sample as a binary record into buffer, which must hold at least
+// the record size. Returns the number of bytes written. These never allocate.
+size_t encodeBinary(const AltitudeSample &sample, uint32_t age, uint8_t *buffer);
+size_t encodeBinary(const ImuSample &sample, uint32_t age, uint8_t *buffer);
+
+// Read the header of the binary record at the start of buffer (size bytes
+// available), giving which sensor it is from and the whole record's length.
+// False if it isn't a record this version understands or isn't all there.
+bool decodeHeader(const uint8_t *buffer, size_t size, SensorId &sensor, size_t &length);
+
+// Decode a whole binary record back into a sample, false if buffer doesn't
+// start with a complete record of that kind. The floats come back as they
+// were sent, i.e. rounded to single precision.
+bool decodeBinary(const uint8_t *buffer, size_t size, AltitudeSample &sample, uint32_t &age);
+bool decodeBinary(const uint8_t *buffer, size_t size, ImuSample &sample, uint32_t &age);
+
+// Human readable form of a sample, handy for debugging
+std::string encodeText(const AltitudeSample &sample);
+std::string encodeText(const ImuSample &sample);
+
+#endif